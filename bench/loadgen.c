@@ -0,0 +1,787 @@
+/** @file loadgen.c
+ *  @brief A load generator for lisod
+ *
+ *  Threads each drive their share of the connections with an epoll loop of
+ *  their own, so a single client machine can keep the server busy. Every
+ *  response is parsed (Content-Length, chunked, or up to the end of the
+ *  connection), and the time from sending a request to the end of its
+ *  response is recorded in a log-linear histogram. Threads are merged at
+ *  the end, for RPS and latency percentiles.
+ *
+ *  Workloads:
+ *    close      a new connection for each request (connect time included)
+ *    keepalive  requests one after another on each connection
+ *    pipeline   -p requests in flight on each connection
+ *  HTTPS is used for an https:// URL, and a cgi script is driven by its URL,
+ *  with a POST body of -b bytes if given.
+ *
+ *  With -r or -L, the run is a regression gate: the exit status is 2 if RPS
+ *  falls below, p99 goes above, or any request fails.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define MODE_CLOSE 0
+#define MODE_KEEPALIVE 1
+#define MODE_PIPELINE 2
+
+/* Bytes of the input buffer of a connection, response headers must fit */
+#define IN_BUF (64 << 10)
+
+/* Most requests in flight on a connection */
+#define MAX_DEPTH 256
+
+/*
+ * Latency histogram in microseconds: 1 << SUB_BITS linear buckets for each
+ * power of 2, within 3% of the value, from 1us to about 18 hours.
+ */
+#define SUB_BITS 5
+#define SUB (1 << SUB_BITS)
+#define OCTAVES 36
+#define BUCKETS ((OCTAVES + 1) << SUB_BITS)
+
+/* Response parsing states */
+#define R_HEAD 0            // Status line and headers
+#define R_BODY 1            // Body of known length
+#define R_CHUNK_SIZE 2      // Size line of a chunk
+#define R_CHUNK_DATA 3
+#define R_CHUNK_END 4       // \r\n after chunk data
+#define R_TRAILER 5         // Trailer lines after the last chunk
+#define R_UNTIL_CLOSE 6     // Body ends with the connection
+
+/* Connection states */
+#define S_CONNECTING 0
+#define S_HANDSHAKE 1
+#define S_READY 2
+
+/** @brief Options of the run, shared by all threads */
+static struct {
+    int threads;
+    int connections;
+    int duration;           //<!seconds
+    int mode;
+    int depth;              //<!requests in flight with MODE_PIPELINE
+    int body;               //<!bytes of POST body, 0 for GET
+    double min_rps;         //<!gate, 0 if not gating on it
+    double max_p99;         //<!gate in milliseconds, 0 if not gating on it
+    int tls;
+    char host[256];
+    char port[16];
+    char path[2048];
+    struct addrinfo *addr;
+    SSL_CTX *ssl_ctx;
+    char *request;          //<!one request, pipelined ones are copies
+    int request_len;
+} opt;
+
+static volatile int stop;
+
+/** @brief Latency distribution */
+typedef struct {
+    unsigned long buckets[BUCKETS];
+    unsigned long count;
+    unsigned long max;
+} histogram_t;
+
+/** @brief A connection to the server */
+typedef struct {
+    int fd;
+    SSL *ssl;
+    int state;
+    char *out;              //<!requests waiting to be sent
+    int out_len;
+    int out_pos;
+    char in[IN_BUF];
+    int in_len;
+    int rstate;             //<!response parsing state, R_*
+    long remaining;         //<!bytes of body or chunk left
+    int status;             //<!status code of the response being parsed
+    int closing;            //<!server said Connection: close
+    unsigned long sent_at[MAX_DEPTH];   //<!send time of requests in flight
+    int head, inflight;     //<!ring of sent_at
+    int unsent;             //<!requests queued but not sent yet
+    int watching;           //<!EPOLLOUT registered
+} conn_t;
+
+/** @brief State of a thread */
+typedef struct {
+    pthread_t tid;
+    int nconns;
+    conn_t *conns;
+    int epfd;
+    unsigned long requests;
+    unsigned long errors;
+    unsigned long bytes;
+    histogram_t latency;
+} worker_t;
+
+/** @brief Microseconds since some fixed point */
+static unsigned long now_us() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** @brief Bucket of a value, from its highest bit and the ones below */
+static int hist_index(unsigned long v) {
+    int e;
+
+    if (v < SUB)
+        return v;
+    e = 63 - __builtin_clzl(v);
+    if (e - SUB_BITS >= OCTAVES)
+        return BUCKETS - 1;
+    return ((e - SUB_BITS + 1) << SUB_BITS) + ((v >> (e - SUB_BITS)) & (SUB - 1));
+}
+
+/** @brief Smallest value of a bucket */
+static unsigned long hist_value(int i) {
+    int e;
+
+    if (i < SUB)
+        return i;
+    e = (i >> SUB_BITS) - 1 + SUB_BITS;
+    return (unsigned long)(SUB + (i & (SUB - 1))) << (e - SUB_BITS);
+}
+
+static void hist_record(histogram_t *h, unsigned long v) {
+    ++h->buckets[hist_index(v)];
+    ++h->count;
+    if (v > h->max)
+        h->max = v;
+}
+
+static void hist_merge(histogram_t *to, histogram_t *from) {
+    int i;
+
+    for (i = 0; i < BUCKETS; ++i)
+        to->buckets[i] += from->buckets[i];
+    to->count += from->count;
+    if (from->max > to->max)
+        to->max = from->max;
+}
+
+/** @brief Value at or below which a fraction q of values are */
+static unsigned long hist_quantile(histogram_t *h, double q) {
+    unsigned long rank = (unsigned long)(q * h->count + 0.5), seen = 0;
+    int i;
+
+    if (rank < 1)
+        rank = 1;
+    for (i = 0; i < BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if (seen >= rank)
+            return hist_value(i);
+    }
+    return h->max;
+}
+
+/** @brief Build the request sent again and again */
+static void build_request() {
+    char *req = malloc(strlen(opt.path) + strlen(opt.host) + 256 + opt.body);
+    int len;
+
+    len = sprintf(req, "%s %s HTTP/1.1\r\nHost: %s\r\n"
+                  "User-Agent: lisod-loadgen\r\n",
+                  opt.body ? "POST" : "GET", opt.path, opt.host);
+    if (opt.mode == MODE_CLOSE)
+        len += sprintf(req + len, "Connection: close\r\n");
+    if (opt.body)
+        len += sprintf(req + len, "Content-Type: application/octet-stream\r\n"
+                       "Content-Length: %d\r\n", opt.body);
+    len += sprintf(req + len, "\r\n");
+    memset(req + len, 'x', opt.body);
+
+    opt.request = req;
+    opt.request_len = len + opt.body;
+}
+
+/** @brief Watch a connection for writability only while it has output */
+static void watch(worker_t *w, conn_t *c, int out) {
+    struct epoll_event ev;
+
+    if (out == c->watching)
+        return;
+    ev.events = EPOLLIN | (out ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->watching = out;
+}
+
+/** @brief Queue requests not sent yet */
+static void queue_requests(conn_t *c) {
+    int i;
+
+    if (c->unsent == 0)
+        return;
+    // What's left of a partial send goes first, then at most depth requests
+    memmove(c->out, c->out + c->out_pos, c->out_len - c->out_pos);
+    c->out_len -= c->out_pos;
+    c->out_pos = 0;
+    for (i = 0; i < c->unsent; ++i) {
+        memcpy(c->out + c->out_len, opt.request, opt.request_len);
+        c->out_len += opt.request_len;
+        c->sent_at[(c->head + c->inflight) % MAX_DEPTH] = now_us();
+        ++c->inflight;
+    }
+    c->unsent = 0;
+}
+
+/** @brief Open a connection, the connect completes in the event loop */
+static int conn_open(worker_t *w, conn_t *c) {
+    struct epoll_event ev;
+    int yes = 1;
+
+    c->fd = socket(opt.addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd == -1)
+        return -1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    if (connect(c->fd, opt.addr->ai_addr, opt.addr->ai_addrlen) == -1 &&
+        errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+
+    c->ssl = NULL;
+    c->state = S_CONNECTING;
+    c->out_len = c->out_pos = 0;
+    c->in_len = 0;
+    c->rstate = R_HEAD;
+    c->closing = 0;
+    c->head = c->inflight = 0;
+    c->unsent = opt.mode == MODE_PIPELINE ? opt.depth : 1;
+    c->watching = 1;
+    // Timed from now, connecting counts for the first requests
+    queue_requests(c);
+
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = c;
+    epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    return 0;
+}
+
+static void conn_close(worker_t *w, conn_t *c) {
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    if (c->ssl)
+        SSL_free(c->ssl);
+    close(c->fd);
+    c->fd = -1;
+}
+
+/** @brief Close a connection and open it again, unless the run is over
+ *
+ *  @param failed Whether requests in flight are counted as errors
+ */
+static void conn_restart(worker_t *w, conn_t *c, int failed) {
+    if (failed)
+        w->errors += c->inflight > 0 ? c->inflight : 1;
+    conn_close(w, c);
+    if (!stop && conn_open(w, c) == -1)
+        ++w->errors;
+}
+
+/** @brief Send queued output
+ *
+ *  @return 0 if ok. -1 on error.
+ */
+static int conn_send(worker_t *w, conn_t *c) {
+    int n, err;
+
+    queue_requests(c);
+    while (c->out_pos < c->out_len) {
+        if (c->ssl) {
+            n = SSL_write(c->ssl, c->out + c->out_pos, c->out_len - c->out_pos);
+            if (n <= 0) {
+                err = SSL_get_error(c->ssl, n);
+                if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+                    break;
+                return -1;
+            }
+        } else {
+            n = send(c->fd, c->out + c->out_pos, c->out_len - c->out_pos,
+                     MSG_NOSIGNAL);
+            if (n == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                return -1;
+            }
+        }
+        c->out_pos += n;
+    }
+    watch(w, c, c->out_pos < c->out_len);
+    return 0;
+}
+
+/** @brief Value of a header in a header block, case insensitive */
+static char* find_header(char *head, int len, char *name) {
+    int n = strlen(name);
+    char *p = head, *end = head + len;
+
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        ++p;
+        if (end - p > n && strncasecmp(p, name, n) == 0 && p[n] == ':') {
+            p += n + 1;
+            while (*p == ' ' || *p == '\t')
+                ++p;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/** @brief A response has ended */
+static void response_done(worker_t *w, conn_t *c) {
+    unsigned long sent = c->sent_at[c->head];
+
+    c->head = (c->head + 1) % MAX_DEPTH;
+    --c->inflight;
+    ++w->requests;
+    if (c->status < 200 || c->status >= 400)
+        ++w->errors;
+    hist_record(&w->latency, now_us() - sent);
+    c->rstate = R_HEAD;
+}
+
+/** @brief Parse and drop responses in the input buffer
+ *
+ *  @return Number of responses completed. -1 if a response is malformed.
+ */
+static int parse_responses(worker_t *w, conn_t *c) {
+    char *p, *v, *end;
+    int pos = 0, done = 0, n;
+
+    while (pos < c->in_len) {
+        p = c->in + pos;
+        n = c->in_len - pos;
+
+        switch (c->rstate) {
+        case R_HEAD:
+            if ((end = memmem(p, n, "\r\n\r\n", 4)) == NULL) {
+                if (n == IN_BUF)
+                    return -1;
+                goto more;
+            }
+            *end = '\0';
+            if (sscanf(p, "HTTP/%*d.%*d %d", &c->status) != 1)
+                return -1;
+            w->bytes += end + 4 - p;
+            n = end - p;
+            c->closing = (v = find_header(p, n, "Connection")) != NULL &&
+                strncasecmp(v, "close", 5) == 0;
+            if ((v = find_header(p, n, "Transfer-Encoding")) != NULL &&
+                strncasecmp(v, "chunked", 7) == 0) {
+                c->rstate = R_CHUNK_SIZE;
+            } else if ((v = find_header(p, n, "Content-Length")) != NULL) {
+                c->remaining = atol(v);
+                c->rstate = R_BODY;
+            } else if (c->status == 204 || c->status == 304) {
+                c->remaining = 0;
+                c->rstate = R_BODY;
+            } else {
+                c->rstate = R_UNTIL_CLOSE;
+            }
+            pos = end + 4 - c->in;
+            if (c->rstate == R_BODY && c->remaining == 0) {
+                response_done(w, c);
+                ++done;
+            }
+            break;
+
+        case R_BODY:
+        case R_CHUNK_DATA:
+            if (n > c->remaining)
+                n = c->remaining;
+            c->remaining -= n;
+            pos += n;
+            w->bytes += n;
+            if (c->remaining > 0)
+                break;
+            if (c->rstate == R_CHUNK_DATA) {
+                c->rstate = R_CHUNK_END;
+            } else {
+                response_done(w, c);
+                ++done;
+            }
+            break;
+
+        case R_CHUNK_END:
+            if (n < 2)
+                goto more;
+            pos += 2;
+            c->rstate = R_CHUNK_SIZE;
+            break;
+
+        case R_CHUNK_SIZE:
+        case R_TRAILER:
+            if ((end = memmem(p, n, "\r\n", 2)) == NULL) {
+                if (n == IN_BUF)
+                    return -1;
+                goto more;
+            }
+            pos = end + 2 - c->in;
+            w->bytes += end + 2 - p;
+            if (c->rstate == R_TRAILER) {
+                // An empty line ends the trailer and the response
+                if (end == p) {
+                    response_done(w, c);
+                    ++done;
+                }
+                break;
+            }
+            c->remaining = strtol(p, NULL, 16);
+            c->rstate = c->remaining ? R_CHUNK_DATA : R_TRAILER;
+            break;
+
+        case R_UNTIL_CLOSE:
+            w->bytes += n;
+            pos = c->in_len;
+            break;
+        }
+    }
+
+more:
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+    return done;
+}
+
+/** @brief Read and parse what the server sent
+ *
+ *  @return 0 if ok. -1 if the connection has been restarted.
+ */
+static int conn_recv(worker_t *w, conn_t *c) {
+    int n, err, done;
+
+    while (1) {
+        if (c->ssl) {
+            n = SSL_read(c->ssl, c->in + c->in_len, IN_BUF - c->in_len);
+            if (n <= 0) {
+                err = SSL_get_error(c->ssl, n);
+                if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+                    return 0;
+                n = err == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+            }
+        } else {
+            n = recv(c->fd, c->in + c->in_len, IN_BUF - c->in_len, 0);
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 0;
+        }
+
+        if (n <= 0) {
+            // A body up to the end of the connection is done now
+            if (n == 0 && c->rstate == R_UNTIL_CLOSE && c->inflight > 0) {
+                response_done(w, c);
+                conn_restart(w, c, 0);
+                return -1;
+            }
+            // The server may close after the last response, that's fine
+            conn_restart(w, c, c->inflight > 0);
+            return -1;
+        }
+
+        c->in_len += n;
+        if ((done = parse_responses(w, c)) == -1) {
+            conn_restart(w, c, 1);
+            return -1;
+        }
+        if (done == 0)
+            continue;
+
+        if (opt.mode == MODE_CLOSE || c->closing) {
+            if (c->inflight == 0) {
+                conn_restart(w, c, 0);
+                return -1;
+            }
+            continue;
+        }
+        if (!stop) {
+            c->unsent += done;
+            if (conn_send(w, c) == -1) {
+                conn_restart(w, c, 1);
+                return -1;
+            }
+        }
+    }
+}
+
+/** @brief Make progress on the connect or TLS handshake
+ *
+ *  @return 1 if the connection is ready. 0 to wait. -1 on error.
+ */
+static int conn_setup(worker_t *w, conn_t *c) {
+    socklen_t len = sizeof(int);
+    int err = 0, ret;
+
+    if (c->state == S_CONNECTING) {
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err)
+            return -1;
+        if (!opt.tls) {
+            c->state = S_READY;
+            return 1;
+        }
+        c->ssl = SSL_new(opt.ssl_ctx);
+        SSL_set_fd(c->ssl, c->fd);
+        SSL_set_tlsext_host_name(c->ssl, opt.host);
+        SSL_set_connect_state(c->ssl);
+        c->state = S_HANDSHAKE;
+    }
+
+    if ((ret = SSL_do_handshake(c->ssl)) == 1) {
+        c->state = S_READY;
+        return 1;
+    }
+    err = SSL_get_error(c->ssl, ret);
+    if (err == SSL_ERROR_WANT_READ) {
+        watch(w, c, 0);
+        return 0;
+    }
+    if (err == SSL_ERROR_WANT_WRITE) {
+        watch(w, c, 1);
+        return 0;
+    }
+    return -1;
+}
+
+/** @brief Handle events on a connection */
+static void conn_event(worker_t *w, conn_t *c, int events) {
+    int ret;
+
+    if (c->state != S_READY) {
+        if ((ret = conn_setup(w, c)) == -1) {
+            conn_restart(w, c, 1);
+            return;
+        }
+        if (ret == 0)
+            return;
+        if (conn_send(w, c) == -1) {
+            conn_restart(w, c, 1);
+            return;
+        }
+        events |= EPOLLIN;
+    }
+
+    if ((events & EPOLLOUT) && conn_send(w, c) == -1) {
+        conn_restart(w, c, 1);
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        conn_recv(w, c);
+}
+
+static void* worker_main(void *arg) {
+    struct epoll_event events[256];
+    worker_t *w = arg;
+    int i, n;
+
+    w->epfd = epoll_create1(0);
+    for (i = 0; i < w->nconns; ++i) {
+        w->conns[i].out = malloc(opt.request_len * MAX_DEPTH);
+        if (conn_open(w, &w->conns[i]) == -1)
+            ++w->errors;
+    }
+
+    while (!stop) {
+        n = epoll_wait(w->epfd, events, 256, 100);
+        for (i = 0; i < n && !stop; ++i)
+            conn_event(w, events[i].data.ptr, events[i].events);
+    }
+
+    for (i = 0; i < w->nconns; ++i) {
+        if (w->conns[i].fd != -1)
+            conn_close(w, &w->conns[i]);
+        free(w->conns[i].out);
+    }
+    close(w->epfd);
+    return NULL;
+}
+
+/** @brief Split an http:// or https:// URL into opt */
+static int parse_url(char *url) {
+    char *p, *slash, *colon;
+
+    if (strncmp(url, "http://", 7) == 0) {
+        opt.tls = 0;
+        p = url + 7;
+    } else if (strncmp(url, "https://", 8) == 0) {
+        opt.tls = 1;
+        p = url + 8;
+    } else {
+        return -1;
+    }
+
+    slash = strchr(p, '/');
+    snprintf(opt.path, sizeof(opt.path), "%s", slash ? slash : "/");
+    if (slash)
+        *slash = '\0';
+    if ((colon = strchr(p, ':')) != NULL) {
+        *colon = '\0';
+        snprintf(opt.port, sizeof(opt.port), "%s", colon + 1);
+    } else {
+        snprintf(opt.port, sizeof(opt.port), "%s", opt.tls ? "443" : "80");
+    }
+    snprintf(opt.host, sizeof(opt.host), "%s", p);
+    return 0;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: loadgen [-t threads] [-c connections] [-d seconds] "
+            "[-m close|keepalive|pipeline] [-p depth] [-b POST bytes] "
+            "[-r min RPS] [-L max p99 ms] <http[s]://host:port/path>\n");
+    fprintf(stderr, "	-t threads – default 4\n");
+    fprintf(stderr, "	-c connections – split among threads, default 64\n");
+    fprintf(stderr, "	-d seconds – length of the run, default 10\n");
+    fprintf(stderr, "	-m mode – a connection per request, requests one after "
+            "another, or pipelined, default keepalive\n");
+    fprintf(stderr, "	-p depth – requests in flight with -m pipeline, "
+            "default 16\n");
+    fprintf(stderr, "	-b bytes – send POST requests with a body, for cgi\n");
+    fprintf(stderr, "	-r RPS, -L ms – fail (exit 2) below this RPS, above "
+            "this p99, or on any failed request\n");
+}
+
+static void on_alarm(int sig) {
+    stop = 1;
+}
+
+int main(int argc, char *argv[]) {
+    struct addrinfo hints;
+    worker_t *workers;
+    histogram_t *total;
+    unsigned long requests = 0, errors = 0, bytes = 0, start, elapsed;
+    double rps, p99;
+    int i, c, per, ret, failed;
+    static char *modes[] = { "close", "keepalive", "pipeline" };
+
+    opt.threads = 4;
+    opt.connections = 64;
+    opt.duration = 10;
+    opt.mode = MODE_KEEPALIVE;
+    opt.depth = 16;
+    while ((c = getopt(argc, argv, "t:c:d:m:p:b:r:L:")) != -1) {
+        switch (c) {
+        case 't': opt.threads = atoi(optarg); break;
+        case 'c': opt.connections = atoi(optarg); break;
+        case 'd': opt.duration = atoi(optarg); break;
+        case 'p': opt.depth = atoi(optarg); break;
+        case 'b': opt.body = atoi(optarg); break;
+        case 'r': opt.min_rps = atof(optarg); break;
+        case 'L': opt.max_p99 = atof(optarg); break;
+        case 'm':
+            for (i = 0; i < 3 && strcmp(optarg, modes[i]) != 0; ++i);
+            if (i == 3) {
+                usage();
+                return 1;
+            }
+            opt.mode = i;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || parse_url(argv[optind]) == -1 ||
+        opt.threads < 1 || opt.connections < opt.threads ||
+        opt.duration < 1 || opt.depth < 1 || opt.depth > MAX_DEPTH ||
+        opt.body < 0) {
+        usage();
+        return 1;
+    }
+    if (opt.mode != MODE_PIPELINE)
+        opt.depth = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((ret = getaddrinfo(opt.host, opt.port, &hints, &opt.addr)) != 0) {
+        fprintf(stderr, "loadgen: %s: %s\n", opt.host, gai_strerror(ret));
+        return 1;
+    }
+
+    if (opt.tls) {
+        SSL_library_init();
+        opt.ssl_ctx = SSL_CTX_new(TLS_client_method());
+        // Benchmarking, not checking who the server is
+        SSL_CTX_set_verify(opt.ssl_ctx, SSL_VERIFY_NONE, NULL);
+    }
+    build_request();
+    signal(SIGPIPE, SIG_IGN);
+
+    workers = calloc(opt.threads, sizeof(worker_t));
+    total = calloc(1, sizeof(histogram_t));
+    start = now_us();
+    for (i = 0; i < opt.threads; ++i) {
+        per = opt.connections / opt.threads +
+              (i < opt.connections % opt.threads);
+        workers[i].nconns = per;
+        workers[i].conns = calloc(per, sizeof(conn_t));
+        pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]);
+    }
+
+    signal(SIGALRM, on_alarm);
+    alarm(opt.duration);
+    while (!stop)
+        pause();
+
+    for (i = 0; i < opt.threads; ++i) {
+        pthread_join(workers[i].tid, NULL);
+        requests += workers[i].requests;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+        hist_merge(total, &workers[i].latency);
+        free(workers[i].conns);
+    }
+    elapsed = now_us() - start;
+    rps = requests * 1e6 / elapsed;
+    p99 = hist_quantile(total, 0.99) / 1e3;
+
+    printf("%s %s://%s:%s%s, %d threads, %d connections",
+           opt.body ? "POST" : "GET", opt.tls ? "https" : "http", opt.host,
+           opt.port, opt.path, opt.threads, opt.connections);
+    if (opt.mode == MODE_PIPELINE)
+        printf(", pipeline depth %d\n", opt.depth);
+    else
+        printf(", %s\n", modes[opt.mode]);
+    printf("  requests  %lu in %.2fs, %lu errors\n", requests, elapsed / 1e6,
+           errors);
+    printf("  rps       %.1f\n", rps);
+    printf("  transfer  %.2f MB/s\n", bytes / (elapsed / 1e6) / (1 << 20));
+    printf("  latency   p50 %.3fms  p99 %.3fms  p999 %.3fms  max %.3fms\n",
+           hist_quantile(total, 0.5) / 1e3, p99,
+           hist_quantile(total, 0.999) / 1e3, total->max / 1e3);
+
+    failed = 0;
+    if (opt.min_rps > 0 || opt.max_p99 > 0) {
+        if (errors > 0 || requests == 0)
+            failed = 1;
+        if (opt.min_rps > 0 && rps < opt.min_rps)
+            failed = 1;
+        if (opt.max_p99 > 0 && p99 > opt.max_p99)
+            failed = 1;
+        printf("  gate      %s\n", failed ? "FAILED" : "passed");
+    }
+
+    freeaddrinfo(opt.addr);
+    free(workers);
+    free(total);
+    free(opt.request);
+    return failed ? 2 : 0;
+}
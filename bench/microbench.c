@@ -0,0 +1,219 @@
+/** @file microbench.c
+ *  @brief Microbenchmarks of parsing and buffer hot paths
+ *
+ *  Linked against the objects of the server, so what's measured is the code
+ *  lisod runs. Each benchmark is repeated in batches of growing size until a
+ *  batch takes BENCH_TIME, and the time per operation of that batch is
+ *  reported.
+ *
+ *  Usage: microbench [name...]  runs benchmarks whose name contains any of
+ *  the arguments, all of them without arguments.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "event.h"
+#include "io.h"
+#include "http_client.h"
+#include "http_parser.h"
+#include "file_cache.h"
+#include "http_date.h"
+#include "scan.h"
+
+/* Nanoseconds a measured batch takes at least */
+#define BENCH_TIME 300000000UL
+
+/* A request from a browser, as most requests look like */
+static char browser_request[] =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+    "\r\n";
+
+/* The smallest request */
+static char minimal_request[] =
+    "GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+static http_client_t *client;
+static int devnull;
+static char chunk[512];
+
+static unsigned long now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/** @brief Parse a request and send the response, like the serving loop */
+static void parse_request(char *req, int len) {
+    io_append(client->in, req, len);
+    http_parse(client);
+    io_send(devnull, client->out, NULL);
+    if (empty(client->in))
+        io_shrink(client->in);
+}
+
+static void bench_parse_browser(long n) {
+    while (n-- > 0)
+        parse_request(browser_request, sizeof(browser_request) - 1);
+}
+
+static void bench_parse_minimal(long n) {
+    while (n-- > 0)
+        parse_request(minimal_request, sizeof(minimal_request) - 1);
+}
+
+/** @brief Find the lines of a request already in the buffer */
+static void bench_nextline(long n) {
+    slice_t line;
+    buf_t *in = client->in;
+
+    in->pos = in->datasize = in->scan = 0;
+    io_append(in, browser_request, sizeof(browser_request) - 1);
+    while (n > 0) {
+        in->pos = in->scan = 0;
+        while (client_nextline(client, &line) > 0 && n-- > 0)
+            ;
+    }
+    in->pos = in->datasize;
+    io_shrink(in);
+}
+
+/** @brief Fill a buffer up to 64KB, as a large request body would */
+static void bench_buf_grow(long n) {
+    buf_t *bp = init_buf();
+    int i;
+
+    while (n-- > 0) {
+        for (i = 0; i < (64 << 10) / (int)sizeof(chunk); ++i)
+            io_append(bp, chunk, sizeof(chunk));
+        bp->pos = bp->datasize;
+        io_shrink(bp);
+    }
+    deinit_buf(bp);
+}
+
+/** @brief Receive small pieces, each consumed before the next one */
+static void bench_buf_cycle(long n) {
+    buf_t *bp = init_buf();
+
+    while (n-- > 0) {
+        io_append(bp, chunk, 100);
+        bp->pos = bp->datasize;
+        if (empty(bp))
+            io_shrink(bp);
+    }
+    deinit_buf(bp);
+}
+
+static struct {
+    char *name;
+    char *unit;
+    void (*run)(long n);
+} benchmarks[] = {
+    { "http_parse/browser", "request", bench_parse_browser },
+    { "http_parse/minimal", "request", bench_parse_minimal },
+    { "client_nextline", "line", bench_nextline },
+    { "buf/grow_64k", "64KB", bench_buf_grow },
+    { "buf/append_consume", "append", bench_buf_cycle },
+};
+
+/** @brief Whether a benchmark is asked for by the arguments */
+static int selected(char *name, int argc, char *argv[]) {
+    int i;
+
+    if (argc < 2)
+        return 1;
+    for (i = 1; i < argc; ++i)
+        if (strstr(name, argv[i]))
+            return 1;
+    return 0;
+}
+
+/** @brief Put a file to serve into a temporary www folder */
+static char* setup_www() {
+    static char dir[] = "/tmp/lisod-bench-XXXXXX";
+    char path[sizeof(dir) + 16], body[2048];
+    int fd;
+
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(path, sizeof(path), "%s/index.html", dir);
+    if ((fd = open(path, O_WRONLY | O_CREAT, 0644)) == -1) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+    memset(body, 'x', sizeof(body));
+    if (write(fd, body, sizeof(body)) != sizeof(body))
+        perror("write");
+    close(fd);
+    return dir;
+}
+
+static void cleanup_www(char *dir) {
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/index.html", dir);
+    unlink(path);
+    rmdir(dir);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long start, elapsed;
+    long n;
+    int i;
+
+    http_version = "HTTP/1.1";
+    www_folder = setup_www();
+    init_select_context();
+    init_file_cache(16 << 20);
+    init_scan();
+    update_date();
+    devnull = open("/dev/null", O_WRONLY);
+    memset(chunk, 'x', sizeof(chunk));
+    client = new_client(-1);
+    strcpy(client->remote_ip, "127.0.0.1");
+
+    for (i = 0; i < (int)(sizeof(benchmarks) / sizeof(benchmarks[0])); ++i) {
+        if (!selected(benchmarks[i].name, argc, argv))
+            continue;
+        // Warm up caches and pools, then grow the batch until it's long enough
+        benchmarks[i].run(1000);
+        for (n = 1000; ; n *= 2) {
+            start = now_ns();
+            benchmarks[i].run(n);
+            if ((elapsed = now_ns() - start) >= BENCH_TIME)
+                break;
+        }
+        printf("%-22s %10.1f ns/%-8s %12.0f /s\n", benchmarks[i].name,
+               (double)elapsed / n, benchmarks[i].unit, n * 1e9 / elapsed);
+    }
+
+    deinit_client(client);
+    deinit_file_cache();
+    deinit_select_context();
+    cleanup_www(www_folder);
+    return 0;
+}
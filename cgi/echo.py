@@ -5,7 +5,11 @@ import os
 if __name__ == '__main__':
     print sys.argv
     print os.environ
-    content_length = int(os.environ['CONTENT_LENGTH'])
+    # Left out for a chunked body still arriving, which is read until EOF
+    content_length = os.environ.get('CONTENT_LENGTH')
     print content_length
-    print sys.stdin.read(content_length)
+    if content_length:
+        print sys.stdin.read(int(content_length))
+    else:
+        print sys.stdin.read()
 
@@ -0,0 +1,314 @@
+/** @file aio.c
+ *  @brief Blocking file I/O off the serving loop
+ *
+ *  Opening a file, or reading one which isn't in the page cache, waits for
+ *  the disk, and every client of the worker waits with it. Such work is
+ *  handed to a few I/O threads instead. A thread runs the work of a job,
+ *  then puts the job on a list of finished ones and writes a byte to a pipe
+ *  watched by the serving loop. aio_poll() takes the finished jobs and calls
+ *  their done callbacks, so results are only acted on by the loop itself.
+ *  As with the FastCGI pool, clients waiting for a job are woken up by the
+ *  wake callback.
+ *
+ *  Threads are started with the first job, so processes forked before, like
+ *  workers, have none of their own yet. A process forked later (the one
+ *  going on serving connections after an upgrade) is left with the forking
+ *  thread only. Jobs which were running are queued again in it, and threads
+ *  are started again for them.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#define _GNU_SOURCE     // For pipe2()
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "aio.h"
+#include "event.h"
+#include "metrics.h"
+#include "log.h"
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t more = PTHREAD_COND_INITIALIZER;
+static aio_job_t *queue_head, *queue_tail;  //waiting for a thread
+static aio_job_t *done_head, *done_tail;    //waiting for aio_poll()
+static aio_job_t **running;                 //job of each thread, or NULL
+static int nthreads = 0;
+static int started;                         //threads of this process
+static int need_start;                      //threads to be started
+static int stopping;
+static int leftover;                        //jobs done before a fork
+static int notify[2] = { -1, -1 };          //a byte tells jobs are done
+static void (*wake_client)(struct http_client *client);
+
+/** @brief Put a job on the list of finished ones, with the lock held
+ *
+ *  The loop is told once, when the list stops being empty. A full pipe is
+ *  readable all the same.
+ */
+static void finish(aio_job_t *job) {
+    job->next = NULL;
+    if (done_tail == NULL) {
+        done_head = job;
+        while (write(notify[1], "", 1) == -1 && errno == EINTR);
+    } else
+        done_tail->next = job;
+    done_tail = job;
+}
+
+/** @brief Main loop of an I/O thread */
+static void* thread_main(void *arg) {
+    long id = (long)arg;
+    aio_job_t *job;
+
+    pthread_mutex_lock(&lock);
+    while (!stopping) {
+        if ((job = queue_head) == NULL) {
+            pthread_cond_wait(&more, &lock);
+            continue;
+        }
+        if ((queue_head = job->next) == NULL)
+            queue_tail = NULL;
+        running[id] = job;
+        pthread_mutex_unlock(&lock);
+
+        job->work(job->arg);
+
+        pthread_mutex_lock(&lock);
+        running[id] = NULL;
+        finish(job);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/** @brief Start the threads missing in this process
+ *
+ *  Signals are blocked in I/O threads, so they interrupt the serving loop.
+ */
+static void start_threads() {
+    pthread_attr_t attr;
+    pthread_t tid;
+    sigset_t all, old;
+    int err;
+
+    need_start = 0;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (; started < nthreads; ++started) {
+        if ((err = pthread_create(&tid, &attr, thread_main,
+                                  (void *)(long)started)) != 0) {
+            errno = err;
+            log_error("aio pthread_create error");
+            break;
+        }
+    }
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/** @brief Run queued jobs in place, when there is no thread to run them */
+static void run_queue() {
+    aio_job_t *job;
+
+    pthread_mutex_lock(&lock);
+    while ((job = queue_head) != NULL) {
+        if ((queue_head = job->next) == NULL)
+            queue_tail = NULL;
+        job->work(job->arg);
+        finish(job);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static void before_fork() {
+    pthread_mutex_lock(&lock);
+}
+
+static void after_fork() {
+    pthread_mutex_unlock(&lock);
+}
+
+/** @brief Take over the jobs of threads which the child doesn't have */
+static void after_fork_child() {
+    int i;
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&more, NULL);
+    for (i = 0; i < started; ++i) {
+        if (running[i] == NULL)
+            continue;
+        running[i]->next = queue_head;
+        if (queue_head == NULL)
+            queue_tail = running[i];
+        queue_head = running[i];
+        running[i] = NULL;
+    }
+    need_start = need_start || started > 0;
+    started = 0;
+    leftover = done_head != NULL;
+}
+
+/** @brief Prepare I/O threads, started once there is work for them
+ *
+ *  @param threads Number of threads. 0 to do file I/O in the serving loop.
+ *  @param wake Called with clients waiting for a job which is done
+ *  @return 0 on success. -1 on error, file I/O is not offloaded then.
+ */
+int init_aio(int threads, void (*wake)(struct http_client *client)) {
+    static int registered = 0;
+
+    if (threads <= 0)
+        return 0;
+
+    if (pipe2(notify, O_NONBLOCK | O_CLOEXEC) == -1) {
+        log_error("init_aio pipe2 error");
+        notify[0] = notify[1] = -1;
+        return -1;
+    }
+    add_read_fd(notify[0]);
+
+    if (!registered && pthread_atfork(before_fork, after_fork,
+                                      after_fork_child) == 0)
+        registered = 1;
+
+    nthreads = threads;
+    started = 0;
+    need_start = 1;
+    stopping = 0;
+    running = calloc(threads, sizeof(aio_job_t *));
+    queue_head = queue_tail = NULL;
+    done_head = done_tail = NULL;
+    wake_client = wake;
+    return 0;
+}
+
+/** @brief Stop I/O threads
+ *
+ *  Threads finish the job they are running and exit. Jobs not done are
+ *  dropped, only done when the process exits.
+ */
+void deinit_aio() {
+    if (notify[0] == -1)
+        return;
+
+    remove_read_fd(notify[0]);
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_broadcast(&more);
+    close(notify[0]);
+    close(notify[1]);
+    notify[0] = notify[1] = -1;
+    pthread_mutex_unlock(&lock);
+    nthreads = 0;
+}
+
+/** @brief Init an aio_job_t struct
+ *
+ *  @param work Does the blocking work with arg, in an I/O thread
+ *  @param done Called with arg by the serving loop once work is done
+ */
+void init_job(aio_job_t *job, void (*work)(void *), void (*done)(void *),
+              void *arg) {
+    job->work = work;
+    job->done = done;
+    job->arg = arg;
+    job->start = 0;
+    job->next = NULL;
+}
+
+/** @brief Hand a job to the I/O threads
+ *
+ *  @return 0 on success. -1 if there are no threads, the work should be
+ *          done in place then.
+ */
+int aio_submit(aio_job_t *job) {
+    if (nthreads == 0 || stopping)
+        return -1;
+    if (need_start)
+        start_threads();
+    if (started == 0)
+        return -1;
+
+    job->start = metrics_clock();
+    job->next = NULL;
+    pthread_mutex_lock(&lock);
+    if (queue_tail == NULL)
+        queue_head = job;
+    else
+        queue_tail->next = job;
+    queue_tail = job;
+    pthread_cond_signal(&more);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+/** @brief Wake up a client whose job is done, called by done callbacks */
+void aio_wake(struct http_client *client) {
+    if (client != NULL && wake_client != NULL)
+        wake_client(client);
+}
+
+/** @brief Call done callbacks of finished jobs
+ *
+ *  Should be called in every iteration of the serving loop.
+ */
+void aio_poll() {
+    aio_job_t *job, *next;
+    unsigned long now;
+    char buf[64];
+
+    if (notify[0] == -1)
+        return;
+
+    // Jobs were left by threads of the parent
+    if (need_start && queue_head != NULL) {
+        start_threads();
+        if (started == 0)
+            run_queue();
+        else
+            pthread_cond_broadcast(&more);
+    }
+    if (!test_read_fd(notify[0]) && !leftover)
+        return;
+    leftover = 0;
+
+    // Drained first, a job finished after the list is taken writes again
+    while (read(notify[0], buf, sizeof(buf)) > 0);
+    clear_read_fd(notify[0]);
+
+    pthread_mutex_lock(&lock);
+    job = done_head;
+    done_head = done_tail = NULL;
+    pthread_mutex_unlock(&lock);
+
+    now = metrics_clock();
+    for (; job != NULL; job = next) {
+        next = job->next;
+        hist_record(&metrics->file_io, now - job->start);
+        job->done(job->arg);
+    }
+}
+
+/** @brief Read part of a file into the page cache, run by I/O threads
+ *
+ *  @return Where reading stopped, before end if the file is shorter or
+ *          can't be read.
+ */
+off_t aio_fetch(int fd, off_t offset, off_t end) {
+    char buf[AIO_CHUNK];
+    ssize_t n;
+
+    while (offset < end) {
+        n = pread(fd, buf, end - offset < AIO_CHUNK ? end - offset : AIO_CHUNK,
+                  offset);
+        if (n <= 0)
+            break;
+        offset += n;
+    }
+    return offset;
+}
@@ -0,0 +1,51 @@
+/** @file aio.h
+ *  @brief Header file for aio.c
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __AIO_H__
+#define __AIO_H__
+
+#include <sys/types.h>
+
+/* Number of I/O threads of each worker */
+#define AIO_THREADS 4
+
+/*
+ * Bytes of a file read ahead by one job. A file is sent window by window,
+ * each one read into the page cache before it's sent.
+ */
+#define AIO_WINDOW (1 << 20)
+
+/* Bytes of each read() of aio_fetch() */
+#define AIO_CHUNK (64 << 10)
+
+/** @brief A piece of blocking work given to an I/O thread
+ *
+ *  A job is embedded in a struct of its submitter, which stays valid until
+ *  done has been called. work must not touch anything the serving loop uses,
+ *  logs included: it only fills in its own struct, and done, called by the
+ *  serving loop, acts on the results.
+ */
+typedef struct aio_job {
+    void (*work)(void *arg);    //<!run by an I/O thread
+    void (*done)(void *arg);    //<!run by aio_poll() once work has returned
+    void *arg;
+    unsigned long start;        //<!when the job was submitted
+    struct aio_job *next;
+} aio_job_t;
+
+struct http_client;
+
+int init_aio(int threads, void (*wake)(struct http_client *client));
+void deinit_aio();
+
+void init_job(aio_job_t *job, void (*work)(void *), void (*done)(void *),
+              void *arg);
+int aio_submit(aio_job_t *job);
+void aio_wake(struct http_client *client);
+void aio_poll();
+
+off_t aio_fetch(int fd, off_t offset, off_t end);
+
+#endif
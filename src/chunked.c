@@ -0,0 +1,267 @@
+/** @file chunked.c
+ *  @brief Chunked transfer coding of streams
+ *
+ *  Output of cgi scripts is a complete response which is passed to the
+ *  client as it's produced. A script that doesn't know the length of its
+ *  output up front can only mark the end of the body by closing, which ends
+ *  the connection too. The encoder adds chunked framing to such responses,
+ *  so that the connection can be kept alive.
+ *
+ *  Request bodies sent with Transfer-Encoding: chunked are decoded in place,
+ *  since decoded data is never longer than the encoded data.
+ *
+ *  Both work on a stream piece by piece, and keep their state in between.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "chunked.h"
+
+#define TE_CHUNKED "Transfer-Encoding: chunked\r\n"
+#define LAST_CHUNK "0\r\n\r\n"
+
+/*=============================Encoding==================================*/
+
+void init_chunk_encoder(chunk_encoder_t *e) {
+    e->state = CE_HEAD;
+    e->lines = 0;
+    e->line_len = 0;
+    e->held_cr = 0;
+    e->framed = 0;
+}
+
+/** @brief Whether a status code means the response has no body */
+static int no_body(int code) {
+    return (code >= 100 && code < 200) || code == 204 || code == 304;
+}
+
+/** @brief Look for framing in a complete response header line */
+static void check_line(chunk_encoder_t *e) {
+    int len = e->line_len < CHUNK_LINE ? e->line_len : CHUNK_LINE - 1;
+    char *sp;
+
+    e->line[len] = '\0';
+    if (e->lines++ == 0) {
+        // Status line: HTTP/1.1 200 OK
+        if ((sp = strchr(e->line, ' ')) != NULL && no_body(atoi(sp + 1)))
+            e->framed = 1;
+        return;
+    }
+
+    if (strncasecmp(e->line, "content-length:", 15) == 0 ||
+        strncasecmp(e->line, "transfer-encoding:", 18) == 0)
+        e->framed = 1;
+}
+
+/** @brief Pass response headers, until the blank line ending them
+ *
+ *  @return Bytes of src consumed
+ */
+static int encode_head(chunk_encoder_t *e, char *src, int len,
+                       char *dst, int *n) {
+    int i = 0;
+    char c;
+
+    while (e->state == CE_HEAD && i < len) {
+        c = src[i++];
+
+        // A \r starting a line could begin the blank line. Wait and see.
+        if (c == '\r' && e->line_len == 0 && !e->held_cr) {
+            e->held_cr = 1;
+            continue;
+        }
+
+        if (c == '\n' && e->line_len == 0) {
+            // The blank line. Add framing before it if necessary.
+            if (!e->framed) {
+                memcpy(dst + *n, TE_CHUNKED, sizeof(TE_CHUNKED) - 1);
+                *n += sizeof(TE_CHUNKED) - 1;
+            }
+            memcpy(dst + *n, "\r\n", 2);
+            *n += 2;
+            e->held_cr = 0;
+            e->state = e->framed ? CE_RAW : CE_BODY;
+            break;
+        }
+
+        if (e->held_cr) {
+            dst[(*n)++] = '\r';
+            e->held_cr = 0;
+            ++e->line_len;
+        }
+        dst[(*n)++] = c;
+
+        if (c == '\n') {
+            check_line(e);
+            e->line_len = 0;
+        } else {
+            if (e->line_len < CHUNK_LINE)
+                e->line[e->line_len] = c;
+            ++e->line_len;
+        }
+    }
+
+    return i;
+}
+
+/** @brief Encode a piece of a response stream
+ *
+ *  @param e Encoder state
+ *  @param src Data read from the stream
+ *  @param len Length of src
+ *  @param dst Buffer of at least len + CHUNK_OVERHEAD bytes
+ *  @return Bytes written to dst
+ */
+int chunk_encode(chunk_encoder_t *e, char *src, int len, char *dst) {
+    int n = 0, i = 0;
+
+    if (e->state == CE_HEAD)
+        i = encode_head(e, src, len, dst, &n);
+    if (i == len)
+        return n;
+
+    if (e->state == CE_BODY)
+        n += sprintf(dst + n, "%x\r\n", len - i);
+    memcpy(dst + n, src + i, len - i);
+    n += len - i;
+    if (e->state == CE_BODY) {
+        memcpy(dst + n, "\r\n", 2);
+        n += 2;
+    }
+
+    return n;
+}
+
+/** @brief The response stream has ended
+ *
+ *  @param dst Buffer of at least CHUNK_OVERHEAD bytes
+ *  @return Bytes written to dst, which end the response
+ */
+int chunk_encode_end(chunk_encoder_t *e, char *dst) {
+    int n = 0;
+
+    if (e->state == CE_BODY) {
+        memcpy(dst, LAST_CHUNK, sizeof(LAST_CHUNK) - 1);
+        n = sizeof(LAST_CHUNK) - 1;
+    } else if (e->state == CE_HEAD && e->held_cr) {
+        dst[n++] = '\r';
+    }
+
+    e->state = CE_DONE;
+    return n;
+}
+
+/*=============================Decoding==================================*/
+
+void init_chunk_decoder(chunk_decoder_t *d) {
+    d->state = CD_SIZE;
+    d->size = 0;
+    d->digits = 0;
+    d->line_len = 0;
+    d->total = 0;
+}
+
+/** @brief Value of a hex digit. -1 if c is not one */
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/** @brief A chunk size line has been read */
+static void end_size_line(chunk_decoder_t *d) {
+    d->state = d->size > 0 ? CD_DATA : CD_TRAILER;
+    d->digits = 0;
+    d->line_len = 0;
+}
+
+/** @brief Decode a piece of a chunked body in place
+ *
+ *  Chunk data is moved to the front of buf, over the framing. Decoding stops
+ *  after the last chunk and its trailers, leaving what follows in buf alone.
+ *
+ *  @param d Decoder state, CD_DONE when the body has ended
+ *  @param buf Encoded data received
+ *  @param len Length of buf
+ *  @param out Set to the bytes of decoded data at the front of buf
+ *  @return Bytes of buf consumed. -1 if the encoding is broken.
+ */
+int chunk_decode(chunk_decoder_t *d, char *buf, int len, int *out) {
+    int i = 0, n, v;
+    char c;
+
+    *out = 0;
+    while (i < len && d->state != CD_DONE) {
+        if (d->state == CD_DATA) {
+            n = len - i < d->size ? len - i : d->size;
+            memmove(buf + *out, buf + i, n);
+            *out += n;
+            d->total += n;
+            i += n;
+            if ((d->size -= n) == 0)
+                d->state = CD_DATA_CR;
+            continue;
+        }
+
+        c = buf[i++];
+        switch (d->state) {
+        case CD_SIZE:
+            if ((v = hex_value(c)) != -1) {
+                if (d->size > (INT_MAX >> 4))
+                    return -1;
+                d->size = (d->size << 4) | v;
+                ++d->digits;
+            } else if (d->digits == 0) {
+                return -1;
+            } else if (c == ';' || c == ' ' || c == '\t') {
+                d->state = CD_EXT;
+            } else if (c == '\r') {
+                d->state = CD_SIZE_LF;
+            } else if (c == '\n') {
+                end_size_line(d);
+            } else {
+                return -1;
+            }
+            break;
+        case CD_EXT:
+            if (c == '\n')
+                end_size_line(d);
+            break;
+        case CD_SIZE_LF:
+            if (c != '\n')
+                return -1;
+            end_size_line(d);
+            break;
+        case CD_DATA_CR:
+            if (c == '\r')
+                d->state = CD_DATA_LF;
+            else if (c == '\n')
+                d->state = CD_SIZE;
+            else
+                return -1;
+            break;
+        case CD_DATA_LF:
+            if (c != '\n')
+                return -1;
+            d->state = CD_SIZE;
+            break;
+        case CD_TRAILER:
+            // Trailers are ignored. A blank line ends them.
+            if (c == '\n') {
+                if (d->line_len == 0)
+                    d->state = CD_DONE;
+                d->line_len = 0;
+            } else if (c != '\r') {
+                ++d->line_len;
+            }
+            break;
+        }
+    }
+
+    return i;
+}
@@ -0,0 +1,67 @@
+/** @file chunked.h
+ *  @brief Header file for chunked.c
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __CHUNKED_H__
+#define __CHUNKED_H__
+
+/*
+ * Maximum bytes chunk_encode() or chunk_encode_end() adds to its input
+ */
+#define CHUNK_OVERHEAD 64
+
+/*
+ * Bytes of each response header line kept to look for framing headers
+ */
+#define CHUNK_LINE 32
+
+/* Encoder states */
+#define CE_HEAD 0           // Passing response headers
+#define CE_BODY 1           // Framing response body as chunks
+#define CE_RAW 2            // Response has its own framing, passed as is
+#define CE_DONE 3           // Response ended
+
+/** @brief State of framing a raw response stream
+ *
+ *  The stream is a complete response, as written by a cgi script. Its
+ *  headers are scanned as they pass. If they specify no way to find the end
+ *  of the body, Transfer-Encoding: chunked is added and the body is framed.
+ */
+typedef struct {
+    int state;
+    int lines;              //<!header lines passed
+    int line_len;           //<!length of current header line
+    char line[CHUNK_LINE];  //<!beginning of current header line
+    int held_cr;            //<!a \r which may start the blank line is held
+    int framed;             //<!response has its own framing or no body
+} chunk_encoder_t;
+
+/* Decoder states */
+#define CD_IDLE 0           // Not decoding
+#define CD_SIZE 1           // Reading chunk size
+#define CD_EXT 2            // Skipping chunk extensions
+#define CD_SIZE_LF 3        // Expecting \n after chunk size
+#define CD_DATA 4           // Reading chunk data
+#define CD_DATA_CR 5        // Expecting \r\n after chunk data
+#define CD_DATA_LF 6        // Expecting \n after chunk data
+#define CD_TRAILER 7        // Skipping trailer lines
+#define CD_DONE 8           // Last chunk and trailers read
+
+/** @brief State of decoding a chunked request body */
+typedef struct {
+    int state;
+    int size;               //<!bytes left in current chunk
+    int digits;             //<!hex digits of chunk size read
+    int line_len;           //<!length of current trailer line
+    int total;              //<!bytes of data decoded so far
+} chunk_decoder_t;
+
+void init_chunk_encoder(chunk_encoder_t *e);
+int chunk_encode(chunk_encoder_t *e, char *src, int len, char *dst);
+int chunk_encode_end(chunk_encoder_t *e, char *dst);
+
+void init_chunk_decoder(chunk_decoder_t *d);
+int chunk_decode(chunk_decoder_t *d, char *buf, int len, int *out);
+
+#endif
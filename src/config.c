@@ -0,0 +1,226 @@
+/** @file config.c
+ *  @brief The config file, read at start and on every reload
+ *
+ *  The file has one setting per line, a name and a value separated by
+ *  spaces. Empty lines and lines starting with '#' are skipped, e.g.
+ *
+ *      # lisod.conf
+ *      www_folder /srv/www
+ *      certificate /etc/lisod/cert.pem
+ *      cache_size 67108864
+ *      rate_limit 100
+ *
+ *  Settings not in the file keep the values given on the command line, or
+ *  the last ones read. Ports, workers and logs are only taken from the
+ *  command line, as the listening sockets and processes outlive a reload.
+ *
+ *  A file is read into a spare copy of the settings and checked, and the
+ *  copy then replaces the settings in use as a whole. So a broken file
+ *  changes nothing. Strings of the two copies are kept in static buffers,
+ *  one copy in use and the other one for the next read.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "log.h"
+
+/* Longest line of the config file */
+#define CONFIG_LINE_MAX (PATH_MAX + 64)
+
+/** @brief Storage of the strings of a config_t */
+typedef struct {
+    char www_folder[PATH_MAX];
+    char cgi_path[PATH_MAX];
+    char private_key_file[PATH_MAX];
+    char certificate_file[PATH_MAX];
+} config_strings_t;
+
+static config_t spare;
+static config_strings_t strings[2];
+static int in_use = -1;     //<!strings[] of the settings in use, -1 for argv
+
+/** @brief Copy a string setting into the spare storage */
+static char* keep(char *dst, char *src) {
+    snprintf(dst, PATH_MAX, "%s", src);
+    return dst;
+}
+
+/** @brief Parse a number setting
+ *
+ *  @return 0 on success. -1 if value is not a number in [min, max].
+ */
+static int parse_number(char *value, long min, long max, long *n) {
+    char *end;
+
+    errno = 0;
+    *n = strtol(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || *n < min || *n > max)
+        return -1;
+    return 0;
+}
+
+/** @brief Set a setting of the spare copy
+ *
+ *  @return 0 on success. -1 if the name or the value is not valid.
+ */
+static int set_option(config_strings_t *s, char *name, char *value) {
+    long n;
+
+    if (strcmp(name, "www_folder") == 0)
+        spare.www_folder = keep(s->www_folder, value);
+    else if (strcmp(name, "cgi_path") == 0)
+        spare.cgi_path = keep(s->cgi_path, value);
+    else if (strcmp(name, "private_key") == 0)
+        spare.private_key_file = keep(s->private_key_file, value);
+    else if (strcmp(name, "certificate") == 0)
+        spare.certificate_file = keep(s->certificate_file, value);
+    else if (strcmp(name, "cache_size") == 0) {
+        if (parse_number(value, 0, LONG_MAX, &n) == -1)
+            return -1;
+        spare.cache_size = n;
+    } else if (strcmp(name, "accept_batch") == 0) {
+        if (parse_number(value, 1, INT_MAX, &n) == -1)
+            return -1;
+        spare.accept_batch = n;
+    } else if (strcmp(name, "max_connections") == 0) {
+        if (parse_number(value, 0, INT_MAX, &n) == -1)
+            return -1;
+        spare.max_connections = n;
+    } else if (strcmp(name, "rate_limit") == 0) {
+        if (parse_number(value, 0, INT_MAX / 1000, &n) == -1)
+            return -1;
+        spare.rate_limit = n;
+    } else if (strcmp(name, "rate_burst") == 0) {
+        if (parse_number(value, 0, INT_MAX / 1000, &n) == -1)
+            return -1;
+        spare.rate_burst = n;
+    } else
+        return -1;
+    return 0;
+}
+
+/** @brief Read config_file over the spare copy
+ *
+ *  @return 0 on success. -1 on error.
+ */
+static int read_config(config_strings_t *s) {
+    char line[CONFIG_LINE_MAX], *name, *value, *end;
+    FILE *fp;
+    int lineno = 0, ret = 0;
+
+    if ((fp = fopen(config_file, "r")) == NULL) {
+        log_msg(L_ERROR, "Can't open config file %s\n", config_file);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        ++lineno;
+        name = line + strspn(line, " \t");
+        if (*name == '#' || *name == '\n' || *name == '\0')
+            continue;
+
+        value = name + strcspn(name, " \t\n");
+        if (*value != '\0')
+            *value++ = '\0';
+        value += strspn(value, " \t");
+        for (end = value + strlen(value);
+             end > value && (end[-1] == '\n' || end[-1] == ' ' ||
+                             end[-1] == '\t'); --end);
+        *end = '\0';
+
+        if (*value == '\0' || set_option(s, name, value) == -1) {
+            log_msg(L_ERROR, "%s:%d: invalid setting %s\n", config_file,
+                    lineno, name);
+            ret = -1;
+            break;
+        }
+    }
+
+    fclose(fp);
+    return ret;
+}
+
+/** @brief Check changed settings which would only fail once a request
+ *         needs them
+ */
+static int check_config() {
+    struct stat s;
+
+    if (strcmp(spare.www_folder, www_folder) != 0 &&
+        (stat(spare.www_folder, &s) == -1 || !S_ISDIR(s.st_mode))) {
+        log_msg(L_ERROR, "www folder %s is not a directory\n",
+                spare.www_folder);
+        return -1;
+    }
+    if (strcmp(spare.cgi_path, cgi_path) != 0 &&
+        access(spare.cgi_path, X_OK) == -1) {
+        log_msg(L_ERROR, "cgi script %s is not executable\n", spare.cgi_path);
+        return -1;
+    }
+    return 0;
+}
+
+/** @brief Read the config file, without changing the settings in use
+ *
+ *  Without a config file the settings in use are taken, so that files they
+ *  name (the certificate for example) are loaded again.
+ *
+ *  @return The settings read, to be passed to apply_config(). NULL if the
+ *          file is broken.
+ */
+config_t* load_config() {
+    config_strings_t *s = &strings[in_use == 0 ? 1 : 0];
+
+    spare.www_folder = keep(s->www_folder, www_folder);
+    spare.cgi_path = keep(s->cgi_path, cgi_path);
+    spare.private_key_file = keep(s->private_key_file, private_key_file);
+    spare.certificate_file = keep(s->certificate_file, certificate_file);
+    spare.cache_size = cache_size;
+    spare.accept_batch = accept_batch;
+    spare.max_connections = max_connections;
+    spare.rate_limit = rate_limit;
+    spare.rate_burst = rate_burst;
+
+    if (config_file != NULL && read_config(s) == -1)
+        return NULL;
+    if (check_config() == -1)
+        return NULL;
+    return &spare;
+}
+
+/** @brief Put settings returned by load_config() in use
+ *
+ *  @param old Where to save the settings replaced, NULL if not needed. Its
+ *             strings are valid until the next load_config().
+ */
+void apply_config(config_t *conf, config_t *old) {
+    if (old != NULL) {
+        old->www_folder = www_folder;
+        old->cgi_path = cgi_path;
+        old->private_key_file = private_key_file;
+        old->certificate_file = certificate_file;
+        old->cache_size = cache_size;
+        old->accept_batch = accept_batch;
+        old->max_connections = max_connections;
+        old->rate_limit = rate_limit;
+        old->rate_burst = rate_burst;
+    }
+
+    www_folder = conf->www_folder;
+    cgi_path = conf->cgi_path;
+    private_key_file = conf->private_key_file;
+    certificate_file = conf->certificate_file;
+    cache_size = conf->cache_size;
+    accept_batch = conf->accept_batch;
+    max_connections = conf->max_connections;
+    rate_limit = conf->rate_limit;
+    rate_burst = conf->rate_burst;
+    in_use = in_use == 0 ? 1 : 0;
+}
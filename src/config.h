@@ -16,4 +16,46 @@ char *log_file_name,
      *private_key_file,
      *certificate_file;
 
+/* Number of worker processes serving requests */
+int worker_count;
+
+/* Connections accepted from a listening socket per iteration of the loop */
+int accept_batch;
+
+/* Connections served by each worker at a time. 0 to derive from the fd limit */
+int max_connections;
+
+/* Number of FastCGI workers for cgi requests. 0 to fork for each request */
+int fcgi_workers;
+
+/* Bytes of static files cached in memory by each worker. 0 disables cache */
+long cache_size;
+
+/*
+ * Requests per second each client address may make, and how many may come
+ * at once, see ratelimit.c. A rate of 0 disables the limit, a burst of 0
+ * allows a second worth of requests.
+ */
+int rate_limit;
+int rate_burst;
+
+/* File of settings read again on reload, see config.c. NULL if none */
+char *config_file;
+
+/** @brief Settings which may be changed by reloading the config file */
+typedef struct {
+    char *www_folder;
+    char *cgi_path;
+    char *private_key_file;
+    char *certificate_file;
+    long cache_size;
+    int accept_batch;
+    int max_connections;
+    int rate_limit;
+    int rate_burst;
+} config_t;
+
+config_t* load_config();
+void apply_config(config_t *conf, config_t *old);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,356 @@
+/** @file event.c
+ *  @brief Event notification for the serving loop
+ *
+ *  Two backends are provided. On Linux, epoll is used in edge-triggered mode
+ *  so that the cost of each wakeup only depends on the number of active fds.
+ *  select() is kept as a fallback when epoll is not available.
+ *
+ *  Since epoll is edge-triggered, a fd stays ready until the user finds out
+ *  it would block (EAGAIN) and calls clear_read_fd()/clear_write_fd(). The
+ *  select backend recomputes readiness on every call and follows the same
+ *  rules, so users never have to know which backend is running.
+ *
+ *  Readiness is remembered even after the interest is removed. A socket that
+ *  was writable when the server stopped watching it can be written to right
+ *  away, without waiting for another round trip through the backend.
+ *
+ *  Each fd may carry a data pointer (see set_fd_data()), which allows the
+ *  server to go straight from a ready fd to the client owning it.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/select.h>
+
+/* Define LISO_USE_SELECT to force the select backend */
+#if defined(__linux__) && !defined(LISO_USE_SELECT)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#endif
+#include "event.h"
+#include "log.h"
+
+static fd_entry_t *fds = NULL;  //Indexed by fd
+static int fds_size = 0;        //Number of entries allocated in fds
+
+/* fds reported ready by the last io_select(), consumed by next_ready_fd() */
+static int ready_fds[MAX_EVENTS];
+static int nready, ready_pos;
+
+static event_backend_t *backend;
+
+/** @brief Get the entry of fd, enlarge the table if necessary */
+static fd_entry_t* get_entry(int fd) {
+    int size;
+
+    if (fd >= fds_size) {
+        size = fds_size ? fds_size : 64;
+        while (size <= fd)
+            size <<= 1;
+        fds = realloc(fds, size * sizeof(fd_entry_t));
+        memset(fds + fds_size, 0, (size - fds_size) * sizeof(fd_entry_t));
+        fds_size = size;
+    }
+
+    return fds + fd;
+}
+
+/** @brief Record that fd is ready for events and queue it for dispatching */
+static void mark_ready(int fd, int events) {
+    fd_entry_t *entry = get_entry(fd);
+
+    events &= entry->interest;
+    entry->ready |= events;
+    if (events && nready < MAX_EVENTS)
+        ready_fds[nready++] = fd;
+}
+
+/*===========================select() backend============================*/
+static fd_set read_fds, write_fds;
+static int fd_max = -1;
+
+static int select_init() {
+    FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
+    fd_max = -1;
+    return 0;
+}
+
+static int select_update(int fd, fd_entry_t *entry, int old_interest) {
+    if (fd >= FD_SETSIZE) {
+        log_msg(L_ERROR, "select_update: fd %d exceeds FD_SETSIZE\n", fd);
+        return -1;
+    }
+
+    if (entry->interest & EV_READ)
+        FD_SET(fd, &read_fds);
+    else
+        FD_CLR(fd, &read_fds);
+    if (entry->interest & EV_WRITE)
+        FD_SET(fd, &write_fds);
+    else
+        FD_CLR(fd, &write_fds);
+
+    if (entry->interest && fd > fd_max)
+        fd_max = fd;
+    return 0;
+}
+
+static int select_wait(int timeout) {
+    fd_set rfds = read_fds, wfds = write_fds;
+    struct timeval tv, *tvp = NULL;
+    int ret, fd, events;
+
+    if (timeout >= 0) {
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        tvp = &tv;
+    }
+
+    if ((ret = select(fd_max + 1, &rfds, &wfds, NULL, tvp)) <= 0)
+        return ret;
+
+    // Level-triggered: readiness of monitored events is recomputed
+    for (fd = 0; fd <= fd_max && fd < fds_size; ++fd) {
+        fds[fd].ready &= ~fds[fd].interest;
+        events = 0;
+        if (FD_ISSET(fd, &rfds)) events |= EV_READ;
+        if (FD_ISSET(fd, &wfds)) events |= EV_WRITE;
+        if (events)
+            mark_ready(fd, events);
+    }
+
+    return ret;
+}
+
+static void select_deinit() {
+}
+
+static event_backend_t select_backend = {
+    "select", select_init, select_update, select_wait, select_deinit
+};
+
+/*============================epoll backend==============================*/
+#ifdef USE_EPOLL
+static int epoll_fd = -1;
+
+static int epoll_init() {
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        log_error("epoll_create1 error");
+        return -1;
+    }
+    return 0;
+}
+
+static int epoll_update(int fd, fd_entry_t *entry, int old_interest) {
+    struct epoll_event ev;
+    int op;
+
+    if (entry->always)
+        return 0;
+
+    if (entry->interest == 0)
+        op = EPOLL_CTL_DEL;
+    else if (old_interest == 0)
+        op = EPOLL_CTL_ADD;
+    else
+        op = EPOLL_CTL_MOD;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLET | EPOLLRDHUP;
+    if (entry->interest & EV_READ) ev.events |= EPOLLIN;
+    if (entry->interest & EV_WRITE) ev.events |= EPOLLOUT;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(epoll_fd, op, fd, &ev) == -1) {
+        // Regular files can't be polled. They never block anyway.
+        if (errno == EPERM && op == EPOLL_CTL_ADD) {
+            entry->always = 1;
+            return 0;
+        }
+        // The fd may has been closed before being removed
+        if (op == EPOLL_CTL_DEL)
+            return 0;
+        log_error("epoll_ctl error");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int epoll_wait_events(int timeout) {
+    struct epoll_event events[MAX_EVENTS];
+    int ret, i, ev;
+
+    if ((ret = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout)) <= 0)
+        return ret;
+
+    for (i = 0; i < ret; ++i) {
+        ev = 0;
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP))
+            ev |= EV_READ;
+        if (events[i].events & EPOLLOUT)
+            ev |= EV_WRITE;
+        // Let the owner find out the error by reading or writing
+        if (events[i].events & (EPOLLERR | EPOLLHUP))
+            ev |= EV_READ | EV_WRITE;
+        mark_ready(events[i].data.fd, ev);
+    }
+
+    return ret;
+}
+
+static void epoll_deinit() {
+    if (epoll_fd != -1)
+        close(epoll_fd);
+    epoll_fd = -1;
+}
+
+static event_backend_t epoll_backend = {
+    "epoll", epoll_init, epoll_update, epoll_wait_events, epoll_deinit
+};
+#endif
+
+/*===============================Interface===============================*/
+
+/** @brief Choose and initialize an event backend
+ *
+ *  epoll is preferred. select is used if epoll is not available.
+ */
+void init_select_context() {
+    nready = ready_pos = 0;
+
+#ifdef USE_EPOLL
+    backend = &epoll_backend;
+    if (backend->init() == 0) {
+        log_msg(L_INFO, "Using event backend: %s\n", backend->name);
+        return;
+    }
+#endif
+    backend = &select_backend;
+    backend->init();
+    log_msg(L_INFO, "Using event backend: %s\n", backend->name);
+}
+
+/** @brief Release resources held by the event backend */
+void deinit_select_context() {
+    if (backend)
+        backend->deinit();
+    free(fds);
+    fds = NULL;
+    fds_size = 0;
+}
+
+/** @brief Largest fd number the backend can watch, plus one
+ *
+ *  @return FD_SETSIZE for select. -1 if only the fd limit of the process
+ *          matters.
+ */
+int select_fd_limit() {
+    return backend == &select_backend ? FD_SETSIZE : -1;
+}
+
+/** @brief Change the interest of fd and notify the backend */
+static void update_interest(int fd, int add, int remove) {
+    fd_entry_t *entry = get_entry(fd);
+    int old_interest = entry->interest;
+
+    entry->interest = (entry->interest | add) & ~remove;
+    if (entry->interest == old_interest)
+        return;
+
+    backend->update(fd, entry, old_interest);
+
+    // Nothing is monitored now. The fd might be closed and reused later.
+    if (entry->interest == 0) {
+        entry->ready = 0;
+        entry->always = 0;
+    }
+}
+
+void add_read_fd(int fd) {
+    update_interest(fd, EV_READ, 0);
+}
+
+void remove_read_fd(int fd) {
+    if (fd < fds_size)
+        update_interest(fd, 0, EV_READ);
+}
+
+/** @brief Whether fd is readable. It stays readable until clear_read_fd() */
+int test_read_fd(int fd) {
+    if (fd < 0 || fd >= fds_size) return 0;
+    if (fds[fd].always) return fds[fd].interest & EV_READ;
+    return fds[fd].ready & EV_READ;
+}
+
+/** @brief Reading from fd would block. Wait for the backend to report it */
+void clear_read_fd(int fd) {
+    if (fd < fds_size)
+        fds[fd].ready &= ~EV_READ;
+}
+
+void add_write_fd(int fd) {
+    update_interest(fd, EV_WRITE, 0);
+}
+
+void remove_write_fd(int fd) {
+    if (fd < fds_size)
+        update_interest(fd, 0, EV_WRITE);
+}
+
+/** @brief Whether fd is writable. It stays writable until clear_write_fd() */
+int test_write_fd(int fd) {
+    if (fd < 0 || fd >= fds_size) return 0;
+    if (fds[fd].always) return fds[fd].interest & EV_WRITE;
+    return fds[fd].ready & EV_WRITE;
+}
+
+/** @brief Writing to fd would block. Wait for the backend to report it */
+void clear_write_fd(int fd) {
+    if (fd < fds_size)
+        fds[fd].ready &= ~EV_WRITE;
+}
+
+/** @brief Associate data with fd
+ *
+ *  The data is kept until it's replaced, so set it to NULL before closing fd.
+ */
+void set_fd_data(int fd, void *data) {
+    get_entry(fd)->data = data;
+}
+
+void* get_fd_data(int fd) {
+    if (fd < 0 || fd >= fds_size) return NULL;
+    return fds[fd].data;
+}
+
+/** @brief Iterate over fds reported by last io_select()
+ *
+ *  @return A ready fd. -1 if all ready fds have been returned.
+ */
+int next_ready_fd() {
+    int fd;
+
+    while (ready_pos < nready) {
+        fd = ready_fds[ready_pos++];
+        // Skip fds removed after being reported
+        if (fd < fds_size && fds[fd].ready)
+            return fd;
+    }
+
+    return -1;
+}
+
+/** @brief Wait for events
+ *
+ *  @param timeout Milliseconds to wait. -1 to wait infinitely.
+ *  @return What the backend system call returns
+ */
+int io_select(int timeout) {
+    nready = ready_pos = 0;
+    return backend->wait(timeout);
+}
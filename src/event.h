@@ -0,0 +1,62 @@
+/** @file event.h
+ *  @brief Header file for event.c
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+/* Readiness flags */
+#define EV_READ 0x1
+#define EV_WRITE 0x2
+
+/* Maximum number of events fetched from the kernel by one io_select() */
+#define MAX_EVENTS 1024
+
+/** @brief Book keeping for a single file descriptor */
+typedef struct {
+    int interest;       //<!EV_READ/EV_WRITE the server is waiting for
+    int ready;          //<!readiness reported but not consumed yet
+    /**
+     * Some fds (regular files for example) can not be monitored by epoll.
+     * They never block, so they are treated as always ready.
+     */
+    int always;
+    void *data;         //<!owner of this fd, usually a http_client_t
+} fd_entry_t;
+
+/** @brief An event notification backend
+ *
+ *  update() is called whenever the interest of a fd changes. wait() blocks
+ *  until some fd is ready or timeout (in milliseconds, -1 for infinite)
+ *  expires, marks ready fds via mark_ready() and returns what the underlying
+ *  system call returns.
+ */
+typedef struct {
+    char *name;
+    int (*init)();
+    int (*update)(int fd, fd_entry_t *entry, int old_interest);
+    int (*wait)(int timeout);
+    void (*deinit)();
+} event_backend_t;
+
+/* Select context */
+int io_select(int timeout);     // Wait for events
+void init_select_context();
+void deinit_select_context();
+int select_fd_limit();
+void add_read_fd(int fd);
+void remove_read_fd(int fd);
+int test_read_fd(int fd);
+void clear_read_fd(int fd);
+void add_write_fd(int fd);
+void remove_write_fd(int fd);
+int test_write_fd(int fd);
+void clear_write_fd(int fd);
+
+/* Dispatching events */
+void set_fd_data(int fd, void *data);
+void* get_fd_data(int fd);
+int next_ready_fd();
+
+#endif
@@ -0,0 +1,803 @@
+/** @file fastcgi.c
+ *  @brief A pool of long-lived cgi workers speaking FastCGI
+ *
+ *  Forking a process for each cgi request means paying the startup cost of
+ *  the script (a Python interpreter for example) on every hit. Instead, a
+ *  number of workers are spawned once, all sharing a listening unix socket as
+ *  their stdin, as FastCGI applications expect. The server keeps one
+ *  connection per worker, with FCGI_KEEP_CONN, and sends each request over
+ *  an idle connection. When all connections are busy, requests wait in a
+ *  queue.
+ *
+ *  The request body is sent as FCGI_STDIN records while it arrives, and
+ *  output of the worker (FCGI_STDOUT) is passed to the client as it arrives,
+ *  just like with a forked cgi script, with chunked framing added if the
+ *  response has no length.
+ *
+ *  Connections are driven by fcgi_poll(), called in every iteration of the
+ *  serving loop. Workers that exit are restarted there, after a delay if
+ *  they keep exiting. While no worker is running, requests fail instead of
+ *  waiting for one.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "fastcgi.h"
+#include "event.h"
+#include "metrics.h"
+#include "timer.h"
+#include "log.h"
+
+static int nworkers = 0;
+static pid_t *pids;                 //pid of each worker
+static volatile int *exited;        //set by SIGCHLD handler
+static unsigned long *spawned;      //when each worker was started, in ms
+static int *crashes;                //quick exits of each worker in a row
+static timeout_t *respawns;         //restart of each worker after a delay
+static char script_path[PATH_MAX];
+static char next_script[PATH_MAX];  //script of workers started next
+static int restarting;              //waiting to start workers of next_script
+static char sock_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static int listen_fd = -1;
+static int wake_fds[2] = {-1, -1};  //written by SIGCHLD handler
+
+static fcgi_conn_t *conns;          //one connection for each worker
+static fcgi_request_t *queue_head, *queue_tail;
+static void (*wake_client)(http_client_t *client);
+
+/** @brief Start a worker with the listening socket as its stdin */
+static pid_t spawn_worker() {
+    char *argv[] = { script_path, NULL };
+    pid_t pid;
+
+    if ((pid = fork()) < 0) {
+        log_error("fastcgi spawn_worker fork error");
+        return -1;
+    }
+
+    if (pid == 0) {
+        if (dup2(listen_fd, STDIN_FILENO) == -1) {
+            log_error("fastcgi dup2 error");
+            exit(EXIT_FAILURE);
+        }
+        execv(script_path, argv);
+        log_error("fastcgi execv error");
+        exit(EXIT_FAILURE);
+    }
+
+    log_msg(L_INFO, "Start FastCGI worker %d\n", pid);
+    return pid;
+}
+
+/** @brief Milliseconds since some fixed point */
+static unsigned long now_ms() {
+    return metrics_clock() / 1000000;
+}
+
+static void worker_down(int i);
+
+/** @brief Start worker i, later again if it can't be forked */
+static void start_worker(int i) {
+    spawned[i] = now_ms();
+    if ((pids[i] = spawn_worker()) == -1)
+        worker_down(i);
+}
+
+/** @brief Restart worker i once its delay is over, see worker_down() */
+static void respawn_expired(void *arg) {
+    start_worker((int)(long)arg);
+}
+
+/** @brief Worker i is gone, restart it
+ *
+ *  A worker which exits soon after its start, like a script which doesn't
+ *  speak FastCGI, would exit again as soon. It's restarted after a delay,
+ *  doubled for each such exit in a row, instead of being forked in a loop.
+ */
+static void worker_down(int i) {
+    int delay;
+
+    pids[i] = -1;
+    if (now_ms() - spawned[i] >= FCGI_MIN_UPTIME) {
+        crashes[i] = 0;
+        start_worker(i);
+        return;
+    }
+
+    delay = FCGI_RESPAWN_DELAY << (crashes[i] < 16 ? crashes[i] : 16);
+    if (delay > FCGI_RESPAWN_MAX)
+        delay = FCGI_RESPAWN_MAX;
+    ++crashes[i];
+    log_msg(L_ERROR, "FastCGI worker keeps exiting, restart in %d ms\n",
+            delay);
+    timeout_set(&respawns[i], delay);
+}
+
+/** @brief Whether any worker is running */
+static int workers_alive() {
+    int i;
+
+    for (i = 0; i < nworkers; ++i)
+        if (pids[i] > 0)
+            return 1;
+    return 0;
+}
+
+/** @brief Bind the socket workers accept connections on
+ *
+ *  Each pool gets a path of its own. A pool being retired, or one of the
+ *  process before an upgrade (same pid), doesn't take over or remove it.
+ *
+ *  @param backlog Connections which may wait to be accepted
+ *  @return 0 on success. -1 on error.
+ */
+static int open_socket(int backlog) {
+    struct sockaddr_un addr;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(sock_path, sizeof(sock_path), "/tmp/lisod-fcgi.%d.%lx.sock",
+             (int)getpid(), (long)ts.tv_sec * 1000000000L + ts.tv_nsec);
+    strcpy(addr.sun_path, sock_path);
+    unlink(sock_path);
+
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        log_error("fastcgi socket error");
+        return -1;
+    }
+    fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, backlog) == -1) {
+        log_error("fastcgi bind/listen error");
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/** @brief Spawn cgi workers
+ *
+ *  @param workers Number of workers. 0 to keep forking for each request.
+ *  @param script The FastCGI application
+ *  @param wake Called when a client gets output or its request ends
+ *  @return 0 on success. -1 on error.
+ */
+int init_fcgi_pool(int workers, char *script,
+                   void (*wake)(http_client_t *client)) {
+    int i;
+
+    if (workers <= 0)
+        return 0;
+
+    if (realpath(script, script_path) == NULL) {
+        log_error("init_fcgi_pool realpath error");
+        return -1;
+    }
+    // A worker exiting wakes up the serving loop, even if it's about to block
+    if (pipe(wake_fds) == -1) {
+        log_error("init_fcgi_pool pipe error");
+        return -1;
+    }
+    for (i = 0; i < 2; ++i) {
+        fcntl(wake_fds[i], F_SETFD, FD_CLOEXEC);
+        fcntl(wake_fds[i], F_SETFL, O_NONBLOCK);
+    }
+    set_fd_data(wake_fds[0], NULL);
+    add_read_fd(wake_fds[0]);
+    if (open_socket(workers) == -1)
+        return -1;
+
+    nworkers = workers;
+    wake_client = wake;
+    queue_head = queue_tail = NULL;
+    restarting = 0;
+    pids = malloc(sizeof(pid_t) * workers);
+    exited = calloc(workers, sizeof(int));
+    spawned = malloc(sizeof(unsigned long) * workers);
+    crashes = calloc(workers, sizeof(int));
+    respawns = malloc(sizeof(timeout_t) * workers);
+    conns = malloc(sizeof(fcgi_conn_t) * workers);
+    for (i = 0; i < workers; ++i) {
+        conns[i].fd = -1;
+        conns[i].req = NULL;
+        conns[i].in = init_buf();
+        init_timeout(&respawns[i], respawn_expired, (void *)(long)i);
+        start_worker(i);
+    }
+
+    return 0;
+}
+
+/** @brief Replace the workers with ones running another script
+ *
+ *  Requests being served are finished by the old workers. New requests wait
+ *  in the queue meanwhile, and go to the new workers once all old ones are
+ *  idle, see fcgi_poll().
+ *
+ *  @param script The FastCGI application
+ *  @return 0 on success. -1 if the script can't be found.
+ */
+int fcgi_restart(char *script) {
+    if (nworkers == 0)
+        return 0;
+    if (realpath(script, next_script) == NULL) {
+        log_error("fcgi_restart realpath error");
+        return -1;
+    }
+    restarting = 1;
+    return 0;
+}
+
+/** @brief Whether cgi requests are served by the worker pool */
+int fcgi_enabled() {
+    return nworkers > 0;
+}
+
+/** @brief Destroy a request, its client must have let it go */
+static void free_request(fcgi_request_t *r) {
+    if (r->client)
+        r->client->fcgi = NULL;
+    deinit_chain(r->records);
+    free(r);
+}
+
+/** @brief Close a connection to the pool */
+static void close_conn(fcgi_conn_t *conn) {
+    remove_read_fd(conn->fd);
+    remove_write_fd(conn->fd);
+    close(conn->fd);
+    conn->fd = -1;
+    conn->in->pos = conn->in->datasize = 0;
+}
+
+/** @brief Stop all workers and release resources */
+void deinit_fcgi_pool() {
+    fcgi_request_t *r;
+    int i;
+
+    if (nworkers == 0)
+        return;
+
+    for (i = 0; i < nworkers; ++i) {
+        if (pids[i] > 0)
+            kill(pids[i], SIGTERM);
+        timeout_cancel(&respawns[i]);
+        if (conns[i].fd != -1)
+            close_conn(&conns[i]);
+        if (conns[i].req)
+            free_request(conns[i].req);
+        deinit_buf(conns[i].in);
+    }
+    while ((r = queue_head) != NULL) {
+        queue_head = r->next;
+        free_request(r);
+    }
+
+    close(listen_fd);
+    unlink(sock_path);
+    remove_read_fd(wake_fds[0]);
+    close(wake_fds[0]);
+    close(wake_fds[1]);
+    wake_fds[0] = wake_fds[1] = -1;
+    free(pids);
+    free((void *)exited);
+    free(spawned);
+    free(crashes);
+    free(respawns);
+    free(conns);
+    nworkers = 0;
+}
+
+/** @brief Note that a child process has exited. Called by SIGCHLD handler */
+void fcgi_child_exited(pid_t pid) {
+    int i, saved = errno;
+
+    for (i = 0; i < nworkers; ++i) {
+        if (pids[i] == pid) {
+            exited[i] = 1;
+            // A full pipe has a wakeup pending already
+            write(wake_fds[1], "", 1);
+        }
+    }
+    errno = saved;
+}
+
+/** @brief Queue a record of given type and content */
+static void put_record(out_chain_t *chain, int type, char *content, int len) {
+    unsigned char header[FCGI_HEADER_LEN];
+
+    header[0] = FCGI_VERSION_1;
+    header[1] = type;
+    header[2] = FCGI_REQUEST_ID >> 8;
+    header[3] = FCGI_REQUEST_ID & 0xff;
+    header[4] = len >> 8;
+    header[5] = len & 0xff;
+    header[6] = 0;      // No padding
+    header[7] = 0;
+    chain_copy(chain, (char *)header, FCGI_HEADER_LEN);
+    chain_copy(chain, content, len);
+}
+
+/** @brief Queue a stream as records, followed by an empty record ending it */
+static void put_stream(out_chain_t *chain, int type, char *data, int len) {
+    int n;
+
+    for (; len > 0; data += n, len -= n) {
+        n = len > FCGI_MAX_CONTENT ? FCGI_MAX_CONTENT : len;
+        put_record(chain, type, data, n);
+    }
+    put_record(chain, type, NULL, 0);
+}
+
+/** @brief Encode the length of a name or value of a parameter */
+static int encode_length(unsigned char *p, int len) {
+    if (len < 128) {
+        p[0] = len;
+        return 1;
+    }
+    p[0] = (len >> 24) | 0x80;
+    p[1] = len >> 16;
+    p[2] = len >> 8;
+    p[3] = len;
+    return 4;
+}
+
+/** @brief Encode environment variables "NAME=value" as FastCGI params
+ *
+ *  @return Encoded params allocated by malloc(). Its length is stored in len.
+ */
+static char* encode_params(char **envp, int *len) {
+    unsigned char *buf, *p;
+    char *eq;
+    int i, size = 0, nlen, vlen;
+
+    for (i = 0; envp[i] != NULL; ++i)
+        size += strlen(envp[i]) + 8;
+
+    p = buf = malloc(size > 0 ? size : 1);
+    for (i = 0; envp[i] != NULL; ++i) {
+        if ((eq = strchr(envp[i], '=')) == NULL)
+            continue;
+        nlen = eq - envp[i];
+        vlen = strlen(eq + 1);
+        p += encode_length(p, nlen);
+        p += encode_length(p, vlen);
+        memcpy(p, envp[i], nlen);
+        memcpy(p + nlen, eq + 1, vlen);
+        p += nlen + vlen;
+    }
+
+    *len = p - buf;
+    return (char *)buf;
+}
+
+/** @brief Open a connection to the worker pool */
+static int fcgi_connect(fcgi_conn_t *conn) {
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sock_path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        log_error("fcgi_connect socket error");
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    // A unix socket connects at once, or fails if the backlog is full
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        log_error("fcgi_connect connect error");
+        close(fd);
+        return -1;
+    }
+
+    conn->fd = fd;
+    set_fd_data(fd, NULL);
+    add_read_fd(fd);
+    return 0;
+}
+
+/** @brief A request could not be completed by the pool
+ *
+ *  If nothing has been sent to the client, it gets an error response of
+ *  code. Otherwise the response is cut and the connection will be closed.
+ */
+static void fail_request(fcgi_request_t *r, int code) {
+    http_client_t *client = r->client;
+
+    if (client) {
+        if (r->replied)
+            client->alive = 0;
+        else
+            end_request(client, code);
+        client->status = C_IDLE;
+        wake_client(client);
+    }
+    free_request(r);
+}
+
+/** @brief Hand queued requests to idle connections */
+static void dispatch() {
+    fcgi_request_t *r;
+    fcgi_conn_t *conn;
+    int i;
+
+    // Queued requests are for the workers started next
+    if (restarting)
+        return;
+
+    for (i = 0; i < nworkers && queue_head != NULL; ++i) {
+        conn = &conns[i];
+        if (conn->req != NULL)
+            continue;
+
+        r = queue_head;
+        if ((queue_head = r->next) == NULL)
+            queue_tail = NULL;
+
+        // The client has gone away while waiting
+        if (r->client == NULL) {
+            free_request(r);
+            --i;
+            continue;
+        }
+
+        if (conn->fd == -1 && fcgi_connect(conn) == -1) {
+            fail_request(r, SERVICE_UNAVAILABLE);
+            continue;
+        }
+
+        conn->req = r;
+        add_write_fd(conn->fd);
+    }
+}
+
+/** @brief Have the connection serving a request send what's queued */
+static void kick(fcgi_request_t *r) {
+    int i;
+
+    for (i = 0; i < nworkers; ++i)
+        if (conns[i].req == r && conns[i].fd != -1)
+            add_write_fd(conns[i].fd);
+}
+
+/** @brief Send a cgi request to the worker pool
+ *
+ *  The request goes to an idle connection, or waits in the queue.
+ *
+ *  @param client The client making the request
+ *  @param envp Cgi environment variables, copied
+ *  @param has_body Whether the request body follows by fcgi_feed(). It's
+ *         empty otherwise.
+ *  @return 0 if the request is accepted. The client gets the output later,
+ *          and its status is set to C_IDLE when the request ends. -1 if the
+ *          pool can't be reached or no worker is running.
+ */
+int fcgi_submit(http_client_t *client, char **envp, int has_body) {
+    unsigned char begin[8] = { 0, FCGI_RESPONDER, FCGI_KEEP_CONN };
+    fcgi_request_t *r;
+    fcgi_conn_t *conn = NULL;
+    char *params;
+    int params_len, i;
+
+    // Nobody would ever take it
+    if (!workers_alive())
+        return -1;
+
+    // Find an idle connection if no one is waiting
+    for (i = 0; i < nworkers && queue_head == NULL; ++i) {
+        if (conns[i].req == NULL) {
+            conn = &conns[i];
+            if (conn->fd == -1 && fcgi_connect(conn) == -1)
+                return -1;
+            break;
+        }
+    }
+
+    r = malloc(sizeof(fcgi_request_t));
+    r->client = client;
+    r->records = init_chain();
+    r->replied = 0;
+    r->stdin_open = has_body;
+    init_chunk_encoder(&r->enc);
+    // An HTTP/2 stream is framed by its connection
+    if (client->stream)
+        r->enc.state = CE_RAW;
+    r->next = NULL;
+
+    put_record(r->records, FCGI_BEGIN_REQUEST, (char *)begin, sizeof(begin));
+    params = encode_params(envp, &params_len);
+    put_stream(r->records, FCGI_PARAMS, params, params_len);
+    free(params);
+    if (!has_body)
+        put_record(r->records, FCGI_STDIN, NULL, 0);
+
+    client->fcgi = r;
+    if (conn) {
+        conn->req = r;
+        add_write_fd(conn->fd);
+    } else {
+        if (queue_tail)
+            queue_tail->next = r;
+        else
+            queue_head = r;
+        queue_tail = r;
+        log_msg(L_INFO, "All FastCGI workers are busy, request queued\n");
+    }
+    return 0;
+}
+
+/** @brief Pass a piece of request body on to the worker
+ *
+ *  A record is queued only once the ones before it have been sent, so a busy
+ *  or slow worker slows down the upload instead of growing the queue, like
+ *  the stdin pipe of a forked script does.
+ *
+ *  @return Bytes taken, at most a record. 0 if the worker hasn't caught up,
+ *          the client is woken up once it has.
+ */
+int fcgi_feed(http_client_t *client, char *data, int len) {
+    fcgi_request_t *r = client->fcgi;
+
+    if (chain_pending(r->records))
+        return 0;
+
+    if (len > FCGI_MAX_CONTENT)
+        len = FCGI_MAX_CONTENT;
+    put_record(r->records, FCGI_STDIN, data, len);
+    kick(r);
+    return len;
+}
+
+/** @brief The request body has been passed on, end the stdin stream */
+void fcgi_end_body(http_client_t *client) {
+    fcgi_request_t *r = client->fcgi;
+
+    if (r == NULL || !r->stdin_open)
+        return;
+    put_record(r->records, FCGI_STDIN, NULL, 0);
+    r->stdin_open = 0;
+    kick(r);
+}
+
+/** @brief The client is destroyed. Drop what its request produces
+ *
+ *  The body is cut where it is, so that the worker doesn't wait for the rest.
+ */
+void fcgi_cancel(http_client_t *client) {
+    if (client->fcgi) {
+        fcgi_end_body(client);
+        client->fcgi->client = NULL;
+        client->fcgi = NULL;
+    }
+}
+
+/** @brief Pass output of a worker to the client */
+static void pass_output(fcgi_request_t *r, char *data, int len) {
+    char buf[BUFSIZE + CHUNK_OVERHEAD];
+    int n;
+
+    for (; len > 0; data += n, len -= n) {
+        n = len < BUFSIZE ? len : BUFSIZE;
+        client_write(r->client, buf, chunk_encode(&r->enc, data, n, buf));
+    }
+    r->replied = 1;
+}
+
+/** @brief The request on a connection has ended */
+static void finish_request(fcgi_conn_t *conn) {
+    fcgi_request_t *r = conn->req;
+    char buf[CHUNK_OVERHEAD];
+
+    conn->req = NULL;
+    if (r->client) {
+        client_write(r->client, buf, chunk_encode_end(&r->enc, buf));
+        r->client->status = C_IDLE;
+        wake_client(r->client);
+    }
+    free_request(r);
+}
+
+/** @brief Process complete records received on a connection */
+static void read_records(fcgi_conn_t *conn) {
+    buf_t *bp = conn->in;
+    unsigned char *h;
+    int len, padding;
+    http_client_t *client;
+
+    while (bp->datasize - bp->pos >= FCGI_HEADER_LEN) {
+        h = (unsigned char *)bp->buf + bp->pos;
+        len = (h[4] << 8) | h[5];
+        padding = h[6];
+        if (bp->datasize - bp->pos < FCGI_HEADER_LEN + len + padding)
+            break;
+
+        client = conn->req ? conn->req->client : NULL;
+        switch (h[1]) {
+        case FCGI_STDOUT:
+            if (client && len > 0) {
+                pass_output(conn->req, (char *)h + FCGI_HEADER_LEN, len);
+                wake_client(client);
+            }
+            break;
+        case FCGI_STDERR:
+            log_msg(L_ERROR, "FastCGI: %.*s\n", len, h + FCGI_HEADER_LEN);
+            break;
+        case FCGI_END_REQUEST:
+            if (conn->req)
+                finish_request(conn);
+            break;
+        }
+        bp->pos += FCGI_HEADER_LEN + len + padding;
+    }
+
+    if (empty(bp))
+        io_shrink(bp);
+}
+
+/** @brief Stop the old workers and start new ones on a new socket
+ *
+ *  An old worker can't accept a connection meant for the new ones, since
+ *  they listen on different sockets.
+ */
+static void restart_pool() {
+    char old_path[sizeof(sock_path)];
+    int i, fd;
+
+    restarting = 0;
+    fd = listen_fd;
+    strcpy(old_path, sock_path);
+    if (open_socket(nworkers) == -1) {
+        log_msg(L_ERROR, "FastCGI pool not restarted, keep old workers\n");
+        listen_fd = fd;
+        strcpy(sock_path, old_path);
+        return;
+    }
+    close(fd);
+    unlink(old_path);
+    strcpy(script_path, next_script);
+
+    for (i = 0; i < nworkers; ++i) {
+        if (conns[i].fd != -1)
+            close_conn(&conns[i]);
+        if (pids[i] > 0)
+            kill(pids[i], SIGTERM);
+        exited[i] = 0;
+        crashes[i] = 0;
+        timeout_cancel(&respawns[i]);
+        start_worker(i);
+    }
+    log_msg(L_INFO, "FastCGI pool restarted with %s\n", script_path);
+}
+
+/** @brief Drop connections left in the backlog of the socket
+ *
+ *  No worker will accept them, and they would fill up the backlog, so that
+ *  connections to the next workers can't be made.
+ */
+static void drain_backlog() {
+    struct pollfd p;
+    int fd;
+
+    p.fd = listen_fd;
+    p.events = POLLIN;
+    while (poll(&p, 1, 0) == 1 && (fd = accept(listen_fd, NULL, NULL)) != -1)
+        close(fd);
+}
+
+/** @brief No worker is running, fail requests instead of letting them wait
+ *
+ *  Requests which have been sent are left in the backlog of the socket, they
+ *  get 502. Queued ones get 503.
+ */
+static void fail_all() {
+    fcgi_request_t *r;
+    int i;
+
+    for (i = 0; i < nworkers; ++i) {
+        if (conns[i].fd != -1)
+            close_conn(&conns[i]);
+        if (conns[i].req) {
+            fail_request(conns[i].req, BAD_GATEWAY);
+            conns[i].req = NULL;
+        }
+    }
+    while ((r = queue_head) != NULL) {
+        if ((queue_head = r->next) == NULL)
+            queue_tail = NULL;
+        fail_request(r, SERVICE_UNAVAILABLE);
+    }
+    drain_backlog();
+    log_msg(L_ERROR, "No FastCGI worker is running, requests failed\n");
+}
+
+/** @brief Drive connections to the worker pool
+ *
+ *  Should be called in every iteration of the serving loop.
+ */
+void fcgi_poll() {
+    fcgi_request_t *r;
+    fcgi_conn_t *conn;
+    char buf[64];
+    int i, n, down = 0;
+
+    if (wake_fds[0] != -1 && test_read_fd(wake_fds[0])) {
+        while (read(wake_fds[0], buf, sizeof(buf)) > 0)
+            ;
+        clear_read_fd(wake_fds[0]);
+    }
+
+    for (i = 0; i < nworkers; ++i) {
+        if (exited[i]) {
+            exited[i] = 0;
+            log_msg(L_ERROR, "FastCGI worker %d exited\n", pids[i]);
+            worker_down(i);
+            down = 1;
+        }
+    }
+    if (down && !workers_alive())
+        fail_all();
+
+    for (i = 0; i < nworkers; ++i) {
+        conn = &conns[i];
+        if (conn->fd == -1)
+            continue;
+
+        r = conn->req;
+        if (r && chain_pending(r->records) && test_write_fd(conn->fd)) {
+            if (io_send(conn->fd, r->records, NULL) == -1) {
+                close_conn(conn);
+                fail_request(r, BAD_GATEWAY);
+                conn->req = NULL;
+                continue;
+            }
+            // All sent, the client may pass on more of its body
+            if (!chain_pending(r->records) && r->stdin_open && r->client)
+                wake_client(r->client);
+        }
+
+        if (test_read_fd(conn->fd)) {
+            n = io_recv(conn->fd, conn->in, NULL);
+            if (n > 0)
+                read_records(conn);
+            // The worker has gone, don't keep a half-served request
+            if (n == 0 || (n == -1 && errno != EAGAIN)) {
+                close_conn(conn);
+                if (conn->req) {
+                    fail_request(conn->req, BAD_GATEWAY);
+                    conn->req = NULL;
+                }
+                continue;
+            }
+        }
+
+        if (conn->req && chain_pending(conn->req->records))
+            add_write_fd(conn->fd);
+        else
+            remove_write_fd(conn->fd);
+    }
+
+    if (restarting) {
+        for (i = 0; i < nworkers && conns[i].req == NULL; ++i);
+        if (i == nworkers)
+            restart_pool();
+    }
+
+    dispatch();
+}
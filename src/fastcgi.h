@@ -0,0 +1,71 @@
+/** @file fastcgi.h
+ *  @brief Header file for fastcgi.c
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __FASTCGI_H__
+#define __FASTCGI_H__
+
+#include <sys/types.h>
+#include "http_client.h"
+
+/* Record types, see the FastCGI specification */
+#define FCGI_VERSION_1 1
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_ABORT_REQUEST 2
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+
+/* Size of a record header and maximum content length of a record */
+#define FCGI_HEADER_LEN 8
+#define FCGI_MAX_CONTENT 65535
+
+/* Every request on a connection uses this id, requests are not multiplexed */
+#define FCGI_REQUEST_ID 1
+
+/*
+ * A worker exiting within FCGI_MIN_UPTIME ms of its start is restarted after
+ * FCGI_RESPAWN_DELAY ms, doubled for each such exit in a row up to
+ * FCGI_RESPAWN_MAX ms.
+ */
+#define FCGI_MIN_UPTIME 1000
+#define FCGI_RESPAWN_DELAY 100
+#define FCGI_RESPAWN_MAX 30000
+
+/** @brief A cgi request waiting for or being served by a worker */
+typedef struct fcgi_request {
+    http_client_t *client;      //<!NULL if the client has gone away
+    out_chain_t *records;       //<!records to be sent to the worker
+    int replied;                //<!whether the client has got any output
+    int stdin_open;             //<!more request body is to be sent
+    chunk_encoder_t enc;        //<!framing of the output if it has no length
+    struct fcgi_request *next;  //<!next request in the waiting queue
+} fcgi_request_t;
+
+/** @brief A connection to the worker pool */
+typedef struct {
+    int fd;                     //<!-1 if not connected
+    fcgi_request_t *req;        //<!request being served, NULL if idle
+    buf_t *in;                  //<!records received from the worker
+} fcgi_conn_t;
+
+int init_fcgi_pool(int workers, char *script,
+                   void (*wake)(http_client_t *client));
+void deinit_fcgi_pool();
+int fcgi_restart(char *script);
+int fcgi_enabled();
+
+int fcgi_submit(http_client_t *client, char **envp, int has_body);
+int fcgi_feed(http_client_t *client, char *data, int len);
+void fcgi_end_body(http_client_t *client);
+void fcgi_cancel(http_client_t *client);
+void fcgi_poll();
+void fcgi_child_exited(pid_t pid);
+
+#endif
@@ -0,0 +1,324 @@
+/** @file file_cache.c
+ *  @brief An in-memory LRU cache of static files
+ *
+ *  Hot files are kept in memory together with a prebuilt block of response
+ *  headers, so that serving them does not touch the file system at all. The
+ *  total size of cached content is limited by a byte budget. When the budget
+ *  is exceeded, the least recently used entries are evicted.
+ *
+ *  On Linux, each cached file is watched with inotify, and entries are
+ *  invalidated as soon as the file changes. Elsewhere, the modification time
+ *  of the file is checked on each hit.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include "file_cache.h"
+#include "event.h"
+#include "log.h"
+
+/* Largest fraction of the budget a single file may take */
+#define CACHE_MAX_SHARE 8
+
+static cache_entry_t *buckets[CACHE_BUCKETS];
+static cache_entry_t *watches[CACHE_BUCKETS];   //entries by watch descriptor
+static cache_entry_t *lru_head, *lru_tail;
+static long budget, used;
+static int notify_fd = -1;
+
+/** @brief djb2 hash of a string */
+static unsigned int hash(char *str) {
+    unsigned int h = 5381;
+
+    while (*str)
+        h = h * 33 + (unsigned char)*str++;
+    return h & (CACHE_BUCKETS - 1);
+}
+
+static void lru_unlink(cache_entry_t *entry) {
+    if (entry->prev) entry->prev->next = entry->next;
+    else lru_head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else lru_tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void lru_push(cache_entry_t *entry) {
+    entry->prev = NULL;
+    entry->next = lru_head;
+    if (lru_head) lru_head->prev = entry;
+    lru_head = entry;
+    if (lru_tail == NULL) lru_tail = entry;
+}
+
+/** @brief Find the entry of a key in the hash table */
+static cache_entry_t* find(char *key) {
+    cache_entry_t *entry;
+
+    for (entry = buckets[hash(key)]; entry != NULL; entry = entry->hnext)
+        if (strcmp(entry->key, key) == 0)
+            break;
+    return entry;
+}
+
+#ifdef __linux__
+/** @brief Head of the list of entries of a watch descriptor */
+static cache_entry_t** watch_bucket(int wd) {
+    return &watches[wd & (CACHE_BUCKETS - 1)];
+}
+
+/** @brief Take an entry off the list of its watch descriptor
+ *
+ *  @return Whether other entries still use the watch. inotify watches an
+ *          inode, so links to the same file share it.
+ */
+static int watch_unlink(cache_entry_t *entry) {
+    cache_entry_t **ptr, *other;
+
+    for (ptr = watch_bucket(entry->wd); *ptr != entry; ptr = &(*ptr)->wnext);
+    *ptr = entry->wnext;
+
+    for (other = *watch_bucket(entry->wd); other != NULL; other = other->wnext)
+        if (other->wd == entry->wd)
+            return 1;
+    return 0;
+}
+#endif
+
+/** @brief Memory charged to an entry */
+static long entry_cost(cache_entry_t *entry) {
+    return entry->size + entry->header_len;
+}
+
+/** @brief Free an entry which is no longer in the cache */
+static void cache_free(cache_entry_t *entry) {
+    free(entry->key);
+    free(entry->path);
+    free(entry->header);
+    free(entry->body);
+    free(entry);
+}
+
+/** @brief Remove an entry from the cache, free it if no one is sending it */
+static void cache_remove(cache_entry_t *entry) {
+    cache_entry_t **ptr;
+
+    for (ptr = &buckets[hash(entry->key)]; *ptr != entry; ptr = &(*ptr)->hnext);
+    *ptr = entry->hnext;
+    lru_unlink(entry);
+    used -= entry_cost(entry);
+
+#ifdef __linux__
+    if (entry->wd != -1 && !watch_unlink(entry))
+        inotify_rm_watch(notify_fd, entry->wd);
+#endif
+
+    log_msg(L_INFO, "Cache: drop %s\n", entry->key);
+    entry->removed = 1;
+    if (entry->refcount == 0)
+        cache_free(entry);
+}
+
+/** @brief Take a reference to an entry before sending its content */
+void cache_hold(cache_entry_t *entry) {
+    ++entry->refcount;
+}
+
+/** @brief Drop a reference taken by cache_hold()
+ *
+ *  @param entry The entry, passed as void* to be used as a release callback
+ */
+void cache_release(void *entry) {
+    cache_entry_t *e = entry;
+
+    if (--e->refcount == 0 && e->removed)
+        cache_free(e);
+}
+
+/** @brief Setup the cache
+ *
+ *  @param bytes Maximum bytes of cached content. 0 disables the cache.
+ */
+void init_file_cache(long bytes) {
+    budget = bytes;
+    used = 0;
+    lru_head = lru_tail = NULL;
+    memset(buckets, 0, sizeof(buckets));
+    memset(watches, 0, sizeof(watches));
+
+#ifdef __linux__
+    if (budget > 0) {
+        if ((notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+            log_error("init_file_cache inotify_init1 error");
+        else
+            add_read_fd(notify_fd);
+    }
+#endif
+}
+
+/** @brief Drop all entries and release resources */
+void deinit_file_cache() {
+    while (lru_head)
+        cache_remove(lru_head);
+
+    if (notify_fd != -1) {
+        remove_read_fd(notify_fd);
+        close(notify_fd);
+        notify_fd = -1;
+    }
+}
+
+/** @brief Size of the largest file worth caching, -1 if nothing is cached */
+long cache_limit() {
+    return budget > 0 ? budget / CACHE_MAX_SHARE : -1;
+}
+
+/** @brief Whether a file of given size is worth caching */
+int cache_fits(int size) {
+    return size <= cache_limit();
+}
+
+/** @brief Find the entry of a file
+ *
+ *  @param key Path of the file, with the coding of an encoded copy
+ *  @return The entry. NULL if it's not cached or no longer valid.
+ */
+cache_entry_t* cache_lookup(char *key) {
+    cache_entry_t *entry;
+    struct stat s;
+
+    if (budget <= 0 || (entry = find(key)) == NULL)
+        return NULL;
+
+    // Without inotify, check whether the file has changed
+    if (entry->wd == -1) {
+        if (stat(entry->path, &s) == -1 || s.st_mtime != entry->mtime ||
+            s.st_size != entry->size) {
+            cache_remove(entry);
+            return NULL;
+        }
+    }
+
+    lru_unlink(entry);
+    lru_push(entry);
+    return entry;
+}
+
+/** @brief Put a file into the cache
+ *
+ *  The cache takes the ownership of header and body, which must be allocated
+ *  by malloc(). Least recently used entries are evicted to make room.
+ *
+ *  Requests for the same file may be opened by I/O threads at the same time.
+ *  If one of them has cached the file already, its entry is kept and the new
+ *  one is dropped, unless the file has changed in between.
+ *
+ *  @param key Path of the file, with the coding of an encoded copy
+ *  @param path Path of the file in the file system
+ *  @param s Result of stat() on the file
+ *  @param meta Information of the file, copied into the entry
+ *  @param header Prebuilt response headers
+ *  @param header_len Length of header
+ *  @param body Content of the file
+ *  @return The entry of the file
+ */
+cache_entry_t* cache_insert(char *key, char *path, struct stat *s,
+                            file_meta_t *meta, char *header, int header_len,
+                            char *body) {
+    cache_entry_t *entry = find(key);
+    unsigned int h = hash(key);
+
+    if (entry != NULL) {
+        if (entry->mtime == s->st_mtime && entry->size == s->st_size) {
+            free(header);
+            free(body);
+            lru_unlink(entry);
+            lru_push(entry);
+            return entry;
+        }
+        cache_remove(entry);
+    }
+
+    entry = malloc(sizeof(cache_entry_t));
+    entry->key = strdup(key);
+    entry->path = strdup(path);
+    entry->header = header;
+    entry->header_len = header_len;
+    entry->body = body;
+    entry->size = s->st_size;
+    entry->mtime = s->st_mtime;
+    entry->wd = -1;
+    entry->refcount = 0;
+    entry->removed = 0;
+    entry->meta = *meta;
+
+#ifdef __linux__
+    if (notify_fd != -1) {
+        entry->wd = inotify_add_watch(notify_fd, path, IN_MODIFY | IN_ATTRIB |
+                        IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF);
+        if (entry->wd == -1) {
+            log_error("cache_insert inotify_add_watch error");
+        } else {
+            entry->wnext = *watch_bucket(entry->wd);
+            *watch_bucket(entry->wd) = entry;
+        }
+    }
+#endif
+
+    while (lru_tail && used + entry_cost(entry) > budget)
+        cache_remove(lru_tail);
+
+    entry->hnext = buckets[h];
+    buckets[h] = entry;
+    lru_push(entry);
+    used += entry_cost(entry);
+
+    log_msg(L_INFO, "Cache: add %s (%d bytes, %ld/%ld used)\n", key,
+            entry->size, used, budget);
+    return entry;
+}
+
+/** @brief Invalidate entries of files which have changed
+ *
+ *  Should be called in every iteration of the serving loop. Does nothing
+ *  unless the inotify fd is readable.
+ */
+void cache_poll() {
+#ifdef __linux__
+    char buf[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *event;
+    cache_entry_t *entry, *next;
+    int n, i;
+
+    if (notify_fd == -1 || !test_read_fd(notify_fd))
+        return;
+
+    while ((n = read(notify_fd, buf, sizeof(buf))) > 0) {
+        for (i = 0; i < n; i += sizeof(struct inotify_event) + event->len) {
+            event = (struct inotify_event *)(buf + i);
+            for (entry = *watch_bucket(event->wd); entry != NULL; entry = next) {
+                next = entry->wnext;
+                if (entry->wd != event->wd)
+                    continue;
+                // The watch is gone with the file
+                if (event->mask & IN_IGNORED) {
+                    watch_unlink(entry);
+                    entry->wd = -1;
+                }
+                cache_remove(entry);
+            }
+        }
+    }
+
+    if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+        log_error("cache_poll read error");
+    clear_read_fd(notify_fd);
+#endif
+}
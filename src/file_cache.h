@@ -0,0 +1,72 @@
+/** @file file_cache.h
+ *  @brief Header file for file_cache.c
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __FILE_CACHE_H__
+#define __FILE_CACHE_H__
+
+#include <time.h>
+#include <sys/stat.h>
+#include "http_date.h"
+
+/* Number of buckets in the hash table, must be a power of 2 */
+#define CACHE_BUCKETS 1024
+
+/* Longest entity tag, e.g. "1a2b3c-5d6e-5f5e100" */
+#define ETAG_MAX 64
+
+/** @brief What responses need to know about a static file
+ *
+ *  Kept with a cached file, so that conditional and range requests for it
+ *  are answered without touching the file system either.
+ */
+typedef struct {
+    const char *type;       //<!media type
+    const char *coding;     //<!content coding of an encoded copy, or NULL
+    int variants;           //<!encoded copies of the file, ENC_*
+    char etag[ETAG_MAX];    //<!quoted strong entity tag
+    char last_modified[HTTP_DATE_LEN + 1];
+} file_meta_t;
+
+/** @brief A cached static file
+ *
+ *  Entries are organized in a hash table keyed by the path of the file and a
+ *  LRU list ordered by last access. Watched entries are also found by their
+ *  inotify watch descriptor. Responses send header and body by reference, so
+ *  an entry dropped from the cache is kept until the last of them is sent.
+ */
+typedef struct cache_entry {
+    char *key;              //<!path of the file, see lookup_file()
+    char *path;             //<!path of the file or encoded copy sent
+    char *header;           //<!prebuilt response line and headers
+    int header_len;
+    char *body;             //<!file content
+    int size;               //<!file size
+    time_t mtime;           //<!last modified time when cached
+    int wd;                 //<!inotify watch descriptor, -1 if not watched
+    int refcount;           //<!number of responses still sending this entry
+    int removed;            //<!dropped from the cache, freed when unused
+    file_meta_t meta;
+    struct cache_entry *prev, *next;    //<!LRU list, most recent first
+    struct cache_entry *hnext;          //<!next entry in the hash bucket
+    struct cache_entry *wnext;          //<!next entry in the watch bucket
+} cache_entry_t;
+
+void init_file_cache(long budget);
+void deinit_file_cache();
+
+/* Access cache */
+cache_entry_t* cache_lookup(char *key);
+cache_entry_t* cache_insert(char *key, char *path, struct stat *s,
+                            file_meta_t *meta, char *header, int header_len,
+                            char *body);
+long cache_limit();
+int cache_fits(int size);
+void cache_hold(cache_entry_t *entry);
+void cache_release(void *entry);
+
+/* Invalidation */
+void cache_poll();
+
+#endif
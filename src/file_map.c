@@ -0,0 +1,148 @@
+/** @file file_map.c
+ *  @brief Memory-mapped files shared between clients
+ *
+ *  Large files are sent from a read-only mapping, so that SSL_write() can
+ *  encrypt straight from the page cache instead of going through a small
+ *  buffer one read() at a time. Clients requesting the same version of a
+ *  file share one mapping, which is unmapped when the last of them is done.
+ *
+ *  A file may be truncated while it is being sent. Senders check its size
+ *  before each chunk, and a SIGBUS from touching pages past the new end
+ *  in the middle of a chunk is caught, so that only that client fails.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "file_map.h"
+#include "log.h"
+
+static file_map_t *maps = NULL;     //All mappings in use
+static long page_size = 0;          //Set once the SIGBUS handler is in place
+
+/** @brief Handle a fault on a mapped file that has shrunk
+ *
+ *  The pages from the faulting one to the end of the mapping are replaced
+ *  with zeros so that the access can complete, and the mapping is marked
+ *  broken for the sender to give up after the chunk. Faults anywhere else
+ *  take the default action when the access is retried.
+ */
+static void sigbus_handler(int sig, siginfo_t *info, void *context) {
+    char *addr = info->si_addr, *page;
+    file_map_t *map;
+
+    for (map = maps; map != NULL; map = map->next) {
+        if (addr < map->addr || addr >= map->addr + map->size)
+            continue;
+        page = (char *)((uintptr_t)addr & ~(uintptr_t)(page_size - 1));
+        if (mmap(page, map->addr + map->size - page, PROT_READ,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+            break;
+        map->broken = 1;
+        return;
+    }
+    signal(SIGBUS, SIG_DFL);
+}
+
+/** @brief Install the SIGBUS handler before the first mapping is made */
+static void catch_sigbus() {
+    struct sigaction sa;
+
+    sa.sa_sigaction = sigbus_handler;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGBUS, &sa, NULL) == -1) {
+        log_error("catch_sigbus sigaction error");
+        return;
+    }
+    page_size = sysconf(_SC_PAGESIZE);
+}
+
+/** @brief Get a mapping of an opened file
+ *
+ *  @param fd The opened file
+ *  @param s Result of stat() on the file
+ *  @return The mapping with its reference count increased. NULL on error.
+ */
+file_map_t* map_file(int fd, struct stat *s) {
+    file_map_t *map;
+    void *addr;
+
+    for (map = maps; map != NULL; map = map->next) {
+        if (!map->broken &&
+            map->dev == s->st_dev && map->ino == s->st_ino &&
+            map->mtime == s->st_mtime && map->size == s->st_size) {
+            ++map->refcount;
+            return map;
+        }
+    }
+
+    if (s->st_size == 0)
+        return NULL;
+    if (page_size == 0)
+        catch_sigbus();
+    if (page_size == 0)
+        return NULL;
+
+    if ((addr = mmap(NULL, s->st_size, PROT_READ, MAP_SHARED, fd, 0)) ==
+            MAP_FAILED) {
+        log_error("map_file mmap error");
+        return NULL;
+    }
+    // Data is consumed once from head to tail
+    if (madvise(addr, s->st_size, MADV_SEQUENTIAL) == -1)
+        log_error("map_file madvise error");
+
+    map = malloc(sizeof(file_map_t));
+    map->addr = addr;
+    map->size = s->st_size;
+    map->dev = s->st_dev;
+    map->ino = s->st_ino;
+    map->mtime = s->st_mtime;
+    map->refcount = 1;
+    map->broken = 0;
+    map->prev = NULL;
+    map->next = maps;
+    if (maps) maps->prev = map;
+    maps = map;
+
+    return map;
+}
+
+/** @brief Drop a reference to a mapping. Unmap it if no one uses it */
+void release_file_map(file_map_t *map) {
+    if (--map->refcount > 0)
+        return;
+
+    if (map->prev) map->prev->next = map->next;
+    else maps = map->next;
+    if (map->next) map->next->prev = map->prev;
+
+    munmap(map->addr, map->size);
+    free(map);
+}
+
+/** @brief Whether a mapping can still be read up to some offset
+ *
+ *  The file is checked for having been truncated, so that sending a chunk
+ *  doesn't run into pages that are no longer backed by it.
+ *
+ *  @param map The mapping
+ *  @param fd The mapped file
+ *  @param end End offset of the chunk to read
+ *  @return 1 if readable. 0 if the file has shrunk.
+ */
+int map_readable(file_map_t *map, int fd, off_t end) {
+    struct stat s;
+
+    if (map->broken)
+        return 0;
+    if (fstat(fd, &s) == -1) {
+        log_error("map_readable fstat error");
+        return 0;
+    }
+    return s.st_size >= end;
+}
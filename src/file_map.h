@@ -0,0 +1,31 @@
+/** @file file_map.h
+ *  @brief Header file for file_map.c
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __FILE_MAP_H__
+#define __FILE_MAP_H__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Files smaller than this are read into the pipe buffer instead */
+#define MMAP_THRESHOLD (64 << 10)
+
+/** @brief A file mapped into memory, shared by all clients sending it */
+typedef struct file_map {
+    char *addr;         //<!start of the mapping
+    off_t size;         //<!size of the mapping
+    dev_t dev;          //<!identity of the mapped file
+    ino_t ino;
+    time_t mtime;
+    int refcount;       //<!number of pipes using this mapping
+    volatile int broken;//<!the file shrank, part of the mapping is zeros
+    struct file_map *prev, *next;
+} file_map_t;
+
+file_map_t* map_file(int fd, struct stat *s);
+void release_file_map(file_map_t *map);
+int map_readable(file_map_t *map, int fd, off_t end);
+
+#endif
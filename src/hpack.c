@@ -0,0 +1,516 @@
+/** @file hpack.c
+ *  @brief HPACK header compression for HTTP/2 (RFC 7541)
+ *
+ *  Request headers are decoded with the static table, a dynamic table kept
+ *  for the connection, and Huffman coded strings. Each decoded field is
+ *  handed to a callback, without building a list of them first.
+ *
+ *  Response headers are encoded as literals that are never added to the
+ *  dynamic table of the peer, so the encoder keeps no state. Names found in
+ *  the static table are sent by index. Strings are not Huffman coded.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "hpack.h"
+
+/* Static table, RFC 7541 Appendix A */
+static const hpack_field_t static_table[HPACK_STATIC_SIZE] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+/* Huffman code of each symbol, RFC 7541 Appendix B. EOS is never sent. */
+static const unsigned int huff_codes[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+    0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+    0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+    0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+    0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+    0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+    0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+    0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+    0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+    0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+    0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+    0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+    0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+    0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+    0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+    0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+    0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+    0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+    0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+    0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+    0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+    0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+    0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+    0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+    0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+/* Length in bits of each code */
+static const unsigned char huff_lens[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+/*============================Huffman coding=============================*/
+
+/*
+ * Decoding tree of the Huffman code. A child is the index of an inner node,
+ * -(symbol + 1) for a leaf, or 0 if no code goes that way (EOS).
+ */
+#define HUFF_NODES 256
+static short huff_tree[HUFF_NODES][2];
+
+/** @brief Build the decoding tree from the code table */
+static void build_huff_tree() {
+    int sym, i, node, bit, nodes = 1;
+
+    for (sym = 0; sym < 256; ++sym) {
+        node = 0;
+        for (i = huff_lens[sym] - 1; i > 0; --i) {
+            bit = (huff_codes[sym] >> i) & 1;
+            if (huff_tree[node][bit] == 0)
+                huff_tree[node][bit] = nodes++;
+            node = huff_tree[node][bit];
+        }
+        huff_tree[node][huff_codes[sym] & 1] = -(sym + 1);
+    }
+}
+
+/** @brief Decode a Huffman coded string
+ *
+ *  @param dst Buffer of at least len * 8 / 5 bytes, the shortest code
+ *             being 5 bits
+ *  @return Length of decoded string. -1 if the coding is broken.
+ */
+static int huff_decode(unsigned char *src, int len, char *dst) {
+    int node = 0, n = 0, bits = 0, ones = 1, i, b, next;
+
+    for (; len > 0; ++src, --len) {
+        for (i = 7; i >= 0; --i) {
+            b = (*src >> i) & 1;
+            if ((next = huff_tree[node][b]) == 0)
+                return -1;
+            if (next < 0) {
+                dst[n++] = -next - 1;
+                node = bits = 0;
+                ones = 1;
+            } else {
+                node = next;
+                ++bits;
+                ones &= b;
+            }
+        }
+    }
+
+    // What's left must be padding: a prefix of EOS shorter than a byte
+    if (bits > 7 || !ones)
+        return -1;
+    return n;
+}
+
+/*============================Dynamic table==============================*/
+
+void init_hpack(hpack_table_t *table) {
+    static int ready = 0;
+
+    if (!ready) {
+        build_huff_tree();
+        ready = 1;
+    }
+
+    table->entries = NULL;
+    table->cap = table->first = table->count = 0;
+    table->size = 0;
+    table->max_size = HPACK_TABLE_SIZE;
+}
+
+/** @brief The i-th newest entry of a table */
+static hpack_entry_t* table_entry(hpack_table_t *table, int i) {
+    return &table->entries[(table->first + i) % table->cap];
+}
+
+/** @brief Drop the oldest entry */
+static void table_evict(hpack_table_t *table) {
+    hpack_entry_t *e = table_entry(table, table->count - 1);
+
+    table->size -= e->nlen + e->vlen + HPACK_ENTRY_OVERHEAD;
+    free(e->name);
+    --table->count;
+}
+
+/** @brief Evict entries until the table fits in size bytes */
+static void table_shrink(hpack_table_t *table, int size) {
+    while (table->count > 0 && table->size > size)
+        table_evict(table);
+}
+
+/** @brief Add a field to a table as its newest entry
+ *
+ *  A field larger than the table empties it and is not added.
+ */
+static void table_add(hpack_table_t *table, char *name, int nlen,
+                      char *value, int vlen) {
+    hpack_entry_t *entries, *e;
+    int size = nlen + vlen + HPACK_ENTRY_OVERHEAD, i;
+
+    table_shrink(table, table->max_size - size);
+    if (size > table->max_size)
+        return;
+
+    // Grow the ring, keeping entries newest first
+    if (table->count == table->cap) {
+        entries = malloc(sizeof(hpack_entry_t) * (table->cap * 2 + 8));
+        for (i = 0; i < table->count; ++i)
+            entries[i] = *table_entry(table, i);
+        free(table->entries);
+        table->entries = entries;
+        table->cap = table->cap * 2 + 8;
+        table->first = 0;
+    }
+
+    table->first = (table->first + table->cap - 1) % table->cap;
+    ++table->count;
+    table->size += size;
+
+    e = table_entry(table, 0);
+    e->name = malloc(nlen + vlen + 2);
+    memcpy(e->name, name, nlen);
+    e->name[nlen] = '\0';
+    e->value = e->name + nlen + 1;
+    memcpy(e->value, value, vlen);
+    e->value[vlen] = '\0';
+    e->nlen = nlen;
+    e->vlen = vlen;
+}
+
+void deinit_hpack(hpack_table_t *table) {
+    while (table->count > 0)
+        table_evict(table);
+    free(table->entries);
+    table->entries = NULL;
+}
+
+/** @brief Find a field by index, static entries first
+ *
+ *  @return 0 on success. -1 if there is no such entry.
+ */
+static int lookup(hpack_table_t *table, int index, char **name, int *nlen,
+                  char **value, int *vlen) {
+    hpack_entry_t *e;
+
+    if (index <= 0)
+        return -1;
+    if (index <= HPACK_STATIC_SIZE) {
+        *name = static_table[index - 1].name;
+        *value = static_table[index - 1].value;
+        *nlen = strlen(*name);
+        *vlen = strlen(*value);
+        return 0;
+    }
+
+    index -= HPACK_STATIC_SIZE + 1;
+    if (index >= table->count)
+        return -1;
+    e = table_entry(table, index);
+    *name = e->name;
+    *nlen = e->nlen;
+    *value = e->value;
+    *vlen = e->vlen;
+    return 0;
+}
+
+/*==============================Decoding=================================*/
+
+/** @brief Decode an integer with an N-bit prefix
+ *
+ *  @return 0 on success. -1 if it's truncated or too large.
+ */
+static int decode_int(unsigned char **p, unsigned char *end, int prefix,
+                      int *value) {
+    int mask = (1 << prefix) - 1, shift = 0, v, b;
+
+    if (*p >= end)
+        return -1;
+    v = *(*p)++ & mask;
+    if (v < mask) {
+        *value = v;
+        return 0;
+    }
+
+    do {
+        if (*p >= end || shift > 21)
+            return -1;
+        b = *(*p)++;
+        v += (b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+
+    *value = v;
+    return 0;
+}
+
+/** @brief Decode a string literal into dst
+ *
+ *  @return Length of the string. -1 if it's broken.
+ */
+static int decode_string(unsigned char **p, unsigned char *end, char *dst) {
+    int huffman, len, n;
+
+    if (*p >= end)
+        return -1;
+    huffman = **p & 0x80;
+    if (decode_int(p, end, 7, &len) == -1 || len > end - *p)
+        return -1;
+
+    if (huffman) {
+        n = huff_decode(*p, len, dst);
+    } else {
+        memcpy(dst, *p, len);
+        n = len;
+    }
+    *p += len;
+    return n;
+}
+
+/** @brief Decode a header block
+ *
+ *  The dynamic table is updated even if emit is NULL, so that a block which
+ *  is not wanted keeps the table in sync with the peer.
+ *
+ *  @param table Dynamic table of the connection
+ *  @param src The complete header block
+ *  @param len Length of src
+ *  @param emit Called for each header field, may be NULL
+ *  @param arg Passed to emit
+ *  @return 0 on success. -1 on a compression error, after which the
+ *          connection can't go on.
+ */
+int hpack_decode(hpack_table_t *table, unsigned char *src, int len,
+                 hpack_emit_t emit, void *arg) {
+    unsigned char *p = src, *end = src + len;
+    char *scratch, *name, *value;
+    int index, nlen, vlen, prefix, fields = 0, ret = -1;
+
+    // Decoded strings are at most 8/5 as long as the block
+    scratch = malloc(len * 2 + 2);
+
+    while (p < end) {
+        if (*p & 0x80) {
+            // Indexed header field
+            if (decode_int(&p, end, 7, &index) == -1 ||
+                lookup(table, index, &name, &nlen, &value, &vlen) == -1)
+                goto done;
+        } else if ((*p & 0xe0) == 0x20) {
+            // Dynamic table size update, only before the first field
+            if (fields > 0 || decode_int(&p, end, 5, &index) == -1 ||
+                index > HPACK_TABLE_SIZE)
+                goto done;
+            table->max_size = index;
+            table_shrink(table, index);
+            continue;
+        } else {
+            // Literal, with incremental indexing (01), without (0000) or
+            // never indexed (0001)
+            prefix = (*p & 0x40) ? 6 : 4;
+            if (decode_int(&p, end, prefix, &index) == -1)
+                goto done;
+
+            if (index > 0) {
+                if (lookup(table, index, &name, &nlen, &value, &vlen) == -1)
+                    goto done;
+                memcpy(scratch, name, nlen);
+            } else if ((nlen = decode_string(&p, end, scratch)) == -1) {
+                goto done;
+            }
+            name = scratch;
+            value = scratch + nlen;
+            if ((vlen = decode_string(&p, end, value)) == -1)
+                goto done;
+
+            if (prefix == 6)
+                table_add(table, name, nlen, value, vlen);
+        }
+
+        ++fields;
+        if (emit)
+            emit(arg, name, nlen, value, vlen);
+    }
+    ret = 0;
+
+done:
+    free(scratch);
+    return ret;
+}
+
+/*==============================Encoding=================================*/
+
+/** @brief Encode an integer with an N-bit prefix
+ *
+ *  @param first Bits above the prefix in the first byte
+ *  @return Bytes written
+ */
+static int encode_int(unsigned char *dst, int first, int prefix, int value) {
+    int mask = (1 << prefix) - 1, n = 0;
+
+    if (value < mask) {
+        dst[0] = first | value;
+        return 1;
+    }
+
+    dst[n++] = first | mask;
+    for (value -= mask; value >= 0x80; value >>= 7)
+        dst[n++] = (value & 0x7f) | 0x80;
+    dst[n++] = value;
+    return n;
+}
+
+/** @brief Encode a string literal, not Huffman coded */
+static int encode_string(unsigned char *dst, char *str, int len) {
+    int n = encode_int(dst, 0, 7, len);
+
+    memcpy(dst + n, str, len);
+    return n + len;
+}
+
+/** @brief Index of a name in the static table. 0 if it's not there */
+static int static_name(char *name, int nlen) {
+    int i;
+
+    for (i = 0; i < HPACK_STATIC_SIZE; ++i)
+        if (strncmp(static_table[i].name, name, nlen) == 0 &&
+            static_table[i].name[nlen] == '\0')
+            return i + 1;
+    return 0;
+}
+
+/** @brief Encode a header field as a literal without indexing
+ *
+ *  @param dst Buffer of at least nlen + vlen + HPACK_FIELD_OVERHEAD bytes
+ *  @param name Lower case header name
+ *  @return Bytes written
+ */
+int hpack_encode(unsigned char *dst, char *name, int nlen,
+                 char *value, int vlen) {
+    int index = static_name(name, nlen), n;
+
+    n = encode_int(dst, 0, 4, index);
+    if (index == 0)
+        n += encode_string(dst + n, name, nlen);
+    return n + encode_string(dst + n, value, vlen);
+}
+
+/** @brief Encode the :status pseudo header
+ *
+ *  Common codes are in the static table, others are sent as literals.
+ *
+ *  @param dst Buffer of at least HPACK_FIELD_OVERHEAD bytes
+ *  @return Bytes written
+ */
+int hpack_encode_status(unsigned char *dst, int code) {
+    char digits[HPACK_FIELD_OVERHEAD];
+    int i;
+
+    snprintf(digits, sizeof(digits), "%03d", code % 1000);
+    for (i = 8; i <= 14; ++i)
+        if (strcmp(static_table[i - 1].value, digits) == 0)
+            return encode_int(dst, 0x80, 7, i);
+
+    return hpack_encode(dst, ":status", 7, digits, 3);
+}
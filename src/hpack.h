@@ -0,0 +1,70 @@
+/** @file hpack.h
+ *  @brief Header file for hpack.c
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __HPACK_H__
+#define __HPACK_H__
+
+/* Number of entries in the static table */
+#define HPACK_STATIC_SIZE 61
+
+/* Default and maximum size of the dynamic table, see SETTINGS_HEADER_TABLE_SIZE */
+#define HPACK_TABLE_SIZE 4096
+
+/* Bytes an entry is charged for in addition to its name and value */
+#define HPACK_ENTRY_OVERHEAD 32
+
+/*
+ * Maximum bytes hpack_encode() writes in addition to the name and value
+ */
+#define HPACK_FIELD_OVERHEAD 16
+
+/** @brief A header field in the static table */
+typedef struct {
+    char *name;
+    char *value;
+} hpack_field_t;
+
+/** @brief A header field in the dynamic table
+ *
+ *  name and value are in one block allocated by malloc(), the value follows
+ *  the NUL ending the name.
+ */
+typedef struct {
+    char *name;
+    char *value;
+    int nlen, vlen;
+} hpack_entry_t;
+
+/** @brief The dynamic table of a decoder
+ *
+ *  Entries are kept in a ring, newest first. The oldest entries are evicted
+ *  when the table grows beyond max_size.
+ */
+typedef struct {
+    hpack_entry_t *entries;
+    int cap;            //<!number of slots in entries
+    int first;          //<!slot of the newest entry
+    int count;          //<!number of entries
+    int size;           //<!size of all entries, as defined by HPACK
+    int max_size;       //<!size limit set by the encoder
+} hpack_table_t;
+
+/** @brief Called for each header field decoded
+ *
+ *  name and value are only valid during the call.
+ */
+typedef void (*hpack_emit_t)(void *arg, char *name, int nlen,
+                             char *value, int vlen);
+
+void init_hpack(hpack_table_t *table);
+void deinit_hpack(hpack_table_t *table);
+
+int hpack_decode(hpack_table_t *table, unsigned char *src, int len,
+                 hpack_emit_t emit, void *arg);
+int hpack_encode(unsigned char *dst, char *name, int nlen,
+                 char *value, int vlen);
+int hpack_encode_status(unsigned char *dst, int code);
+
+#endif
@@ -0,0 +1,1121 @@
+/** @file http2.c
+ *  @brief HTTP/2 over TLS, with streams served by the HTTP/1.1 handlers
+ *
+ *  Clients which offer "h2" by ALPN speak HTTP/2 on the https port. All
+ *  requests of such a client share one connection, each on a stream of its
+ *  own, instead of a connection per request in flight.
+ *
+ *  A stream is handled by a client object without a socket. The request
+ *  headers, decoded by HPACK, are rewritten as an HTTP/1.1 request into its
+ *  input buffer, and DATA frames are appended as the body. A body of unknown
+ *  length is framed as chunks. Thus the parser, the static file and cgi
+ *  handlers, FastCGI and body streaming all work on streams unchanged.
+ *
+ *  What the handlers write is an HTTP/1.1 response. Its header is turned into
+ *  a HEADERS frame and the rest is sent as DATA frames, within the flow
+ *  control windows of the stream and the connection. Streams take turns, one
+ *  frame each, so a large response doesn't hold up the others.
+ *
+ *  Events on the pipes of a stream wake up the connection, which is the
+ *  only one talking to the socket.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "http2.h"
+#include "http_parser.h"
+#include "request_handler.h"
+#include "config.h"
+#include "log.h"
+
+/* Protocols offered by ALPN, in order of preference */
+static unsigned char alpn_protos[] = "\x02h2\x08http/1.1";
+
+/*============================Negotiation================================*/
+
+/** @brief ALPN callback of the SSL context, picks h2 if the client has it
+ *
+ *  HTTP/2 requires TLS 1.2 or later. Older connections stay on HTTP/1.1.
+ */
+int h2_alpn_select(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                   const unsigned char *in, unsigned int inlen, void *arg) {
+    if (SSL_version(ssl) < TLS1_2_VERSION)
+        return SSL_TLSEXT_ERR_NOACK;
+    if (SSL_select_next_proto((unsigned char **)out, outlen, alpn_protos,
+                              sizeof(alpn_protos) - 1, in, inlen) !=
+        OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/** @brief Whether h2 has been selected during the handshake */
+int h2_negotiated(SSL *ssl) {
+    const unsigned char *proto;
+    unsigned int len;
+
+    SSL_get0_alpn_selected(ssl, &proto, &len);
+    return len == 2 && memcmp(proto, "h2", 2) == 0;
+}
+
+/*==============================Frames===================================*/
+
+static unsigned int get32(unsigned char *p) {
+    return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put32(unsigned char *p, unsigned int v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/** @brief Fill a frame header */
+static void frame_header(unsigned char *h, int len, int type, int flags,
+                         int id) {
+    h[0] = len >> 16;
+    h[1] = len >> 8;
+    h[2] = len;
+    h[3] = type;
+    h[4] = flags;
+    put32(h + 5, id & 0x7fffffff);
+}
+
+/** @brief Queue a frame to the connection */
+static void put_frame(h2_conn_t *h2, int type, int flags, int id,
+                      unsigned char *payload, int len) {
+    unsigned char h[H2_FRAME_HEADER];
+
+    frame_header(h, len, type, flags, id);
+    chain_copy(h2->client->out, (char *)h, H2_FRAME_HEADER);
+    chain_copy(h2->client->out, (char *)payload, len);
+}
+
+/** @brief Queue a frame with a 32 bit payload */
+static void put_frame32(h2_conn_t *h2, int type, int id, unsigned int v) {
+    unsigned char payload[4];
+
+    put32(payload, v);
+    put_frame(h2, type, 0, id, payload, 4);
+}
+
+/** @brief End the connection because of an error
+ *
+ *  GOAWAY is sent, and the connection is closed once it's out.
+ *
+ *  @return -1
+ */
+static int goaway(h2_conn_t *h2, int code) {
+    unsigned char payload[8];
+
+    log_msg(L_ERROR, "HTTP/2 connection error %d on fd %d\n", code,
+            h2->client->fd);
+    put32(payload, h2->last_id);
+    put32(payload + 4, code);
+    put_frame(h2, H2_GOAWAY, 0, 0, payload, 8);
+    h2->client->alive = 0;
+    return -1;
+}
+
+/** @brief Tell the peer that no new streams will be taken
+ *
+ *  Streams already open are served, and the connection is closed once they
+ *  are done, see h2_serve().
+ */
+void h2_shutdown(h2_conn_t *h2) {
+    unsigned char payload[8];
+
+    if (h2->goaway)
+        return;
+    put32(payload, h2->last_id);
+    put32(payload + 4, H2_NO_ERROR);
+    put_frame(h2, H2_GOAWAY, 0, 0, payload, 8);
+    h2->goaway = 1;
+}
+
+/*==============================Streams==================================*/
+
+static h2_stream_t* find_stream(h2_conn_t *h2, int id) {
+    h2_stream_t *s;
+
+    for (s = h2->streams; s != NULL && s->id != id; s = s->next);
+    return s;
+}
+
+/** @brief Open a stream and create the client object handling it */
+static h2_stream_t* new_stream(h2_conn_t *h2, int id) {
+    h2_stream_t *s = malloc(sizeof(h2_stream_t)), **tail;
+    http_client_t *client = new_client(-1);
+
+    client->stream = s;
+    strcpy(client->remote_ip, h2->client->remote_ip);
+
+    s->id = id;
+    s->conn = h2;
+    s->client = client;
+    s->parsed = 0;
+    s->remote_closed = 0;
+    s->chunked = 0;
+    s->send_window = h2->initial_window;
+    s->recv_window = H2_WINDOW;
+    s->state = S_HEAD;
+    s->head = init_buf();
+    s->next = NULL;
+
+    // Streams are kept in the order they are opened, and take turns so
+    for (tail = &h2->streams; *tail != NULL; tail = &(*tail)->next);
+    *tail = s;
+    ++h2->nstreams;
+    return s;
+}
+
+/** @brief Close a stream, whatever its handler is doing is dropped */
+static void free_stream(h2_stream_t *s) {
+    h2_stream_t **ptr;
+
+    for (ptr = &s->conn->streams; *ptr != s; ptr = &(*ptr)->next);
+    *ptr = s->next;
+    --s->conn->nstreams;
+
+    deinit_client(s->client);
+    deinit_buf(s->head);
+    free(s);
+}
+
+/** @brief Abort a stream with RST_STREAM */
+static void reset_stream(h2_stream_t *s, int code) {
+    log_msg(L_INFO, "HTTP/2 reset stream %d: %d\n", s->id, code);
+    put_frame32(s->conn, H2_RST_STREAM, s->id, code);
+    free_stream(s);
+}
+
+/** @brief The response on a stream has been sent
+ *
+ *  If the peer is still sending the request body, it's told to stop.
+ */
+static void close_stream(h2_stream_t *s) {
+    if (!s->remote_closed)
+        put_frame32(s->conn, H2_RST_STREAM, s->id, H2_NO_ERROR);
+    free_stream(s);
+}
+
+/*=============================Requests==================================*/
+
+/** @brief State of rewriting a header block as an HTTP/1.1 request */
+typedef struct {
+    h2_stream_t *s;
+    char *method, *path, *authority;    //<!pseudo headers
+    char *cookie;           //<!cookie headers joined
+    int started;            //<!request line has been written
+    int has_length;         //<!a content-length header is present
+    int bad;                //<!the request is malformed
+} builder_t;
+
+/* Connection-specific headers, which are not passed on */
+static char *hop_by_hop[] = {
+    "connection", "keep-alive", "proxy-connection", "transfer-encoding",
+    "upgrade", "te", NULL
+};
+
+static int is_hop_by_hop(char *name, int nlen) {
+    int i;
+
+    for (i = 0; hop_by_hop[i] != NULL; ++i)
+        if (strncmp(hop_by_hop[i], name, nlen) == 0 &&
+            hop_by_hop[i][nlen] == '\0')
+            return 1;
+    return 0;
+}
+
+/** @brief Whether a field can be written into an HTTP/1.1 request as is
+ *
+ *  Names must be lower case tokens, and values must not break the line.
+ */
+static int valid_field(char *name, int nlen, char *value, int vlen) {
+    int i;
+    char c;
+
+    if (nlen == 0 || (nlen == 1 && name[0] == ':'))
+        return 0;
+    for (i = name[0] == ':' ? 1 : 0; i < nlen; ++i) {
+        c = name[i];
+        if (c <= ' ' || c == ':' || c == 0x7f || (c >= 'A' && c <= 'Z'))
+            return 0;
+    }
+    for (i = 0; i < vlen; ++i)
+        if (value[i] == '\r' || value[i] == '\n' || value[i] == '\0')
+            return 0;
+    return 1;
+}
+
+static int name_is(char *name, int nlen, char *str) {
+    return strncmp(name, str, nlen) == 0 && str[nlen] == '\0';
+}
+
+static void append(builder_t *b, char *data, int len) {
+    io_append(b->s->client->in, data, len);
+}
+
+static void append_str(builder_t *b, char *str) {
+    append(b, str, strlen(str));
+}
+
+/** @brief Write the request line, once all pseudo headers are known */
+static void start_request(builder_t *b) {
+    if (b->started || b->bad)
+        return;
+    b->started = 1;
+
+    if (b->method == NULL || b->path == NULL || b->path[0] != '/' ||
+        strpbrk(b->method, " \t") || strpbrk(b->path, " \t")) {
+        b->bad = 1;
+        return;
+    }
+
+    append_str(b, b->method);
+    append_str(b, " ");
+    append_str(b, b->path);
+    append_str(b, " ");
+    append_str(b, http_version);
+    append_str(b, "\r\n");
+    if (b->authority) {
+        append_str(b, "host: ");
+        append_str(b, b->authority);
+        append_str(b, "\r\n");
+    }
+}
+
+/** @brief Keep a pseudo header, they must come before regular headers */
+static void set_pseudo(builder_t *b, char *name, int nlen, char *value,
+                       int vlen) {
+    char **field = NULL;
+
+    if (name_is(name, nlen, ":method"))
+        field = &b->method;
+    else if (name_is(name, nlen, ":path"))
+        field = &b->path;
+    else if (name_is(name, nlen, ":authority"))
+        field = &b->authority;
+    else if (name_is(name, nlen, ":scheme"))
+        return;
+
+    if (field == NULL || *field != NULL || b->started) {
+        b->bad = 1;
+        return;
+    }
+    *field = strndup(value, vlen);
+}
+
+/** @brief Add a decoded field to the request, see hpack_decode() */
+static void add_field(void *arg, char *name, int nlen, char *value, int vlen) {
+    builder_t *b = arg;
+    int len;
+
+    if (b->bad)
+        return;
+    if (!valid_field(name, nlen, value, vlen)) {
+        b->bad = 1;
+        return;
+    }
+
+    if (name[0] == ':') {
+        set_pseudo(b, name, nlen, value, vlen);
+        return;
+    }
+
+    start_request(b);
+    if (b->bad || is_hop_by_hop(name, nlen) ||
+        (b->authority && name_is(name, nlen, "host")))
+        return;
+
+    if (name_is(name, nlen, "content-length"))
+        b->has_length = 1;
+
+    // Cookies may be split into several fields, the handlers want one
+    if (name_is(name, nlen, "cookie")) {
+        len = b->cookie ? strlen(b->cookie) : 0;
+        b->cookie = realloc(b->cookie, len + vlen + 3);
+        if (len > 0) {
+            memcpy(b->cookie + len, "; ", 2);
+            len += 2;
+        }
+        memcpy(b->cookie + len, value, vlen);
+        b->cookie[len + vlen] = '\0';
+        return;
+    }
+
+    append(b, name, nlen);
+    append_str(b, ": ");
+    append(b, value, vlen);
+    append_str(b, "\r\n");
+}
+
+/** @brief End the rewritten request header
+ *
+ *  @param end_stream Whether the request has no body
+ *  @return 0 if ok. -1 if the request is malformed.
+ */
+static int finish_request(builder_t *b, int end_stream) {
+    start_request(b);
+
+    if (!b->bad) {
+        if (b->cookie) {
+            append_str(b, "cookie: ");
+            append_str(b, b->cookie);
+            append_str(b, "\r\n");
+        }
+
+        // DATA frames end the body, which has no length otherwise
+        if (!end_stream && !b->has_length) {
+            append_str(b, "transfer-encoding: chunked\r\n");
+            b->s->chunked = 1;
+        } else if (end_stream && !b->has_length &&
+                   strcmp(b->method, "POST") == 0) {
+            append_str(b, "content-length: 0\r\n");
+        }
+        append_str(b, "\r\n");
+    }
+
+    free(b->method);
+    free(b->path);
+    free(b->authority);
+    free(b->cookie);
+    return b->bad ? -1 : 0;
+}
+
+/** @brief Let the handlers work on what a stream has received
+ *
+ *  The request is parsed until it's passed to a handler. After that, only a
+ *  body streamed to a cgi script is consumed.
+ *
+ *  @return 0 if ok. -1 if the request can never be complete.
+ */
+static int stream_request(h2_stream_t *s) {
+    http_client_t *client = s->client;
+
+    if (!s->parsed) {
+        http_parse(client);
+        if (client->status != C_PHEADER && client->status != C_PBODY)
+            s->parsed = 1;
+        else if (s->remote_closed)
+            return -1;     // Body shorter than its content-length
+    }
+
+    if (client->body_stream || client->cgi_in != -1)
+        feed_cgi(client);
+    return 0;
+}
+
+/** @brief Append a piece of request body received on a stream
+ *
+ *  A body nobody is going to read is dropped.
+ */
+static int stream_data(h2_stream_t *s, unsigned char *data, int len,
+                       int end_stream) {
+    http_client_t *client = s->client;
+    char size[16];
+
+    if (len > 0 && (!s->parsed || client->body_stream)) {
+        if (s->chunked) {
+            io_append(client->in, size, sprintf(size, "%x\r\n", len));
+            io_append(client->in, (char *)data, len);
+            io_append(client->in, "\r\n", 2);
+        } else {
+            io_append(client->in, (char *)data, len);
+        }
+    }
+
+    if (end_stream) {
+        s->remote_closed = 1;
+        if (s->chunked)
+            io_append(client->in, "0\r\n\r\n", 5);
+        else if (client->body_stream)
+            cut_body(client);
+    }
+
+    return stream_request(s);
+}
+
+/** @brief Let the peer send more body, as far as the handler keeps up
+ *
+ *  Body streamed to a cgi script is buffered up to a window. Other bodies
+ *  are taken as fast as they come.
+ */
+static void stream_window(h2_stream_t *s) {
+    http_client_t *client = s->client;
+    int buffered, grant;
+
+    if (s->remote_closed)
+        return;
+
+    buffered = client->body_stream ? client->in->datasize - client->in->pos : 0;
+    grant = H2_WINDOW - buffered - s->recv_window;
+    if (grant >= H2_WINDOW / 2) {
+        put_frame32(s->conn, H2_WINDOW_UPDATE, s->id, grant);
+        s->recv_window += grant;
+    }
+}
+
+/*=============================Responses=================================*/
+
+/** @brief Take output of the handler of a stream
+ *
+ *  Queued output goes first, then the output of a cgi script.
+ *
+ *  @return Bytes copied to dst. 0 if there is nothing now. -1 on error.
+ */
+static int stream_pull(http_client_t *client, char *dst, int max) {
+    int n;
+
+    if (chain_pending(client->out))
+        return chain_pull(client->out, dst, max);
+    if (client->pipe == NULL)
+        return 0;
+
+    n = io_pipe_read(client->pipe, dst, max);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    if (n <= 0) {
+        if (n == -1)
+            log_error("HTTP/2 stream pipe error");
+        deinit_pipe(client->pipe);
+        client->pipe = NULL;
+        client->status = C_IDLE;
+    }
+    return n;
+}
+
+/** @brief Whether the handler of a stream has written all of its response */
+static int response_done(h2_stream_t *s) {
+    http_client_t *client = s->client;
+
+    return s->parsed && client->status == C_IDLE && client->pipe == NULL &&
+           client->fcgi == NULL && !chain_pending(client->out);
+}
+
+/** @brief Find the blank line ending a response header
+ *
+ *  @return Offset right after it. -1 if it's not there yet.
+ */
+static int head_end(buf_t *head) {
+    char *buf = head->buf;
+    int i;
+
+    for (i = head->scan; i < head->datasize; ++i)
+        if (buf[i] == '\n' && ((i >= 1 && buf[i - 1] == '\n') ||
+                               (i >= 2 && buf[i - 1] == '\r' &&
+                                buf[i - 2] == '\n')))
+            return i + 1;
+    head->scan = head->datasize;
+    return -1;
+}
+
+/** @brief Get the next line of a response header in [*p, end)
+ *
+ *  @return Length of the line without \r\n. -1 if there are no more lines.
+ */
+static int next_line(char **p, char *end, char **line) {
+    char *nl;
+    int len;
+
+    if (*p >= end)
+        return -1;
+    *line = *p;
+    nl = memchr(*p, '\n', end - *p);
+    if (nl == NULL)
+        nl = end;
+    *p = nl + 1;
+    len = nl - *line;
+    if (len > 0 && (*line)[len - 1] == '\r')
+        --len;
+    return len;
+}
+
+/** @brief Split a header line into lower case name and trimmed value
+ *
+ *  @return 0 if ok. -1 if it's not a header.
+ */
+static int split_header(char *line, int len, char **name, int *nlen,
+                        char **value, int *vlen) {
+    char *colon = memchr(line, ':', len);
+    int i;
+
+    if (colon == NULL || colon == line)
+        return -1;
+
+    *name = line;
+    *nlen = colon - line;
+    for (i = 0; i < *nlen; ++i)
+        if (line[i] >= 'A' && line[i] <= 'Z')
+            line[i] += 'a' - 'A';
+
+    *value = colon + 1;
+    *vlen = len - *nlen - 1;
+    while (*vlen > 0 && (**value == ' ' || **value == '\t')) {
+        ++*value;
+        --*vlen;
+    }
+    while (*vlen > 0 && ((*value)[*vlen - 1] == ' ' ||
+                         (*value)[*vlen - 1] == '\t'))
+        --*vlen;
+    return 0;
+}
+
+/** @brief Turn an HTTP/1.1 response header into HEADERS frames
+ *
+ *  The status comes from the status line. A cgi script may give a Status
+ *  header instead.
+ */
+static void send_headers(h2_stream_t *s, char *text, int len) {
+    unsigned char *block = malloc(len * 2 + HPACK_FIELD_OVERHEAD);
+    char *p, *end = text + len, *line, *name, *value;
+    int code = OK, n, nlen, vlen, off, first;
+
+    for (p = text, first = 1; (n = next_line(&p, end, &line)) > 0;
+         first = 0) {
+        if (first && n > 5 && strncmp(line, "HTTP/", 5) == 0) {
+            if ((name = memchr(line, ' ', n)) != NULL)
+                code = atoi(name + 1);
+        } else if (split_header(line, n, &name, &nlen, &value, &vlen) == 0 &&
+                   name_is(name, nlen, "status")) {
+            code = atoi(value);
+        }
+    }
+
+    n = hpack_encode_status(block, code);
+    for (p = text, first = 1; (off = next_line(&p, end, &line)) > 0;
+         first = 0) {
+        if ((first && strncmp(line, "HTTP/", 5) == 0) ||
+            split_header(line, off, &name, &nlen, &value, &vlen) == -1 ||
+            is_hop_by_hop(name, nlen) || name_is(name, nlen, "status"))
+            continue;
+        n += hpack_encode(block + n, name, nlen, value, vlen);
+    }
+
+    for (off = 0; off < n; off += len) {
+        len = n - off < H2_MAX_FRAME ? n - off : H2_MAX_FRAME;
+        put_frame(s->conn, off == 0 ? H2_HEADERS : H2_CONTINUATION,
+                  off + len == n ? H2_END_HEADERS : 0, s->id, block + off,
+                  len);
+    }
+    free(block);
+}
+
+/** @brief Collect the response header written by the handler of a stream
+ *
+ *  What follows the header is kept, and sent first as body.
+ *
+ *  @return 1 when the header has been sent. 0 if it's not complete yet. -1
+ *          if the handler doesn't give a proper header.
+ */
+static int collect_head(h2_stream_t *s) {
+    buf_t *head = s->head;
+    char buf[BUFSIZE];
+    int n, end;
+
+    while ((n = stream_pull(s->client, buf, BUFSIZE)) > 0) {
+        io_append(head, buf, n);
+        if ((end = head_end(head)) != -1) {
+            send_headers(s, head->buf, end);
+            head->pos = end;
+            s->state = S_BODY;
+            return 1;
+        }
+        if (head->datasize > H2_MAX_HEAD)
+            return -1;
+    }
+
+    if (n == -1 || response_done(s))
+        return -1;
+    return 0;
+}
+
+/** @brief Produce the next frame of the response on a stream
+ *
+ *  @return 1 if a frame has been queued. 0 if the stream has nothing to send
+ *          or is blocked by flow control. -1 on error.
+ */
+static int stream_output(h2_stream_t *s) {
+    static unsigned char frame[H2_FRAME_HEADER + H2_MAX_FRAME];
+    h2_conn_t *h2 = s->conn;
+    buf_t *head = s->head;
+    int room, n = 0, flags = 0;
+
+    if (s->state == S_HEAD)
+        return collect_head(s);
+
+    room = s->send_window < h2->send_window ? s->send_window : h2->send_window;
+    if (room > H2_MAX_FRAME)
+        room = H2_MAX_FRAME;
+
+    if (room > 0 && head->pos < head->datasize) {
+        n = head->datasize - head->pos < room ? head->datasize - head->pos :
+                                                room;
+        memcpy(frame + H2_FRAME_HEADER, head->buf + head->pos, n);
+        head->pos += n;
+    } else if (room > 0) {
+        n = stream_pull(s->client, (char *)frame + H2_FRAME_HEADER, room);
+    }
+    if (n == -1)
+        return -1;
+
+    if (head->pos >= head->datasize && response_done(s)) {
+        flags = H2_END_STREAM;
+        s->state = S_DONE;
+    } else if (n == 0) {
+        return 0;
+    }
+
+    frame_header(frame, n, H2_DATA, flags, s->id);
+    chain_copy(h2->client->out, (char *)frame, H2_FRAME_HEADER + n);
+    s->send_window -= n;
+    h2->send_window -= n;
+    return 1;
+}
+
+/** @brief Produce frames from all streams, one frame each in turn
+ *
+ *  @return 1 if producing stops because the output queue is full. 0 if no
+ *          stream can send anything now.
+ */
+static int h2_output(h2_conn_t *h2) {
+    h2_stream_t *s, *next;
+    int progress, ret;
+
+    do {
+        progress = 0;
+        for (s = h2->streams; s != NULL; s = next) {
+            next = s->next;
+            if (h2->client->out->count >= H2_OUT_QUEUE)
+                return 1;
+
+            if ((ret = stream_output(s)) == -1) {
+                reset_stream(s, H2_INTERNAL_ERROR);
+                continue;
+            }
+            progress |= ret;
+            if (s->state == S_DONE)
+                close_stream(s);
+        }
+    } while (progress);
+
+    return 0;
+}
+
+/** @brief Whether a stream waits for a cgi response which hasn't started */
+static int stream_awaiting(h2_stream_t *s) {
+    http_client_t *client = s->client;
+
+    return s->state == S_HEAD && s->head->datasize == 0 &&
+           !chain_pending(client->out) &&
+           (client->pipe != NULL || client->fcgi != NULL);
+}
+
+/** @brief Whether any stream of a connection waits for a cgi response */
+int h2_awaiting(h2_conn_t *h2) {
+    h2_stream_t *s;
+
+    for (s = h2->streams; s != NULL; s = s->next)
+        if (stream_awaiting(s))
+            return 1;
+    return 0;
+}
+
+/** @brief Answer streams whose cgi response never came with 504
+ *
+ *  The connection is going to be closed. Frames of the responses and a
+ *  GOAWAY are queued on it.
+ */
+void h2_gateway_timeout(h2_conn_t *h2) {
+    h2_stream_t *s;
+
+    for (s = h2->streams; s != NULL; s = s->next)
+        if (stream_awaiting(s))
+            gateway_timeout(s->client);
+    h2_output(h2);
+    h2_shutdown(h2);
+}
+
+/*==========================Frame handlers===============================*/
+
+/** @brief Remove padding from the payload of a frame
+ *
+ *  @return 0 if ok. -1 if the padding is longer than the payload.
+ */
+static int strip_padding(int flags, unsigned char **p, int *len) {
+    int pad;
+
+    if (!(flags & H2_PADDED))
+        return 0;
+    if (*len < 1 || (pad = **p) > *len - 1)
+        return -1;
+    ++*p;
+    *len -= pad + 1;
+    return 0;
+}
+
+static int on_data(h2_conn_t *h2, int id, int flags, unsigned char *p,
+                   int len) {
+    h2_stream_t *s;
+    int size = len;
+
+    if (id == 0)
+        return goaway(h2, H2_PROTOCOL_ERROR);
+    if (size > h2->recv_window)
+        return goaway(h2, H2_FLOW_CONTROL_ERROR);
+
+    // The connection window is given back at once, streams have their own
+    h2->recv_window -= size;
+    if (h2->recv_window < H2_CONN_WINDOW / 2) {
+        put_frame32(h2, H2_WINDOW_UPDATE, 0, H2_CONN_WINDOW - h2->recv_window);
+        h2->recv_window = H2_CONN_WINDOW;
+    }
+
+    if (strip_padding(flags, &p, &len) == -1)
+        return goaway(h2, H2_PROTOCOL_ERROR);
+
+    // A stream reset by us may still get what's in flight
+    if ((s = find_stream(h2, id)) == NULL)
+        return id > h2->last_id ? goaway(h2, H2_PROTOCOL_ERROR) : 0;
+    if (s->remote_closed) {
+        reset_stream(s, H2_STREAM_CLOSED);
+        return 0;
+    }
+    if (size > s->recv_window) {
+        reset_stream(s, H2_FLOW_CONTROL_ERROR);
+        return 0;
+    }
+    s->recv_window -= size;
+
+    if (stream_data(s, p, len, flags & H2_END_STREAM) == -1)
+        reset_stream(s, H2_PROTOCOL_ERROR);
+    return 0;
+}
+
+/** @brief A complete header block has been received */
+static int end_headers(h2_conn_t *h2, int id, int flags) {
+    unsigned char *block = (unsigned char *)h2->block->buf;
+    int len = h2->block->datasize;
+    h2_stream_t *s;
+    builder_t b;
+
+    // Trailers end the body. Their fields are dropped.
+    if ((s = find_stream(h2, id)) != NULL) {
+        if (hpack_decode(&h2->decoder, block, len, NULL, NULL) == -1)
+            return goaway(h2, H2_COMPRESSION_ERROR);
+        if (!(flags & H2_END_STREAM) || s->remote_closed ||
+            stream_data(s, NULL, 0, 1) == -1)
+            reset_stream(s, H2_PROTOCOL_ERROR);
+        return 0;
+    }
+
+    // The block is decoded anyway, to keep the table in sync with the peer
+    if ((id & 1) == 0 || id <= h2->last_id || h2->goaway ||
+        h2->nstreams >= H2_MAX_STREAMS) {
+        if (hpack_decode(&h2->decoder, block, len, NULL, NULL) == -1)
+            return goaway(h2, H2_COMPRESSION_ERROR);
+        if ((id & 1) == 0)
+            return goaway(h2, H2_PROTOCOL_ERROR);
+        if (id > h2->last_id) {
+            h2->last_id = id;
+            put_frame32(h2, H2_RST_STREAM, id, H2_REFUSED_STREAM);
+        }
+        return 0;
+    }
+
+    h2->last_id = id;
+    s = new_stream(h2, id);
+    memset(&b, 0, sizeof(b));
+    b.s = s;
+    if (hpack_decode(&h2->decoder, block, len, add_field, &b) == -1) {
+        finish_request(&b, 1);
+        free_stream(s);
+        return goaway(h2, H2_COMPRESSION_ERROR);
+    }
+    if (finish_request(&b, flags & H2_END_STREAM) == -1) {
+        reset_stream(s, H2_PROTOCOL_ERROR);
+        return 0;
+    }
+
+    log_msg(L_HTTP_DEBUG, "HTTP/2 stream %d:\n%.*s", id, s->client->in->datasize,
+            s->client->in->buf);
+    s->remote_closed = flags & H2_END_STREAM;
+    if (stream_request(s) == -1)
+        reset_stream(s, H2_PROTOCOL_ERROR);
+    return 0;
+}
+
+/** @brief Add a fragment to the header block */
+static int header_fragment(h2_conn_t *h2, int id, int flags, unsigned char *p,
+                           int len) {
+    if (h2->block->datasize + len > H2_MAX_HEADER_BLOCK)
+        return goaway(h2, H2_PROTOCOL_ERROR);
+
+    io_append(h2->block, (char *)p, len);
+    if (!(flags & H2_END_HEADERS))
+        return 0;
+
+    h2->block_id = 0;
+    return end_headers(h2, id, h2->block_flags);
+}
+
+static int on_headers(h2_conn_t *h2, int id, int flags, unsigned char *p,
+                      int len) {
+    if (id == 0 || strip_padding(flags, &p, &len) == -1)
+        return goaway(h2, H2_PROTOCOL_ERROR);
+
+    // Priority is not taken into account
+    if (flags & H2_PRIORITY_FLAG) {
+        if (len < 5)
+            return goaway(h2, H2_PROTOCOL_ERROR);
+        p += 5;
+        len -= 5;
+    }
+
+    h2->block_id = id;
+    h2->block_flags = flags;
+    h2->block->datasize = 0;
+    return header_fragment(h2, id, flags, p, len);
+}
+
+static int on_settings(h2_conn_t *h2, int id, int flags, unsigned char *p,
+                       int len) {
+    h2_stream_t *s;
+    unsigned int value;
+    int i;
+
+    if (id != 0)
+        return goaway(h2, H2_PROTOCOL_ERROR);
+    if (flags & H2_ACK)
+        return len == 0 ? 0 : goaway(h2, H2_FRAME_SIZE_ERROR);
+    if (len % 6 != 0)
+        return goaway(h2, H2_FRAME_SIZE_ERROR);
+
+    for (i = 0; i < len; i += 6) {
+        value = get32(p + i + 2);
+        switch ((p[i] << 8) | p[i + 1]) {
+        case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+            if (value > 0x7fffffff)
+                return goaway(h2, H2_FLOW_CONTROL_ERROR);
+            for (s = h2->streams; s != NULL; s = s->next)
+                s->send_window += (int)value - h2->initial_window;
+            h2->initial_window = value;
+            break;
+        case H2_SETTINGS_MAX_FRAME_SIZE:
+            // Frames sent are never larger than the default anyway
+            if (value < H2_MAX_FRAME || value > 0xffffff)
+                return goaway(h2, H2_PROTOCOL_ERROR);
+            break;
+        }
+    }
+
+    put_frame(h2, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+    return 0;
+}
+
+static int on_window_update(h2_conn_t *h2, int id, unsigned char *p, int len) {
+    h2_stream_t *s;
+    int inc;
+
+    if (len != 4)
+        return goaway(h2, H2_FRAME_SIZE_ERROR);
+    inc = get32(p) & 0x7fffffff;
+
+    if (id == 0) {
+        if (inc == 0)
+            return goaway(h2, H2_PROTOCOL_ERROR);
+        if (h2->send_window > 0x7fffffff - inc)
+            return goaway(h2, H2_FLOW_CONTROL_ERROR);
+        h2->send_window += inc;
+    } else if ((s = find_stream(h2, id)) != NULL) {
+        if (inc == 0)
+            reset_stream(s, H2_PROTOCOL_ERROR);
+        else if (s->send_window > 0x7fffffff - inc)
+            reset_stream(s, H2_FLOW_CONTROL_ERROR);
+        else
+            s->send_window += inc;
+    }
+    return 0;
+}
+
+/** @brief Handle a frame received on a connection
+ *
+ *  @return 0 if ok. -1 on a connection error, GOAWAY has been queued.
+ */
+static int handle_frame(h2_conn_t *h2, int type, int flags, int id,
+                        unsigned char *p, int len) {
+    h2_stream_t *s;
+
+    // Nothing may come between the frames of a header block
+    if (h2->block_id != 0 && (type != H2_CONTINUATION || id != h2->block_id))
+        return goaway(h2, H2_PROTOCOL_ERROR);
+
+    switch (type) {
+    case H2_DATA:
+        return on_data(h2, id, flags, p, len);
+    case H2_HEADERS:
+        return on_headers(h2, id, flags, p, len);
+    case H2_CONTINUATION:
+        if (h2->block_id == 0)
+            return goaway(h2, H2_PROTOCOL_ERROR);
+        return header_fragment(h2, id, flags, p, len);
+    case H2_RST_STREAM:
+        if (len != 4)
+            return goaway(h2, H2_FRAME_SIZE_ERROR);
+        if ((s = find_stream(h2, id)) != NULL)
+            free_stream(s);
+        return 0;
+    case H2_SETTINGS:
+        return on_settings(h2, id, flags, p, len);
+    case H2_PUSH_PROMISE:
+        return goaway(h2, H2_PROTOCOL_ERROR);
+    case H2_PING:
+        if (id != 0)
+            return goaway(h2, H2_PROTOCOL_ERROR);
+        if (len != 8)
+            return goaway(h2, H2_FRAME_SIZE_ERROR);
+        if (!(flags & H2_ACK))
+            put_frame(h2, H2_PING, H2_ACK, 0, p, len);
+        return 0;
+    case H2_GOAWAY:
+        h2->goaway = 1;
+        return 0;
+    case H2_WINDOW_UPDATE:
+        return on_window_update(h2, id, p, len);
+    }
+
+    // PRIORITY and unknown frames are ignored
+    return 0;
+}
+
+/** @brief Handle frames received so far
+ *
+ *  @return 0 if ok. -1 if the connection has to be closed.
+ */
+static int h2_input(h2_conn_t *h2) {
+    buf_t *in = h2->client->in;
+    unsigned char *h;
+    int len;
+
+    if (!h2->preface) {
+        if (in->datasize - in->pos < H2_PREFACE_LEN)
+            return 0;
+        if (memcmp(in->buf + in->pos, H2_PREFACE, H2_PREFACE_LEN) != 0) {
+            log_msg(L_ERROR, "Bad HTTP/2 preface on fd %d\n", h2->client->fd);
+            h2->client->alive = 0;
+            return -1;
+        }
+        in->pos += H2_PREFACE_LEN;
+        h2->preface = 1;
+    }
+
+    while (in->datasize - in->pos >= H2_FRAME_HEADER) {
+        h = (unsigned char *)in->buf + in->pos;
+        len = (h[0] << 16) | (h[1] << 8) | h[2];
+        if (len > H2_MAX_FRAME)
+            return goaway(h2, H2_FRAME_SIZE_ERROR);
+        if (in->datasize - in->pos < H2_FRAME_HEADER + len)
+            break;
+
+        in->pos += H2_FRAME_HEADER + len;
+        if (handle_frame(h2, h[3], h[4], get32(h + 5) & 0x7fffffff,
+                         h + H2_FRAME_HEADER, len) == -1)
+            return -1;
+    }
+
+    if (empty(in))
+        io_shrink(in);
+    return 0;
+}
+
+/*=============================Connection================================*/
+
+/** @brief Start speaking HTTP/2 on a connection
+ *
+ *  The server preface (SETTINGS) is queued, together with a larger window
+ *  for the connection.
+ */
+h2_conn_t* init_h2(http_client_t *client) {
+    h2_conn_t *h2 = malloc(sizeof(h2_conn_t));
+    unsigned char settings[6];
+    int yes = 1;
+
+    /*
+     * Small frames such as the last DATA frame within a window would wait
+     * for the ACK of the previous ones, stalling the stream until the peer
+     * sends its delayed ACK
+     */
+    if (setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int)) < 0)
+        log_error("setsockopt TCP_NODELAY failed.");
+
+    h2->client = client;
+    h2->preface = 0;
+    init_hpack(&h2->decoder);
+    h2->send_window = H2_WINDOW;
+    h2->recv_window = H2_CONN_WINDOW;
+    h2->initial_window = H2_WINDOW;
+    h2->last_id = 0;
+    h2->nstreams = 0;
+    h2->streams = NULL;
+    h2->block = init_buf();
+    h2->block_id = 0;
+    h2->block_flags = 0;
+    h2->goaway = 0;
+
+    settings[0] = 0;
+    settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(settings + 2, H2_MAX_STREAMS);
+    put_frame(h2, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+    put_frame32(h2, H2_WINDOW_UPDATE, 0, H2_CONN_WINDOW - H2_WINDOW);
+
+    log_msg(L_INFO, "HTTP/2 on fd %d\n", client->fd);
+    return h2;
+}
+
+/** @brief Destroy the HTTP/2 state of a connection and all its streams */
+void deinit_h2(h2_conn_t *h2) {
+    while (h2->streams)
+        free_stream(h2->streams);
+    deinit_hpack(&h2->decoder);
+    deinit_buf(h2->block);
+    free(h2);
+}
+
+/** @brief Serve an HTTP/2 connection
+ *
+ *  Received frames are handled, request bodies are passed on, and frames
+ *  are produced from the responses of all streams. Sending is left to the
+ *  caller.
+ *
+ *  @return 1 if there is more output once the output queue drains. 0
+ *          otherwise. The connection should be closed once its output is
+ *          sent if it's no longer alive.
+ */
+int h2_serve(http_client_t *client) {
+    h2_conn_t *h2 = client->h2;
+    h2_stream_t *s, *next;
+    int held;
+
+    if (!client->alive || h2_input(h2) == -1)
+        return 0;
+
+    for (s = h2->streams; s != NULL; s = next) {
+        next = s->next;
+        if (s->client->body_stream || s->client->cgi_in != -1)
+            feed_cgi(s->client);
+        stream_window(s);
+    }
+
+    held = h2_output(h2);
+
+    // The peer is going away, and nothing is left to send
+    if (h2->goaway && h2->streams == NULL)
+        client->alive = 0;
+    return held;
+}
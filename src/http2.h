@@ -0,0 +1,132 @@
+/** @file http2.h
+ *  @brief Header file for http2.c
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __HTTP2_H__
+#define __HTTP2_H__
+
+#include <openssl/ssl.h>
+#include "http_client.h"
+#include "hpack.h"
+
+/* Connection preface sent by the client */
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+
+/* Size of a frame header, and the largest payload sent or accepted */
+#define H2_FRAME_HEADER 9
+#define H2_MAX_FRAME 16384
+
+/* Streams a client may open at the same time */
+#define H2_MAX_STREAMS 100
+
+/* Initial flow control window of a stream, and of the connection */
+#define H2_WINDOW 65535
+
+/* Receive window of the connection, shared by all request bodies */
+#define H2_CONN_WINDOW (1 << 20)
+
+/* Largest header block accepted, including CONTINUATION frames */
+#define H2_MAX_HEADER_BLOCK (64 << 10)
+
+/* Largest response header passed on by handlers */
+#define H2_MAX_HEAD (16 << 10)
+
+/*
+ * Frames are produced until this many output segments are queued for the
+ * connection, then producing waits for the queue to drain
+ */
+#define H2_OUT_QUEUE 64
+
+/* Frame types */
+#define H2_DATA 0
+#define H2_HEADERS 1
+#define H2_PRIORITY 2
+#define H2_RST_STREAM 3
+#define H2_SETTINGS 4
+#define H2_PUSH_PROMISE 5
+#define H2_PING 6
+#define H2_GOAWAY 7
+#define H2_WINDOW_UPDATE 8
+#define H2_CONTINUATION 9
+
+/* Frame flags */
+#define H2_END_STREAM 0x1
+#define H2_ACK 0x1
+#define H2_END_HEADERS 0x4
+#define H2_PADDED 0x8
+#define H2_PRIORITY_FLAG 0x20
+
+/* Settings */
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 4
+#define H2_SETTINGS_MAX_FRAME_SIZE 5
+
+/* Error codes */
+#define H2_NO_ERROR 0
+#define H2_PROTOCOL_ERROR 1
+#define H2_INTERNAL_ERROR 2
+#define H2_FLOW_CONTROL_ERROR 3
+#define H2_STREAM_CLOSED 5
+#define H2_FRAME_SIZE_ERROR 6
+#define H2_REFUSED_STREAM 7
+#define H2_COMPRESSION_ERROR 9
+
+/* Response states of a stream */
+#define S_HEAD 0            // Collecting response headers from handlers
+#define S_BODY 1            // Sending response body as DATA frames
+#define S_DONE 2            // END_STREAM sent
+
+struct h2_conn;
+
+/** @brief A stream of an HTTP/2 connection
+ *
+ *  Each stream carries one request, which is handled by a client object of
+ *  its own. The request is rewritten as HTTP/1.1 into the input buffer of
+ *  that client, so the parser and handlers work as usual. What the handlers
+ *  write is an HTTP/1.1 response, which is turned back into frames.
+ */
+typedef struct h2_stream {
+    int id;
+    struct h2_conn *conn;
+    http_client_t *client;  //<!client object handling the request
+    int parsed;             //<!request has been passed to a handler
+    int remote_closed;      //<!END_STREAM received
+    int chunked;            //<!request body is framed as chunks for the parser
+    int send_window;        //<!bytes of DATA the peer accepts
+    int recv_window;        //<!bytes of DATA the peer may send
+    int state;              //<!response state S_*
+    buf_t *head;            //<!response header collected, then body after it
+    struct h2_stream *next;
+} h2_stream_t;
+
+/** @brief State of an HTTP/2 connection */
+typedef struct h2_conn {
+    http_client_t *client;  //<!the connection
+    int preface;            //<!client preface has been received
+    hpack_table_t decoder;  //<!dynamic table for request headers
+    int send_window;        //<!connection level window for DATA sent
+    int recv_window;        //<!connection level window for DATA received
+    int initial_window;     //<!initial stream window set by the peer
+    int last_id;            //<!largest stream id seen
+    int nstreams;
+    h2_stream_t *streams;
+    buf_t *block;           //<!header block being assembled
+    int block_id;           //<!stream of the header block, 0 if none
+    int block_flags;        //<!flags of the HEADERS frame starting the block
+    int goaway;             //<!GOAWAY received or sent, no new streams
+} h2_conn_t;
+
+int h2_alpn_select(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                   const unsigned char *in, unsigned int inlen, void *arg);
+int h2_negotiated(SSL *ssl);
+
+h2_conn_t* init_h2(http_client_t *client);
+void deinit_h2(h2_conn_t *h2);
+int h2_serve(http_client_t *client);
+void h2_shutdown(h2_conn_t *h2);
+int h2_awaiting(h2_conn_t *h2);
+void h2_gateway_timeout(h2_conn_t *h2);
+
+#endif
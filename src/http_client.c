@@ -6,101 +6,98 @@
  *  ready to write to a client, it takes data from the output buffer.
  *
  *  Two most important function here are doing similar things.
- *  What client_readline do is getting data from the input buffer which is
- *  filled by the server. (The server is feeding client_readline)
- *  What client_write to is putting data in the output buffer and those data is
- *  pending for the server to send.
+ *  What client_nextline do is finding lines in the input buffer which is
+ *  filled by the server. (The server is feeding client_nextline)
+ *  What client_write to is putting data in the output chain and those data is
+ *  pending for the server to send. Data which outlives the request, like a
+ *  cached file, can be queued by client_write_ref() without being copied.
  *
  *  @author Chao Xin(cxin)
  */
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <arpa/inet.h>
 #include "config.h"
 #include "log.h"
 #include "io.h"
 #include "http_client.h"
+#include "scan.h"
+#include "fastcgi.h"
+#include "request_handler.h"
+#include "http2.h"
+#include "http_date.h"
+#include "metrics.h"
 
 /** brief Compare two string(case insensitive) */
 int strcicmp(char* s1, char* s2) {
-    int len = strlen(s1),
-        i;
-    char c1, c2;
+    int len = strlen(s1);
 
     if (len != strlen(s2)) return 1;
-
-    for (i = 0; i < len; ++i) {
-        c1 = s1[i]; c2 = s2[i];
-        if (c1 >= 'A' && c1 <= 'Z')
-            c1 = c1 - 'A' + 'a';
-        if (c2 >= 'A' && c2 <= 'Z')
-            c2 = c2 - 'A' + 'a';
-        if (c1 != c2) return 1;
-    }
-
-    return 0;
-}
-
-/** @brief Destroy a http_header struct */
-void deinit_header(http_header_t *header) {
-    if (header == NULL) return;
-    if (header->key != NULL)
-        free(header->key);
-    if (header->val != NULL)
-        free(header->val);
-    free(header);
+    return scan_casecmp(s1, s2, len);
 }
 
-/** @brief Destroy a http_request struct */
-void deinit_request(http_request_t *req) {
-    http_header_t *ptr, *tmp;
-
-    if (req == NULL) return;
-
-    ptr = req->headers;
-
-    while (ptr != NULL) {
-        tmp = ptr->next;
-        deinit_header(ptr);
-        ptr = tmp;
-    }
-
-    /*
-     * Don't need to free body. Since it's a pointer to memory in the input
-     * buffer of a client.
-     */
-
-    free(req);
-}
+/* Clients and requests are recycled, see pool.c */
+static pool_t client_pool = POOL_INITIALIZER(sizeof(http_client_t));
+static pool_t request_pool = POOL_INITIALIZER(sizeof(http_request_t));
 
-/** @brief Create a new http_request */
-http_request_t* new_request() {
-    http_request_t *req;
+/** @brief Get the request object of a client ready for a new request
+ *
+ *  Everything allocated for the last request is freed at once.
+ */
+void reset_request(http_client_t *client) {
+    http_request_t *req = client->req;
 
-    req = malloc(sizeof(http_request_t));
+    arena_reset(&client->arena);
     req->cnt_headers = 0;
     req->headers = NULL;
+    memset(req->known, 0, sizeof(req->known));
+    memset(req->buckets, 0, sizeof(req->buckets));
     req->body = NULL;
-
-    return req;
+    req->status = OK;
+    req->in = client->in;
+    req->uri.len = req->query.len = req->path.len = 0;
 }
 
-/** @brief Create a new http client associated with socket fd */
+/** @brief Create a new http client associated with socket fd
+ *
+ *  fd is -1 for the client of an HTTP/2 stream.
+ */
 http_client_t* new_client(int fd) {
-    http_client_t *client = malloc(sizeof(http_client_t));
+    http_client_t *client = pool_get(&client_pool);
 
     client->fd = fd;
+    client->pipe = NULL;
     client->status = C_IDLE;
     client->alive = 1;
 
     client->in = init_buf();
-    client->out = init_buf();
+    client->out = init_chain();
 
-    client->req = new_request();
+    init_arena(&client->arena);
+    client->req = pool_get(&request_pool);
+    reset_request(client);
     client->remote_ip[0] = '\0';
-    client->remote_host = NULL;
     client->ssl_context = NULL;
+    client->fcgi = NULL;
+    client->opening = NULL;
+    client->cgi_in = -1;
+    client->body_stream = 0;
+    client->body_left = 0;
+    client->body_start = 0;
+    client->body_raw = 0;
+    client->dechunk.state = CD_IDLE;
+    client->h2 = NULL;
+    client->stream = NULL;
+    client->prev = NULL;
     client->next = NULL;
+    client->scheduled = 0;
+    client->next_active = NULL;
+    init_timeout(&client->timeout, NULL, client);
+    client->deadline = 0;
+    client->timed_out = 0;
+    if (fd != -1)
+        set_fd_data(fd, client);
 
     return client;
 }
@@ -108,24 +105,46 @@ http_client_t* new_client(int fd) {
 /** @brief Destroy a client struct, free all its resource */
 void deinit_client(http_client_t *client) {
     if (client == NULL) return;
-    remove_read_fd(client->fd);
-    remove_write_fd(client->fd);
+    timeout_cancel(&client->timeout);
+    if (client->h2)
+        deinit_h2(client->h2);
+    if (client->fd != -1) {
+        remove_read_fd(client->fd);
+        remove_write_fd(client->fd);
+        set_fd_data(client->fd, NULL);
+    }
+    if (client->pipe)
+        deinit_pipe(client->pipe);
+    if (client->cgi_in != -1) {
+        remove_write_fd(client->cgi_in);
+        set_fd_data(client->cgi_in, NULL);
+        close(client->cgi_in);
+    }
+    fcgi_cancel(client);
+    static_file_cancel(client);
 
-    close(client->fd);
-    log_msg(L_INFO, "Closed fd %d\n", client->fd);
+    if (client->fd != -1) {
+        close(client->fd);
+        log_msg(L_INFO, "Closed fd %d\n", client->fd);
+    }
     deinit_buf(client->in);
-    deinit_buf(client->out);
-    deinit_request(client->req);
+    deinit_chain(client->out);
+    /*
+     * Don't need to free the request body. Since it's a pointer to memory in
+     * the input buffer of a client. Headers are in the arena.
+     */
+    pool_put(&request_pool, client->req);
+    deinit_arena(&client->arena);
     if (client->ssl_context) {
         SSL_shutdown(client->ssl_context);
         SSL_free(client->ssl_context);
     }
-    free(client);
+    pool_put(&client_pool, client);
 }
 
 /** @brief Write a buffer to client
  *
- *  Copy buf_len bytes from buf to client's output buffer
+ *  Copy buf_len bytes from buf to client's output chain
  *
  *  @param client A pointer to a client struct
  *  @param buf The buffer to be written to client
@@ -133,20 +152,7 @@ void deinit_client(http_client_t *client) {
  *  @return Void
  */
 void client_write(http_client_t *client, char* buf, int buf_len) {
-    buf_t *c_buf = client->out;     //Internal output buffer of client
-
-    //The space is not enough, realloc !
-    if (c_buf->datasize + buf_len > c_buf->bufsize) {
-        /*
-         * An additional BUFSIZE is added to the bufsize to prevent
-         * frequent realloc
-         */
-        c_buf->bufsize = c_buf->datasize + buf_len + BUFSIZE;
-        c_buf->buf = realloc(c_buf->buf, c_buf->bufsize);
-    }
-
-    memmove(c_buf->buf + c_buf->datasize, buf, buf_len);
-    c_buf->datasize += buf_len;
+    chain_copy(client->out, buf, buf_len);
 }
 
 /** @brief Write a string to client */
@@ -155,89 +161,161 @@ void client_write_string(http_client_t *client, char* str) {
     client_write(client, str, strlen(str));
 }
 
-/** @brief Read a line ends in \n from client's input buffer
+/** @brief Write a buffer to client without copying it
+ *
+ *  @param release Called with arg after the buffer is sent. NULL if the
+ *                 buffer is never freed.
+ */
+void client_write_ref(http_client_t *client, char* buf, int buf_len,
+                      void (*release)(void *), void *arg) {
+    chain_ref(client->out, buf, buf_len, release, arg);
+}
+
+/** @brief Find the next line ends in \n in client's input buffer
+ *
+ *  The line is not copied. Its position is stored in line, without the
+ *  trailing \r\n. The pointer pos is updated to the character next to '\n'.
  *
- *  Find \n started from the internal pointer pos of the client's input buffer
- *  and copy the content between pos pointer and \n(include) to the passed in
- *  buffer. Also update the pointer pos to the character next to '\n'.
+ *  When no \n is found, the search resumes from where it stops next time,
+ *  instead of scanning the partial line again.
  *
  *  @param client A pointer to a client struct
- *  @param line The buffer which stores the line.
+ *  @param line Where the line is
  *  @return 1 on success. If no \n is found, return 0. If the length of line
- *  exceed MAX_LINE_LEN, return -1.
+ *  exceed MAXBUF, return -1.
  */
-int client_readline(http_client_t *client, char *line) {
+int client_nextline(http_client_t *client, slice_t *line) {
     buf_t *bp = client->in;
-    int end = bp->pos,
-        n;
+    char *nl;
+    int n;
 
-    while (end < bp->datasize) {
-        if (end - bp->pos >= MAXBUF)
-            return -1;
-        if (bp->buf[end] == '\n') {
-            n = end - bp->pos;
+    if (bp->scan < bp->pos)
+        bp->scan = bp->pos;
 
-            /* Deal with \r\n */
-            if (n > 0 && bp->buf[end - 1] == '\r')
-                n -= 1;
+    nl = bp->buf + bp->scan +
+         scan_char(bp->buf + bp->scan, bp->datasize - bp->scan, '\n');
+    if (nl == bp->buf + bp->datasize) {
+        bp->scan = bp->datasize;
+        return bp->datasize - bp->pos >= MAXBUF ? -1 : 0;
+    }
 
-            strncpy(line, bp->buf + bp->pos, n);
+    n = nl - (bp->buf + bp->pos);
+    if (n >= MAXBUF)
+        return -1;
 
-            line[n] = '\0';     //End the string
+    line->off = bp->pos;
+    /* Deal with \r\n */
+    line->len = (n > 0 && nl[-1] == '\r') ? n - 1 : n;
 
-            bp->pos = end + 1;
-            return 1;
-        }
-        end += 1;
-    }
+    bp->pos += n + 1;
+    bp->scan = bp->pos;
+    return 1;
+}
+
+/** @brief Decode chunked request body received so far
+ *
+ *  Decoded body stays in place in the input buffer, ending at body_raw.
+ *  Encoded data after it is decoded and moved down over the chunk framing.
+ *  When the last chunk has been read, what follows is left as is.
+ *
+ *  @param client A pointer to a client struct
+ *  @return 0 if ok. -1 if the encoding is broken.
+ */
+int client_dechunk(http_client_t *client) {
+    buf_t *bp = client->in;
+    char *raw = bp->buf + client->body_raw;
+    int used, out;
+
+    if (client->dechunk.state == CD_DONE)
+        return 0;
+
+    used = chunk_decode(&client->dechunk, raw, bp->datasize - client->body_raw,
+                        &out);
+    if (used == -1)
+        return -1;
 
+    memmove(raw + out, raw + used, bp->datasize - client->body_raw - used);
+    bp->datasize -= used - out;
+    client->body_raw += out;
     return 0;
 }
 
+/** @brief Reason phrase of a status code */
+static char* reason_phrase(int code) {
+    switch (code) {
+    case OK: return "OK";
+    case PARTIAL_CONTENT: return "Partial Content";
+    case NOT_MODIFIED: return "Not Modified";
+    case BAD_REQUEST: return "Bad Request";
+    case NOT_FOUND: return "Not Found";
+    case METHOD_NOT_ALLOWED: return "Method Not Allowed";
+    case LENGTH_REQUIRED: return "Length Required";
+    case PAYLOAD_TOO_LARGE: return "Payload Too Large";
+    case RANGE_NOT_SATISFIABLE: return "Range Not Satisfiable";
+    case TOO_MANY_REQUESTS: return "Too Many Requests";
+    case INTERNAL_SERVER_ERROR: return "Internal Server Error";
+    case NOT_IMPLEMENTED: return "Not Implemeneted";
+    case BAD_GATEWAY: return "Bad Gateway";
+    case SERVICE_UNAVAILABLE: return "Service Unavailable";
+    case GATEWAY_TIMEOUT: return "Gateway Timeout";
+    case HTTP_VERSION_NOT_SUPPORTED: return "HTTP Version Not Supported";
+    }
+    return "";
+}
+
 /** @brief Send the response line to client with status code
  *
  *  @param client The corresponding client
  *  @param code Status code
  */
 void send_response_line(http_client_t *client, int code) {
-    char* line;
-
-    client_write_string(client, http_version);
-
-    if (code == OK)
-        line = " 200 OK";
-    if (code == BAD_REQUEST)
-        line = " 400 Bad Request";
-    if (code == NOT_FOUND)
-        line = " 404 Not Found";
-    if (code == METHOD_NOT_ALLOWED)
-        line = " 405 Method Not Allowed";
-    if (code == LENGTH_REQUIRED)
-        line = " 411 Length Required";
-    if (code == INTERNAL_SERVER_ERROR)
-        line = " 500 Internal Server Error";
-    if (code == NOT_IMPLEMENTED)
-        line = " 501 Not Implemeneted";
-    if (code == SERVICE_UNAVAILABLE)
-        line = " 503 Service Unavailable";
-    if (code == HTTP_VERSION_NOT_SUPPORTED)
-        line = " 505 HTTP Version Not Supported";
-
-    client_write_string(client, line);
-    client_write_string(client, "\r\n");
+    char *line = chain_printf(client->out, "%s %d %s\r\n", http_version, code,
+                              reason_phrase(code));
+
+    log_msg(L_HTTP_DEBUG, "%s", line);
 }
 
-/** @brief Send the response header */
+/** @brief Send the response header
+ *
+ *  The header is printed straight into the output chain.
+ */
 void send_header(http_client_t *client, char* key, char* val) {
-    client_write_string(client, key);
-    client_write_string(client, ": ");
-    client_write_string(client, val);
-    client_write_string(client, "\r\n");
+    char *line = chain_printf(client->out, "%s: %s\r\n", key, val);
+
+    log_msg(L_HTTP_DEBUG, "%s", line);
 }
 
-//In case of what kind of error should the connection be closed?
+/*
+ * In case of what kind of error should the connection be closed? A client
+ * over its rate limit is closed too, the body of its request is never read.
+ */
 static int is_fatal(int code) {
-    return code == BAD_REQUEST || code == INTERNAL_SERVER_ERROR;
+    return code == BAD_REQUEST || code == PAYLOAD_TOO_LARGE ||
+           code == INTERNAL_SERVER_ERROR || code == TOO_MANY_REQUESTS ||
+           code == GATEWAY_TIMEOUT;
+}
+
+/** @brief Add current request to the access log
+ *
+ *  @param code Status code of the response, 0 if a cgi script decides it
+ */
+void log_request(http_client_t *client, int code) {
+    http_request_t *req = client->req;
+    access_record_t rec;
+    struct in_addr addr;
+
+    if (inet_pton(AF_INET, client->remote_ip, &addr) != 1)
+        addr.s_addr = 0;
+    rec.time = htonl(current_time());
+    rec.addr = addr.s_addr;
+    rec.status = htons(code);
+    rec.method = req->method;
+    rec.flags = (client->ssl_context || client->stream ? ACCESS_TLS : 0) |
+                (client->stream ? ACCESS_H2 : 0);
+    rec.length = htonl(req->content_length > 0 ? req->content_length : 0);
+    log_access(&rec, req->uri.len ? slice_str(req, req->uri) : "",
+               req->uri.len);
+    ++metrics->responses[code / 100 < RESPONSE_CLASSES ? code / 100 : 0];
 }
 
 /** @brief Ends current request with given status code and destroy request
@@ -247,6 +325,7 @@ static int is_fatal(int code) {
  *          should be closed.
  */
 int end_request(http_client_t *client, int code) {
+    log_request(client, code);
     client->status = C_IDLE;
     send_response_line(client, code);
 
@@ -255,29 +334,143 @@ int end_request(http_client_t *client, int code) {
         client->alive = 0;
 
     if (is_fatal(code)) {
+        if (code == TOO_MANY_REQUESTS)
+            send_header(client, "Retry-After", "1");
         send_header(client, "Connection", "Close");
         client_write_string(client, "\r\n");
         client->alive = 0;
         return -1;
     }
+    // No body, without a length the client would wait for one to end
+    send_header(client, "Content-Length", "0");
     client_write_string(client, "\r\n");
 
     return 0;
 }
 
+/** @brief Get the string of a slice of a request
+ *
+ *  @return A NUL terminated string in the input buffer. Valid until the
+ *          buffer is modified.
+ */
+char* slice_str(http_request_t *req, slice_t slice) {
+    if (slice.len == 0)
+        return "";
+    return req->in->buf + slice.off;
+}
+
+/* Names of well-known headers, indexed by id */
+static char *known_names[H_KNOWN] = {
+    "connection", "content-length", "content-type", "host", "accept",
+    "accept-encoding", "user-agent", "cookie", "if-modified-since",
+    "if-none-match", "range", "transfer-encoding", "expect", "if-range"
+};
+
+/* Open addressing table from hash of a name to 1 + id of the header */
+#define KNOWN_SLOTS 64
+#define NEXT_SLOT(i) (((i) + 1) & (KNOWN_SLOTS - 1))
+static int known_slots[KNOWN_SLOTS];
+
+/** @brief FNV-1a hash of a header name, ignoring case */
+static unsigned int header_hash(char *key, int len) {
+    unsigned int h = 2166136261u;
+    int i;
+    char c;
+
+    for (i = 0; i < len; ++i) {
+        c = key[i];
+        if (c >= 'A' && c <= 'Z')
+            c = c - 'A' + 'a';
+        h = (h ^ (unsigned char)c) * 16777619u;
+    }
+    return h;
+}
+
+/** @brief Find the id of a header name
+ *
+ *  @return The id of a well-known header. H_OTHER otherwise.
+ */
+static int header_id(char *key, int len, unsigned int hash) {
+    static int ready = 0;
+    int i, id;
+
+    // Fill the table on first use
+    if (!ready) {
+        for (id = 0; id < H_KNOWN; ++id) {
+            i = header_hash(known_names[id], strlen(known_names[id]));
+            for (i &= KNOWN_SLOTS - 1; known_slots[i]; i = NEXT_SLOT(i));
+            known_slots[i] = id + 1;
+        }
+        ready = 1;
+    }
+
+    for (i = hash & (KNOWN_SLOTS - 1); known_slots[i]; i = NEXT_SLOT(i)) {
+        id = known_slots[i] - 1;
+        if (strlen(known_names[id]) == len &&
+            scan_casecmp(known_names[id], key, len) == 0)
+            return id;
+    }
+    return H_OTHER;
+}
+
+/** @brief Add a parsed header to a request
+ *
+ *  The key is interned: well-known headers go into their slot, and others
+ *  into a bucket, so that later lookups don't need to walk all headers.
+ */
+void add_request_header(http_request_t *req, http_header_t *header) {
+    char *key = slice_str(req, header->key);
+    int b;
+
+    header->hash = header_hash(key, header->key.len);
+    header->id = header_id(key, header->key.len, header->hash);
+    header->hnext = NULL;
+
+    /* The last one wins when a header appears several times */
+    if (header->id != H_OTHER) {
+        req->known[header->id] = header;
+    } else {
+        b = header->hash & (HEADER_BUCKETS - 1);
+        header->hnext = req->buckets[b];
+        req->buckets[b] = header;
+    }
+
+    ++req->cnt_headers;
+    /* Insert new header into header list in request object */
+    header->next = req->headers;
+    req->headers = header;
+}
+
+/** @brief Retrieve the value of a well-known request header
+ *
+ *  @param id One of H_*
+ *  @return The value corresponds to the given header. NULL if not found
+ */
+char* get_known_header(http_request_t *req, int id) {
+    if (req->known[id] == NULL)
+        return NULL;
+    return slice_str(req, req->known[id]->val);
+}
+
 /** @brief Retrieve the value of a request header by key
+ *
+ *  Prefer get_known_header() for well-known headers.
  *
  *  @return The value corresponds to the given key. NULL if not found
  */
 char* get_request_header(http_request_t *req, char *key) {
     http_header_t *ptr;
+    int len = strlen(key), id;
+    unsigned int hash = header_hash(key, len);
 
-    ptr = req->headers;
-    while (ptr) {
-        if (strcicmp(ptr->key, key) == 0)
-            return ptr->val;
-        ptr = ptr->next;
-    }
+    if ((id = header_id(key, len, hash)) != H_OTHER)
+        return get_known_header(req, id);
+
+    ptr = req->buckets[hash & (HEADER_BUCKETS - 1)];
+    for (; ptr != NULL; ptr = ptr->hnext)
+        if (ptr->hash == hash && ptr->key.len == len &&
+            scan_casecmp(slice_str(req, ptr->key), key, len) == 0)
+            return slice_str(req, ptr->val);
 
     return NULL;
 }
@@ -285,13 +478,16 @@ char* get_request_header(http_request_t *req, char *key) {
 
 /** @brief Check if the value of Connection header is close
  *
- *  Return 1 if connection is stated "close" in request header. If there's no
- *  "connection" header or connection is stated "keep-alive".
+ *  Return 1 if connection is stated "close" in request header, or the server
+ *  is draining. 0 if there's no "connection" header or connection is stated
+ *  "keep-alive".
  */
 int connection_close(http_request_t *req) {
     char *connection;
 
-    connection = get_request_header(req, "connection");
+    if (draining)
+        return 1;
+    connection = get_known_header(req, H_CONNECTION);
     if (connection != NULL && strcicmp(connection, "close") == 0)
         return 1;
     return 0;
@@ -9,16 +9,26 @@
 #include <netinet/in.h>
 #include <openssl/ssl.h>
 #include "io.h"
+#include "pool.h"
+#include "chunked.h"
+#include "timer.h"
 
 /* http response code */
 #define OK 200
+#define PARTIAL_CONTENT 206
+#define NOT_MODIFIED 304
 #define BAD_REQUEST 400
 #define NOT_FOUND 404
 #define METHOD_NOT_ALLOWED 405
 #define LENGTH_REQUIRED 411
+#define PAYLOAD_TOO_LARGE 413
+#define RANGE_NOT_SATISFIABLE 416
+#define TOO_MANY_REQUESTS 429
 #define INTERNAL_SERVER_ERROR 500
 #define NOT_IMPLEMENTED 501
+#define BAD_GATEWAY 502
 #define SERVICE_UNAVAILABLE 503
+#define GATEWAY_TIMEOUT 504
 #define HTTP_VERSION_NOT_SUPPORTED 505
 
 /**
@@ -36,6 +46,7 @@
  * request before finishing the current response.
  */
 #define C_PIPING 3
+#define C_HANDSHAKE 4       // TLS handshake in progress
 
 /* Methods */
 #define M_GET 0
@@ -48,32 +59,83 @@
 /* Maximum length of a URI */
 #define MAX_URI_LEN 2048
 
+/** @brief A piece of a request in the input buffer of a client
+ *
+ *  Requests are not copied out of the input buffer. The parser records where
+ *  each part is, and NUL terminates it in place. Offsets stay valid when the
+ *  buffer is reallocated. Use slice_str() to get the string.
+ */
+typedef struct {
+    int off;            //<!offset from the start of the input buffer
+    int len;
+} slice_t;
+
+/**
+ * Well-known request headers
+ *
+ * They are recognized while parsing and can be looked up by id without
+ * comparing any string.
+ */
+#define H_CONNECTION 0
+#define H_CONTENT_LENGTH 1
+#define H_CONTENT_TYPE 2
+#define H_HOST 3
+#define H_ACCEPT 4
+#define H_ACCEPT_ENCODING 5
+#define H_USER_AGENT 6
+#define H_COOKIE 7
+#define H_IF_MODIFIED_SINCE 8
+#define H_IF_NONE_MATCH 9
+#define H_RANGE 10
+#define H_TRANSFER_ENCODING 11
+#define H_EXPECT 12
+#define H_IF_RANGE 13
+#define H_KNOWN 14          // Number of well-known headers
+#define H_OTHER -1          // Id of other headers
+
+/* Number of buckets for other headers, must be a power of 2 */
+#define HEADER_BUCKETS 16
+
 /** @brief Store information of a single http header.
  *
- * Headers are organized using linked list.
+ * Headers are organized using linked list. They are allocated from the arena
+ * of the client and go away in bulk when the request ends.
  */
 typedef struct http_header {
-    char* key;
-    char* val;
+    slice_t key;
+    slice_t val;
+    int id;                     //<!well-known header id or H_OTHER
+    unsigned int hash;          //<!case insensitive hash of key
     struct http_header *next;
+    struct http_header *hnext;  //<!next header in the same bucket
 } http_header_t;
 
 /** @brief Store information of a single request */
 typedef struct http_request {
     int method;
-    char uri[MAX_URI_LEN];
-    char query[MAX_URI_LEN];
-    char path[MAX_URI_LEN];
+    slice_t uri;            //<!request path without query string
+    slice_t query;
+    slice_t path;           //<!path after /cgi of a cgi request
     char *body;
     int is_cgi;
     int content_length;
+    int status;             //<!status of a response queued by a handler
     int cnt_headers;
     http_header_t *headers; //Headers in a linked list
+    http_header_t *known[H_KNOWN];  //<!well-known headers by id
+    http_header_t *buckets[HEADER_BUCKETS];     //<!other headers by hash
+    buf_t *in;              //<!input buffer the slices point into
 } http_request_t;
 
+struct fcgi_request;
+struct static_file;
+struct h2_conn;
+struct h2_stream;
+
 /** @brief Store information of a single client.
  *
- *  Clients are organized using linked list. The server maintain an this object
+ *  Clients are organized using doubly linked list, so that a client can be
+ *  removed without walking the list. The server maintain an this object
  *  for each client. The object includes the file descriptor, data regarding
  *  current request, and an input buffer and an output buffer.
  */
@@ -82,34 +144,63 @@ typedef struct http_client {
     pipe_t *pipe;           //<!pipe from a file or cgi output
     int status;             //<!the current status of this client
     int alive;              //<!indicates if the client should be kept alive
-    buf_t *in, *out;        //<!input and output buffer assigned to this client
+    buf_t *in;              //<!input buffer assigned to this client
+    out_chain_t *out;       //<!output waiting to be sent to this client
     http_request_t* req;     //<!current request from this client
     char remote_ip[INET_ADDRSTRLEN];   //<!ip address of the client
-    char* remote_host;                  //<!host name of the client
     SSL* ssl_context;        //<!SSL context for this client
+    arena_t arena;           //<!memory for the current request
+    struct fcgi_request *fcgi;  //<!request sent to FastCGI workers, or NULL
+    struct static_file *opening;    //<!file opened by an I/O thread, or NULL
+    int cgi_in;             //<!stdin pipe of the cgi script, -1 if closed
+    int body_stream;        //<!rest of request body goes through feed_cgi()
+    int body_left;          //<!bytes of request body not consumed yet
+    int body_start;         //<!offset of request body in the input buffer
+    int body_raw;           //<!end of decoded chunked body in the buffer
+    chunk_decoder_t dechunk;    //<!state of decoding a chunked body
+    struct h2_conn *h2;         //<!HTTP/2 state if the connection speaks it
+    struct h2_stream *stream;   //<!HTTP/2 stream handled by this client, which
+                                //<!has no socket of its own, or NULL
+    struct http_client* prev;   //<!previous client in the linked list
     struct http_client* next;   //<!next client in the linked list
+    int scheduled;              //<!whether the client is in the active list
+    timeout_t timeout;          //<!fires when the deadline passes
+    int deadline;               //<!D_* the timeout is set for, see server.c
+    int timed_out;              //<!deadline has passed, close it
+    struct http_client* next_active;    //<!next client to be served
 } http_client_t;
 
 http_client_t *client_head;     //<!first client in the linked list
 
+/*
+ * Set on SIGQUIT, the server finishes the requests it has and exits. Every
+ * response closes its connection then, see connection_close().
+ */
+int draining;
+
 /* Initialize and destroy object */
-void deinit_header(http_header_t *header);
-void deinit_request(http_request_t *req);
-http_request_t* new_request();
+void reset_request(http_client_t *client);
 void deinit_client(http_client_t *client);
 http_client_t* new_client(int fd);
 
 /* IO with client */
 void client_write(http_client_t *client, char* buf, int buf_len);
 void client_write_string(http_client_t *client, char* str);
-int client_readline(http_client_t *client, char *line);
+void client_write_ref(http_client_t *client, char* buf, int buf_len,
+                      void (*release)(void *), void *arg);
+int client_nextline(http_client_t *client, slice_t *line);
+int client_dechunk(http_client_t *client);
 void send_response_line(http_client_t *client, int code);
 void send_header(http_client_t *client, char* key, char* val);
 int end_request(http_client_t *client, int code);
+void log_request(http_client_t *client, int code);
 
 /* helper functions */
 int strcicmp(char* s1, char* s2);
+char* slice_str(http_request_t *req, slice_t slice);
+void add_request_header(http_request_t *req, http_header_t *header);
 char* get_request_header(http_request_t *req, char *key);
+char* get_known_header(http_request_t *req, int id);
 int connection_close(http_request_t *req);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,154 @@
+/** @file http_date.c
+ *  @brief Dates of HTTP headers, formatted without the C library
+ *
+ *  Every response carries the current date, which only changes once a
+ *  second. The serving loop calls update_date() in each iteration, and the
+ *  date is formatted again only when the second has changed. Responses take
+ *  the cached string.
+ *
+ *  Dates are formatted by hand in the IMF-fixdate form of RFC 7231, as
+ *  strftime() and gmtime() are much slower and depend on the locale. Dates
+ *  sent back by clients (If-Modified-Since for example) are parsed in the
+ *  same form, which is the one they got from us.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <string.h>
+#include "http_date.h"
+
+static const char *days[] = { "Thu", "Fri", "Sat", "Sun", "Mon", "Tue", "Wed" };
+static const char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+static time_t now = 0;
+static char date[HTTP_DATE_LEN + 1];
+
+/** @brief Write n as a number of exactly width digits */
+static char* put_digits(char *p, int n, int width) {
+    int i;
+
+    for (i = width - 1; i >= 0; --i, n /= 10)
+        p[i] = '0' + n % 10;
+    return p + width;
+}
+
+/** @brief Format a time like "Sun, 06 Nov 1994 08:49:37 GMT"
+ *
+ *  @param t Seconds since the epoch
+ *  @param buf Buffer of at least HTTP_DATE_LEN + 1 bytes
+ */
+void format_date(time_t t, char *buf) {
+    long day = t / 86400, secs = t % 86400, era, doe, yoe, doy, mp;
+    int year, month, mday;
+    char *p = buf;
+
+    if (secs < 0) {
+        secs += 86400;
+        --day;
+    }
+
+    // Civil date of a day number, with years starting on March 1st
+    era = (day + 719468 >= 0 ? day + 719468 : day + 719468 - 146096) / 146097;
+    doe = day + 719468 - era * 146097;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    mday = doy - (153 * mp + 2) / 5 + 1;
+    month = mp < 10 ? mp + 2 : mp - 10;
+    year = yoe + era * 400 + (month < 2);
+
+    memcpy(p, days[((day % 7) + 7) % 7], 3);
+    p += 3;
+    *p++ = ',';
+    *p++ = ' ';
+    p = put_digits(p, mday, 2);
+    *p++ = ' ';
+    memcpy(p, months[month], 3);
+    p += 3;
+    *p++ = ' ';
+    p = put_digits(p, year, 4);
+    *p++ = ' ';
+    p = put_digits(p, secs / 3600, 2);
+    *p++ = ':';
+    p = put_digits(p, secs / 60 % 60, 2);
+    *p++ = ':';
+    p = put_digits(p, secs % 60, 2);
+    memcpy(p, " GMT", 5);
+}
+
+/** @brief Read a number of exactly width digits
+ *
+ *  @return The number. -1 if there are not enough digits.
+ */
+static int get_digits(const char *p, int width) {
+    int n = 0, i;
+
+    for (i = 0; i < width; ++i) {
+        if (p[i] < '0' || p[i] > '9')
+            return -1;
+        n = n * 10 + p[i] - '0';
+    }
+    return n;
+}
+
+/** @brief Parse a date like "Sun, 06 Nov 1994 08:49:37 GMT"
+ *
+ *  @return Seconds since the epoch. -1 if it's not such a date.
+ */
+time_t parse_date(const char *str) {
+    int mday, month, year, hour, min, sec;
+    long y, era, yoe, doy, doe;
+
+    if (strlen(str) < HTTP_DATE_LEN || str[3] != ',' || str[4] != ' ' ||
+        str[7] != ' ' || str[11] != ' ' || str[16] != ' ' ||
+        str[19] != ':' || str[22] != ':' || strncmp(str + 25, " GMT", 4))
+        return -1;
+
+    for (month = 0; month < 12; ++month)
+        if (strncmp(str + 8, months[month], 3) == 0)
+            break;
+    mday = get_digits(str + 5, 2);
+    year = get_digits(str + 12, 4);
+    hour = get_digits(str + 17, 2);
+    min = get_digits(str + 20, 2);
+    sec = get_digits(str + 23, 2);
+    if (month == 12 || mday < 1 || mday > 31 || year < 1970 || hour < 0 ||
+        hour > 23 || min < 0 || min > 59 || sec < 0 || sec > 60)
+        return -1;
+
+    // Day number of a civil date, the inverse of format_date()
+    y = year - (month < 2);
+    era = y / 400;
+    yoe = y - era * 400;
+    doy = (153 * (month < 2 ? month + 10 : month - 2) + 2) / 5 + mday - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return (era * 146097 + doe - 719468) * 86400 + hour * 3600 + min * 60 +
+           sec;
+}
+
+/** @brief Refresh the cached time, and the date if a second has passed
+ *
+ *  Called by the serving loop in every iteration.
+ */
+void update_date() {
+    time_t t = time(NULL);
+
+    if (t != now) {
+        now = t;
+        format_date(now, date);
+    }
+}
+
+/** @brief Time of the last update_date() */
+time_t current_time() {
+    if (now == 0)
+        update_date();
+    return now;
+}
+
+/** @brief Current date for the Date header, as of the last update_date() */
+char* current_date() {
+    if (now == 0)
+        update_date();
+    return date;
+}
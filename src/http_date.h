@@ -0,0 +1,20 @@
+/** @file http_date.h
+ *  @brief Header file for http_date.c
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __HTTP_DATE_H__
+#define __HTTP_DATE_H__
+
+#include <time.h>
+
+/* Length of a date like "Sun, 06 Nov 1994 08:49:37 GMT" */
+#define HTTP_DATE_LEN 29
+
+void update_date();
+time_t current_time();
+char* current_date();
+void format_date(time_t t, char *buf);
+time_t parse_date(const char *str);
+
+#endif
@@ -8,44 +8,55 @@
 #include "config.h"
 #include "http_parser.h"
 #include "request_handler.h"
+#include "scan.h"
 #include "log.h"
+#include "metrics.h"
+#include "ratelimit.h"
 
-/** @brief Check if string str start with string sub
- *  @return 1 if true, 0 if false
+/** @brief NUL terminate a slice in place
+ *
+ *  The byte after a slice is always a delimiter (a space, ':', '?', '\r' or
+ *  '\n'), which is not needed once the line is parsed.
  */
-static int startwith(char* str, char* sub) {
-    int i = 0;
-    if (strlen(sub) > strlen(str))
-        return 0;
-    for (i = 0; i < strlen(sub); ++i)
-        if (str[i] != sub[i])
-            return 0;
-    return 1;
+static void terminate(char *buf, slice_t slice) {
+    buf[slice.off + slice.len] = '\0';
+}
+
+/** @brief Find the next token separated by spaces in buf[i, end)
+ *
+ *  @return The position right after the token
+ */
+static int next_token(char *buf, int i, int end, slice_t *token) {
+    i += scan_nonspace(buf + i, end - i);
+    token->off = i;
+    token->len = scan_space(buf + i, end - i);
+    return i + token->len;
 }
 
 /** @brief Parse a uri
  *
- *  Check if the given uri points to a static file or a cgi script. The
- *  path to the static file or cgi path is stored in buf. When the uri
- *  points to a cgi script, the query string is stored in req->query.
+ *  Check if the given uri points to a static file or a cgi script. When the
+ *  uri points to a cgi script, the path after "/cgi" is stored in req->path.
+ *  The query string is stored in req->query.
  */
-static void parse_uri(http_request_t* req, char* uri) {
-    char *cgi_head = "/cgi/";
-    char *query_start;
-
-    query_start = strchr(uri, '?');
-    if (query_start == NULL) {      // No query string
-        strcpy(req->uri, uri);
-        req->query[0] = '\0';
-    } else {                // With query string
-        strncpy(req->uri, uri, query_start - uri);
-        req->uri[query_start - uri] = '\0';
-        strcpy(req->query, query_start + 1);
+static void parse_uri(http_request_t* req, char *buf, slice_t uri) {
+    int query_start;
+
+    req->uri = uri;
+    req->query.len = 0;
+    query_start = scan_char(buf + uri.off, uri.len, '?');
+    if (query_start < uri.len) {    // With query string
+        req->uri.len = query_start;
+        req->query.off = uri.off + req->uri.len + 1;
+        req->query.len = uri.len - req->uri.len - 1;
+        terminate(buf, req->query);
     }
+    terminate(buf, req->uri);
 
-    if (startwith(uri, cgi_head)) {     // Cgi?
+    if (uri.len >= 5 && strncmp(buf + uri.off, "/cgi/", 5) == 0) {     // Cgi?
         req->is_cgi = 1;
-        strcpy(req->path, req->uri + 4);
+        req->path.off = req->uri.off + 4;
+        req->path.len = req->uri.len - 4;
     } else {
         req->is_cgi = 0;
     }
@@ -55,73 +66,70 @@ static void parse_uri(http_request_t* req, char* uri) {
  *
  *  @return 0 on success. HTTP status code on error.
  */
-static int parse_request_line(http_request_t* req, char *line) {
-    char method[MAXBUF], uri[MAXBUF], version[MAXBUF];
-
-    if (sscanf(line, "%s %s %s", method, uri, version) < 3) {
-        log_msg(L_ERROR, "Bad request line: %s\n", line);
+static int parse_request_line(http_client_t* client, slice_t line) {
+    http_request_t *req = client->req;
+    char *buf = client->in->buf;
+    int end = line.off + line.len, i;
+    slice_t method, uri, version;
+
+    i = next_token(buf, line.off, end, &method);
+    i = next_token(buf, i, end, &uri);
+    next_token(buf, i, end, &version);
+    if (version.len == 0) {
+        log_msg(L_ERROR, "Bad request line: %.*s\n", line.len, buf + line.off);
         return BAD_REQUEST;
     }
 
-    if (strlen(uri) > MAX_URI_LEN) {
+    if (uri.len > MAX_URI_LEN) {
         log_msg(L_ERROR, "URI too long\n");
         return BAD_REQUEST;
     }
 
+    terminate(buf, method);
+    terminate(buf, version);
+
     req->method = -1;
-    if (strcicmp(method, "GET") == 0) req->method = M_GET;
-    if (strcicmp(method, "HEAD") == 0) req->method = M_HEAD;
-    if (strcicmp(method, "POST") == 0) req->method = M_POST;
+    if (strcicmp(buf + method.off, "GET") == 0) req->method = M_GET;
+    if (strcicmp(buf + method.off, "HEAD") == 0) req->method = M_HEAD;
+    if (strcicmp(buf + method.off, "POST") == 0) req->method = M_POST;
 
     //Method not allowed.
     if (req->method == -1) {
-        log_msg(L_ERROR, "Not Implemented\n", method);
+        log_msg(L_ERROR, "Not Implemented: %s\n", buf + method.off);
         return NOT_IMPLEMENTED;
     }
 
     //Wrong version
-    if (strcicmp(version, http_version) != 0) {
-        log_msg(L_ERROR, "Version not supported: %s\n", version);
+    if (strcicmp(buf + version.off, http_version) != 0) {
+        log_msg(L_ERROR, "Version not supported: %s\n", buf + version.off);
         return HTTP_VERSION_NOT_SUPPORTED;
     }
 
-    parse_uri(req, uri);
+    parse_uri(req, buf, uri);
 
     return 0;
 }
 
-/** @brief Return a trimmed version of a string which starts at head and ends
- *         at tail.
- *
- *  Before copying, remove heading and trailing while spaces. If after
- *  trimming, the string becomes empty, return NULL.
+/** @brief Remove heading and trailing spaces and tabs of buf[head, tail]
  *
- *  @param head A pointer to the first character in the string
- *  @param tail A pointer to the last character in the string
- *  @return A copy of the trimmed version. NULL if the string becomes empty
- *          after trimming.
+ *  @param buf The input buffer
+ *  @param head Offset of the first character in the string
+ *  @param tail Offset of the last character in the string
+ *  @param slice Where the trimmed string is
+ *  @return 0 on success. -1 if the string becomes empty after trimming.
  */
-static char* copy_trimmed_string(char *head, char* tail) {
-    char *buf;
-
-    //Remove heading and trailing spaces
-    while (head <= tail) {
-        if (*head != ' ' && *tail != ' ')
-            break;
-        if (*head == ' ')
-            head += 1;
-        if (*tail == ' ')
-            tail -= 1;
-    }
+static int trim(char *buf, int head, int tail, slice_t *slice) {
+    if (head <= tail)
+        head += scan_nonspace(buf + head, tail - head + 1);
+    while (head <= tail && (buf[tail] == ' ' || buf[tail] == '\t'))
+        tail -= 1;
     //After removing heading and trailing spaces, the string become empty
     if (head > tail)
-        return NULL;
-
-    buf = malloc(tail - head + 2);
-    strncpy(buf, head, tail - head + 1);
-    buf[tail - head + 1] = '\0';
+        return -1;
 
-    return buf;
+    slice->off = head;
+    slice->len = tail - head + 1;
+    return 0;
 }
 
 /** @brief Parse a line into key/val pair and add them into header collection
@@ -129,52 +137,43 @@ static char* copy_trimmed_string(char *head, char* tail) {
  *
  *  @return 0 on success. -1 if parse error.
  */
-static int parse_header(http_request_t* req, char* line) {
-    char *val;
+static int parse_header(http_client_t* client, slice_t line) {
+    http_request_t *req = client->req;
+    char *buf = client->in->buf;
     http_header_t *header;
+    int colon, end = line.off + line.len;
 
-    val = strchr(line, ':');
+    colon = line.off + scan_char(buf + line.off, line.len, ':');
     /* Seperator not found or is the first or last character */
-    if (val == NULL || val[1] == '\0' || val == line)
+    if (colon >= end - 1 || colon == line.off)
         return -1;
 
-    header = malloc(sizeof(http_header_t));
-    header->key = copy_trimmed_string(line, val - 1);
-    if (header->key == NULL) {
-        free(header);
+    header = arena_alloc(&client->arena, sizeof(http_header_t));
+    if (trim(buf, line.off, colon - 1, &header->key) == -1 ||
+        trim(buf, colon + 1, end - 1, &header->val) == -1)
         return -1;
-    }
-    header->val = copy_trimmed_string(val + 1, line + strlen(line) - 1);
-    if (header->val == NULL) {
-        deinit_header(header);
-        return -1;
-    }
+    terminate(buf, header->key);
+    terminate(buf, header->val);
 
-    ++req->cnt_headers;
-    /* Insert new header into header list in request object */
-    header->next = req->headers;
-    req->headers = header;
+    add_request_header(req, header);
 
     return 0;
 }
 
-/** @brief Parse and response to request from a client
- *
- *  @return 0 if the connection should be kept alive. -1 if the connection
- *          should be closed.
+/** @brief Parse and respond to the request in the input buffer, see
+ *  http_parse()
  */
-int http_parse(http_client_t *client) {
-    int ret, i;
-    char line[MAXBUF];
+static int parse(http_client_t *client) {
+    int ret = 0, i, chunked;
+    slice_t line;
     char* buf;
 
     if (client->status == C_IDLE) {  /* A new request, parse request line */
-        ret = client_readline(client, line);
-        if (strlen(line) == 0) return 0;
-
-        log_msg(L_HTTP_DEBUG, "%s\n", line);
+        if ((ret = client_nextline(client, &line)) == 0)
+            return 0;
 
-        if (ret == 0) return 0;
+        // Drop everything from the last request
+        reset_request(client);
 
         /* The length of a line exceed MAXBUF */
         if (ret < 0) {
@@ -182,11 +181,13 @@ int http_parse(http_client_t *client) {
             return end_request(client, BAD_REQUEST);
         }
 
-        if (client->req != NULL) free(client->req);
-        client->req = new_request();
+        // Empty lines before a request are ignored
+        if (line.len == 0) return 0;
+
+        log_msg(L_HTTP_DEBUG, "%.*s\n", line.len, client->in->buf + line.off);
 
         /* parse request line and store information in client->req */
-        if ((ret = parse_request_line(client->req, line)) > 0)
+        if ((ret = parse_request_line(client, line)) > 0)
             return end_request(client, ret);
 
         /* Now start parsing header */
@@ -199,20 +200,41 @@ int http_parse(http_client_t *client) {
      *  correspondingly. Thus client->req->content_length == -1 means the
      *  request header section has not ended.
      */
-    while (client->status == C_PHEADER && client_readline(client, line) > 0) {
-        log_msg(L_HTTP_DEBUG, "%s\n", line);
+    while (client->status == C_PHEADER &&
+           (ret = client_nextline(client, &line)) > 0) {
+        log_msg(L_HTTP_DEBUG, "%.*s\n", line.len, client->in->buf + line.off);
 
-        if (strlen(line) == 0) {    //Request header ends
+        if (line.len == 0) {    //Request header ends
+
+            if (!rate_allow(client->remote_ip)) {
+                ++metrics->rate_limited;
+                return end_request(client, TOO_MANY_REQUESTS);
+            }
 
             if (client->req->method == M_POST) {
-                buf = get_request_header(client->req, "Content-Length");
+                client->body_start = client->body_raw = client->in->pos;
+
+                /* Transfer-Encoding overrides Content-Length */
+                buf = get_known_header(client->req, H_TRANSFER_ENCODING);
+                if (buf != NULL) {
+                    if (strcicmp(buf, "chunked") != 0)
+                        return end_request(client, NOT_IMPLEMENTED);
+                    // Length unknown until the last chunk
+                    client->req->content_length = -1;
+                    init_chunk_decoder(&client->dechunk);
+                    client->status = C_PBODY;
+                    break;
+                }
+
+                buf = get_known_header(client->req, H_CONTENT_LENGTH);
                 if (buf == NULL)
                     return end_request(client, LENGTH_REQUIRED);
                 //validate content-length
-                if (strlen(buf) == 0) return BAD_REQUEST;
-                for (i = 0; i < strlen(buf); ++i)
+                for (i = 0; buf[i] != '\0'; ++i)
                     if (buf[i] < '0' || buf[i] >'9') //each char in range ['0', '9']
                         return end_request(client, BAD_REQUEST);
+                if (i > 9 || atoi(buf) > MAX_BODY)
+                    return end_request(client, PAYLOAD_TOO_LARGE);
 
                 client->req->content_length = atoi(buf);
 
@@ -226,6 +248,10 @@ int http_parse(http_client_t *client) {
             if (ret != 0)
                 return end_request(client, ret);
             else {
+                // A file opened by an I/O thread is logged once it's sent
+                if (client->opening == NULL)
+                    log_request(client, client->req->is_cgi ? 0 :
+                                        client->req->status);
                 /* The client signal a "Connection: Close" */
                 if (connection_close(client->req))
                     client->alive = 0;
@@ -233,39 +259,93 @@ int http_parse(http_client_t *client) {
                 return ret;
             }
         }
-        ret = parse_header(client->req, line);
+        ret = parse_header(client, line);
         if (ret == -1) {
-            log_msg(L_ERROR, "Bad request header format: %s\n", line);
+            log_msg(L_ERROR, "Bad request header format: %.*s\n", line.len,
+                    client->in->buf + line.off);
             return end_request(client, BAD_REQUEST);
         }
     }
 
+    /* The length of a header line exceed MAXBUF */
+    if (ret < 0) {
+        log_error("A line in request is too long");
+        return end_request(client, BAD_REQUEST);
+    }
+
     /*
      * We've finished reading and parsing request header. Now, see if the body
-     * of the request is ready. If so, copy data
+     * of the request is ready. The body of a cgi request is not waited for,
+     * it's passed to the script as it arrives (see feed_cgi()).
      */
     if (client->status == C_PBODY) {
-        // Reveive complete body?
-        if (client->in->datasize - client->in->pos >= client->req->content_length) {
+        chunked = client->dechunk.state != CD_IDLE;
+
+        /*
+         * A chunked body is decoded in place in the input buffer. Once it has
+         * all arrived, it's handled like a body with a Content-Length, and a
+         * cgi script started by then is told its length.
+         */
+        if (chunked) {
+            if (client_dechunk(client) == -1)
+                return end_request(client, BAD_REQUEST);
+            if (client->dechunk.total > MAX_BODY)
+                return end_request(client, PAYLOAD_TOO_LARGE);
+
+            if (client->dechunk.state == CD_DONE) {
+                client->dechunk.state = CD_IDLE;
+                client->req->content_length =
+                    client->body_raw - client->body_start;
+                chunked = 0;
+            } else if (!stream_body(client)) {
+                /* Body not complete, next time then */
+                return 0;
+            }
+        }
+
+        if (stream_body(client)) {
+            client->body_left = chunked ? 0 : client->req->content_length;
+            client->body_stream = chunked || client->body_left > 0;
+            if (client->body_stream)
+                client->in->limit = BODY_BACKLOG;
+        } else if (client->in->datasize - client->in->pos >=
+                   client->req->content_length) {
             /* Let body points to corresponding memory in the input buffer */
             client->req->body = client->in->buf + client->in->pos;
             client->in->pos += client->req->content_length;
-            ret = handle_post(client);
-
-            if (ret != 0)
-                return end_request(client, ret);
-            else {
-                /* The client signal a "Connection: Close" */
-                if (connection_close(client->req))
-                    client->alive = 0;
-
-                return ret;
-            }
+        } else {
+            /* Body not ready, next time then */
+            return 0;
         }
 
-        /* Body not ready, next time then */
-        return 0;
+        ret = handle_post(client);
+        if (ret != 0)
+            return end_request(client, ret);
+        log_request(client, 0);
+
+        /* The client signal a "Connection: Close" */
+        if (connection_close(client->req))
+            client->alive = 0;
+        return ret;
     }
 
     return 0;
 }
+
+/** @brief Parse and response to request from a client
+ *
+ *  Lines are parsed where they are in the input buffer. Nothing is copied.
+ *  Calls which consume input are timed, handling the request included.
+ *
+ *  @return 0 if the connection should be kept alive. -1 if the connection
+ *          should be closed.
+ */
+int http_parse(http_client_t *client) {
+    unsigned long start = metrics_clock();
+    int pos = client->in->pos, ret;
+
+    ret = parse(client);
+    if (client->in->pos != pos)
+        hist_record(&metrics->parse, metrics_clock() - start);
+    return ret;
+}
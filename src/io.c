@@ -3,132 +3,928 @@
  *
  *  The function take a greedy approach, that is, send and receive as much bytes
  *  as possible in one call. When receiving, the buffer size will increase
- *  dynamically. When sending, the buffer size might shrink when it's empty
- *  enough.
+ *  dynamically. Buffers are slabs of a few size classes from pools shared by
+ *  all connections, so growing and shrinking them recycles memory instead of
+ *  calling realloc(). Output is queued in a chain of segments, and sent by writev()
+ *  so that a response needs as few system calls as possible.
+ *
+ *  Greedy up to a budget: the server gives each client it serves a number of
+ *  bytes to send and receive (see io_budget()), so that a large download or
+ *  upload doesn't hold up everyone else until its socket would block.
+ *
+ *  Files are sent from the page cache only. What's not there is read by an
+ *  I/O thread first (see aio.c), so the serving loop never waits for the
+ *  disk.
  *
  *  @author Chao Xin(cxin)
  */
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include "io.h"
+#include "aio.h"
+#include "pool.h"
 #include "log.h"
+#include "metrics.h"
+
+/* Buffer structs, output segments and pipes are recycled */
+static pool_t buf_pool = POOL_INITIALIZER(sizeof(buf_t));
+static pool_t chain_pool = POOL_INITIALIZER(sizeof(out_chain_t));
+static pool_t seg_pool = POOL_INITIALIZER(sizeof(out_seg_t));
+static pool_t pipe_pool = POOL_INITIALIZER(sizeof(pipe_t));
+
+/** @brief A window of a file read ahead for a pipe by an I/O thread */
+typedef struct file_read {
+    aio_job_t job;
+    pipe_t *pipe;       //<!NULL once the pipe is closed
+    int fd;
+    off_t offset, end;
+} file_read_t;
+
+/*
+ * Bytes which may still be sent and received, -1 if unlimited. See
+ * io_budget().
+ */
+static long send_budget = -1, recv_budget = -1;
+
+#define SLAB_POOL(size) POOL_INITIALIZER_MAX((size), SLAB_POOL_BYTES / (size))
 
-static select_context context;
+/* Free slabs of each class, data of buffers and output segments */
+static pool_t slab_pools[SLAB_CLASSES] = {
+    SLAB_POOL(BUFSIZE), SLAB_POOL(BUFSIZE << 1), SLAB_POOL(BUFSIZE << 2),
+    SLAB_POOL(BUFSIZE << 3), SLAB_POOL(BUFSIZE << 4), SLAB_POOL(BUFSIZE << 5),
+    SLAB_POOL(BUFSIZE << 6)
+};
+
+/** @brief Limit bytes sent and received from now on
+ *
+ *  Once a budget is spent, sending or receiving stops as if the socket would
+ *  block, except that the socket is left ready. What's left is done after
+ *  the other clients have had their turn.
+ *
+ *  @param bytes Budget of each direction, -1 for no limit
+ */
+void io_budget(long bytes) {
+    send_budget = recv_budget = bytes;
+}
+
+/** @brief Whether either budget has run out since io_budget() */
+int io_budget_spent() {
+    return send_budget == 0 || recv_budget == 0;
+}
+
+/** @brief At most count bytes, no more than left in a budget */
+static long allowance(long budget, long count) {
+    return budget >= 0 && budget < count ? budget : count;
+}
+
+static void spend(long *budget, long n) {
+    if (*budget > 0)
+        *budget = *budget > n ? *budget - n : 0;
+}
+
+/** @brief Account for bytes sent */
+static void sent(int n) {
+    metrics->bytes_sent += n;
+    spend(&send_budget, n);
+}
+
+/** @brief Class of the smallest slab holding size bytes
+ *
+ *  @return SLAB_CLASSES if it's larger than any slab
+ */
+static int slab_class(int size) {
+    int k = 0;
+
+    while (k < SLAB_CLASSES && (BUFSIZE << k) < size)
+        ++k;
+    return k;
+}
+
+/** @brief Bytes actually allocated for a block of at least size bytes */
+static int slab_size(int size) {
+    int k = slab_class(size);
+
+    return k < SLAB_CLASSES ? BUFSIZE << k : size;
+}
+
+/** @brief Free memory allocated by alloc_block() */
+static void free_block(char *block, int size) {
+    int k = slab_class(size);
+
+    metrics->buffer_bytes -= size;
+    if (k < SLAB_CLASSES && (BUFSIZE << k) == size)
+        pool_put(&slab_pools[k], block);
+    else
+        free(block);
+}
+
+/** @brief Allocate size bytes, from a slab pool if size is a slab size */
+static char* alloc_block(int size) {
+    int k = slab_class(size);
+
+    metrics->buffer_bytes += size;
+    if (k < SLAB_CLASSES && (BUFSIZE << k) == size)
+        return pool_get(&slab_pools[k]);
+    return malloc(size);
+}
+
+/** @brief Move the data of a buffer into a block of size bytes
+ *
+ *  Data from offset from on is kept, moved to the beginning of the block.
+ */
+static void move_block(buf_t *bp, int size, int from) {
+    char *block = alloc_block(size);
+
+    if (bp->datasize > from)
+        memcpy(block, bp->buf + from, bp->datasize - from);
+    free_block(bp->buf, bp->bufsize);
+    bp->buf = block;
+    bp->bufsize = size;
+}
+
+/** @brief Give a buffer the slab of the next class, data stays where it is */
+static void grow(buf_t *bp) {
+    move_block(bp, slab_size(bp->bufsize < BUFSIZE ? BUFSIZE :
+                             bp->bufsize << 1), 0);
+}
 
 /** @brief The buffer is full and need to be expand? */
 inline int full(buf_t *bp) {
     return bp->datasize + (BUFSIZE >> 1) > bp->bufsize;
 }
 
-/** @brief The buffer is empty and should be shrink? */
+/** @brief Should the buffer be shrunk?
+ *
+ *  Yes if all the data has been processed, if processed data takes half of
+ *  it, or if data left would fit a slab of a quarter of its size.
+ */
 inline int empty(buf_t *bp) {
-    int freespace = bp->bufsize - bp->datasize + bp->pos;
-    return freespace > BUFSIZE;
+    int left = bp->datasize - bp->pos;
+
+    if (bp->bufsize == 0)
+        return 0;
+    return left == 0 || bp->pos >= bp->bufsize >> 1 ||
+        (bp->bufsize > BUFSIZE && left + (BUFSIZE >> 1) <= bp->bufsize >> 2);
 }
 
 /** @brief Shrink buffer size
  *
- *  Move data started at pointer bp->pos to the head of buffer and then deduce
- *  the free memory by half.
+ *  A buffer whose data has all been processed gives its slab back, so an
+ *  idle connection holds no buffer memory until it receives again. Otherwise
+ *  data started at bp->pos is moved to a slab just large enough for it.
+ *  Should only be called when empty() says so, data is not moved each time
+ *  some of it is processed.
  *
  *  @param bp The buffer to be shrunk
  *
  *  @return Void
  */
 void io_shrink(buf_t *bp) {
-    int freespace;
+    int left = bp->datasize - bp->pos;
 
     log_msg(L_IO_DEBUG, "Start shrinking buffer. bufsize: %d datasize: %d pos: %d\n",
             bp->bufsize, bp->datasize, bp->pos);
 
-    //calculate free memory
-    freespace = bp->bufsize - bp->datasize + bp->pos;
-    //move data to the head of buffer
-    bp->datasize -= bp->pos;
-    memmove(bp->buf, bp->buf + bp->pos, bp->datasize);
+    if (left == 0) {
+        free_block(bp->buf, bp->bufsize);
+        bp->buf = NULL;
+        bp->bufsize = 0;
+    } else {
+        move_block(bp, slab_size(left + (BUFSIZE >> 1)), bp->pos);
+    }
+    bp->scan = bp->scan > bp->pos ? bp->scan - bp->pos : 0;
+    bp->datasize = left;
     bp->pos = 0;
-    //cut of half of the free space
-    bp->bufsize -= freespace >> 1;
-
-    bp->buf = realloc(bp->buf, bp->bufsize);
 
     log_msg(L_IO_DEBUG, "Shrinking completed. bufsize: %d datasize: %d pos: %d\n",
             bp->bufsize, bp->datasize, bp->pos);
 }
 
+/** @brief Drop processed data in the middle of a buffer
+ *
+ *  Bytes in [start, pos) are removed and the data after them is moved down,
+ *  so that data before start (a parsed request for example) stays in place.
+ *  Nothing is moved unless the space reclaimed is at least as large as the
+ *  data to be moved.
+ *
+ *  @param bp The buffer
+ *  @param start Beginning of the processed data to drop
+ *  @return Number of bytes dropped
+ */
+int io_discard(buf_t *bp, int start) {
+    int gap = bp->pos - start;
+
+    if (gap <= 0 || gap < bp->datasize - bp->pos)
+        return 0;
+
+    memmove(bp->buf + start, bp->buf + bp->pos, bp->datasize - bp->pos);
+    bp->datasize -= gap;
+    bp->scan = bp->scan > bp->pos ? bp->scan - gap : start;
+    bp->pos = start;
+    return gap;
+}
+
+/** @brief Whether the last recv()/send()/SSL_read()/SSL_write() would block
+ *
+ *  @param ssl_context SSL context used in the last call. NULL if not SSL
+ *  @param ret What the last call returns
+ *  @return 1 if the call should be retried when the socket is ready again.
+ *          0 if it's an error or the connection has been closed.
+ */
+static int would_block(SSL *ssl_context, int ret) {
+    int err;
+
+    if (ssl_context) {
+        err = SSL_get_error(ssl_context, ret);
+        return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE;
+    }
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
 /** @brief Try to recv as much data as possible
  *
- *  Call recv()/SSL_read() until connection closed or error occurs.
+ *  Call recv()/SSL_read() until the socket would block, connection closed or
+ *  error occurs. When the socket would block, it's cleared from readable fds.
+ *  If bp has a limit, receiving also stops when there are that many bytes
+ *  not processed yet. The socket stays readable in this case.
  *
  *  @param sock Client socket
  *  @param bp A pointer to a buf_t struct which stores received data
  *  @param ssl_context If ssl_context if not NULL, SSL_read() will be used
  *                     instead of recv().
  *  @return Number of bytes received on normal exit, 0 on connection closed,
- *          -1 on error.
+ *          -1 on error. If there is no data available, -1 is returned and
+ *          errno is set to EAGAIN.
  */
 int io_recv(int sock, buf_t *bp, SSL* ssl_context) {
-    int nbytes;
+    int nbytes, total = 0, room;
+
+    while (1) {
+        // Allocate more memory
+        if (full(bp))
+            grow(bp);
+
+        room = bp->bufsize - bp->datasize - 1;
+        if (bp->limit > 0) {
+            if (bp->datasize - bp->pos >= bp->limit) {
+                if (total > 0)
+                    return total;
+                errno = EAGAIN;
+                return -1;
+            }
+            if (room > bp->limit - (bp->datasize - bp->pos))
+                room = bp->limit - (bp->datasize - bp->pos);
+        }
+        if (recv_budget == 0) {
+            if (total > 0)
+                return total;
+            errno = EAGAIN;
+            return -1;
+        }
+        room = allowance(recv_budget, room);
+
+        if (ssl_context)
+            nbytes = SSL_read(ssl_context, bp->buf + bp->datasize, room);
+        else
+            nbytes = recv(sock, bp->buf + bp->datasize, room, 0);
+        if (nbytes <= 0)
+            break;
 
-    if (ssl_context)
-        nbytes = SSL_read(ssl_context, bp->buf + bp->datasize,
-                          bp->bufsize - bp->datasize - 1);
-    else
-        nbytes = recv(sock, bp->buf + bp->datasize,
-                      bp->bufsize - bp->datasize - 1, 0);
-    if (nbytes > 0) {
         log_msg(L_IO_DEBUG, "io_recv: %d bytes data received.\n", nbytes);
+        metrics->bytes_received += nbytes;
+        spend(&recv_budget, nbytes);
         bp->datasize += nbytes;
+        total += nbytes;
+    }
 
-        // Allocate more memory
-        if (full(bp)) {
-            bp->bufsize += bp->bufsize >> 1;
-            bp->buf = realloc(bp->buf, bp->bufsize);
-        }
+    if (nbytes < 0 && would_block(ssl_context, nbytes)) {
+        clear_read_fd(sock);
+        if (total > 0)
+            return total;
+        errno = EAGAIN;
+        return -1;
     }
 
+    /* Data received before the connection is closed will be processed first */
+    if (total > 0)
+        return total;
+
     if (nbytes < 0)
         log_error("io_recv error");
 
     return nbytes;
 }
 
-/** @brief Send data to socket sock
+/** @brief Append data to a buffer, growing it as necessary
+ *
+ *  Used when the input of a client doesn't come from its socket, but from
+ *  another layer (an HTTP/2 connection for example).
+ */
+void io_append(buf_t *bp, char *data, int len) {
+    while (bp->datasize + len + (BUFSIZE >> 1) > bp->bufsize)
+        grow(bp);
+    memcpy(bp->buf + bp->datasize, data, len);
+    bp->datasize += len;
+}
+
+/** @brief Create an empty output chain */
+out_chain_t* init_chain() {
+    out_chain_t *chain = pool_get(&chain_pool);
+
+    chain->head = chain->tail = NULL;
+    chain->pos = 0;
+    chain->retry_len = 0;
+    chain->count = 0;
+    return chain;
+}
+
+/** @brief Remove the first segment from a chain and release its data */
+static void chain_drop(out_chain_t *chain) {
+    out_seg_t *seg = chain->head;
+
+    chain->head = seg->next;
+    if (chain->head == NULL)
+        chain->tail = NULL;
+    chain->pos = 0;
+    --chain->count;
+
+    if (seg->cap > 0)
+        free_block(seg->data, seg->cap);
+    if (seg->release)
+        seg->release(seg->arg);
+    if (seg->file)
+        deinit_pipe(seg->file);
+    pool_put(&seg_pool, seg);
+}
+
+/** @brief Destroy a chain, data not sent yet is dropped */
+void deinit_chain(out_chain_t *chain) {
+    while (chain->head)
+        chain_drop(chain);
+    pool_put(&chain_pool, chain);
+}
+
+/** @brief Append a segment to a chain
+ *
+ *  @param cap Bytes allocated to data if the chain owns it. 0 otherwise.
+ */
+static out_seg_t* chain_append(out_chain_t *chain, char *data, int len,
+                               int cap) {
+    out_seg_t *seg = pool_get(&seg_pool);
+
+    seg->data = data;
+    seg->len = len;
+    seg->cap = cap;
+    seg->release = NULL;
+    seg->arg = NULL;
+    seg->file = NULL;
+    seg->next = NULL;
+    ++chain->count;
+
+    if (chain->tail)
+        chain->tail->next = seg;
+    else
+        chain->head = seg;
+    chain->tail = seg;
+    return seg;
+}
+
+/** @brief Free room in the last segment owned by the chain */
+static int chain_room(out_chain_t *chain) {
+    if (chain->tail == NULL || chain->tail->cap == 0 || chain->tail->file)
+        return 0;
+    return chain->tail->cap - chain->tail->len;
+}
+
+/** @brief Queue data without copying it
+ *
+ *  @param release Called with arg once the data has been sent or dropped,
+ *                 NULL if the data never goes away
+ */
+void chain_ref(out_chain_t *chain, char *data, int len,
+               void (*release)(void *), void *arg) {
+    out_seg_t *seg;
+
+    if (len <= 0) {
+        if (release)
+            release(arg);
+        return;
+    }
+    seg = chain_append(chain, data, len, 0);
+    seg->release = release;
+    seg->arg = arg;
+}
+
+/** @brief Queue a copy of data
+ *
+ *  Small pieces are packed together into segments of at least BUFSIZE bytes.
+ */
+void chain_copy(out_chain_t *chain, char *data, int len) {
+    int cap;
+
+    if (len <= 0)
+        return;
+    if (chain_room(chain) < len) {
+        cap = slab_size(len);
+        chain_append(chain, alloc_block(cap), 0, cap);
+    }
+    memcpy(chain->tail->data + chain->tail->len, data, len);
+    chain->tail->len += len;
+}
+
+/** @brief Queue the content of a file
+ *
+ *  The chain takes the ownership of the pipe, which is destroyed after the
+ *  file is sent or dropped. Data queued later goes out after the file.
+ */
+void chain_file(out_chain_t *chain, pipe_t *pp) {
+    chain_append(chain, NULL, 0, 0)->file = pp;
+}
+
+/** @brief Queue formatted data, which is printed directly into the chain
+ *
+ *  @return The formatted data
+ */
+char* chain_printf(out_chain_t *chain, char *format, ...) {
+    va_list arguments;
+    char *dst;
+    int room, n;
+
+    room = chain_room(chain);
+    dst = room > 0 ? chain->tail->data + chain->tail->len : NULL;
+    va_start(arguments, format);
+    n = vsnprintf(dst, room, format, arguments);
+    va_end(arguments);
+    if (n <= 0)
+        return "";
+
+    // Not enough room, print again into a new segment
+    if (n >= room) {
+        room = slab_size(n + 1);
+        chain_append(chain, alloc_block(room), 0, room);
+        dst = chain->tail->data;
+        va_start(arguments, format);
+        vsnprintf(dst, room, format, arguments);
+        va_end(arguments);
+    }
+
+    chain->tail->len += n;
+    return dst;
+}
+
+/** @brief Whether the chain has data to be sent */
+int chain_pending(out_chain_t *chain) {
+    return chain->head != NULL;
+}
+
+/** @brief Whether the head of a chain is a file being read ahead
+ *
+ *  Nothing can be sent before the read is done.
+ */
+int chain_loading(out_chain_t *chain) {
+    return chain->head != NULL && chain->head->file != NULL &&
+           chain->head->file->reading != NULL;
+}
+
+/** @brief Mark n bytes at the head of a chain as sent */
+static void chain_consume(out_chain_t *chain, int n) {
+    int left;
+
+    while (n > 0) {
+        left = chain->head->len - chain->pos;
+        if (n < left) {
+            chain->pos += n;
+            return;
+        }
+        n -= left;
+        chain_drop(chain);
+    }
+}
+
+/** @brief Take data from the head of a chain instead of sending it
+ *
+ *  Files in the chain are read through their pipes.
  *
- *  Call send()/SSL_write() to send data in buffer to socket sock
+ *  @return Number of bytes copied to dst, 0 if the chain is empty. -1 if a
+ *          file can't be read.
+ */
+int chain_pull(out_chain_t *chain, char *dst, int max) {
+    int total = 0, n;
+
+    while (chain->head && total < max) {
+        if (chain->head->file) {
+            if ((n = io_pipe_read(chain->head->file, dst + total,
+                                  max - total)) == -1)
+                return total > 0 ? total : -1;
+            if (n == 0)
+                chain_drop(chain);
+            total += n;
+            continue;
+        }
+
+        n = chain->head->len - chain->pos;
+        if (n > max - total)
+            n = max - total;
+        memcpy(dst + total, chain->head->data + chain->pos, n);
+        total += n;
+        chain_consume(chain, n);
+    }
+    return total;
+}
+
+/** @brief Build an iovec array from the head of a chain, up to a file */
+static int chain_iov(out_chain_t *chain, struct iovec *iov) {
+    out_seg_t *seg;
+    int cnt = 0;
+
+    for (seg = chain->head; seg != NULL && seg->file == NULL && cnt < MAX_IOV;
+         seg = seg->next) {
+        iov[cnt].iov_base = seg->data + (cnt == 0 ? chain->pos : 0);
+        iov[cnt].iov_len = seg->len - (cnt == 0 ? chain->pos : 0);
+        ++cnt;
+    }
+    return cnt;
+}
+
+/** @brief SSL_write() data at the head of a chain
+ *
+ *  SSL can't write a vector. Segments smaller than a TLS record are gathered
+ *  so that they go out in a single record. A write that would block must be
+ *  retried with the same length, which is remembered in retry_len.
+ */
+static int chain_ssl_write(out_chain_t *chain, SSL *ssl_context) {
+    static char gather[SSL_GATHER_SIZE];
+    out_seg_t *seg;
+    int len, want, start, n, ret;
+
+    want = chain->retry_len;
+    len = chain->head->len - chain->pos;
+
+    seg = chain->head->next;
+    if (len >= SSL_GATHER_SIZE || seg == NULL || seg->file ||
+        (want > 0 && want <= len)) {
+        if (want > 0)
+            len = want;
+        ret = SSL_write(ssl_context, chain->head->data + chain->pos, len);
+    } else {
+        if (want == 0)
+            want = SSL_GATHER_SIZE;
+        len = 0;
+        for (seg = chain->head; seg != NULL && seg->file == NULL && len < want;
+             seg = seg->next) {
+            start = seg == chain->head ? chain->pos : 0;
+            n = seg->len - start;
+            if (n > want - len)
+                n = want - len;
+            memcpy(gather + len, seg->data + start, n);
+            len += n;
+        }
+        ret = SSL_write(ssl_context, gather, len);
+    }
+
+    chain->retry_len = ret <= 0 ? len : 0;
+    return ret;
+}
+
+/** @brief Send data queued in a chain to socket sock
+ *
+ *  Plain sockets send up to MAX_IOV segments in one writev(). Data is sent
+ *  until the chain is empty, the socket would block or the budget is spent.
+ *  When the socket would block, it's cleared from writable fds.
+ *
+ *  Files in the chain are sent by io_pipe(), then the chain moves on.
  *
  *  @param sock Client socket
- *  @param bp A pointer to a buf_t struct which store data to be sent
+ *  @param chain Data to be sent
  *  @param ssl_context If ssl_context if not NULL, SSL_write() will be used
- *                     instead of send().
- *  @return Number of bytes sent, -1 on error
+ *                     instead of writev().
+ *  @return Number of bytes sent from memory, -1 on error
  */
-int io_send(int sock, buf_t *bp, SSL* ssl_context) {
-    int nbytes;
+int io_send(int sock, out_chain_t *chain, SSL* ssl_context) {
+    struct iovec iov[MAX_IOV];
+    int nbytes, total = 0;
+
+    while (chain->head && send_budget != 0) {
+        if (chain->head->file) {
+            // The pipe buffer is refilled on each call until sock blocks
+            while ((nbytes = io_pipe(sock, chain->head->file,
+                                     ssl_context)) == 0 &&
+                   test_write_fd(sock) && send_budget != 0 &&
+                   !chain_loading(chain));
+            if (nbytes == -1)
+                return -1;
+            if (nbytes == 0)
+                break;
+            chain_drop(chain);
+            continue;
+        }
 
-    if (bp->pos < bp->datasize) {
         if (ssl_context)
-            nbytes = SSL_write(ssl_context, bp->buf + bp->pos, bp->datasize - bp->pos);
+            nbytes = chain_ssl_write(chain, ssl_context);
         else
-            nbytes = send(sock, bp->buf + bp->pos, bp->datasize - bp->pos, 0);
+            nbytes = writev(sock, iov, chain_iov(chain, iov));
 
         if (nbytes <= 0) {
+            if (nbytes < 0 && would_block(ssl_context, nbytes)) {
+                clear_write_fd(sock);
+                break;
+            }
             log_error("io_send error");
             return -1;
         }
 
         log_msg(L_IO_DEBUG, "io_send: %d bytes sent.\n", nbytes);
-        bp->pos += nbytes;
+        sent(nbytes);
+        chain_consume(chain, nbytes);
+        total += nbytes;
     }
 
-    //Shrink buffer when there is too much free space in the buffer
-    if (empty(bp))
-        io_shrink(bp);
+    return total;
+}
 
-    return nbytes;
+/** @brief Stop piping from the fd of a pipe */
+static void close_pipe(pipe_t *pp) {
+    remove_read_fd(pp->from_fd);
+    set_fd_data(pp->from_fd, NULL);
+    // A thread still reading the file closes it when it's done
+    if (pp->reading) {
+        pp->reading->pipe = NULL;
+        pp->reading = NULL;
+    } else
+        close(pp->from_fd);
+    pp->from_fd = -1;
+    if (pp->map) {
+        release_file_map(pp->map);
+        pp->map = NULL;
+    }
+}
+
+/** @brief Whether file content can be sent without copying to user space
+ *
+ *  Plain sockets use sendfile(). SSL connections can only do so when the
+ *  kernel handles TLS encryption (kTLS).
+ */
+static int can_sendfile(SSL *ssl_context) {
+#ifdef __linux__
+    if (ssl_context == NULL)
+        return 1;
+#ifdef SSL_OP_ENABLE_KTLS
+    return BIO_get_ktls_send(SSL_get_wbio(ssl_context));
+#endif
+#endif
+    return 0;
+}
+
+/** @brief Whether bytes [offset, end) of the file of a pipe are in memory
+ *
+ *  Only a mapped file can tell, by mincore().
+ */
+static int resident(pipe_t *pp, off_t offset, off_t end) {
+    static long page = 0;
+    unsigned char vec[AIO_WINDOW / 4096 + 2];
+    off_t start;
+    long i, pages;
+
+    if (pp->map == NULL)
+        return 0;
+    if (page == 0)
+        page = sysconf(_SC_PAGESIZE);
+
+    start = offset & ~(off_t)(page - 1);
+    pages = (end - start + page - 1) / page;
+    if (pages > (long)sizeof(vec) ||
+        mincore(pp->map->addr + start, end - start, vec) == -1)
+        return 0;
+    for (i = 0; i < pages; ++i)
+        if (!(vec[i] & 1))
+            return 0;
+    return 1;
+}
+
+static void read_work(void *arg) {
+    file_read_t *r = arg;
+
+    aio_fetch(r->fd, r->offset, r->end);
+}
+
+/** @brief A window has been read, the pipe can go on with it
+ *
+ *  A short read isn't tried again, sending runs into the same error.
+ */
+static void read_done(void *arg) {
+    file_read_t *r = arg;
+
+    if (r->pipe) {
+        r->pipe->reading = NULL;
+        r->pipe->ready_end = r->end;
+        aio_wake(r->pipe->owner);
+    } else
+        close(r->fd);
+    free(r);
+}
+
+/** @brief Bytes of a file pipe which can be sent now
+ *
+ *  Data in memory, but no further than the end of the content to be sent.
+ */
+static off_t file_ready_bytes(pipe_t *pp) {
+    return (pp->ready_end < pp->file_end ? pp->ready_end : pp->file_end) -
+           pp->file_offset;
+}
+
+/** @brief Make sure file data of a pipe is in memory before it's sent
+ *
+ *  Data is sent window by window (AIO_WINDOW). A window found in the page
+ *  cache is sent right away, otherwise it's read by an I/O thread first.
+ *  Without threads, data is read when it's sent, as it comes.
+ *
+ *  @return 1 if data at file_offset can be sent. 0 if it's being read.
+ */
+static int file_ready(pipe_t *pp) {
+    file_read_t *r;
+    off_t end;
+
+    if (pp->reading)
+        return 0;
+    if (pp->file_offset < pp->ready_end || pp->file_offset >= pp->file_end)
+        return 1;
+
+    end = pp->file_end - pp->file_offset > AIO_WINDOW ?
+          pp->file_offset + AIO_WINDOW : pp->file_end;
+    if (resident(pp, pp->file_offset, end)) {
+        pp->ready_end = end;
+        return 1;
+    }
+
+    r = malloc(sizeof(file_read_t));
+    init_job(&r->job, read_work, read_done, r);
+    r->pipe = pp;
+    r->fd = pp->from_fd;
+    r->offset = pp->file_offset;
+    r->end = end;
+    if (aio_submit(&r->job) == -1) {
+        free(r);
+        pp->ready_end = pp->file_end;
+        return 1;
+    }
+    pp->reading = r;
+    return 0;
+}
+
+/** @brief Send file content in a pipe by sendfile()/SSL_sendfile()
+ *
+ *  pp->file_offset is advanced by bytes sent, so the next call resumes where
+ *  this one stops.
+ *
+ *  @return 1 piping complete. 0 to be continued. -1 error.
+ */
+static int io_sendfile(int sock, pipe_t *pp, SSL *ssl_context) {
+#ifdef __linux__
+    ssize_t n;
+    size_t count;
+
+    while (pp->file_offset < pp->file_end) {
+        if (send_budget == 0 || !file_ready(pp))
+            return 0;
+        count = allowance(send_budget, file_ready_bytes(pp));
+#ifdef SSL_OP_ENABLE_KTLS
+        if (ssl_context) {
+            n = SSL_sendfile(ssl_context, pp->from_fd, pp->file_offset, count, 0);
+            if (n > 0)
+                pp->file_offset += n;
+        } else
+#endif
+            n = sendfile(sock, pp->from_fd, &pp->file_offset, count);
+
+        if (n <= 0) {
+            if (n < 0 && would_block(ssl_context, n)) {
+                clear_write_fd(sock);
+                return 0;
+            }
+            // A file truncated after opening also ends up here
+            close_pipe(pp);
+            log_error("io_sendfile error");
+            return -1;
+        }
+        log_msg(L_IO_DEBUG, "io_sendfile: %d bytes sent.\n", (int)n);
+        sent(n);
+    }
+#endif
+
+    close_pipe(pp);
+    return 1;
+}
+
+/** @brief Send file content in a pipe from its memory mapping
+ *
+ *  Sending goes on until all content is sent or the socket would block, so a
+ *  large file needs much less calls than going through the pipe buffer.
+ *
+ *  @return 1 piping complete. 0 to be continued. -1 error.
+ */
+static int io_pipe_map(int sock, pipe_t *pp, SSL *ssl_context) {
+    off_t count;
+    int n;
+
+    while (pp->file_offset < pp->file_end) {
+        if (send_budget == 0 || !file_ready(pp))
+            return 0;
+        count = file_ready_bytes(pp);
+        if (count > MAP_CHUNK)
+            count = MAP_CHUNK;
+        if (!map_readable(pp->map, pp->from_fd, pp->file_offset + count)) {
+            close_pipe(pp);
+            log_msg(L_ERROR, "io_pipe_map: file truncated.\n");
+            return -1;
+        }
+
+        if (ssl_context)
+            n = SSL_write(ssl_context, pp->map->addr + pp->file_offset, count);
+        else
+            n = send(sock, pp->map->addr + pp->file_offset, count, 0);
+
+        if (n <= 0) {
+            if (n < 0 && would_block(ssl_context, n)) {
+                clear_write_fd(sock);
+                return 0;
+            }
+            close_pipe(pp);
+            log_error("io_pipe_map send error");
+            return -1;
+        }
+        log_msg(L_IO_DEBUG, "io_pipe_map: %d bytes sent.\n", n);
+        sent(n);
+        pp->file_offset += n;
+        if (pp->map->broken) {
+            // Zeros have gone out in place of the lost tail
+            close_pipe(pp);
+            log_msg(L_ERROR, "io_pipe_map: file truncated.\n");
+            return -1;
+        }
+    }
+
+    close_pipe(pp);
+    return 1;
+}
+
+/** @brief Fill the buffer of a pipe with encoded data from its fd
+ *
+ *  @return Number of bytes in the buffer. 0 after the end of the response
+ *          has been returned. -1 on error or would block.
+ */
+static int pipe_encode(pipe_t *pp) {
+    char raw[BUFSIZE];
+    int n;
+
+    if (pp->enc.state == CE_DONE)
+        return 0;
+
+    // Part of a header line may be held by the encoder, giving nothing yet
+    while ((n = read(pp->from_fd, raw, BUFSIZE)) > 0)
+        if ((n = chunk_encode(&pp->enc, raw, n, pp->buf)) > 0)
+            return n;
+
+    if (n == 0)
+        return chunk_encode_end(&pp->enc, pp->buf);
+    return n;
+}
+
+/** @brief Fill the buffer of a pipe with data from its fd
+ *
+ *  @return Number of bytes read. 0 on EOF. -1 on error or would block.
+ */
+static int pipe_fill(pipe_t *pp) {
+    off_t count;
+    int n;
+
+    if (!pp->is_file && pp->encode)
+        return pipe_encode(pp);
+    if (!pp->is_file)
+        return read(pp->from_fd, pp->buf, BUFSIZE);
+
+    if (pp->file_offset >= pp->file_end)
+        return 0;
+    count = file_ready_bytes(pp);
+    if (count > BUFSIZE)
+        count = BUFSIZE;
+    if ((n = pread(pp->from_fd, pp->buf, count, pp->file_offset)) == 0) {
+        // Truncated, the promised length can't be delivered
+        errno = EIO;
+        return -1;
+    }
+    if (n > 0)
+        pp->file_offset += n;
+    return n;
 }
 
 /** @brief Pipe content directly to client socket without reading it extirely
@@ -136,6 +932,11 @@ int io_send(int sock, buf_t *bp, SSL* ssl_context) {
  *
  *  If buf in pipe is not empty, send data in buf to socket sock. After the buf
  *  becomes empty, refill it using data read from fd associated with the pipe.
+ *  If reading or sending would block, the corresponding fd is cleared from
+ *  ready fds.
+ *
+ *  Regular files skip the buffer and are sent by sendfile() when possible,
+ *  or from their memory mapping.
  *
  *  @param sock Client socket
  *  @param pp The pointer to a pipe to the file client requested or a cgi
@@ -147,19 +948,34 @@ int io_send(int sock, buf_t *bp, SSL* ssl_context) {
 int io_pipe(int sock, pipe_t *pp, SSL *ssl_context) {
     int n;
 
+    if (send_budget == 0)
+        return 0;
+
+    if (pp->is_file && pp->datasize <= pp->offset) {
+        if (!file_ready(pp))
+            return 0;
+        if (can_sendfile(ssl_context))
+            return io_sendfile(sock, pp, ssl_context);
+        if (pp->map)
+            return io_pipe_map(sock, pp, ssl_context);
+    }
+
     if (pp->datasize <= pp->offset) { // No data in buf
-        pp->datasize = read(pp->from_fd, pp->buf, BUFSIZE); // Get new data
-        if (pp->datasize == -1) {
-            close(pp->from_fd);
-            remove_read_fd(pp->from_fd);
+        n = pipe_fill(pp); // Get new data
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                clear_read_fd(pp->from_fd);
+                return 0;
+            }
+            close_pipe(pp);
             log_error("io_pipe read error");
             return -1;
         }
-        if (pp->datasize == 0) { // Got EOF. Piping completed
-            close(pp->from_fd);
-            remove_read_fd(pp->from_fd);
+        if (n == 0) { // Got EOF. Piping completed
+            close_pipe(pp);
             return 1;
         }
+        pp->datasize = n;
         pp->offset = 0;
     }
 
@@ -170,41 +986,123 @@ int io_pipe(int sock, pipe_t *pp, SSL *ssl_context) {
     else
         n = send(sock, pp->buf + pp->offset, pp->datasize - pp->offset, 0);
 
-    if (n == -1) {
-        close(pp->from_fd);
-        remove_read_fd(pp->from_fd);
+    if (n <= 0) {
+        if (n < 0 && would_block(ssl_context, n)) {
+            clear_write_fd(sock);
+            return 0;
+        }
+        close_pipe(pp);
         log_error("io_pipe send error");
         return -1;
     }
     log_msg(L_IO_DEBUG, "io_pipe: %d bytes sent.\n", n);
+    sent(n);
     pp->offset += n;
 
     return 0;
 }
 
+/** @brief Read data from a pipe instead of sending it to a socket
+ *
+ *  Used when output goes through another layer of framing (HTTP/2) before
+ *  it's sent. Data from a cgi script is read raw, pp->encode must be 0.
+ *
+ *  @param pp The pipe
+ *  @param dst Where data is copied to
+ *  @param max Maximum bytes to copy
+ *  @return Number of bytes copied. 0 when all data has been read, the pipe is
+ *          closed then. -1 on error or would block.
+ */
+int io_pipe_read(pipe_t *pp, char *dst, int max) {
+    off_t count;
+    int n;
+
+    if (pp->from_fd == -1)
+        return 0;
+
+    if (pp->is_file) {
+        if (pp->file_offset >= pp->file_end) {
+            close_pipe(pp);
+            return 0;
+        }
+        if (!file_ready(pp)) {
+            errno = EAGAIN;
+            return -1;
+        }
+        count = file_ready_bytes(pp);
+        n = count > max ? max : count;
+        if (pp->map) {
+            if (!map_readable(pp->map, pp->from_fd, pp->file_offset + n)) {
+                errno = EIO;
+                return -1;
+            }
+            memcpy(dst, pp->map->addr + pp->file_offset, n);
+            if (pp->map->broken) {
+                errno = EIO;
+                return -1;
+            }
+        } else if ((n = pread(pp->from_fd, dst, n, pp->file_offset)) == 0) {
+            // Truncated, the promised length can't be delivered
+            errno = EIO;
+            n = -1;
+        }
+        if (n > 0)
+            pp->file_offset += n;
+        return n;
+    }
+
+    if ((n = read(pp->from_fd, dst, max)) == 0)
+        close_pipe(pp);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        clear_read_fd(pp->from_fd);
+    return n;
+}
+
 /** @brief Init a pipe_t struct
  *
  *  @return A pointer to the newly created pipe_t struct
  */
 pipe_t* init_pipe() {
-    pipe_t *pp = malloc(sizeof(pipe_t));
+    pipe_t *pp = pool_get(&pipe_pool);
 
+    pp->from_fd = -1;
     pp->offset = 0;
     pp->datasize = 0;
+    pp->is_file = 0;
+    pp->file_offset = 0;
+    pp->file_end = 0;
+    pp->map = NULL;
+    pp->ready_end = 0;
+    pp->reading = NULL;
+    pp->owner = NULL;
+    pp->encode = 0;
     return pp;
 }
 
+/** @brief Destroy a pipe_t struct. Close its fd if piping is not completed
+ *
+ *  @param pp A pipe_t struct
+ *  @return Void
+ */
+void deinit_pipe(pipe_t *pp) {
+    if (pp->from_fd != -1)
+        close_pipe(pp);
+    pool_put(&pipe_pool, pp);
+}
+
 /** @brief Init a buf_t struct
  *
  *  @return A pointer to the newly created buf_t struct
  */
 buf_t* init_buf() {
-    buf_t *bp = malloc(sizeof(buf_t));
+    buf_t *bp = pool_get(&buf_pool);
 
     bp->bufsize = BUFSIZE;
     bp->datasize = 0;
     bp->pos = 0;
-    bp->buf = malloc(bp->bufsize);
+    bp->scan = 0;
+    bp->limit = 0;
+    bp->buf = alloc_block(bp->bufsize);
 
     return bp;
 }
@@ -215,52 +1113,6 @@ buf_t* init_buf() {
  *  @return Void
  */
 void deinit_buf(buf_t *bp) {
-    free(bp->buf);
-    free(bp);
-}
-
-void init_select_context() {
-    FD_ZERO(&context.read_fds);
-    FD_ZERO(&context.read_fds_cpy);
-    FD_ZERO(&context.write_fds);
-    FD_ZERO(&context.write_fds_cpy);
-}
-
-void add_read_fd(int fd) {
-    FD_SET(fd, &context.read_fds_cpy);
-    if (fd > context.fd_max)
-        context.fd_max = fd;
-}
-
-void remove_read_fd(int fd) {
-    FD_CLR(fd, &context.read_fds_cpy);
-}
-
-int test_read_fd(int fd) {
-    return FD_ISSET(fd, &context.read_fds);
-}
-
-void add_write_fd(int fd) {
-    FD_SET(fd, &context.write_fds_cpy);
-    if (fd > context.fd_max)
-        context.fd_max = fd;
-}
-
-void remove_write_fd(int fd) {
-    FD_CLR(fd, &context.write_fds_cpy);
-}
-
-int test_write_fd(int fd) {
-    return FD_ISSET(fd, &context.write_fds);
-}
-
-/** @brief Wrapper for select()
- *
- *  @return What select() returns
- */
-int io_select() {
-    context.read_fds = context.read_fds_cpy;
-    context.write_fds = context.write_fds_cpy;
-    return select(context.fd_max + 1, &context.read_fds, &context.write_fds,
-        NULL, NULL);
+    free_block(bp->buf, bp->bufsize);
+    pool_put(&buf_pool, bp);
 }
@@ -7,19 +7,43 @@
 #define __MYIO_H__
 
 #include <unistd.h>
+#include <sys/types.h>
 #include <openssl/ssl.h>
+#include "event.h"
+#include "file_map.h"
+#include "chunked.h"
 
 /*
- * Initial buffer size
+ * Initial buffer size, also the smallest slab
  */
 #define BUFSIZE 1024
 
-/** @brief Context for using select */
-typedef struct {
-    fd_set read_fds, read_fds_cpy;
-    fd_set write_fds, write_fds_cpy;
-    int fd_max;
-} select_context;
+/*
+ * Buffers are slabs of BUFSIZE << n bytes for n < SLAB_CLASSES, shared by all
+ * connections. Larger ones come from malloc() directly.
+ */
+#define SLAB_CLASSES 7
+
+/*
+ * Bytes of free slabs of each class kept for reuse
+ */
+#define SLAB_POOL_BYTES (4 << 20)
+
+/*
+ * Maximum bytes passed to one send()/SSL_write() when sending from a memory
+ * mapped file
+ */
+#define MAP_CHUNK (256 << 10)
+
+/*
+ * Maximum number of segments sent by one writev()
+ */
+#define MAX_IOV 64
+
+/*
+ * Segments smaller than this are gathered into one TLS record
+ */
+#define SSL_GATHER_SIZE (16 << 10)
 
 /** @brief A dynamic size buffer */
 typedef struct {
@@ -32,43 +56,111 @@ typedef struct {
      * been sent
      */
     int pos;
+    int scan;           //<!where the user's search for a delimiter resumes
+    int limit;          //<!stop receiving at this many unprocessed bytes, 0 if
+                        //<!unlimited
 } buf_t;
 
+struct pipe;
+struct file_read;
+struct http_client;
+
+/** @brief A piece of output data
+ *
+ *  Data queued by reference stays where it is until it's sent. If release is
+ *  not NULL, it's called with arg once the data is no longer needed.
+ *
+ *  A segment may instead stand for a file, which is sent through a pipe when
+ *  it reaches the head of the chain.
+ */
+typedef struct out_seg {
+    char *data;
+    int len;
+    int cap;            //<!bytes allocated if data is owned by the chain, or 0
+    void (*release)(void *arg);
+    void *arg;
+    struct pipe *file;  //<!pipe of a file to be sent instead of data, or NULL
+    struct out_seg *next;
+} out_seg_t;
+
+/** @brief Output waiting to be sent, as a chain of segments
+ *
+ *  A response is queued as a few segments (headers, body...) which are sent
+ *  together by writev(), instead of being copied into one buffer first.
+ *
+ *  Responses to pipelined requests queue up one after another in the same
+ *  chain, so they go out in order.
+ */
+typedef struct {
+    out_seg_t *head, *tail;
+    int pos;            //<!bytes of head already sent
+    int retry_len;      //<!length of last SSL_write() which would block
+    int count;          //<!number of segments queued
+} out_chain_t;
+
 /** @brief A struct for piping content from specific fd
  *
  *  Data in from_fd will be first read into buf, and directly sent out. This
  *  process will be repeated until an error occurs or an EOF is read.
+ *
+ *  If from_fd is a regular file, bytes in [file_offset, file_end) are sent.
+ *  When possible, they are sent by sendfile() without passing through buf.
+ *  Otherwise, if the file is mapped into memory, they are sent from map.
+ *
+ *  File data is only sent once it's in memory, up to ready_end. Data beyond
+ *  is read ahead by an I/O thread first, and owner is woken up when it's
+ *  done (see file_ready() in io.c).
+ *
+ *  If encode is set, data from from_fd is a response which goes through enc,
+ *  which adds chunked framing if the response doesn't have its own.
  */
-typedef struct {
+typedef struct pipe {
     int from_fd;
-    char buf[BUFSIZE];
+    char buf[BUFSIZE + CHUNK_OVERHEAD];
     int offset;
     int datasize;
+    int is_file;        //<!from_fd is a regular file
+    off_t file_offset;  //<!next byte in the file to be sent
+    off_t file_end;     //<!end of the file content to be sent
+    file_map_t *map;    //<!mapping of the file, NULL if not mapped
+    off_t ready_end;    //<!file data before it is in memory
+    struct file_read *reading;  //<!read ahead in progress, or NULL
+    struct http_client *owner;  //<!client sending the file
+    int encode;         //<!pass data from from_fd through enc
+    chunk_encoder_t enc;
 } pipe_t;
 
 /* Init and deinit data structure */
 buf_t* init_buf();
 void deinit_buf(buf_t *bp);
 pipe_t* init_pipe();
+void deinit_pipe(pipe_t *pp);
+out_chain_t* init_chain();
+void deinit_chain(out_chain_t *chain);
+
+/* Queue output */
+void chain_ref(out_chain_t *chain, char *data, int len,
+               void (*release)(void *), void *arg);
+void chain_copy(out_chain_t *chain, char *data, int len);
+void chain_file(out_chain_t *chain, pipe_t *pp);
+char* chain_printf(out_chain_t *chain, char *format, ...);
+int chain_pending(out_chain_t *chain);
+int chain_pull(out_chain_t *chain, char *dst, int max);
+int chain_loading(out_chain_t *chain);
 
 /* Monitor dynamic buffer */
 int full(buf_t *bp);
 int empty(buf_t *bp);
 void io_shrink(buf_t *bp);
+int io_discard(buf_t *bp, int start);
+void io_append(buf_t *bp, char *data, int len);
 
 /* Send/recv with client */
 int io_recv(int sock, buf_t *bp, SSL* ssl_context);
-int io_send(int sock, buf_t *bp, SSL* ssl_context);
+int io_send(int sock, out_chain_t *chain, SSL* ssl_context);
 int io_pipe(int sock, pipe_t *pp, SSL* ssl_context);
-
-/* Select context */
-int io_select();       // Shorthand for select
-void init_select_context();
-void add_read_fd(int fd);
-void remove_read_fd(int fd);
-int test_read_fd(int fd);
-void add_write_fd(int fd);
-void remove_write_fd(int fd);
-int test_write_fd(int fd);
+int io_pipe_read(pipe_t *pp, char *dst, int max);
+void io_budget(long bytes);
+int io_budget_spent();
 
 #endif
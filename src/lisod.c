@@ -10,16 +10,48 @@
 #include <sys/stat.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
 #include "config.h"
 #include "server.h"
 #include "log.h"
+#include "fastcgi.h"
+#include "resolver.h"
+#include "metrics.h"
+#include "upgrade.h"
 
 char* http_version = "HTTP/1.1";
 
+#define DEFAULT_WORKERS 1   //Number of worker processes if not specified
+#define DEFAULT_CACHE_SIZE (16 << 20)   //Bytes of file cache if not specified
+#define DEFAULT_ACCEPT_BATCH 64     //Connections accepted at a time
+
+static char *access_log_name = NULL;    //binary access log, -l
+
+static pid_t *workers;      //pid of each worker process
+static sigset_t worker_mask;    //signal mask of workers, see supervise()
+
 /**
- * SIGHUP indicates that the config file should be reloaded.
+ * SIGHUP indicates that the config file should be reloaded. That's done by
+ * the serving loop, or by the master which passes it on to the workers.
  */
 static void sighup_handler(int sig) {
+	reload = 1;
+}
+
+/**
+ * SIGQUIT asks to stop accepting connections, and exit once those being
+ * served are done.
+ */
+static void sigquit_handler(int sig) {
+	draining = 1;
+}
+
+/**
+ * SIGUSR2 asks to exec the program again, see upgrade.c
+ */
+static void sigusr2_handler(int sig) {
+	upgrade = 1;
 }
 
 /**
@@ -39,12 +71,40 @@ static void sigchld_handler(int sig) {
 	pid_t pid;
 	int status;
 
-	while ((pid = waitpid(-1, &status, WNOHANG|WUNTRACED)) > 0)
+	while ((pid = waitpid(-1, &status, WNOHANG|WUNTRACED)) > 0) {
 		log_msg(L_INFO, "Reap child process %d\n", pid);
+		fcgi_child_exited(pid);
+		resolver_child_exited(pid);
+	}
+}
+
+/** @brief Send a signal to all workers */
+static void signal_workers(int sig) {
+	int i;
+
+	for (i = 0; i < worker_count; ++i)
+		if (workers[i] > 0)
+			kill(workers[i], sig);
+}
+
+/**
+ * SIGTERM received by the master process. Terminate all workers.
+ */
+static void master_sigterm_handler(int sig) {
+	signal_workers(SIGTERM);
+	log_msg(L_INFO, "Server terminated. Bye~");
+	exit(EXIT_SUCCESS);
+}
+
+/**
+ * SIGCHLD received by the master process. It only wakes it up, workers are
+ * reaped in supervise().
+ */
+static void master_sigchld_handler(int sig) {
 }
 
 static void usage() {
-	fprintf(stderr, "Usage: ./lisod <HTTP port> <HTTPS port> <log file> <lock file> <www folder>");
+	fprintf(stderr, "Usage: ./lisod [-w workers] [-c cache bytes] [-f FastCGI workers] [-a accept batch] [-m max connections] [-r rate] [-b burst] [-l access log] [-C config file] <HTTP port> <HTTPS port> <log file> <lock file> <www folder>");
 	fprintf(stderr, "<CGI script path> <private key file> <certificate file>\n");
 	fprintf(stderr, "	HTTP port – the port for the HTTP (or echo) server to listen on\n");
 	fprintf(stderr, "	HTTPS port – the port for the HTTPS server to listen on\n");
@@ -55,12 +115,53 @@ static void usage() {
 	fprintf(stderr, "redirect all /cgi/* URIs. In the real world, this would likely be a directory of executable programs.\n");
 	fprintf(stderr, "	private key file – private key file path\n");
 	fprintf(stderr, "	certificate file – certificate file path\n");
+	fprintf(stderr, "	-w workers – number of worker processes, default %d\n",
+		DEFAULT_WORKERS);
+	fprintf(stderr, "	-c cache bytes – memory for caching static files per worker, ");
+	fprintf(stderr, "0 to disable, default %d\n", DEFAULT_CACHE_SIZE);
+	fprintf(stderr, "	-f FastCGI workers – serve cgi requests with this number of ");
+	fprintf(stderr, "long-lived FastCGI processes instead of forking, default 0\n");
+	fprintf(stderr, "	-a accept batch – connections accepted from a listening ");
+	fprintf(stderr, "socket at a time, default %d\n", DEFAULT_ACCEPT_BATCH);
+	fprintf(stderr, "	-m max connections – connections served by each worker, ");
+	fprintf(stderr, "more are turned away with 503, default from the fd limit\n");
+	fprintf(stderr, "	-r rate – requests per second each client address may ");
+	fprintf(stderr, "make, more are answered with 429, default 0 for no limit\n");
+	fprintf(stderr, "	-b burst – requests a client address may make at once ");
+	fprintf(stderr, "under -r, default a second worth\n");
+	fprintf(stderr, "	-l access log – write a binary record of each request ");
+	fprintf(stderr, "to this file, see access_record_t in log.h\n");
+	fprintf(stderr, "	-C config file – settings read at start and again on ");
+	fprintf(stderr, "SIGHUP, overriding the arguments, see config.c\n");
+	fprintf(stderr, "Signals: SIGHUP reloads config and certificate, SIGQUIT ");
+	fprintf(stderr, "drains connections and exits, SIGUSR2 execs the binary ");
+	fprintf(stderr, "again without dropping connections, SIGTERM exits now\n");
 }
 
 /** @brief Set up log system */
 static void config_log() {
 	log_mask = L_ERROR | L_HTTP_DEBUG | L_INFO;
 	set_log_file(log_file_name);
+	if (access_log_name != NULL)
+		set_access_log(access_log_name);
+}
+
+/** @brief Set up signal handling and logs of the daemon process
+ *
+ *  An upgraded program only does this, as it's a daemon already.
+ */
+static void init_process() {
+	// Signal handling
+	signal(SIGHUP, sighup_handler);
+	signal(SIGTERM, sigterm_handler);
+	signal(SIGCHLD, sigchld_handler);
+	signal(SIGQUIT, sigquit_handler);
+	signal(SIGUSR2, sigusr2_handler);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (upgraded())
+		log_append = 1;
+	config_log();
 }
 
 /** @brief daemonize the server */
@@ -110,24 +211,215 @@ static void daemonize(char* lock_file) {
     	exit(EXIT_FAILURE);
     }*/
 
-    // Signal handling
-    signal(SIGHUP, sighup_handler);
-   	signal(SIGTERM, sigterm_handler);
-   	signal(SIGCHLD, sigchld_handler);
-	signal(SIGPIPE, SIG_IGN);
-
-	config_log();
+	init_process();
 
     log_msg(L_INFO, "Successfully daemonized lisod process, pid %d.\n",
     	getpid());
 }
 
+/** @brief Fork a worker process which runs the serving loop
+ *
+ *  @param slot Index of the worker, whose metrics slot it takes
+ *  @return pid of the worker. -1 on error
+ */
+static pid_t spawn_worker(int slot) {
+	pid_t pid;
+
+	if ((pid = fork()) < 0) {
+		log_error("spawn_worker fork error");
+		return -1;
+	}
+
+	if (pid == 0) {
+		// Workers reap their own cgi processes
+		signal(SIGTERM, sigterm_handler);
+		signal(SIGCHLD, sigchld_handler);
+		// Upgrades are done by the master
+		signal(SIGUSR2, SIG_IGN);
+		sigprocmask(SIG_SETMASK, &worker_mask, NULL);
+
+		metrics_attach(slot);
+		serve(slot);
+		// serve() only returns when the server can not be setup
+		exit(EXIT_FAILURE);
+	}
+
+	log_msg(L_INFO, "Start worker process %d\n", pid);
+	return pid;
+}
+
+/** @brief Reload config, and have the workers do the same
+ *
+ *  Workers spawned later start with the config of the master.
+ */
+static void reload_workers() {
+	if (reload_config(NULL) == -1) {
+		log_msg(L_ERROR, "Reload failed, config not changed\n");
+		return;
+	}
+	log_msg(L_INFO, "Config reloaded, reload workers\n");
+	signal_workers(SIGHUP);
+}
+
+/** @brief Note that a process has exited, restart it if it's a worker
+ *
+ *  @param quitting Whether workers are exiting on SIGQUIT
+ *  @return 1 if a worker is gone. 0 otherwise.
+ */
+static int worker_exited(pid_t pid, int status, int quitting) {
+	int i;
+
+	// Not a worker, e.g. one of the old program after an upgrade
+	for (i = 0; i < worker_count && workers[i] != pid; ++i);
+	if (i == worker_count) {
+		log_msg(L_INFO, "Reap process %d\n", pid);
+		return 0;
+	}
+
+	if (quitting) {
+		workers[i] = -1;
+		return 1;
+	}
+
+	// A worker failed to setup the server. Retrying won't help.
+	if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_FAILURE) {
+		log_msg(L_ERROR, "Worker %d failed to start\n", pid);
+		workers[i] = -1;
+		return 1;
+	}
+
+	log_msg(L_ERROR, "Worker %d died, restarting\n", pid);
+	return (workers[i] = spawn_worker(i)) <= 0;
+}
+
+/** @brief Start workers and restart them when they crash
+ *
+ *  Each worker takes its own listening sockets bound with SO_REUSEPORT
+ *  (see open_listeners()) and runs an independent serving loop, so no state
+ *  is shared between workers. The master process does nothing but
+ *  supervising, and passing reloads and graceful stops on to the workers.
+ *
+ *  Signals are blocked but in sigsuspend(), so none arrives between checking
+ *  what the handlers have asked for and waiting.
+ */
+static void supervise() {
+	int i, status, alive, quitting = 0;
+	sigset_t mask;
+	pid_t pid;
+
+	workers = calloc(worker_count, sizeof(pid_t));
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGQUIT);
+	sigaddset(&mask, SIGUSR2);
+	sigprocmask(SIG_BLOCK, &mask, &worker_mask);
+
+	// The master waits for workers itself
+	signal(SIGCHLD, master_sigchld_handler);
+	signal(SIGTERM, master_sigterm_handler);
+
+	/*
+	 * Workers of the old program stop accepting. Connections wait on the
+	 * listening sockets for the new workers meanwhile.
+	 */
+	retire_old();
+
+	alive = 0;
+	for (i = 0; i < worker_count; ++i)
+		if ((workers[i] = spawn_worker(i)) > 0)
+			++alive;
+
+	while (alive > 0) {
+		log_flush();
+
+		if (reload) {
+			reload = 0;
+			reload_workers();
+		}
+		// Workers go on serving, and are retired by the new program
+		if (upgrade) {
+			upgrade = 0;
+			if (!quitting)
+				exec_upgrade(workers, worker_count);
+		}
+		if (draining && !quitting) {
+			quitting = 1;
+			log_msg(L_INFO, "Draining workers\n");
+			signal_workers(SIGQUIT);
+		}
+
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+			alive -= worker_exited(pid, status, quitting);
+		if (alive > 0)
+			sigsuspend(&worker_mask);
+	}
+
+	if (quitting)
+		log_msg(L_INFO, "Server drained. Bye~\n");
+	free(workers);
+}
+
 int main(int argc, char* argv[])
 {
-	if (argc < 9) {
+	int opt;
+	sigset_t none;
+
+	// An upgraded program inherits the signal mask of the old master
+	sigemptyset(&none);
+	sigprocmask(SIG_SETMASK, &none, NULL);
+	init_upgrade(argv);
+
+	worker_count = DEFAULT_WORKERS;
+	cache_size = DEFAULT_CACHE_SIZE;
+	accept_batch = DEFAULT_ACCEPT_BATCH;
+	fcgi_workers = 0;
+	max_connections = 0;
+	rate_limit = rate_burst = 0;
+	config_file = NULL;
+	while ((opt = getopt(argc, argv, "w:c:f:a:m:r:b:l:C:")) != -1) {
+		switch (opt) {
+		case 'w':
+			worker_count = atoi(optarg);
+			break;
+		case 'c':
+			cache_size = atol(optarg);
+			break;
+		case 'f':
+			fcgi_workers = atoi(optarg);
+			break;
+		case 'a':
+			accept_batch = atoi(optarg);
+			break;
+		case 'm':
+			max_connections = atoi(optarg);
+			break;
+		case 'r':
+			rate_limit = atoi(optarg);
+			break;
+		case 'b':
+			rate_burst = atoi(optarg);
+			break;
+		case 'l':
+			access_log_name = optarg;
+			break;
+		case 'C':
+			config_file = optarg;
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+
+	if (argc - optind < 8 || worker_count < 1 || accept_batch < 1 ||
+		max_connections < 0 || rate_limit < 0 || rate_burst < 0 ||
+		rate_limit > INT_MAX / 1000 || rate_burst > INT_MAX / 1000) {
 		usage();
 		return -1;
 	}
+	argv += optind - 1;
 
 	http_port = atoi(argv[1]);
 	https_port = atoi(argv[2]);
@@ -138,9 +430,33 @@ int main(int argc, char* argv[])
 	private_key_file = argv[7];
 	certificate_file = argv[8];
 
-	daemonize(lock_file);
+	/*
+	 * Read the config file, and load the certificate it names. Problems are
+	 * reported on stderr, before becoming a daemon.
+	 */
+	init_ssl_tickets();
+	if (reload_config(NULL) == -1) {
+		fprintf(stderr, "lisod: bad config, not started\n");
+		return -1;
+	}
+
+	if (upgraded()) {
+		init_process();
+		log_msg(L_INFO, "Upgraded lisod process, pid %d.\n", getpid());
+	} else
+		daemonize(lock_file);
+	if (open_listeners(worker_count) == -1) {
+		log_msg(L_ERROR, "Can't listen on port %d or %d\n", http_port,
+				https_port);
+		return -1;
+	}
+	init_metrics(worker_count);
 
-	serve();
+	if (worker_count == 1) {
+		metrics_attach(0);
+		serve(0);
+	} else
+		supervise();
 
 	return 0;
 }
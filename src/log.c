@@ -6,62 +6,189 @@
  *  defined in log.h. log_mask is basically a bit map of what message should be
  *  logged. By setting log_mask, we can output a specific part of logs.
  *
+ *  Messages are not written one by one. They are appended to a ring buffer,
+ *  which log_flush() writes out with as few write() calls as possible. The
+ *  serving loop flushes once per iteration, and a ring getting full is
+ *  flushed right away.
+ *
+ *  Signal handlers log as well, so appending doesn't take a lock. Space is
+ *  reserved by moving the tail with compare-and-swap, then filled in. A
+ *  handler interrupting a logging call only appends, and leaves flushing to
+ *  the interrupted call, which might not have filled in its record yet.
+ *
+ *  The access log, if enabled, takes a fixed binary record per request in a
+ *  ring of its own.
+ *
  *  @author Chao Xin(cxin)
  *
  */
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
 #include "log.h"
 
-FILE *log_file = NULL;
 int log_mask = L_ERROR; //By default, only error message will be logged.
 
+/** @brief Records waiting to be written to a file */
+typedef struct {
+    char buf[LOG_RING];
+    unsigned long head;     //<!end of what has been written
+    unsigned long tail;     //<!end of what has been reserved
+    unsigned long dropped;  //<!records lost because the ring was full
+    int fd;                 //<!-1 if disabled
+} log_ring_t;
+
+static log_ring_t messages = { .fd = STDERR_FILENO };
+static log_ring_t access_log = { .fd = -1 };
+
+/* Depth of logging calls, more than 1 inside a signal handler */
+static volatile sig_atomic_t busy = 0;
+
+/** @brief Write out everything in a ring */
+static void flush_ring(log_ring_t *ring) {
+    unsigned long tail = ring->tail;
+    int start, len, n;
+
+    while (ring->head != tail) {
+        start = ring->head & (LOG_RING - 1);
+        len = tail - ring->head;
+        // Up to the end of the buffer first, the rest has wrapped around
+        if (len > LOG_RING - start)
+            len = LOG_RING - start;
+        if ((n = write(ring->fd, ring->buf + start, len)) == -1) {
+            if (errno == EINTR)
+                continue;
+            // Nowhere to write to, drop the records
+            ring->head = tail;
+            break;
+        }
+        ring->head += n;
+    }
+}
+
+/** @brief Put len bytes at the tail of a ring
+ *
+ *  If the ring is full it's flushed first, except when logging has been
+ *  interrupted by a signal handler. Then the record is dropped.
+ *
+ *  @return 0 if appended. -1 if dropped.
+ */
+static int append(log_ring_t *ring, char *data, int len) {
+    unsigned long tail;
+    int start, first;
+
+    do {
+        tail = ring->tail;
+        if (tail + len - ring->head > LOG_RING) {
+            if (busy > 1) {
+                ++ring->dropped;
+                return -1;
+            }
+            flush_ring(ring);
+            continue;
+        }
+    } while (!__atomic_compare_exchange_n(&ring->tail, &tail, tail + len, 0,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+    start = tail & (LOG_RING - 1);
+    first = len < LOG_RING - start ? len : LOG_RING - start;
+    memcpy(ring->buf + start, data, first);
+    memcpy(ring->buf, data + first, len - first);
+    return 0;
+}
+
+/** @brief Forget records inherited from the parent, which writes them itself */
+static void forget_records() {
+    messages.head = messages.tail;
+    access_log.head = access_log.tail;
+}
+
+/** @brief Open a log file for appending, records of all processes go there */
+static int open_log(char *fname) {
+    static int registered = 0;
+    int fd;
+
+    if ((fd = open(fname, O_WRONLY | O_CREAT | O_APPEND |
+                   (log_append ? 0 : O_TRUNC), 0640)) == -1)
+        return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    if (!registered) {
+        registered = 1;
+        pthread_atfork(NULL, NULL, forget_records);
+        atexit(log_flush);
+    }
+    return fd;
+}
+
 /** @brief Set the file where logs will be output to
+ *
+ *  Until it's set, logs are written to stderr.
  *
  *  @param fname The log file name
  *  @return void
  */
 void set_log_file(char *fname) {
-    FILE *f;
+    int fd;
 
-    if ((f = fopen(fname, "w")) == NULL) {
+    if ((fd = open_log(fname)) == -1) {
         log_error("set_log_file error");
         return;
     }
-    log_file = f;
+    messages.fd = fd;
 }
 
-/** @brief Write formatted logs
+/** @brief Enable the binary access log
  *
- *  Create a new log message with given type(Defined in log.h). The message
- *  will be written into log file if the type is in log_mask.
- *
- *  The output in this function is implemented using vfprintf. Thus this
- *  function can be used like printf(char* format, ... )
+ *  @param fname The access log file name
+ */
+void set_access_log(char *fname) {
+    int fd;
+
+    if ((fd = open_log(fname)) == -1) {
+        log_error("set_access_log error");
+        return;
+    }
+    access_log.fd = fd;
+}
+
+/** @brief Write formatted logs
  *
- *  When log_file is NULL, the message will be output to stderr
+ *  Called by log_msg() for types in log_mask. Can be used like
+ *  printf(char* format, ... ). The message is buffered, see log_flush().
  *
- *  @param type The type of the log message
  *  @param format The output format
  *  @oaram ... Arguments for the format
  *
  *  @return void
  */
-void log_msg(int type, char* format, ...) {
+void log_write(char* format, ...) {
+    char record[LOG_RECORD_MAX];
     va_list arguments;
+    int len;
 
-    if ((type & log_mask) != 0) {
-        va_start(arguments, format);
-        if (log_file == NULL)
-            vfprintf(stderr, format, arguments);
-        else
-            vfprintf(log_file, format, arguments);
-        va_end(arguments);
+    ++busy;
+    va_start(arguments, format);
+    len = vsnprintf(record, sizeof(record), format, arguments);
+    va_end(arguments);
+    if (len >= (int)sizeof(record)) {
+        len = sizeof(record) - 1;
+        record[len - 1] = '\n';
     }
+    if (len > 0)
+        append(&messages, record, len);
 
-    fflush(log_file);
+    // Don't let a lot of records pile up between flushes
+    if (busy == 1 && messages.tail - messages.head > LOG_RING / 2)
+        flush_ring(&messages);
+    --busy;
 }
 
 /** @brief Write an error log
@@ -75,4 +202,51 @@ void log_msg(int type, char* format, ...) {
  */
 void log_error(char* msg) {
     log_msg(L_ERROR, "%s : %s\n", msg, strerror(errno));
-}
\ No newline at end of file
+}
+
+/** @brief Add a record to the access log
+ *
+ *  @param rec The record, uri_len is filled in here
+ *  @param uri The request URI
+ *  @param uri_len Length of the URI, it's cut at LOG_RECORD_MAX
+ */
+void log_access(access_record_t *rec, char *uri, int uri_len) {
+    char record[sizeof(access_record_t) + LOG_RECORD_MAX];
+    int len;
+
+    if (access_log.fd == -1)
+        return;
+
+    len = uri_len < LOG_RECORD_MAX ? uri_len : LOG_RECORD_MAX;
+    rec->uri_len = htons(len);
+    memcpy(record, rec, sizeof(access_record_t));
+    memcpy(record + sizeof(access_record_t), uri, len);
+
+    ++busy;
+    append(&access_log, record, sizeof(access_record_t) + len);
+    --busy;
+}
+
+/** @brief Write out buffered records
+ *
+ *  Called by the serving loop in every iteration, and when the process
+ *  exits.
+ */
+void log_flush() {
+    unsigned long dropped;
+
+    // The interrupted call may be filling in its record
+    if (busy > 0)
+        return;
+
+    ++busy;
+    if ((dropped = messages.dropped) > 0) {
+        messages.dropped = 0;
+        flush_ring(&messages);
+        log_write("%lu log records dropped\n", dropped);
+    }
+    flush_ring(&messages);
+    if (access_log.fd != -1)
+        flush_ring(&access_log);
+    --busy;
+}
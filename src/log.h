@@ -7,6 +7,7 @@
 #define __MYLOG_H__
 
 #include <stdio.h>
+#include <stdint.h>
 
 #define L_ERROR 0x1 //This flag indicates an error message
 #define L_INFO 0x2 //This flag indicates an info message
@@ -14,19 +15,60 @@
 #define L_IO_DEBUG 0x4
 #define L_HTTP_DEBUG 0x8
 
-/*
- * @brief log_file indicates where to write log. When it's NULL, log will be written
- *        to stderr
+/* Bytes of log records buffered before they are written, a power of 2 */
+#define LOG_RING (256 << 10)
+
+/* Longest message, longer ones are cut */
+#define LOG_RECORD_MAX 4096
+
+/* Flags of an access record */
+#define ACCESS_TLS 0x1      // Request came over https
+#define ACCESS_H2 0x2       // Request came on a HTTP/2 stream
+
+/** @brief A record of the binary access log
+ *
+ *  Records are written one after another, each followed by uri_len bytes of
+ *  the request URI. All fields are in network byte order, so the log can be
+ *  read on any machine, e.g. with struct.unpack("!IIHBBIH") in Python. One
+ *  is written for each request when it's handed to a handler or rejected.
  */
-FILE* log_file;
+typedef struct __attribute__((packed)) {
+    uint32_t time;          //<!seconds since the epoch
+    uint32_t addr;          //<!IPv4 address of the client
+    uint16_t status;        //<!status code, 0 if decided by the cgi script
+    uint8_t method;         //<!M_* of the request
+    uint8_t flags;          //<!ACCESS_*
+    uint32_t length;        //<!bytes of the request body
+    uint16_t uri_len;
+} access_record_t;
+
 /*
  * @brief A bit map of what types of logs should be output
  */
 int log_mask;
 
+/*
+ * Log files are truncated when opened, unless this is set. It's set by an
+ * upgraded program, which goes on with the logs of the old one.
+ */
+int log_append;
+
+/*
+ * Formatting is skipped entirely, arguments included, for types not in
+ * log_mask. Arguments must not have side effects.
+ */
+#define log_msg(type, ...) \
+    do { \
+        if (((type) & log_mask) != 0) \
+            log_write(__VA_ARGS__); \
+    } while (0)
+
 void set_log_file(char* fname);
+void set_access_log(char* fname);
 
-void log_msg(int type, char* format, ...);
+void log_write(char* format, ...) __attribute__((format(printf, 1, 2)));
 void log_error(char* msg);
+void log_access(access_record_t *rec, char *uri, int uri_len);
+void log_flush();
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,267 @@
+/** @file metrics.c
+ *  @brief Counters of the hot paths and their Prometheus page
+ *
+ *  Each worker counts in a slot of its own, one of a table mapped before the
+ *  workers are forked and shared by all of them. Counting is a plain add to
+ *  memory only this worker writes, and slots are cache line aligned, so
+ *  workers never fight over a line. Whatever worker a scrape reaches renders
+ *  the slots of all workers, labelled by worker.
+ *
+ *  Durations are recorded in log-linear histograms, like HdrHistogram: the
+ *  bucket of a value is found from its highest bit and the few bits below,
+ *  without any search.
+ *
+ *  The page is produced in memory, nothing is read from the file system.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "metrics.h"
+#include "log.h"
+
+/* Until the table is mapped, and if it can't be, a worker counts here */
+static worker_metrics_t own;
+worker_metrics_t *metrics = &own;
+
+static worker_metrics_t *slots = &own;
+static int nslots = 1;
+
+/** @brief A counter or gauge of every worker */
+typedef struct {
+    char *name;
+    char *type;
+    char *help;
+    size_t offset;      //<!of the field in worker_metrics_t
+} metric_desc_t;
+
+static metric_desc_t scalars[] = {
+    { "lisod_connections_accepted_total", "counter", "Connections accepted.",
+      offsetof(worker_metrics_t, accepted) },
+    { "lisod_connections_shed_total", "counter",
+      "Connections turned away with 503 at the connection cap.",
+      offsetof(worker_metrics_t, shed) },
+    { "lisod_connections_timed_out_total", "counter",
+      "Connections closed for missing a deadline.",
+      offsetof(worker_metrics_t, timeouts) },
+    { "lisod_requests_rate_limited_total", "counter",
+      "Requests refused with 429 over the rate limit of their address.",
+      offsetof(worker_metrics_t, rate_limited) },
+    { "lisod_service_yields_total", "counter",
+      "Times a client used up its budget and waited for the others.",
+      offsetof(worker_metrics_t, yields) },
+    { "lisod_received_bytes_total", "counter", "Bytes received from clients.",
+      offsetof(worker_metrics_t, bytes_received) },
+    { "lisod_sent_bytes_total", "counter", "Bytes sent to clients.",
+      offsetof(worker_metrics_t, bytes_sent) },
+    { "lisod_cgi_forks_total", "counter", "CGI processes forked.",
+      offsetof(worker_metrics_t, cgi_forks) },
+    { "lisod_connections", "gauge", "Connections open.",
+      offsetof(worker_metrics_t, clients) },
+    { "lisod_buffer_bytes", "gauge", "Memory of buffers in use.",
+      offsetof(worker_metrics_t, buffer_bytes) },
+};
+
+static metric_desc_t histograms[] = {
+    { "lisod_parse_duration_seconds", "histogram",
+      "Time of http_parse() calls which consumed input, handlers included.",
+      offsetof(worker_metrics_t, parse) },
+    { "lisod_cgi_fork_duration_seconds", "histogram",
+      "Time of fork() for cgi scripts.",
+      offsetof(worker_metrics_t, fork) },
+    { "lisod_file_io_duration_seconds", "histogram",
+      "Time from handing file I/O to a thread until the loop takes the result.",
+      offsetof(worker_metrics_t, file_io) },
+};
+
+static char *classes[RESPONSE_CLASSES] = {
+    "cgi", "1xx", "2xx", "3xx", "4xx", "5xx"
+};
+
+/** @brief Map the table of slots shared by workers
+ *
+ *  Called before workers are forked. Without the table, each worker only
+ *  reports itself.
+ *
+ *  @param workers Number of worker processes
+ */
+void init_metrics(int workers) {
+    void *table;
+
+    table = mmap(NULL, sizeof(worker_metrics_t) * workers,
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) {
+        log_error("init_metrics mmap error");
+        return;
+    }
+    slots = table;
+    nslots = workers;
+}
+
+/** @brief Start counting in the slot of a worker, from 0
+ *
+ *  A restarted worker takes over the slot of the one it replaces.
+ */
+void metrics_attach(int worker) {
+    metrics = &slots[worker < nslots ? worker : 0];
+    memset(metrics, 0, sizeof(worker_metrics_t));
+    metrics->pid = getpid();
+}
+
+/** @brief Nanoseconds since some fixed point, for timing hot paths */
+unsigned long metrics_clock() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/** @brief Bucket of a value
+ *
+ *  The highest bit picks the power of 2, the HIST_SUB_BITS below it the
+ *  linear bucket within.
+ */
+static int hist_index(unsigned long v) {
+    int e;
+
+    if (v < 1UL << HIST_MIN_SHIFT)
+        return 0;
+    e = 63 - __builtin_clzl(v);
+    if (e >= HIST_MIN_SHIFT + HIST_OCTAVES)
+        return HIST_BUCKETS - 1;
+    return 1 + ((e - HIST_MIN_SHIFT) << HIST_SUB_BITS) +
+           ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/** @brief Upper bound of a bucket in nanoseconds, except the last one */
+static unsigned long hist_bound(int i) {
+    int e, s;
+
+    if (i == 0)
+        return 1UL << HIST_MIN_SHIFT;
+    e = HIST_MIN_SHIFT + ((i - 1) >> HIST_SUB_BITS);
+    s = (i - 1) & (HIST_SUB - 1);
+    return (unsigned long)(HIST_SUB + s + 1) << (e - HIST_SUB_BITS);
+}
+
+/** @brief Record a duration */
+void hist_record(histogram_t *h, unsigned long ns) {
+    ++h->buckets[hist_index(ns)];
+    ++h->count;
+    h->sum += ns;
+}
+
+/** @brief Read a counter another worker may be writing */
+static unsigned long load(unsigned long *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/** @brief Field of a slot at offset */
+static void* field(int worker, size_t offset) {
+    return (char *)&slots[worker] + offset;
+}
+
+/** @brief Text of the page being rendered */
+typedef struct {
+    char *buf;
+    int len;
+    int size;
+} text_t;
+
+/** @brief printf() at the end of the text, growing it as necessary */
+static void text_printf(text_t *t, char *format, ...) {
+    va_list arguments;
+    int n;
+
+    while (1) {
+        va_start(arguments, format);
+        n = vsnprintf(t->buf + t->len, t->size - t->len, format, arguments);
+        va_end(arguments);
+        if (n < t->size - t->len)
+            break;
+        t->size *= 2;
+        t->buf = realloc(t->buf, t->size);
+    }
+    t->len += n;
+}
+
+/** @brief Render a histogram of every worker */
+static void render_histogram(text_t *t, metric_desc_t *desc) {
+    unsigned long total;
+    histogram_t *h;
+    int w, i;
+
+    text_printf(t, "# HELP %s %s\n# TYPE %s %s\n", desc->name, desc->help,
+                desc->name, desc->type);
+    for (w = 0; w < nslots; ++w) {
+        if (slots[w].pid == 0)
+            continue;
+        h = field(w, desc->offset);
+
+        // Buckets are cumulative, and all of them are listed on each scrape
+        total = 0;
+        for (i = 0; i < HIST_BUCKETS - 1; ++i) {
+            total += load(&h->buckets[i]);
+            text_printf(t, "%s_bucket{worker=\"%d\",le=\"%g\"} %lu\n",
+                        desc->name, w, hist_bound(i) / 1e9, total);
+        }
+        total += load(&h->buckets[i]);
+        text_printf(t, "%s_bucket{worker=\"%d\",le=\"+Inf\"} %lu\n",
+                    desc->name, w, total);
+        text_printf(t, "%s_sum{worker=\"%d\"} %.9f\n", desc->name, w,
+                    load(&h->sum) / 1e9);
+        text_printf(t, "%s_count{worker=\"%d\"} %lu\n", desc->name, w,
+                    load(&h->count));
+    }
+}
+
+/** @brief Render the metrics of all workers in Prometheus text format
+ *
+ *  @param len Where the length of the page is stored
+ *  @return The page, to be freed by the caller
+ */
+char* render_metrics(int *len) {
+    text_t t = { malloc(16 << 10), 0, 16 << 10 };
+    metric_desc_t *desc;
+    unsigned long v;
+    int i, w;
+
+    for (i = 0; i < (int)(sizeof(scalars) / sizeof(scalars[0])); ++i) {
+        desc = &scalars[i];
+        text_printf(&t, "# HELP %s %s\n# TYPE %s %s\n", desc->name,
+                    desc->help, desc->name, desc->type);
+        for (w = 0; w < nslots; ++w) {
+            if (slots[w].pid == 0)
+                continue;
+            v = load(field(w, desc->offset));
+            if (desc->type[0] == 'g')
+                text_printf(&t, "%s{worker=\"%d\"} %ld\n", desc->name, w,
+                            (long)v);
+            else
+                text_printf(&t, "%s{worker=\"%d\"} %lu\n", desc->name, w, v);
+        }
+    }
+
+    text_printf(&t, "# HELP lisod_responses_total Requests by response "
+                "status class.\n# TYPE lisod_responses_total counter\n");
+    for (w = 0; w < nslots; ++w) {
+        if (slots[w].pid == 0)
+            continue;
+        for (i = 0; i < RESPONSE_CLASSES; ++i)
+            text_printf(&t, "lisod_responses_total{worker=\"%d\","
+                        "class=\"%s\"} %lu\n", w, classes[i],
+                        load(&slots[w].responses[i]));
+    }
+
+    for (i = 0; i < (int)(sizeof(histograms) / sizeof(histograms[0])); ++i)
+        render_histogram(&t, &histograms[i]);
+
+    *len = t.len;
+    return t.buf;
+}
@@ -0,0 +1,75 @@
+/** @file metrics.h
+ *  @brief Header file for metrics.c
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <sys/types.h>
+
+/* URI of the metrics page, only served to clients on the loopback */
+#define METRICS_URI "/.lisod/metrics"
+
+/* Bytes of a cache line, slots of workers never share one */
+#define CACHE_LINE 64
+
+/*
+ * Histograms have 1 << HIST_SUB_BITS linear buckets for each power of 2 of
+ * nanoseconds, from 1 << HIST_MIN_SHIFT (1us) on, HIST_OCTAVES of them (up
+ * to 68s). Values are off by at most 25%, whatever their magnitude. One more
+ * bucket at each end takes smaller and larger values.
+ */
+#define HIST_SUB_BITS 2
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MIN_SHIFT 10
+#define HIST_OCTAVES 26
+#define HIST_BUCKETS ((HIST_OCTAVES << HIST_SUB_BITS) + 2)
+
+/* Response classes counted, 1xx to 5xx, and those decided by cgi scripts */
+#define RESPONSE_CLASSES 6
+
+/** @brief Distribution of durations in nanoseconds */
+typedef struct {
+    unsigned long count;
+    unsigned long sum;
+    unsigned long buckets[HIST_BUCKETS];
+} histogram_t;
+
+/** @brief Counters of a worker
+ *
+ *  Only the worker itself writes them, so they are plain integers. Whatever
+ *  worker serves the metrics page reads all slots.
+ */
+typedef struct __attribute__((aligned(CACHE_LINE))) {
+    pid_t pid;                      //<!worker using the slot, 0 if none
+    unsigned long accepted;         //<!connections accepted
+    unsigned long shed;             //<!connections turned away with 503
+    unsigned long timeouts;         //<!connections closed at a deadline
+    unsigned long rate_limited;     //<!requests refused with 429
+    unsigned long yields;           //<!services stopped by the budget
+    unsigned long bytes_received;
+    unsigned long bytes_sent;
+    unsigned long cgi_forks;        //<!cgi processes forked
+    unsigned long responses[RESPONSE_CLASSES];  //<!requests by status / 100
+    long clients;                   //<!connections open
+    long buffer_bytes;              //<!buffer memory in use
+    histogram_t parse;              //<!http_parse() calls, handlers included
+    histogram_t fork;               //<!cgi fork() calls
+    histogram_t file_io;            //<!jobs of I/O threads, queueing included
+} worker_metrics_t;
+
+/*
+ * @brief Slot of counters of this worker
+ */
+worker_metrics_t *metrics;
+
+void init_metrics(int workers);
+void metrics_attach(int worker);
+
+unsigned long metrics_clock();
+void hist_record(histogram_t *h, unsigned long ns);
+
+char* render_metrics(int *len);
+
+#endif
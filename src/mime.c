@@ -0,0 +1,51 @@
+/** @file mime.c
+ *  @brief Media types of static files by file extension
+ *
+ *  Known extensions are kept in a perfect hash table generated by
+ *  tools/gen_mime.py (see mime_table.h). Finding the type of a file takes two
+ *  hashes of its extension and one string comparison, whatever the number of
+ *  known types. To add a type, edit the generator and run it again.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <string.h>
+#include "mime.h"
+#include "mime_table.h"
+
+/** @brief FNV-1a hash of an extension, same as in tools/gen_mime.py */
+static unsigned int mime_hash(const char *ext, unsigned int seed) {
+    unsigned int h = seed;
+
+    while (*ext)
+        h = (h ^ (unsigned char)*ext++) * 16777619u;
+    return h;
+}
+
+/** @brief Media type of a file
+ *
+ *  @param path Path of the file, only its extension is looked at
+ *  @return The type. MIME_DEFAULT if the extension is not known.
+ */
+const char* get_mimetype(const char *path) {
+    char ext[MIME_EXT_MAX + 1];
+    const char *dot = strrchr(path, '.');
+    const mime_type_t *t;
+    int i;
+
+    if (dot == NULL || strchr(dot, '/') != NULL)
+        return MIME_DEFAULT;
+
+    for (i = 0, ++dot; dot[i] != '\0'; ++i) {
+        if (i == MIME_EXT_MAX)
+            return MIME_DEFAULT;
+        ext[i] = dot[i] >= 'A' && dot[i] <= 'Z' ? dot[i] - 'A' + 'a' : dot[i];
+    }
+    ext[i] = '\0';
+
+    t = &mime_table[mime_hash(ext, mime_seeds[mime_hash(ext, MIME_SEED) &
+                                              (MIME_BUCKETS - 1)]) &
+                    (MIME_SLOTS - 1)];
+    if (t->ext == NULL || strcmp(t->ext, ext) != 0)
+        return MIME_DEFAULT;
+    return t->type;
+}
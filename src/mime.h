@@ -0,0 +1,23 @@
+/** @file mime.h
+ *  @brief Header file for mime.c
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __MIME_H__
+#define __MIME_H__
+
+/* Longest extension with a known type */
+#define MIME_EXT_MAX 16
+
+/* Type of files whose extension is unknown */
+#define MIME_DEFAULT "application/octet-stream"
+
+/** @brief A file extension and its media type */
+typedef struct {
+    const char *ext;        //<!lower case, without the dot
+    const char *type;
+} mime_type_t;
+
+const char* get_mimetype(const char *path);
+
+#endif
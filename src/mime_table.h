@@ -0,0 +1,111 @@
+/** @file mime_table.h
+ *  @brief Perfect hash table of file extensions
+ *
+ *  Generated by tools/gen_mime.py, do not edit.
+ */
+#ifndef __MIME_TABLE_H__
+#define __MIME_TABLE_H__
+
+#include "mime.h"
+
+#define MIME_SEED 2166136261u
+#define MIME_BUCKETS 64
+#define MIME_SLOTS 128
+
+static const unsigned int mime_seeds[MIME_BUCKETS] = {
+    1, 2, 1, 2, 1, 1, 0, 1, 3, 2, 1, 2,
+    0, 2, 3, 1, 1, 7, 2, 1, 2, 2, 1, 4,
+    3, 2, 0, 3, 1, 0, 0, 1, 6, 1, 1, 7,
+    1, 1, 1, 7, 3, 3, 1, 5, 0, 1, 4, 2,
+    2, 1, 0, 1, 2, 0, 1, 2, 4, 1, 5, 4,
+    2, 0, 1, 3,
+};
+
+static const mime_type_t mime_table[MIME_SLOTS] = {
+    [2] = { "otf", "font/otf" },
+    [3] = { "epub", "application/epub+zip" },
+    [5] = { "mov", "video/quicktime" },
+    [6] = { "tgz", "application/gzip" },
+    [9] = { "mid", "audio/midi" },
+    [12] = { "gif", "image/gif" },
+    [13] = { "pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation" },
+    [15] = { "ttf", "font/ttf" },
+    [16] = { "pdf", "application/pdf" },
+    [17] = { "aac", "audio/aac" },
+    [18] = { "m4v", "video/mp4" },
+    [19] = { "xz", "application/x-xz" },
+    [20] = { "css", "text/css" },
+    [21] = { "ogg", "audio/ogg" },
+    [27] = { "md", "text/markdown" },
+    [28] = { "exe", "application/octet-stream" },
+    [29] = { "map", "application/json" },
+    [31] = { "woff", "font/woff" },
+    [32] = { "midi", "audio/midi" },
+    [33] = { "mpg", "video/mpeg" },
+    [35] = { "ts", "video/mp2t" },
+    [36] = { "vtt", "text/vtt" },
+    [37] = { "svg", "image/svg+xml" },
+    [38] = { "js", "text/javascript" },
+    [39] = { "bmp", "image/bmp" },
+    [40] = { "iso", "application/octet-stream" },
+    [43] = { "swf", "application/x-shockwave-flash" },
+    [44] = { "doc", "application/msword" },
+    [45] = { "jpg", "image/jpeg" },
+    [46] = { "tiff", "image/tiff" },
+    [47] = { "webp", "image/webp" },
+    [48] = { "png", "image/png" },
+    [49] = { "bz2", "application/x-bzip2" },
+    [50] = { "xls", "application/vnd.ms-excel" },
+    [54] = { "ics", "text/calendar" },
+    [57] = { "jsonld", "application/ld+json" },
+    [58] = { "xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet" },
+    [60] = { "odt", "application/vnd.oasis.opendocument.text" },
+    [61] = { "wav", "audio/wav" },
+    [62] = { "eot", "application/vnd.ms-fontobject" },
+    [63] = { "mpeg", "video/mpeg" },
+    [64] = { "htm", "text/html" },
+    [66] = { "atom", "application/atom+xml" },
+    [68] = { "html", "text/html" },
+    [70] = { "docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document" },
+    [71] = { "rss", "application/rss+xml" },
+    [72] = { "apng", "image/apng" },
+    [73] = { "mjs", "text/javascript" },
+    [74] = { "xml", "text/xml" },
+    [75] = { "jar", "application/java-archive" },
+    [78] = { "txt", "text/plain" },
+    [79] = { "m3u8", "application/vnd.apple.mpegurl" },
+    [80] = { "ppt", "application/vnd.ms-powerpoint" },
+    [81] = { "avi", "video/x-msvideo" },
+    [82] = { "ogv", "video/ogg" },
+    [83] = { "webmanifest", "application/manifest+json" },
+    [86] = { "tif", "image/tiff" },
+    [87] = { "woff2", "font/woff2" },
+    [89] = { "zip", "application/zip" },
+    [90] = { "bin", "application/octet-stream" },
+    [91] = { "csv", "text/csv" },
+    [92] = { "json", "application/json" },
+    [95] = { "gz", "application/gzip" },
+    [97] = { "dmg", "application/octet-stream" },
+    [98] = { "wasm", "application/wasm" },
+    [99] = { "m4a", "audio/mp4" },
+    [101] = { "jpeg", "image/jpeg" },
+    [102] = { "svgz", "image/svg+xml" },
+    [103] = { "log", "text/plain" },
+    [104] = { "7z", "application/x-7z-compressed" },
+    [106] = { "ico", "image/x-icon" },
+    [108] = { "weba", "audio/webm" },
+    [110] = { "avif", "image/avif" },
+    [112] = { "flac", "audio/flac" },
+    [113] = { "tar", "application/x-tar" },
+    [114] = { "text", "text/plain" },
+    [115] = { "rtf", "application/rtf" },
+    [117] = { "shtml", "text/html" },
+    [120] = { "mp4", "video/mp4" },
+    [121] = { "oga", "audio/ogg" },
+    [122] = { "xhtml", "application/xhtml+xml" },
+    [123] = { "webm", "video/webm" },
+    [125] = { "mp3", "audio/mpeg" },
+    [126] = { "rar", "application/vnd.rar" },
+};
+
+#endif
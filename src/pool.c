@@ -0,0 +1,121 @@
+/** @file pool.c
+ *  @brief Arenas and free-list pools
+ *
+ *  Objects that live as long as a request (headers of a request for example)
+ *  are allocated from an arena of the client. The arena is reset in bulk when
+ *  the request ends, so parsing a request doesn't call malloc()/free() for
+ *  each of them. The first chunk of an arena is kept after resetting, thus a
+ *  keep-alive connection with small requests reuses the same memory.
+ *
+ *  Objects living longer than a request, like clients and buffers, are put
+ *  back into a pool once they are destroyed and handed out again later.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+
+/* Alignment of memory returned by arena_alloc() */
+#define ARENA_ALIGN (sizeof(void*) > sizeof(double) ? \
+                     sizeof(void*) : sizeof(double))
+
+/** @brief Setup an empty arena. No memory is allocated until first used */
+void init_arena(arena_t *arena) {
+    arena->head = NULL;
+}
+
+/** @brief Free all memory held by an arena */
+void deinit_arena(arena_t *arena) {
+    arena_chunk_t *chunk, *next;
+
+    for (chunk = arena->head; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    arena->head = NULL;
+}
+
+/** @brief Allocate memory from an arena
+ *
+ *  @return Memory valid until the arena is reset or destroyed
+ */
+void* arena_alloc(arena_t *arena, size_t size) {
+    arena_chunk_t *chunk = arena->head;
+    size_t chunk_size;
+    void *ptr;
+
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if (chunk == NULL || chunk->used + size > chunk->size) {
+        // A big object gets a chunk of its own
+        chunk_size = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        chunk = malloc(sizeof(arena_chunk_t) + chunk_size);
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = arena->head;
+        arena->head = chunk;
+    }
+
+    ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+/** @brief Copy len bytes of str into an arena as a NUL terminated string */
+char* arena_strndup(arena_t *arena, char *str, size_t len) {
+    char *dst = arena_alloc(arena, len + 1);
+
+    memcpy(dst, str, len);
+    dst[len] = '\0';
+    return dst;
+}
+
+/** @brief Free everything allocated from an arena at once
+ *
+ *  The oldest chunk of regular size is kept for next use.
+ */
+void arena_reset(arena_t *arena) {
+    arena_chunk_t *chunk, *next, *keep = NULL;
+
+    for (chunk = arena->head; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        if (keep == NULL && next == NULL && chunk->size == ARENA_CHUNK)
+            keep = chunk;
+        else
+            free(chunk);
+    }
+
+    if (keep) {
+        keep->used = 0;
+        keep->next = NULL;
+    }
+    arena->head = keep;
+}
+
+/** @brief Get an object from a pool, allocate a new one if the pool is empty
+ *
+ *  The content of the object is undefined.
+ */
+void* pool_get(pool_t *pool) {
+    void *obj = pool->free_list;
+
+    if (obj == NULL)
+        return malloc(pool->size);
+
+    pool->free_list = *(void **)obj;
+    --pool->nfree;
+    return obj;
+}
+
+/** @brief Put an object back to a pool */
+void pool_put(pool_t *pool, void *obj) {
+    if (pool->nfree >= pool->max_free) {
+        free(obj);
+        return;
+    }
+
+    *(void **)obj = pool->free_list;
+    pool->free_list = obj;
+    ++pool->nfree;
+}
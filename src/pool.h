@@ -0,0 +1,55 @@
+/** @file pool.h
+ *  @brief Header file for pool.c
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stddef.h>
+
+/* Size of a regular arena chunk */
+#define ARENA_CHUNK 4096
+
+/* Maximum number of free objects kept by a pool */
+#define POOL_MAX_FREE 1024
+
+/** @brief A block of memory an arena allocates from */
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;        //<!bytes available in data
+    size_t used;        //<!bytes already allocated
+    char data[];
+} arena_chunk_t;
+
+/** @brief Memory allocated piece by piece and freed all at once */
+typedef struct {
+    arena_chunk_t *head;    //<!chunk being allocated from
+} arena_t;
+
+/** @brief A free list of objects of the same size */
+typedef struct {
+    size_t size;        //<!size of an object
+    void *free_list;    //<!free objects, linked through their first word
+    int nfree;          //<!number of objects in free_list
+    int max_free;       //<!objects kept at most, the rest are freed
+} pool_t;
+
+/* Initialize a pool for objects of given size */
+#define POOL_INITIALIZER(size) { (size), NULL, 0, POOL_MAX_FREE }
+
+/* Initialize a pool keeping at most max free objects */
+#define POOL_INITIALIZER_MAX(size, max) { (size), NULL, 0, (max) }
+
+/* Arena */
+void init_arena(arena_t *arena);
+void deinit_arena(arena_t *arena);
+void* arena_alloc(arena_t *arena, size_t size);
+char* arena_strndup(arena_t *arena, char *str, size_t len);
+void arena_reset(arena_t *arena);
+
+/* Pool */
+void* pool_get(pool_t *pool);
+void pool_put(pool_t *pool, void *obj);
+
+#endif
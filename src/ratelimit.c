@@ -0,0 +1,94 @@
+/** @file ratelimit.c
+ *  @brief Token buckets limiting the request rate of each client address
+ *
+ *  Every address has a bucket of up to rate_burst tokens, refilled with
+ *  rate_limit tokens per second. A request takes a token, and is refused
+ *  when there is none. Tokens are counted in thousandths so that slow rates
+ *  still refill between two requests.
+ *
+ *  Buckets live in a fixed table, set associative like a CPU cache. An
+ *  address missing from its set takes the bucket used longest ago. That one
+ *  has had the most time to refill, and a full bucket is the same as a new
+ *  one, so evicting it forgets little. Each worker has a table of its own,
+ *  the limit applies to the connections a worker serves.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <time.h>
+#include <arpa/inet.h>
+#include "ratelimit.h"
+#include "config.h"
+
+/* Thousandths of a token taken by a request */
+#define REQUEST_COST 1000
+
+typedef struct {
+    unsigned int addr;      //<!IPv4 address in network order, 0 if unused
+    long tokens;            //<!in thousandths
+    unsigned long stamp;    //<!milliseconds of the last refill
+} rate_bucket_t;
+
+static rate_bucket_t buckets[RATE_SETS][RATE_WAYS];
+
+/** @brief Milliseconds since some fixed point */
+static unsigned long now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** @brief Bucket of an address, taking over the stalest one of its set */
+static rate_bucket_t* find_bucket(unsigned int addr, long capacity,
+                                  unsigned long now) {
+    rate_bucket_t *set, *b;
+    unsigned int h = addr * 2654435761u;
+    int i;
+
+    set = buckets[(h ^ (h >> 16)) & (RATE_SETS - 1)];
+    b = &set[0];
+    for (i = 0; i < RATE_WAYS; ++i) {
+        if (set[i].addr == addr)
+            return &set[i];
+        if (set[i].stamp < b->stamp)
+            b = &set[i];
+    }
+
+    b->addr = addr;
+    b->tokens = capacity;
+    b->stamp = now;
+    return b;
+}
+
+/** @brief Take a token for a request from an address
+ *
+ *  @param ip Address of the client in dotted decimal
+ *  @return 1 if the request may be served. 0 if it's over the limit.
+ */
+int rate_allow(char *ip) {
+    struct in_addr addr;
+    rate_bucket_t *b;
+    unsigned long now, elapsed;
+    long capacity;
+
+    if (rate_limit <= 0 || inet_pton(AF_INET, ip, &addr) != 1 ||
+        addr.s_addr == 0)
+        return 1;
+
+    // Without a burst, a second worth of requests may come at once
+    capacity = (long)(rate_burst > 0 ? rate_burst : rate_limit) * REQUEST_COST;
+    now = now_ms();
+    b = find_bucket(addr.s_addr, capacity, now);
+
+    elapsed = now - b->stamp;
+    if (elapsed >= (unsigned long)(capacity / rate_limit))
+        b->tokens = capacity;
+    else if ((b->tokens += elapsed * rate_limit) > capacity)
+        b->tokens = capacity;
+    b->stamp = now;
+
+    if (b->tokens < REQUEST_COST)
+        return 0;
+    b->tokens -= REQUEST_COST;
+    return 1;
+}
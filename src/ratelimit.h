@@ -0,0 +1,18 @@
+/** @file ratelimit.h
+ *  @brief Header file for ratelimit.c
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+/*
+ * Addresses are kept in RATE_SETS sets of RATE_WAYS buckets each. RATE_SETS
+ * must be a power of 2.
+ */
+#define RATE_SETS 1024
+#define RATE_WAYS 4
+
+int rate_allow(char *ip);
+
+#endif
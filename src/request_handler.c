@@ -18,150 +18,743 @@
 #include "request_handler.h"
 #include "http_client.h"
 #include "io.h"
+#include "file_cache.h"
+#include "aio.h"
+#include "fastcgi.h"
+#include "resolver.h"
+#include "http_date.h"
+#include "mime.h"
+#include "scan.h"
+#include "metrics.h"
 
-static char* get_mimetype(char* path) {
-    char* ext = path + strlen(path) - 1;
+/** @brief Absolute path of www_folder, resolved again once it's changed */
+static char* get_www_root() {
+    static char www_root[PATH_MAX], resolved[PATH_MAX];
 
-    while (ext != path && ext[0] != '.' && ext[0] != '/')
-        ext -= 1;
-    if (ext[0] == '.') {
-        ext += 1;
-        if (strcicmp(ext, "html") == 0)
-            return "text/html";
-        if (strcicmp(ext, "css") == 0)
-            return "text/css";
-        if (strcicmp(ext, "png") == 0)
-            return "image/png";
-        if (strcicmp(ext, "jpg") == 0)
-            return "image/jpg";
-        if (strcicmp(ext, "gif") == 0)
-            return "image/gif";
+    if (www_root[0] == '\0' || strcmp(resolved, www_folder) != 0) {
+        if (realpath(www_folder, www_root) == NULL) {
+            www_root[0] = '\0';
+            return NULL;
+        }
+        snprintf(resolved, sizeof(resolved), "%s", www_folder);
     }
-
-    return "application/octet-stream";
+    return www_root;
 }
 
 /** @brief Try to open file and retrieve its information
  *
- *  The passed-in uri will be concatenated with www_folder to make the full
- *  path. The size, type and last modified date will be retrieve.
+ *  A directory is taken as its index.html. The size and last modified date
+ *  will be retrieve. Called by I/O threads, so nothing is logged here: the
+ *  error is told by failed and errno.
  *
- *  @param file_path URI from HTTP request
- *  @param size The pointer to the variable which stores the file size
- *  @param mimetype The pointer to a string buffer which will be used to store
- *                  the mimetype
- *  @param last_modified The pointer to a string buffer that stores the last
- *                       modified date.
+ *  @param path The full path of the file, www_folder and the URI. The buffer
+ *              should be able to hold 2 * PATH_MAX bytes.
+ *  @param s The pointer to the stat struct of the opened file
+ *  @param failed Set to what failed if an error occurs
  *  @return File descriptor of the openned file if success. Negate of the
  *          corresponding http response code if error occurs.
  */
-static int open_file(char *file_path, int *size, char *mimetype, char *last_modifiled) {
-    struct stat s;
-    char path[2 * PATH_MAX];
+static int open_file(char *path, struct stat *s, char **failed) {
     int fd;
 
-    /* Get the absolute path of www_folder */
-    if (realpath(www_folder, path) == NULL) {
-        log_error("open_file error: realpath error");
-        return -INTERNAL_SERVER_ERROR;
-    }
-    strcat(path, file_path);
-
     /* Check if the file exists */
-    if (stat(path, &s) == -1) {
-        log_error("open_file error: stat error");
+    if (stat(path, s) == -1) {
+        *failed = "open_file error: stat error";
         return -NOT_FOUND;
     }
     else {
         //is a directory?
-        if (S_ISDIR(s.st_mode)) {
+        if (S_ISDIR(s->st_mode)) {
             //try to get index.html
             if (path[strlen(path) - 1] == '/')
                 strcat(path, "index.html");
             else
                 strcat(path, "/index.html");
-            if (stat(path, &s) == -1) {
-                log_error("open_file error: stat error");
+            if (stat(path, s) == -1) {
+                *failed = "open_file error: stat error";
                 return -NOT_FOUND;
             }
         }
     }
 
     if ((fd = open(path, O_RDONLY)) == -1) {
-        log_error("open_file error: open error");
+        *failed = "open_file error: open error";
         return -INTERNAL_SERVER_ERROR;
     }
 
-    /* get the size of file by lseek to the end of the file */
-    if ((*size = lseek(fd, 0, SEEK_END)) == -1) {
-        close(fd);
-        log_error("open_file error: lseek error");
-        return -INTERNAL_SERVER_ERROR;
+    return fd;
+}
+
+/** @brief Send headers which differ between responses and end the header */
+static void send_dynamic_headers(http_client_t *client) {
+    char *header;
+
+    header = chain_printf(client->out, "Date: %s\r\nConnection: %s\r\n\r\n",
+                          current_date(), connection_close(client->req) ? "close" :
+                                                                "keep-alive");
+    log_msg(L_HTTP_DEBUG, "%s", header);
+}
+
+/** @brief Precompressed siblings of static files
+ *
+ *  A file may be accompanied by compressed copies of itself, e.g. style.css
+ *  by style.css.br and style.css.gz. A client accepting the encoding gets
+ *  the copy instead. Entries are in the order of preference.
+ */
+static struct {
+    char *name;         //<!content coding of Accept-Encoding
+    char *suffix;       //<!appended to the path of the file
+    int flag;
+} encodings[] = {
+    { "br", ".br", ENC_BR },
+    { "gzip", ".gz", ENC_GZIP },
+};
+
+#define N_ENCODINGS ((int)(sizeof(encodings) / sizeof(encodings[0])))
+
+/** @brief Encodings accepted by a request
+ *
+ *  Codings listed with q=0 are refused, as are those left out unless "*" is
+ *  listed. x-gzip is taken as gzip.
+ *
+ *  @return A bit map of ENC_*
+ */
+static int accepted_encodings(http_request_t *req) {
+    char *p = get_known_header(req, H_ACCEPT_ENCODING), *name, *q;
+    int yes = 0, no = 0, any = 0, len, flag, i;
+
+    if (p == NULL)
+        return 0;
+
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            ++p;
+        for (name = p; *p && *p != ',' && *p != ';' && *p != ' ' &&
+                       *p != '\t'; ++p);
+        len = p - name;
+
+        // Weight of the coding, only whether it's zero matters
+        flag = 1;
+        for (; *p && *p != ','; ++p) {
+            if ((*p == 'q' || *p == 'Q') && p[1] == '=') {
+                for (q = p + 2; *q == '0' || *q == '.'; ++q);
+                flag = *q >= '1' && *q <= '9';
+            }
+        }
+        if (len == 0)
+            continue;
+
+        if (len == 1 && *name == '*') {
+            any = flag;
+            continue;
+        }
+        if (len == 6 && scan_casecmp(name, "x-gzip", 6) == 0) {
+            name += 2;
+            len -= 2;
+        }
+        for (i = 0; i < N_ENCODINGS; ++i) {
+            if (strlen(encodings[i].name) == len &&
+                scan_casecmp(name, encodings[i].name, len) == 0) {
+                if (flag)
+                    yes |= encodings[i].flag;
+                else
+                    no |= encodings[i].flag;
+            }
+        }
     }
-    /* restore offset */
-    if (lseek(fd, 0, SEEK_SET) == -1) {
-        close(fd);
-        log_error("open_file error: lseek error");
-        return -INTERNAL_SERVER_ERROR;
+
+    return any ? ENC_ALL & ~no : yes & ~no;
+}
+
+/** @brief Precompressed siblings of a file
+ *
+ *  Siblings older than the file are left out, they are not up to date.
+ *
+ *  @return A bit map of ENC_*
+ */
+static int find_variants(char *path, struct stat *s) {
+    char variant[2 * PATH_MAX + 8];
+    struct stat vs;
+    int found = 0, i;
+
+    for (i = 0; i < N_ENCODINGS; ++i) {
+        snprintf(variant, sizeof(variant), "%s%s", path, encodings[i].suffix);
+        if (stat(variant, &vs) == 0 && S_ISREG(vs.st_mode) &&
+            vs.st_mtime >= s->st_mtime)
+            found |= encodings[i].flag;
     }
+    return found;
+}
 
-    strcpy(mimetype, get_mimetype(path));
+/** @brief Cache key of an encoded copy of a file
+ *
+ *  The part of a path which comes from the URI has no space, so keys can't
+ *  clash with the path of a file.
+ *
+ *  @param path Path of the file itself
+ *  @return 0 if ok. -1 if the path is too long.
+ */
+static int variant_key(char *key, int size, char *path, int i) {
+    return snprintf(key, size, "%s %s", path, encodings[i].name) < size ? 0 : -1;
+}
 
-    strftime(last_modifiled, 128, "%a, %d %b %Y %H:%M:%S GMT", gmtime(&(s.st_mtime)));
+/** @brief Whether an If-None-Match list has the entity tag of a file
+ *
+ *  The weak comparison of RFC 7232 is used, W/ prefixes are ignored.
+ */
+static int etag_match(char *list, char *etag) {
+    int len = strlen(etag);
+    char *p = list, *end;
 
-    return fd;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            ++p;
+        if (*p == '*')
+            return 1;
+        if (strncmp(p, "W/", 2) == 0)
+            p += 2;
+        if (*p != '"') {
+            for (; *p && *p != ','; ++p);
+            continue;
+        }
+        if (strncmp(p, etag, len) == 0)
+            return 1;
+        if ((end = strchr(p + 1, '"')) == NULL)
+            break;
+        p = end + 1;
+    }
+    return 0;
 }
 
-/** @brief Handler for serving static file
+/** @brief Read a byte offset of a range
  *
- *  Send required response line and response headers to client and if the method
- *  is GET, a pipe between the open file and client socket will be setup
+ *  @return 0 if ok. -1 if there is no number or it's too large.
+ */
+static int get_offset(char **p, off_t *n) {
+    char *start = *p;
+
+    for (*n = 0; **p >= '0' && **p <= '9'; ++*p) {
+        if (*n > (LLONG_MAX - 9) / 10)
+            return -1;
+        *n = *n * 10 + **p - '0';
+    }
+    return *p > start ? 0 : -1;
+}
+
+/** @brief Parse a Range header against a file of size bytes
+ *
+ *  Only a single range is served. A list of ranges is ignored like an
+ *  invalid header, the whole file is sent then.
+ *
+ *  @return 1 with the range in [*first, *last] if it's satisfiable. 0 if it
+ *          isn't. -1 if the header is to be ignored.
+ */
+static int parse_range(char *spec, off_t size, off_t *first, off_t *last) {
+    char *p = spec + 6;
+    off_t n;
+
+    if (scan_casecmp(spec, "bytes=", 6) != 0 || strchr(p, ',') != NULL)
+        return -1;
+    while (*p == ' ')
+        ++p;
+
+    // Suffix range, the last n bytes
+    if (*p == '-') {
+        ++p;
+        if (get_offset(&p, &n) == -1 || *p != '\0')
+            return -1;
+        if (n == 0 || size == 0)
+            return 0;
+        *first = n < size ? size - n : 0;
+        *last = size - 1;
+        return 1;
+    }
+
+    if (get_offset(&p, first) == -1 || *p++ != '-')
+        return -1;
+    if (*p == '\0') {
+        *last = size - 1;
+    } else {
+        if (get_offset(&p, &n) == -1 || *p != '\0' || n < *first)
+            return -1;
+        *last = n < size - 1 ? n : size - 1;
+    }
+    return *first < size ? 1 : 0;
+}
+
+/** @brief Decide how to answer a request for a static file
+ *
+ *  Preconditions are evaluated as RFC 7232 says: If-None-Match, or
+ *  If-Modified-Since if there is no If-None-Match. A Range is then honoured
+ *  for GET requests, unless an If-Range doesn't match the file any more.
+ *
+ *  @param first,last Range of the file to be sent, the whole file unless
+ *                    PARTIAL_CONTENT is returned
+ *  @return OK, NOT_MODIFIED, PARTIAL_CONTENT or RANGE_NOT_SATISFIABLE
+ */
+static int evaluate(http_request_t *req, file_meta_t *meta, off_t size,
+                    time_t mtime, off_t *first, off_t *last) {
+    char *inm = get_known_header(req, H_IF_NONE_MATCH), *ims, *range, *cond;
+    time_t t;
+
+    *first = 0;
+    *last = size - 1;
+
+    if (inm) {
+        if (etag_match(inm, meta->etag))
+            return NOT_MODIFIED;
+    } else if ((ims = get_known_header(req, H_IF_MODIFIED_SINCE)) != NULL &&
+               (t = parse_date(ims)) != -1 && mtime <= t) {
+        return NOT_MODIFIED;
+    }
+
+    if (req->method != M_GET ||
+        (range = get_known_header(req, H_RANGE)) == NULL)
+        return OK;
+    // If-Range needs a strong match, which a date is only if it's exact
+    if ((cond = get_known_header(req, H_IF_RANGE)) != NULL &&
+        (cond[0] == '"' ? strcmp(cond, meta->etag) != 0 :
+                          parse_date(cond) != mtime))
+        return OK;
+
+    switch (parse_range(range, size, first, last)) {
+    case 1:
+        return PARTIAL_CONTENT;
+    case 0:
+        return RANGE_NOT_SATISFIABLE;
+    }
+    *first = 0;
+    *last = size - 1;
+    return OK;
+}
+
+/** @brief Print the response line and headers for a static file
+ *
+ *  Date and Connection are left to send_dynamic_headers(), so that the
+ *  header of a 200 can be cached with the file.
+ *
+ *  @param code What evaluate() decides
+ *  @return Length of the header
+ */
+static int build_header(char *buf, int len, int code, file_meta_t *meta,
+                        off_t size, off_t first, off_t last) {
+    char *vary = meta->variants ? "Vary: Accept-Encoding\r\n" : "";
+    char range[128] = "";
+
+    if (code == NOT_MODIFIED)
+        return snprintf(buf, len,
+            "%s 304 Not Modified\r\n"
+            "ETag: %s\r\n"
+            "Last-Modified: %s\r\n"
+            "%s"
+            "Server: Liso/1.0\r\n",
+            http_version, meta->etag, meta->last_modified, vary);
+
+    if (code == RANGE_NOT_SATISFIABLE)
+        return snprintf(buf, len,
+            "%s 416 Range Not Satisfiable\r\n"
+            "Content-Range: bytes */%lld\r\n"
+            "Content-Length: 0\r\n"
+            "Server: Liso/1.0\r\n",
+            http_version, (long long)size);
+
+    if (code == PARTIAL_CONTENT)
+        snprintf(range, sizeof(range), "Content-Range: bytes %lld-%lld/%lld\r\n",
+                 (long long)first, (long long)last, (long long)size);
+
+    return snprintf(buf, len,
+        "%s %s\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %lld\r\n"
+        "%s"
+        "Accept-Ranges: bytes\r\n"
+        "ETag: %s\r\n"
+        "Last-Modified: %s\r\n"
+        "%s%s%s"
+        "%s"
+        "Server: Liso/1.0\r\n",
+        http_version, code == OK ? "200 OK" : "206 Partial Content",
+        meta->type, (long long)(last - first + 1), range, meta->etag,
+        meta->last_modified, meta->coding ? "Content-Encoding: " : "",
+        meta->coding ? meta->coding : "", meta->coding ? "\r\n" : "", vary);
+}
+
+/** @brief Send a file from the cache. No file system access is needed
+ *
+ *  Header and body are queued by reference, and go out together with the
+ *  dynamic headers in one writev(). Responses other than a plain 200 get a
+ *  header of their own, and the part of the body asked for.
+ */
+static void send_cached_file(http_client_t *client, cache_entry_t *entry) {
+    char header[MAXBUF];
+    off_t first, last;
+    int code, len;
+
+    code = evaluate(client->req, &entry->meta, entry->size, entry->mtime,
+                    &first, &last);
+    client->req->status = code;
+    if (code == OK) {
+        log_msg(L_HTTP_DEBUG, "%.*s", entry->header_len, entry->header);
+        cache_hold(entry);
+        client_write_ref(client, entry->header, entry->header_len,
+                         cache_release, entry);
+    } else {
+        len = build_header(header, sizeof(header), code, &entry->meta,
+                           entry->size, first, last);
+        log_msg(L_HTTP_DEBUG, "%s", header);
+        client_write(client, header, len);
+    }
+    send_dynamic_headers(client);
+
+    if (client->req->method == M_GET &&
+        (code == OK || code == PARTIAL_CONTENT)) {
+        cache_hold(entry);
+        client_write_ref(client, entry->body + first, last - first + 1,
+                         cache_release, entry);
+    }
+}
+
+/** @brief Find a cached response for a file
+ *
+ *  The encoded copy the client accepts and prefers most is taken, the plain
+ *  file only if it has no such copy. Each entry knows the copies its file
+ *  had, so a copy not cached yet isn't passed over for a worse one.
+ *
+ *  @param path Path of the file
+ *  @param accepted Encodings accepted by the client
+ *  @return The entry. NULL if the file has to be read.
+ */
+static cache_entry_t* lookup_path(char *path, int accepted) {
+    char key[MAXBUF];
+    cache_entry_t *entry;
+    int i, missed = 0;
+
+    for (i = 0; i < N_ENCODINGS; ++i) {
+        if (!(accepted & encodings[i].flag))
+            continue;
+        if (variant_key(key, sizeof(key), path, i) == 0 &&
+            (entry = cache_lookup(key)) != NULL)
+            return (entry->meta.variants & missed) ? NULL : entry;
+        missed |= encodings[i].flag;
+    }
+
+    if ((entry = cache_lookup(path)) != NULL &&
+        (entry->meta.variants & accepted))
+        return NULL;
+    return entry;
+}
+
+/** @brief Find a cached response for a request
+ *
+ *  Entries are keyed by the path of the file sent, so a file has one entry
+ *  whatever the URI it's asked by. The path is made up as open_file() does,
+ *  without touching the file system: a URI which may be a directory is
+ *  looked up as its index.html too.
+ *
+ *  @param root Absolute path of www_folder
+ *  @return The entry. NULL if the file has to be read.
+ */
+static cache_entry_t* lookup_file(char *root, char *uri, int accepted) {
+    char path[MAXBUF];
+    cache_entry_t *entry;
+    int len;
+
+    len = snprintf(path, sizeof(path), "%s%s", root, uri);
+    if (len + (int)sizeof("/index.html") > (int)sizeof(path))
+        return NULL;
+
+    if (path[len - 1] != '/' && (entry = lookup_path(path, accepted)) != NULL)
+        return entry;
+    strcat(path, path[len - 1] == '/' ? "index.html" : "/index.html");
+    return lookup_path(path, accepted);
+}
+
+/** @brief Read a small file into memory and put it into the cache
+ *
+ *  @param key Cache key
+ *  @param header Response line and static headers of a 200
+ *  @return The cache entry. NULL on error, the file is then served from fd.
+ */
+static cache_entry_t* cache_file(char *key, int fd, char *path,
+                                 struct stat *s, file_meta_t *meta,
+                                 char *header, int header_len) {
+    cache_entry_t *entry;
+    char *body;
+    int n, total;
+
+    // Cached meanwhile by another request for the same file
+    if ((entry = cache_lookup(key)) != NULL && entry->mtime == s->st_mtime &&
+        entry->size == s->st_size)
+        return entry;
+
+    body = malloc(s->st_size > 0 ? s->st_size : 1);
+    for (total = 0; total < s->st_size; total += n) {
+        if ((n = pread(fd, body + total, s->st_size - total, total)) <= 0) {
+            log_error("cache_file read error");
+            free(body);
+            return NULL;
+        }
+    }
+
+    return cache_insert(key, path, s, meta, strndup(header, header_len),
+                        header_len, body);
+}
+
+/** @brief A static file looked up by an I/O thread
+ *
+ *  Filled in by open_static(), the handler goes on with it in
+ *  send_static_file().
+ */
+typedef struct static_file {
+    aio_job_t job;
+    http_client_t *client;      //<!NULL once the client is gone
+    char path[2 * PATH_MAX + 8];
+    int accepted;               //<!encodings accepted by the client
+    long cache_max;             //<!files up to this size are read whole
+    int fetch;                  //<!read the start of the file to be sent
+    int fd;                     //<!file opened, or negated status code
+    char *failed;               //<!what failed, logged by the loop
+    int err;                    //<!errno of the failure
+    struct stat s;
+    const char *type;
+    int variants;               //<!siblings of the file, ENC_*
+    int coding;                 //<!index in encodings of the sibling opened,
+                                //<!-1 for the file itself
+    off_t warm;                 //<!bytes from the start which have been read
+} static_file_t;
+
+/** @brief Open a static file, the part of serving it which waits for the disk
+ *
+ *  The preferred sibling accepted by the client is opened instead, if there
+ *  is one. Then a file small enough to be cached is read into the page
+ *  cache, or the start of a file to be sent, so the serving loop finds them
+ *  in memory. Runs in an I/O thread unless there is none.
+ */
+static void open_static(void *arg) {
+    static_file_t *f = arg;
+    off_t end = 0;
+    int vfd, i;
+
+    f->coding = -1;
+    f->warm = 0;
+    if ((f->fd = open_file(f->path, &f->s, &f->failed)) < 0) {
+        f->err = errno;
+        return;
+    }
+    f->type = get_mimetype(f->path);
+
+    // Switch to the preferred sibling
+    f->variants = find_variants(f->path, &f->s);
+    for (i = 0; i < N_ENCODINGS; ++i) {
+        if (!(f->variants & f->accepted & encodings[i].flag))
+            continue;
+        strcat(f->path, encodings[i].suffix);
+        if ((vfd = open(f->path, O_RDONLY)) != -1 && fstat(vfd, &f->s) == 0) {
+            close(f->fd);
+            f->fd = vfd;
+            f->coding = i;
+            break;
+        }
+        if (vfd != -1)
+            close(vfd);
+        f->path[strlen(f->path) - strlen(encodings[i].suffix)] = '\0';
+    }
+
+    if (f->s.st_size <= f->cache_max)
+        end = f->s.st_size;
+    else if (f->fetch)
+        end = f->s.st_size < AIO_WINDOW ? f->s.st_size : AIO_WINDOW;
+    f->warm = aio_fetch(f->fd, 0, end);
+}
+
+/** @brief Answer a request with a static file opened by open_static()
+ *
+ *  A file small enough is put into the cache and sent from there. Otherwise
+ *  the opened file is queued behind the headers if the method is GET.
  *
- *  @param client A pointer to corresponding client object
  *  @return 0 if OK. Return response status code on error
  */
-static int server_static_file(http_client_t *client) {
-    char buf[MAXBUF];
-    char last_modifiled[128], date[128], mimetype[128];
-    int size, fd;
-    time_t current_time;
+static int send_static_file(http_client_t *client, static_file_t *f) {
+    char key[MAXBUF], header[MAXBUF], *suffix;
+    struct stat *s = &f->s;
+    file_meta_t meta;
+    cache_entry_t *entry;
+    pipe_t *pp;
+    off_t first, last;
+    int header_len, code;
 
-    if ((fd = open_file(client->req->uri, &size, mimetype, last_modifiled)) < 0)
-        return -fd;
+    if (f->fd < 0) {
+        errno = f->err;
+        log_error(f->failed);
+        return -f->fd;
+    }
+    meta.type = f->type;
+    meta.coding = NULL;
+    meta.variants = f->variants;
 
-    current_time = time(NULL);
-    strftime(date, 128, "%a, %d %b %Y %H:%M:%S GMT", gmtime(&current_time));
+    // A sibling is keyed by the path of the file itself, see lookup_file()
+    if (f->coding >= 0) {
+        meta.coding = encodings[f->coding].name;
+        suffix = f->path + strlen(f->path) - strlen(encodings[f->coding].suffix);
+        *suffix = '\0';
+        if (variant_key(key, sizeof(key), f->path, f->coding) == -1)
+            key[0] = '\0';
+        *suffix = encodings[f->coding].suffix[0];
+    } else if (snprintf(key, sizeof(key), "%s", f->path) >= (int)sizeof(key)) {
+        key[0] = '\0';
+    }
 
-    sprintf(buf, "%d", size);
+    snprintf(meta.etag, ETAG_MAX, "\"%lx-%llx-%lx\"", (unsigned long)s->st_ino,
+             (unsigned long long)s->st_size, (unsigned long)s->st_mtime);
+    format_date(s->st_mtime, meta.last_modified);
 
-    send_response_line(client, OK);
-    send_header(client, "Content-Type", mimetype);
-    send_header(client, "Content-Length", buf);
-    send_header(client, "Date", date);
-    send_header(client, "Last-Modified", last_modifiled);
-    send_header(client, "Server", "Liso/1.0");
-    if (connection_close(client->req))
-        send_header(client, "Connection", "close");
-    else
-        send_header(client, "Connection", "keep-alive");
-    client_write_string(client, "\r\n");
+    if (key[0] && cache_fits(s->st_size)) {
+        header_len = build_header(header, sizeof(header), OK, &meta,
+                                  s->st_size, 0, s->st_size - 1);
+        if ((entry = cache_file(key, f->fd, f->path, s, &meta, header,
+                                header_len))) {
+            close(f->fd);
+            send_cached_file(client, entry);
+            return 0;
+        }
+    }
+
+    // The whole header block is printed at once
+    code = evaluate(client->req, &meta, s->st_size, s->st_mtime, &first, &last);
+    client->req->status = code;
+    header_len = build_header(header, sizeof(header), code, &meta, s->st_size,
+                              first, last);
+    client_write(client, header, header_len);
+    log_msg(L_HTTP_DEBUG, "%s", header);
+    send_dynamic_headers(client);
 
     /**
-     * A GET request should send the file content back to the client. Here, we
-     * just pipe the file directly to the client socket. See io_pipe() in io.c
-     * for more information
+     * A GET request should send the file content back to the client. The file
+     * is queued behind the headers and piped directly to the client socket
+     * when its turn comes. See io_send() and io_pipe() in io.c for more
+     * information. Meanwhile, pipelined requests can be handled.
      */
-    if (client->req->method == M_GET) {
-        client->pipe = init_pipe();
-        client->pipe->from_fd = fd;
-        add_read_fd(fd);
+    if (client->req->method == M_GET &&
+        (code == OK || code == PARTIAL_CONTENT)) {
+        pp = init_pipe();
+        pp->from_fd = f->fd;
+        pp->is_file = 1;
+        pp->file_offset = first;
+        pp->file_end = last + 1;
+        // Read ahead from the start of the file, not beyond the range
+        if (first < f->warm)
+            pp->ready_end = f->warm < last + 1 ? f->warm : last + 1;
+        pp->owner = client;
+        /*
+         * SSL connections can't use sendfile() unless the kernel does TLS.
+         * Let them encrypt large files straight from a shared mapping. The
+         * mapping also tells which part of a file is in memory.
+         */
+        if (s->st_size >= MMAP_THRESHOLD)
+            pp->map = map_file(f->fd, s);
+        chain_file(client->out, pp);
     }
     else
-        close(fd);
+        close(f->fd);
 
     return 0;
 }
 
+/** @brief The file of a request has been opened by an I/O thread
+ *
+ *  The request is answered now, as it would have been by the handler.
+ */
+static void file_opened(void *arg) {
+    static_file_t *f = arg;
+    http_client_t *client = f->client;
+    int code;
+
+    if (client == NULL) {
+        if (f->fd >= 0)
+            close(f->fd);
+        free(f);
+        return;
+    }
+
+    client->opening = NULL;
+    if ((code = send_static_file(client, f)) != 0)
+        end_request(client, code);
+    else
+        log_request(client, client->req->status);
+    client->status = C_IDLE;
+    aio_wake(client);
+    free(f);
+}
+
+/** @brief Forget the file a client is waiting for, when it's closed */
+void static_file_cancel(http_client_t *client) {
+    if (client->opening) {
+        client->opening->client = NULL;
+        client->opening = NULL;
+    }
+}
+
+/** @brief Handler for serving static file
+ *
+ *  Send required response line and response headers to client and if the method
+ *  is GET, the opened file is queued after them.
+ *
+ *  A precompressed sibling of the file (see encodings) is sent instead if
+ *  the client accepts its encoding. Responses of files with siblings vary
+ *  by Accept-Encoding.
+ *
+ *  Conditional requests are answered with 304 if the file hasn't changed,
+ *  and a single byte range with 206. The entity tag comes from the inode,
+ *  size and modification time of the file sent.
+ *
+ *  Small files are cached in memory (see file_cache.c). A cached file is
+ *  queued in the output chain by reference. Other files are opened by an I/O
+ *  thread (see aio.c), the client waits in C_PIPING and the response is
+ *  queued by file_opened().
+ *
+ *  @param client A pointer to corresponding client object
+ *  @return 0 if OK. Return response status code on error
+ */
+static int server_static_file(http_client_t *client) {
+    static_file_t *f;
+    cache_entry_t *entry;
+    char *uri = slice_str(client->req, client->req->uri), *root;
+    int accepted, code;
+
+    /* Get the absolute path of www_folder */
+    if ((root = get_www_root()) == NULL) {
+        log_error("open_file error: realpath error");
+        return INTERNAL_SERVER_ERROR;
+    }
+
+    accepted = accepted_encodings(client->req);
+    if ((entry = lookup_file(root, uri, accepted)) != NULL) {
+        send_cached_file(client, entry);
+        return 0;
+    }
+
+    f = malloc(sizeof(static_file_t));
+    init_job(&f->job, open_static, file_opened, f);
+    f->client = client;
+    strcpy(f->path, root);
+    strcat(f->path, uri);
+    f->accepted = accepted;
+    f->cache_max = cache_limit();
+    f->fetch = client->req->method == M_GET;
+    if (aio_submit(&f->job) == 0) {
+        client->opening = f;
+        return 0;
+    }
+
+    // No thread, the file is opened in place and read as it's sent
+    f->cache_max = -1;
+    f->fetch = 0;
+    open_static(f);
+    code = send_static_file(client, f);
+    free(f);
+    return code;
+}
+
 /** @brief */
 static char* create_string(char* format, ...) {
     char buf[MAXBUF];
@@ -174,7 +767,6 @@ static char* create_string(char* format, ...) {
 
     str = malloc(sizeof(char) * (strlen(buf) + 1));
     strcpy(str, buf);
-    str[strlen(buf) + 1] = '\0';
     return str;
 }
 
@@ -209,13 +801,13 @@ static char** setup_envp(http_client_t* client) {
     envp = malloc(sizeof(char*) * (RFC_VARS + req->cnt_headers + 1));
     /* AUTH_TYPE */
     envp[0] = create_string("AUTH_TYPE=");
-    /* CONTENT_LENGTH */
-    if (req->method == M_POST)
+    /* CONTENT_LENGTH, left out below for a chunked body still arriving */
+    if (req->method == M_POST && req->content_length >= 0)
         envp[1] = create_string("CONTENT_LENGTH=%d", req->content_length);
     else
         envp[1] = create_string("CONTENT_LENGTH=");
     /* CONTENT_TYPE */
-    tmp = get_request_header(req, "content-type");
+    tmp = get_known_header(req, H_CONTENT_TYPE);
     if (tmp == NULL)
         envp[2] = create_string("CONTENT_TYPE=");
     else
@@ -223,18 +815,17 @@ static char** setup_envp(http_client_t* client) {
     /* GATEWAY_INTERFACE */
     envp[3] = create_string("GATEWAY_INTERFACE=CGI/1.1");
     /* PATH_INFO */
-    envp[4] = create_string("PATH_INFO=%s", req->path);
+    envp[4] = create_string("PATH_INFO=%s", slice_str(req, req->path));
     /* PATH_TRANSLATED */
     envp[5] = create_string("PATH_TRANSLATED=");
     /* QUERY_STRING */
-    envp[6] = create_string("QUERY_STRING=%s", req->query);
+    envp[6] = create_string("QUERY_STRING=%s", slice_str(req, req->query));
     /* REMOTE_ADDR */
     envp[7] = create_string("REMOTE_ADDR=%s", client->remote_ip);
-    /* REMOTE_HOST */
-    if (client->remote_host == NULL)
-        envp[8] = create_string("REMOTE_HOST=");
-    else
-        envp[8] = create_string("REMOTE_HOST=%s", client->remote_host);
+    /* REMOTE_HOST, the address is substituted until the name is known */
+    tmp = resolve_host(client->remote_ip);
+    envp[8] = create_string("REMOTE_HOST=%s",
+                            tmp == NULL ? client->remote_ip : tmp);
     /* REMOTE_IDENT */
     envp[9] = create_string("REMOTE_IDENT=");
     /* REMOTE_USER */
@@ -260,12 +851,17 @@ static char** setup_envp(http_client_t* client) {
     /* SERVER_SOFTWARE */
     envp[16] = create_string("SERVER_SOFTWARE=Liso/1.0");
     /* REQUEST_URI */
-    envp[17] = create_string("REQUEST_URI=%s", req->uri);
+    envp[17] = create_string("REQUEST_URI=%s", slice_str(req, req->uri));
     /* HTTP request headers */
     i = RFC_VARS; // Index in envp
     for (h = req->headers; h != NULL; h = h->next) {
-        translate_header(h->key, buf);
-        envp[i++] = create_string("HTTP_%s=%s", buf, h->val);
+        translate_header(slice_str(req, h->key), buf);
+        envp[i++] = create_string("HTTP_%s=%s", buf, slice_str(req, h->val));
+    }
+    // Length unknown, the script reads the body until EOF
+    if (req->method == M_POST && req->content_length < 0) {
+        free(envp[1]);
+        envp[1] = envp[--i];
     }
     // Terminate the array by NULL
     envp[i] = NULL;
@@ -273,11 +869,35 @@ static char** setup_envp(http_client_t* client) {
     return envp;
 }
 
+/** @brief Free environment variables created by setup_envp() */
+static void free_envp(char **envp) {
+    int i;
+
+    for (i = 0; envp[i] != NULL; ++i)
+        free(envp[i]);
+    free(envp);
+}
+
+/** @brief Handle a CGI request with the FastCGI worker pool
+ *
+ *  @return 0 if ok. HTTP status code if something goes wrong
+ */
+static int fcgi_handler(http_client_t *client) {
+    char **envp = setup_envp(client);
+    int ret;
+
+    // The body is passed on as it arrives, see feed_cgi()
+    ret = fcgi_submit(client, envp, client->body_stream);
+    free_envp(envp);
+
+    return ret == -1 ? SERVICE_UNAVAILABLE : 0;
+}
+
 /** @brief Handle a CGI request
  *
  *  Use fork() to create a new process to run cgi script. Use pipe to feed
- *  request body to stdin of the cgi script. Setup pipe for stdout of the
- *  cgi script.
+ *  request body to stdin of the cgi script, which is done by feed_cgi() while
+ *  the body arrives. Setup pipe for stdout of the cgi script.
  *
  *  @return 0 if ok. HTTP status code if something goes wrong
  */
@@ -285,9 +905,12 @@ static int cgi_handler(http_client_t *client) {
     pid_t pid;
     char path[PATH_MAX * 2];
     int stdin_pipe[2], stdout_pipe[2];
-    int bytes_left, n;
     char **envp;
     char* argv[] = { NULL, NULL };
+    unsigned long start;
+
+    if (fcgi_enabled())
+        return fcgi_handler(client);
 
     /* Get the absolute path of cgi_path */
     if (realpath(cgi_path, path) == NULL) {
@@ -316,9 +939,17 @@ static int cgi_handler(http_client_t *client) {
         return INTERNAL_SERVER_ERROR;
     }
 
+    /*
+     * Environment is set up before fork(), so that a host name lookup
+     * started for REMOTE_HOST is remembered by the server
+     */
+    envp = setup_envp(client);
+
     /* Create subprocess */
+    start = metrics_clock();
     if ((pid = fork()) < 0) {
         log_error("launch_cgi fork() error");
+        free_envp(envp);
         return INTERNAL_SERVER_ERROR;
     }
 
@@ -336,7 +967,6 @@ static int cgi_handler(http_client_t *client) {
             exit(EXIT_FAILURE);
         }
 
-        envp = setup_envp(client);
         if (execve(argv[0], argv, envp)) {
             log_error("exceve error");
             exit(EXIT_FAILURE);
@@ -345,33 +975,36 @@ static int cgi_handler(http_client_t *client) {
 
     /* Main routine continues */
     if (pid > 0) {
+        hist_record(&metrics->fork, metrics_clock() - start);
+        ++metrics->cgi_forks;
         log_msg(L_INFO, "Start child process %d\n", pid);
+        free_envp(envp);
 
         close(stdin_pipe[0]);
         close(stdout_pipe[1]);
+        // Later cgi processes must not hold our ends of the pipes
+        fcntl(stdin_pipe[1], F_SETFD, FD_CLOEXEC);
+        fcntl(stdout_pipe[0], F_SETFD, FD_CLOEXEC);
 
-        /* Write request body to subprocess */
-        if (client->req->method == M_POST) {
-            bytes_left = client->req->content_length;
-            /* We don't want to be block when passing data to subprocess */
+        /* Request body is passed on as it arrives, see feed_cgi() */
+        if (client->body_stream) {
             fcntl(stdin_pipe[1], F_SETFL, O_NONBLOCK);
-            while ((n = write(stdin_pipe[1], client->req->body,
-                    bytes_left)) > 0)
-                bytes_left -= n;
-
-            // Error writing bytes to subprocess
-            if (bytes_left > 0 || n == -1) {
-                log_msg(L_ERROR, "fail to send request body to subprocess\n");
-                kill(pid, SIGKILL);
-                close(stdin_pipe[1]);
-                return INTERNAL_SERVER_ERROR;
-            }
+            client->cgi_in = stdin_pipe[1];
+            set_fd_data(stdin_pipe[1], client);
+        } else {
+            close(stdin_pipe[1]);
         }
-        close(stdin_pipe[1]);
 
-        /* setup pipe from subprocess output */
+        /*
+         * setup pipe from subprocess output, framed if it has no length.
+         * An HTTP/2 stream is framed by its connection instead.
+         */
         client->pipe = init_pipe();
         client->pipe->from_fd = stdout_pipe[0];
+        client->pipe->encode = client->stream == NULL;
+        init_chunk_encoder(&client->pipe->enc);
+        fcntl(stdout_pipe[0], F_SETFL, O_NONBLOCK);
+        set_fd_data(stdout_pipe[0], client);
         add_read_fd(stdout_pipe[0]);
 
          return 0;
@@ -382,6 +1015,40 @@ static int cgi_handler(http_client_t *client) {
     return -1;
 }
 
+/** @brief Whether the request is for the metrics page
+ *
+ *  Only clients on the loopback get it, others see the site as it is.
+ */
+static int is_metrics(http_client_t *client) {
+    return strncmp(client->remote_ip, "127.", 4) == 0 &&
+        strcmp(slice_str(client->req, client->req->uri), METRICS_URI) == 0;
+}
+
+/** @brief Send the metrics page, rendered for each request
+ *
+ *  @return 0 if ok
+ */
+static int metrics_handler(http_client_t *client) {
+    char *page, *header;
+    int len;
+
+    page = render_metrics(&len);
+    send_response_line(client, OK);
+    header = chain_printf(client->out,
+                          "Content-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: %d\r\n"
+                          "Cache-Control: no-store\r\n"
+                          "Server: Liso/1.0\r\n", len);
+    log_msg(L_HTTP_DEBUG, "%s", header);
+    send_dynamic_headers(client);
+
+    if (client->req->method == M_GET)
+        client_write_ref(client, page, len, free, page);
+    else
+        free(page);
+    return 0;
+}
+
 /** @brief Internal handler
  *
  *  This process will be called by both handle_get and handle_head. It only
@@ -394,6 +1061,8 @@ static int cgi_handler(http_client_t *client) {
 static int internal_handler(http_client_t *client) {
     if (client->req->is_cgi) {
         return cgi_handler(client);
+    } else if (client->req->method != M_POST && is_metrics(client)) {
+        return metrics_handler(client);
     } else if (client->req->method != M_POST) {
         return server_static_file(client);
     }
@@ -410,13 +1079,17 @@ static int internal_handler(http_client_t *client) {
 int handle_get(http_client_t *client) {
     int ret = internal_handler(client);
 
-    log_msg(L_INFO, "Handle GET request. URI: %s\n", client->req->uri);
+    log_msg(L_INFO, "Handle GET request. URI: %s\n",
+            slice_str(client->req, client->req->uri));
 
     /*
-     * If internal_handler processes without error, the content of the static
-     * file will be pipe to client.
+     * If internal_handler processes without error, the output of a cgi script
+     * will be piped to client. Static files, cached or not, have been queued
+     * in the output chain already, unless an I/O thread is opening one.
+     * FastCGI output is passed on as it arrives.
      */
-    if (ret == 0)
+    if (ret == 0 && (client->pipe != NULL || client->fcgi != NULL ||
+                     client->opening != NULL))
         client->status = C_PIPING;
     else
         client->status = C_IDLE;
@@ -431,8 +1104,9 @@ int handle_get(http_client_t *client) {
 int handle_head(http_client_t *client) {
     int ret = internal_handler(client);
 
-    log_msg(L_INFO, "Handle HEAD request. URI: %s\n", client->req->uri);
-    client->status = C_IDLE;
+    log_msg(L_INFO, "Handle HEAD request. URI: %s\n",
+            slice_str(client->req, client->req->uri));
+    client->status = ret == 0 && client->opening != NULL ? C_PIPING : C_IDLE;
     return ret;
 }
 
@@ -443,15 +1117,173 @@ int handle_head(http_client_t *client) {
  */
 int handle_post(http_client_t *client) {
     int ret = internal_handler(client);
-    log_msg(L_INFO, "Handle POST request. URI: %s\n", client->req->uri);
+    log_msg(L_INFO, "Handle POST request. URI: %s\n",
+            slice_str(client->req, client->req->uri));
 
     /*
      * If successfully running cgi script, the output will be piped to client.
      */
-    if (ret == 0)
+    if (ret == 0 && (client->pipe != NULL || client->fcgi != NULL ||
+                     client->opening != NULL))
         client->status = C_PIPING;
     else
         client->status = C_IDLE;
 
     return ret;
 }
+
+/** @brief Whether the body of current request is streamed to a cgi script
+ *
+ *  Such a request is handled as soon as its headers are parsed, and the body
+ *  is passed on by feed_cgi(), to a forked script or a FastCGI worker. The body of other POST requests is
+ *  received completely first.
+ */
+int stream_body(http_client_t *client) {
+    return client->req->is_cgi;
+}
+
+/** @brief Stop passing request body to the cgi script */
+static void close_cgi_in(http_client_t *client) {
+    if (client->cgi_in == -1)
+        return;
+
+    remove_write_fd(client->cgi_in);
+    set_fd_data(client->cgi_in, NULL);
+    close(client->cgi_in);
+    client->cgi_in = -1;
+}
+
+/** @brief Bytes of request body in the input buffer ready to be consumed */
+static int body_ready(http_client_t *client) {
+    buf_t *in = client->in;
+
+    if (client->dechunk.state != CD_IDLE)
+        return client->body_raw - in->pos;
+    return in->datasize - in->pos < client->body_left ?
+           in->datasize - in->pos : client->body_left;
+}
+
+/** @brief Give up the rest of request body, which can't be found
+ *
+ *  The cgi script gets what has been received so far.
+ */
+void cut_body(http_client_t *client) {
+    if (client->dechunk.state != CD_IDLE)
+        client->dechunk.state = CD_DONE;
+    else
+        client->body_left = body_ready(client);
+}
+
+/** @brief Pass request body received so far to the cgi script
+ *
+ *  The body is written to the stdin pipe of the script without blocking. If
+ *  the pipe is full, it's watched for writability, and the input buffer holds
+ *  up to BODY_BACKLOG bytes before the client socket stops being read. Thus a
+ *  slow script slows down the upload instead of growing the buffer. A
+ *  FastCGI worker is fed the same way, see fcgi_feed().
+ *
+ *  A chunked body is decoded first. If its encoding is broken, or it grows
+ *  beyond MAX_BODY, the end of the request can't be found, so the script gets
+ *  what has been decoded and the connection is closed after the response.
+ *
+ *  Once the script is gone, or if it never started, the rest of the body is
+ *  received and dropped, so that it's not mistaken for the next request.
+ *
+ *  @return Void
+ */
+void feed_cgi(http_client_t *client) {
+    buf_t *in = client->in;
+    int chunked = client->dechunk.state != CD_IDLE;
+    int n;
+
+    if (chunked && (client_dechunk(client) == -1 ||
+                    client->dechunk.total > MAX_BODY)) {
+        log_msg(L_ERROR, "Bad or too large chunked request body\n");
+        client->alive = 0;
+        client->dechunk.state = CD_DONE;
+        in->datasize = client->body_raw;
+    }
+
+    while ((n = body_ready(client)) > 0) {
+        if (client->fcgi != NULL) {
+            if ((n = fcgi_feed(client, in->buf + in->pos, n)) == 0)
+                break;
+        } else if (client->cgi_in != -1 &&
+            (n = write(client->cgi_in, in->buf + in->pos, n)) == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                clear_write_fd(client->cgi_in);
+                add_write_fd(client->cgi_in);
+                break;
+            }
+            // The script exits without reading all of the body
+            log_error("feed_cgi write error");
+            close_cgi_in(client);
+            continue;
+        }
+
+        in->pos += n;
+        if (!chunked)
+            client->body_left -= n;
+    }
+
+    // Nothing to write. Don't wake up for a writable pipe.
+    if (client->cgi_in != -1 && body_ready(client) == 0)
+        remove_write_fd(client->cgi_in);
+
+    // Keep the request in place, only drop body which has been consumed
+    n = io_discard(in, client->body_start);
+    if (chunked)
+        client->body_raw -= n;
+
+    if (chunked && client->dechunk.state == CD_DONE && body_ready(client) == 0)
+        client->dechunk.state = CD_IDLE;
+    if (client->dechunk.state == CD_IDLE && client->body_left == 0) {
+        close_cgi_in(client);
+        fcgi_end_body(client);
+        client->body_stream = 0;
+        in->limit = 0;
+    }
+}
+
+/** @brief Whether any of the response of the cgi script has come out
+ *
+ *  A stream of HTTP/2 collects the response itself, see h2_gateway_timeout().
+ */
+static int cgi_replied(http_client_t *client) {
+    chunk_encoder_t *e;
+
+    if (client->fcgi != NULL)
+        return client->fcgi->replied;
+    if (client->pipe == NULL || !client->pipe->encode)
+        return 0;
+    e = &client->pipe->enc;
+    return e->state != CE_HEAD || e->lines > 0 || e->line_len > 0;
+}
+
+/** @brief The cgi script has taken too long to respond, give up on it
+ *
+ *  The script or FastCGI worker is let go. If none of its response has been
+ *  sent, the client gets 504, otherwise the response is cut. Either way the
+ *  connection is to be closed.
+ */
+void gateway_timeout(http_client_t *client) {
+    int replied = cgi_replied(client);
+
+    log_msg(L_ERROR, "No response from the cgi script in time\n");
+    close_cgi_in(client);
+    client->body_stream = 0;
+    if (client->pipe != NULL) {
+        deinit_pipe(client->pipe);
+        client->pipe = NULL;
+    }
+    fcgi_cancel(client);
+
+    if (replied) {
+        client->status = C_IDLE;
+        client->alive = 0;
+    } else {
+        end_request(client, GATEWAY_TIMEOUT);
+    }
+}
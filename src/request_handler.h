@@ -8,9 +8,31 @@
 
 #include "http_client.h"
 
+/*
+ * Maximum bytes of request body buffered while the cgi script is not ready
+ * to read it. The client socket is not read beyond this.
+ */
+#define BODY_BACKLOG (64 << 10)
+
+/* Maximum bytes of request body accepted, larger ones get 413 */
+#define MAX_BODY (16 << 20)
+
+/* Content codings of precompressed static files */
+#define ENC_GZIP 0x1
+#define ENC_BR 0x2
+#define ENC_ALL (ENC_GZIP | ENC_BR)
+
 /* Request handlers */
 int handle_get(http_client_t *client);
 int handle_post(http_client_t *client);
 int handle_head(http_client_t *client);
 
+/* Request body streaming */
+int stream_body(http_client_t *client);
+void feed_cgi(http_client_t *client);
+void cut_body(http_client_t *client);
+void gateway_timeout(http_client_t *client);
+
+void static_file_cancel(http_client_t *client);
+
 #endif
\ No newline at end of file
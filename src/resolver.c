@@ -0,0 +1,227 @@
+/** @file resolver.c
+ *  @brief Reverse DNS lookups off the serving loop
+ *
+ *  Looking up the name of a client blocks for as long as the DNS server
+ *  takes, so it's never done by the serving loop itself. A few helper
+ *  processes do the lookups, receiving addresses and sending back names over
+ *  a socket pair. The socket keeps message boundaries, so each message is a
+ *  whole request or reply, and an idle helper picks up the next request.
+ *
+ *  Names are only looked up when asked for by resolve_host(), that is when a
+ *  cgi request needs REMOTE_HOST, and are cached for RESOLVER_TTL seconds. A
+ *  request arriving before the answer gets the address instead, which RFC
+ *  3875 allows when the name is not available.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "resolver.h"
+#include "event.h"
+#include "log.h"
+
+static int nhelpers = 0;
+static pid_t *pids;                 //pid of each helper
+static volatile int *exited;        //set by SIGCHLD handler
+static int server_sock = -1;        //end of the socket pair for the server
+static int helper_sock = -1;        //end of the socket pair for helpers
+
+static resolver_entry_t cache[RESOLVER_CACHE];
+
+/** @brief Main loop of a helper, looks up each address received */
+static void helper_loop() {
+    struct sockaddr_in sa;
+    resolver_reply_t reply;
+    int n;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    // Ends when the server closes its end of the socket pair
+    while ((n = recv(helper_sock, &sa.sin_addr, sizeof(sa.sin_addr), 0))) {
+        if (n == -1 && errno != EINTR)
+            break;
+        if (n != sizeof(sa.sin_addr))
+            continue;
+        reply.addr = sa.sin_addr;
+        if (getnameinfo((struct sockaddr *)&sa, sizeof(sa), reply.name,
+                        sizeof(reply.name), NULL, 0, NI_NAMEREQD) != 0)
+            reply.name[0] = '\0';
+        send(helper_sock, &reply, sizeof(reply), 0);
+    }
+}
+
+/** @brief Start a helper process
+ *
+ *  Everything inherited from the server except the socket is closed, so
+ *  that a helper doesn't keep the connections of the server open.
+ */
+static pid_t spawn_helper() {
+    pid_t pid;
+    int fd, max;
+
+    if ((pid = fork()) < 0) {
+        log_error("resolver spawn_helper fork error");
+        return -1;
+    }
+
+    if (pid == 0) {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGHUP, SIG_DFL);
+        max = sysconf(_SC_OPEN_MAX);
+        for (fd = STDERR_FILENO + 1; fd < max; ++fd)
+            if (fd != helper_sock)
+                close(fd);
+        helper_loop();
+        exit(EXIT_SUCCESS);
+    }
+
+    return pid;
+}
+
+/** @brief Start helpers doing reverse lookups
+ *
+ *  @param helpers Number of helper processes
+ *  @return 0 on success. -1 on error, names are not looked up then.
+ */
+int init_resolver(int helpers) {
+    int sv[2], i;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+        log_error("init_resolver socketpair error");
+        return -1;
+    }
+    server_sock = sv[0];
+    helper_sock = sv[1];
+    fcntl(server_sock, F_SETFD, FD_CLOEXEC);
+    fcntl(helper_sock, F_SETFD, FD_CLOEXEC);
+    fcntl(server_sock, F_SETFL, O_NONBLOCK);
+    add_read_fd(server_sock);
+
+    memset(cache, 0, sizeof(cache));
+    nhelpers = helpers;
+    pids = malloc(sizeof(pid_t) * helpers);
+    exited = calloc(helpers, sizeof(int));
+    for (i = 0; i < helpers; ++i)
+        pids[i] = spawn_helper();
+
+    return 0;
+}
+
+/** @brief Stop all helpers and release resources */
+void deinit_resolver() {
+    int i;
+
+    if (server_sock == -1)
+        return;
+
+    for (i = 0; i < nhelpers; ++i)
+        if (pids[i] > 0)
+            kill(pids[i], SIGTERM);
+    remove_read_fd(server_sock);
+    close(server_sock);
+    close(helper_sock);
+    server_sock = helper_sock = -1;
+    free(pids);
+    free((void *)exited);
+    nhelpers = 0;
+}
+
+/** @brief Cache slot of an address */
+static resolver_entry_t* slot(struct in_addr addr) {
+    unsigned int h = ntohl(addr.s_addr);
+
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return &cache[h & (RESOLVER_CACHE - 1)];
+}
+
+/** @brief Name of the host with address ip
+ *
+ *  The name is returned if it's in the cache. Otherwise a lookup is started
+ *  for later requests, and this one doesn't wait for it.
+ *
+ *  @param ip IPv4 address in dotted form
+ *  @return The name, valid until the next call of resolver_poll(). NULL if
+ *          it's not known yet or the address has no name.
+ */
+char* resolve_host(char *ip) {
+    struct in_addr addr;
+    resolver_entry_t *e;
+    time_t now;
+
+    if (server_sock == -1 || inet_pton(AF_INET, ip, &addr) != 1)
+        return NULL;
+
+    e = slot(addr);
+    now = time(NULL);
+    if (e->state != R_EMPTY && e->addr.s_addr == addr.s_addr &&
+        now < e->expires)
+        return e->state == R_DONE && e->name[0] != '\0' ? e->name : NULL;
+
+    // A full socket means helpers are behind, try again next time
+    if (send(server_sock, &addr, sizeof(addr), 0) == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            log_error("resolve_host send error");
+        return NULL;
+    }
+
+    e->addr = addr;
+    e->state = R_PENDING;
+    e->expires = now + RESOLVER_TIMEOUT;
+    e->name[0] = '\0';
+    return NULL;
+}
+
+/** @brief Collect answers from helpers and restart those exited
+ *
+ *  Should be called in every iteration of the serving loop.
+ */
+void resolver_poll() {
+    resolver_reply_t reply;
+    resolver_entry_t *e;
+    int i, n;
+
+    for (i = 0; i < nhelpers; ++i) {
+        if (exited[i]) {
+            exited[i] = 0;
+            log_msg(L_ERROR, "Resolver helper %d exited\n", pids[i]);
+            pids[i] = spawn_helper();
+        }
+    }
+
+    if (server_sock == -1 || !test_read_fd(server_sock))
+        return;
+
+    while ((n = recv(server_sock, &reply, sizeof(reply), 0)) > 0) {
+        if (n != sizeof(reply))
+            continue;
+        // Only the lookup still waited for is filled in
+        e = slot(reply.addr);
+        if (e->state != R_PENDING || e->addr.s_addr != reply.addr.s_addr)
+            continue;
+        reply.name[sizeof(reply.name) - 1] = '\0';
+        strcpy(e->name, reply.name);
+        e->state = R_DONE;
+        e->expires = time(NULL) +
+            (e->name[0] ? RESOLVER_TTL : RESOLVER_NEGATIVE_TTL);
+    }
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        clear_read_fd(server_sock);
+}
+
+/** @brief Mark a helper as exited, called by the SIGCHLD handler */
+void resolver_child_exited(pid_t pid) {
+    int i;
+
+    for (i = 0; i < nhelpers; ++i)
+        if (pids[i] == pid)
+            exited[i] = 1;
+}
@@ -0,0 +1,54 @@
+/** @file resolver.h
+ *  @brief Header file for resolver.c
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __RESOLVER_H__
+#define __RESOLVER_H__
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <time.h>
+
+/* Number of helper processes doing lookups for each worker */
+#define RESOLVER_HELPERS 2
+
+/* Number of addresses whose names are cached, must be a power of 2 */
+#define RESOLVER_CACHE 1024
+
+/*
+ * Seconds a name, or the lack of it, is cached. A lookup without an answer
+ * after RESOLVER_TIMEOUT is tried again.
+ */
+#define RESOLVER_TTL 300
+#define RESOLVER_NEGATIVE_TTL 60
+#define RESOLVER_TIMEOUT 10
+
+/* States of a cache entry */
+#define R_EMPTY 0
+#define R_PENDING 1         // Waiting for a helper to answer
+#define R_DONE 2            // Name known, or known not to exist if empty
+
+/** @brief Answer of a helper to a lookup */
+typedef struct {
+    struct in_addr addr;
+    char name[NI_MAXHOST];  //<!empty if the address has no name
+} resolver_reply_t;
+
+/** @brief A cached reverse lookup */
+typedef struct {
+    struct in_addr addr;
+    int state;              //<!R_*
+    time_t expires;         //<!when the entry stops being valid
+    char name[NI_MAXHOST];
+} resolver_entry_t;
+
+int init_resolver(int helpers);
+void deinit_resolver();
+
+char* resolve_host(char *ip);
+void resolver_poll();
+void resolver_child_exited(pid_t pid);
+
+#endif
@@ -0,0 +1,308 @@
+/** @file scan.c
+ *  @brief Vectorized scanning of request text
+ *
+ *  Parsing a request is mostly looking for delimiters ('\n', ':', spaces)
+ *  and comparing tokens ignoring case. These loops are done 16 or 32 bytes
+ *  at a time with SSE2/AVX2 on x86 and NEON on ARM, and byte by byte for
+ *  the rest of a buffer or on other CPUs.
+ *
+ *  Kernels are chosen by init_scan() according to what the running CPU
+ *  supports. Until then, the portable ones are used.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include "scan.h"
+#include "log.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define USE_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__)
+#define USE_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+#if defined(__aarch64__)
+#define USE_NEON
+#include <arm_neon.h>
+#endif
+
+/*===========================Portable kernels============================*/
+static int scalar_find_char(const char *buf, int len, char c) {
+    int i;
+
+    for (i = 0; i < len; ++i)
+        if (buf[i] == c)
+            break;
+    return i;
+}
+
+static int scalar_find_space(const char *buf, int len) {
+    int i;
+
+    for (i = 0; i < len; ++i)
+        if (buf[i] == ' ' || buf[i] == '\t')
+            break;
+    return i;
+}
+
+static int scalar_skip_space(const char *buf, int len) {
+    int i;
+
+    for (i = 0; i < len; ++i)
+        if (buf[i] != ' ' && buf[i] != '\t')
+            break;
+    return i;
+}
+
+static int scalar_casecmp(const char *s1, const char *s2, int len) {
+    int i;
+    char c1, c2;
+
+    for (i = 0; i < len; ++i) {
+        c1 = s1[i]; c2 = s2[i];
+        if (c1 >= 'A' && c1 <= 'Z')
+            c1 = c1 - 'A' + 'a';
+        if (c2 >= 'A' && c2 <= 'Z')
+            c2 = c2 - 'A' + 'a';
+        if (c1 != c2) return 1;
+    }
+    return 0;
+}
+
+static scan_ops_t scalar_ops = {
+    "scalar", scalar_find_char, scalar_find_space, scalar_skip_space,
+    scalar_casecmp
+};
+
+/*=============================SSE2 kernels==============================*/
+#ifdef USE_SSE2
+#define LOAD16(p) _mm_loadu_si128((const __m128i *)(p))
+
+static int sse2_find_char(const char *buf, int len, char c) {
+    __m128i v = _mm_set1_epi8(c);
+    int i, m;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        m = _mm_movemask_epi8(_mm_cmpeq_epi8(LOAD16(buf + i), v));
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+    return i + scalar_find_char(buf + i, len - i, c);
+}
+
+/** @brief Bit mask of spaces and tabs in 16 bytes */
+static inline int sse2_spaces(const char *p) {
+    __m128i x = LOAD16(p);
+
+    return _mm_movemask_epi8(_mm_or_si128(
+        _mm_cmpeq_epi8(x, _mm_set1_epi8(' ')),
+        _mm_cmpeq_epi8(x, _mm_set1_epi8('\t'))));
+}
+
+static int sse2_find_space(const char *buf, int len) {
+    int i, m;
+
+    for (i = 0; i + 16 <= len; i += 16)
+        if ((m = sse2_spaces(buf + i)) != 0)
+            return i + __builtin_ctz(m);
+    return i + scalar_find_space(buf + i, len - i);
+}
+
+static int sse2_skip_space(const char *buf, int len) {
+    int i, m;
+
+    for (i = 0; i + 16 <= len; i += 16)
+        if ((m = ~sse2_spaces(buf + i) & 0xffff) != 0)
+            return i + __builtin_ctz(m);
+    return i + scalar_skip_space(buf + i, len - i);
+}
+
+/** @brief Turn 'A'-'Z' into lower case. Bytes >= 0x80 compare as negative */
+static inline __m128i sse2_lower(__m128i x) {
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)),
+                                  _mm_cmplt_epi8(x, _mm_set1_epi8('Z' + 1)));
+    return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+static int sse2_casecmp(const char *s1, const char *s2, int len) {
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16)
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(sse2_lower(LOAD16(s1 + i)),
+                sse2_lower(LOAD16(s2 + i)))) != 0xffff)
+            return 1;
+    return scalar_casecmp(s1 + i, s2 + i, len - i);
+}
+
+static scan_ops_t sse2_ops = {
+    "sse2", sse2_find_char, sse2_find_space, sse2_skip_space, sse2_casecmp
+};
+#endif
+
+/*=============================AVX2 kernels==============================*/
+#ifdef USE_AVX2
+#define AVX2 __attribute__ ((target("avx2")))
+#define LOAD32(p) _mm256_loadu_si256((const __m256i *)(p))
+
+AVX2 static int avx2_find_char(const char *buf, int len, char c) {
+    __m256i v = _mm256_set1_epi8(c);
+    unsigned int m;
+    int i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(LOAD32(buf + i), v));
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+    return i + sse2_find_char(buf + i, len - i, c);
+}
+
+AVX2 static inline unsigned int avx2_spaces(const char *p) {
+    __m256i x = LOAD32(p);
+
+    return _mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')),
+        _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\t'))));
+}
+
+AVX2 static int avx2_find_space(const char *buf, int len) {
+    unsigned int m;
+    int i;
+
+    for (i = 0; i + 32 <= len; i += 32)
+        if ((m = avx2_spaces(buf + i)) != 0)
+            return i + __builtin_ctz(m);
+    return i + sse2_find_space(buf + i, len - i);
+}
+
+AVX2 static int avx2_skip_space(const char *buf, int len) {
+    unsigned int m;
+    int i;
+
+    for (i = 0; i + 32 <= len; i += 32)
+        if ((m = ~avx2_spaces(buf + i)) != 0)
+            return i + __builtin_ctz(m);
+    return i + sse2_skip_space(buf + i, len - i);
+}
+
+AVX2 static inline __m256i avx2_lower(__m256i x) {
+    __m256i upper = _mm256_and_si256(
+        _mm256_cmpgt_epi8(x, _mm256_set1_epi8('A' - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), x));
+    return _mm256_or_si256(x, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+AVX2 static int avx2_casecmp(const char *s1, const char *s2, int len) {
+    int i;
+
+    for (i = 0; i + 32 <= len; i += 32)
+        if ((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                avx2_lower(LOAD32(s1 + i)), avx2_lower(LOAD32(s2 + i)))) !=
+                0xffffffffu)
+            return 1;
+    return sse2_casecmp(s1 + i, s2 + i, len - i);
+}
+
+static scan_ops_t avx2_ops = {
+    "avx2", avx2_find_char, avx2_find_space, avx2_skip_space, avx2_casecmp
+};
+#endif
+
+/*=============================NEON kernels==============================*/
+#ifdef USE_NEON
+#define LOADQ(p) vld1q_u8((const uint8_t *)(p))
+
+static int neon_find_char(const char *buf, int len, char c) {
+    uint8x16_t v = vdupq_n_u8(c);
+    int i;
+
+    // Find the block with a match, then the byte within
+    for (i = 0; i + 16 <= len; i += 16)
+        if (vmaxvq_u8(vceqq_u8(LOADQ(buf + i), v)))
+            return i + scalar_find_char(buf + i, 16, c);
+    return i + scalar_find_char(buf + i, len - i, c);
+}
+
+static inline uint8x16_t neon_spaces(const char *p) {
+    uint8x16_t x = LOADQ(p);
+
+    return vorrq_u8(vceqq_u8(x, vdupq_n_u8(' ')), vceqq_u8(x, vdupq_n_u8('\t')));
+}
+
+static int neon_find_space(const char *buf, int len) {
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16)
+        if (vmaxvq_u8(neon_spaces(buf + i)))
+            return i + scalar_find_space(buf + i, 16);
+    return i + scalar_find_space(buf + i, len - i);
+}
+
+static int neon_skip_space(const char *buf, int len) {
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16)
+        if (vminvq_u8(neon_spaces(buf + i)) == 0)
+            return i + scalar_skip_space(buf + i, 16);
+    return i + scalar_skip_space(buf + i, len - i);
+}
+
+static inline uint8x16_t neon_lower(uint8x16_t x) {
+    // x - 'A' <= 'Z' - 'A' as unsigned means upper case
+    uint8x16_t upper = vcleq_u8(vsubq_u8(x, vdupq_n_u8('A')),
+                                vdupq_n_u8('Z' - 'A'));
+    return vorrq_u8(x, vandq_u8(upper, vdupq_n_u8(0x20)));
+}
+
+static int neon_casecmp(const char *s1, const char *s2, int len) {
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16)
+        if (vminvq_u8(vceqq_u8(neon_lower(LOADQ(s1 + i)),
+                               neon_lower(LOADQ(s2 + i)))) == 0)
+            return 1;
+    return scalar_casecmp(s1 + i, s2 + i, len - i);
+}
+
+static scan_ops_t neon_ops = {
+    "neon", neon_find_char, neon_find_space, neon_skip_space, neon_casecmp
+};
+#endif
+
+/*===============================Interface===============================*/
+static scan_ops_t *ops = &scalar_ops;
+
+/** @brief Choose the fastest kernels supported by the CPU */
+void init_scan() {
+    ops = &scalar_ops;
+#ifdef USE_SSE2
+    ops = &sse2_ops;
+#endif
+#ifdef USE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        ops = &avx2_ops;
+#endif
+#ifdef USE_NEON
+    ops = &neon_ops;
+#endif
+    log_msg(L_INFO, "Using scan kernels: %s\n", ops->name);
+}
+
+int scan_char(const char *buf, int len, char c) {
+    return ops->find_char(buf, len, c);
+}
+
+int scan_space(const char *buf, int len) {
+    return ops->find_space(buf, len);
+}
+
+int scan_nonspace(const char *buf, int len) {
+    return ops->skip_space(buf, len);
+}
+
+int scan_casecmp(const char *s1, const char *s2, int len) {
+    return ops->casecmp(s1, s2, len);
+}
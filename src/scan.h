@@ -0,0 +1,29 @@
+/** @file scan.h
+ *  @brief Header file for scan.c
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+/** @brief Kernels for scanning request text, one set per instruction set */
+typedef struct {
+    char *name;
+    /* Offset of the first c in buf[0, len). len if not found */
+    int (*find_char)(const char *buf, int len, char c);
+    /* Offset of the first space or tab. len if not found */
+    int (*find_space)(const char *buf, int len);
+    /* Offset of the first byte which is not a space or tab. len if none */
+    int (*skip_space)(const char *buf, int len);
+    /* 0 if the first len bytes are equal ignoring ASCII case */
+    int (*casecmp)(const char *s1, const char *s2, int len);
+} scan_ops_t;
+
+void init_scan();
+
+int scan_char(const char *buf, int len, char c);
+int scan_space(const char *buf, int len);
+int scan_nonspace(const char *buf, int len);
+int scan_casecmp(const char *s1, const char *s2, int len);
+
+#endif
@@ -5,34 +5,99 @@
  *  Each time when it's okay to send data to the client, the server tries to
  *  send data from the output buffer of the client.
  *
+ *  Every connection has a deadline for whatever it's waiting for from the
+ *  client, see update_deadline(). A client which misses it is closed, so
+ *  idle and slow connections don't hold on to their fds forever. The number
+ *  of connections is capped as well, those beyond it are turned away with
+ *  503 right after being accepted.
+ *
  *  @author Chao Xin(cxin)
  */
+#define _GNU_SOURCE     // For accept4() and pipe2()
 #include <stdlib.h>
 #include <netdb.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <sys/resource.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
 #include "server.h"
 #include "io.h"
 #include "log.h"
 #include "http_client.h"
 #include "http_parser.h"
+#include "request_handler.h"
+#include "file_cache.h"
+#include "scan.h"
+#include "fastcgi.h"
+#include "aio.h"
+#include "http2.h"
+#include "resolver.h"
+#include "http_date.h"
+#include "timer.h"
+#include "metrics.h"
+#include "upgrade.h"
 
 int terminate = 0;
+int reload = 0;
+int draining = 0;
+int upgrade = 0;
 
-static int http_fd, https_fd;
+static int *listeners;          //<!http and https socket of each worker
+static int nlisteners;
+static int http_fd = -1, https_fd = -1;
 static SSL_CTX *ssl_context;
+static unsigned char ticket_keys[SSL_TICKET_KEYS];  //<!see init_ssl_tickets()
+static int nclients;            //<!connections being served
+static timeout_t drain_timeout; //<!see start_draining()
+
+/**
+ * Deadline kinds
+ *
+ * What a client is waiting for decides how long it may wait.
+ */
+#define D_NONE 0            // Waiting for the server, e.g. a file being read
+#define D_HEADER 1          // Waiting for headers of a request
+#define D_BODY 2            // Waiting for more of a request body
+#define D_IDLE 3            // Waiting for the next request
+#define D_WRITE 4           // Waiting for the socket to take output
+#define D_RESPONSE 5        // Waiting for output of a cgi script
+
+static int deadline_ms[] = {
+	0, HEADER_TIMEOUT, BODY_TIMEOUT, KEEPALIVE_TIMEOUT, WRITE_TIMEOUT,
+	RESPONSE_TIMEOUT
+};
+
+static char shed_response[] = "HTTP/1.1 503 Service Unavailable\r\n"
+							  "Retry-After: 1\r\n"
+							  "Content-Length: 0\r\n"
+							  "Connection: close\r\n\r\n";
+
+/** @brief Make a socket non-blocking */
+static int set_nonblocking(int fd) {
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL, 0)) == -1 ||
+		fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		log_error("set_nonblocking error");
+		return -1;
+	}
+	return 0;
+}
 
 /** @brief Create and config a socket on given port. */
 static int setup_server_socket(unsigned short port) {
 	static int yes = 1; //For setsockopt
-	int server_fd;
+	int server_fd, defer = DEFER_ACCEPT, fastopen = FASTOPEN_QUEUE;
 	static struct sockaddr_in server_addr;
 
 	if ((server_fd = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
@@ -46,6 +111,17 @@ static int setup_server_socket(unsigned short port) {
 		return -1;
 	}
 
+#ifdef SO_REUSEPORT
+	/*
+	 * Each worker process binds its own listening socket on the same port.
+	 * The kernel balances incoming connections between them.
+	 */
+	if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) < 0) {
+		log_error("setsockopt SO_REUSEPORT failed.");
+		return -1;
+	}
+#endif
+
 	bzero((char *)&server_addr, sizeof(server_addr));
 	server_addr.sin_family = AF_INET;
 	server_addr.sin_port = htons(port);
@@ -63,52 +139,208 @@ static int setup_server_socket(unsigned short port) {
 		return -1;
 	}
 
+#ifdef TCP_DEFER_ACCEPT
+	// Only wake up for a connection once the client has sent something
+	if (defer > 0 && setsockopt(server_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+								&defer, sizeof(int)) < 0)
+		log_error("setsockopt TCP_DEFER_ACCEPT failed.");
+#endif
+
+#ifdef TCP_FASTOPEN
+	// Returning clients may send their request along with the SYN
+	if (fastopen > 0 && setsockopt(server_fd, IPPROTO_TCP, TCP_FASTOPEN,
+								   &fastopen, sizeof(int)) < 0)
+		log_error("setsockopt TCP_FASTOPEN failed.");
+#endif
+
+	// Pending connections are accepted until accept() would block
+	if (set_nonblocking(server_fd) == -1) {
+		close(server_fd);
+		return -1;
+	}
+
 	return server_fd;
 }
 
-/** @brief Setup ssl_context, load private key, certificate
+/** @brief Whether fd is a listening TCP socket bound to port */
+static int is_listener(int fd, unsigned short port) {
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr), optlen = sizeof(int);
+	int listening;
+
+	return getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening,
+					  &optlen) == 0 && listening &&
+		   getsockname(fd, (struct sockaddr *)&addr, &len) == 0 &&
+		   addr.sin_family == AF_INET && ntohs(addr.sin_port) == port;
+}
+
+/** @brief Open the listening sockets of all workers
+ *
+ *  Each worker gets a http and a https socket of its own, all bound to the
+ *  same ports with SO_REUSEPORT, and takes them in serve(). The sockets are
+ *  opened before the workers are spawned and stay open in the master. So
+ *  connections waiting on the socket of a worker which died are served by
+ *  the one restarted, and the sockets can be handed to an upgrade.
+ *
+ *  Sockets handed over by the program before an upgrade (see LISTEN_ENV)
+ *  are taken first, in the order of the workers. Connections waiting on
+ *  them are not lost.
+ *
+ *  @param slots Number of workers
+ *  @return 0 on success. -1 on error.
+ */
+int open_listeners(int slots) {
+	char *env, *p, *end;
+	int i, fd, n = 0;
+
+	nlisteners = slots * 2;
+	listeners = malloc(sizeof(int) * nlisteners);
+
+	if ((env = getenv(LISTEN_ENV)) != NULL) {
+		for (p = env; *p != '\0'; p = end + (*end == ',')) {
+			fd = strtol(p, &end, 10);
+			if (end == p)
+				break;
+			if (n < nlisteners &&
+				is_listener(fd, n % 2 == 0 ? http_port : https_port)) {
+				fcntl(fd, F_SETFD, FD_CLOEXEC);
+				listeners[n++] = fd;
+			} else
+				close(fd);
+		}
+		// Not for cgi scripts, nor for the workers
+		unsetenv(LISTEN_ENV);
+		log_msg(L_INFO, "Took over %d listening sockets\n", n);
+	}
+
+	for (i = n; i < nlisteners; ++i) {
+		fd = setup_server_socket(i % 2 == 0 ? http_port : https_port);
+		if (fd == -1) {
+			while (--i >= 0)
+				close(listeners[i]);
+			free(listeners);
+			nlisteners = 0;
+			return -1;
+		}
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		listeners[i] = fd;
+	}
+	return 0;
+}
+
+/** @brief Let the listening sockets be inherited by the next program
+ *
+ *  @param share 1 before exec, 0 to take them back if the exec failed
+ */
+void share_listeners(int share) {
+	char *env;
+	int i, len = 0;
+
+	if (!share) {
+		for (i = 0; i < nlisteners; ++i)
+			fcntl(listeners[i], F_SETFD, FD_CLOEXEC);
+		unsetenv(LISTEN_ENV);
+		return;
+	}
+
+	env = malloc(nlisteners * 12 + 1);
+	env[0] = '\0';
+	for (i = 0; i < nlisteners; ++i) {
+		fcntl(listeners[i], F_SETFD, 0);
+		len += sprintf(env + len, "%s%d", i ? "," : "", listeners[i]);
+	}
+	setenv(LISTEN_ENV, env, 1);
+	free(env);
+}
+
+/** @brief Create a SSL context, load private key, certificate
  *
- *  @return 0 if success. -1 if erorr occurs
+ *  @param key The private key file
+ *  @param cert The certificate file
+ *  @return The context. NULL if erorr occurs
  */
-static int ssl_setup() {
+static SSL_CTX* new_ssl_context(char *key, char *cert) {
+    SSL_CTX *ctx;
+
     SSL_load_error_strings();
     SSL_library_init();
 
-    /* we want to use TLSv1 only */
-    if ((ssl_context = SSL_CTX_new(TLSv1_server_method())) == NULL)
+    /*
+     * Negotiate the best version the client has, up to TLS 1.3. Old clients
+     * which only know TLS 1.0 are still served.
+     */
+    if ((ctx = SSL_CTX_new(TLS_server_method())) == NULL)
     {
 		log_msg(L_ERROR, "Error creating SSL context.\n");
-        return -1;
+        return NULL;
     }
 
     /* register private key */
-    if (SSL_CTX_use_PrivateKey_file(ssl_context, private_key_file,
-                                    SSL_FILETYPE_PEM) == 0)
+    if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) == 0)
     {
-        SSL_CTX_free(ssl_context);
-        log_msg(L_ERROR, "Error associating private key.\n");
-        return -1;
+        SSL_CTX_free(ctx);
+        log_msg(L_ERROR, "Error associating private key %s.\n", key);
+        return NULL;
     }
 
     /* register public key (certificate) */
-    if (SSL_CTX_use_certificate_file(ssl_context, certificate_file,
-                                     SSL_FILETYPE_PEM) == 0)
+    if (SSL_CTX_use_certificate_file(ctx, cert, SSL_FILETYPE_PEM) == 0)
     {
-        SSL_CTX_free(ssl_context);
-        log_msg(L_ERROR, "Error associating certificate.\n");
-        return -1;
+        SSL_CTX_free(ctx);
+        log_msg(L_ERROR, "Error associating certificate %s.\n", cert);
+        return NULL;
     }
 
-    return 0;
+    /* a certificate rotated without its key is caught here, not by clients */
+    if (SSL_CTX_check_private_key(ctx) == 0)
+    {
+        SSL_CTX_free(ctx);
+        log_msg(L_ERROR, "Private key %s does not match certificate %s.\n",
+                key, cert);
+        return NULL;
+    }
+
+    /*
+     * Sockets are non-blocking. Report partial writes, and allow retrying a
+     * write after the output buffer is reallocated.
+     */
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                          SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_VERSION);
+
+    /*
+     * Returning clients resume their sessions instead of a full handshake,
+     * by a ticket, or from the cache for those without ticket support. All
+     * workers use the same ticket keys, so a ticket works on any of them.
+     */
+    SSL_CTX_set_session_id_context(ctx, (unsigned char *)"lisod", 5);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, SSL_SESSION_CACHE);
+    SSL_CTX_set_timeout(ctx, SSL_SESSION_TIMEOUT);
+    SSL_CTX_set_tlsext_ticket_keys(ctx, ticket_keys, sizeof(ticket_keys));
+    // One ticket is enough for a client to come back with
+    SSL_CTX_set_num_tickets(ctx, 1);
+
+    /* offer HTTP/2 to clients which support it */
+    SSL_CTX_set_alpn_select_cb(ctx, h2_alpn_select, NULL);
+
+#ifdef SSL_OP_ENABLE_KTLS
+    /* let the kernel encrypt, so that static files can be sent by sendfile */
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+    return ctx;
 }
 
 /** @brief Wrap client socket with SSL
+ *
+ *  The handshake is not done here. The client is put in C_HANDSHAKE status,
+ *  and ssl_handshake() makes progress whenever the socket is ready.
  *
  *  @return 0 if sucess. -1 if error
  */
 static int ssl_wrap(http_client_t *client) {
-	int ret, err;
-
 	if ((client->ssl_context = SSL_new(ssl_context)) == NULL) {
 		log_msg(L_ERROR, "ssl_wrap SSL_new error.\n");
 		return -1;
@@ -119,69 +351,696 @@ static int ssl_wrap(http_client_t *client) {
     	return -1;
     }
 
-    if ((ret = SSL_accept(client->ssl_context)) <= 0) {
-    	err = SSL_get_error(client->ssl_context, ret);
-    	log_msg(L_ERROR, "ssl_wrap SSL_accept returns %d: %s\n", err,
-    		    ERR_reason_error_string(err));
+    SSL_set_accept_state(client->ssl_context);
+    client->status = C_HANDSHAKE;
+    return 0;
+}
 
-    	return -1;
-    }
+/** @brief Continue the TLS handshake of client
+ *
+ *  Whatever OpenSSL is waiting for decides which event the socket is watched
+ *  for, so a slow client only holds up itself.
+ *
+ *  @return 1 if the handshake is done. 0 if it has to wait for the socket.
+ *          -1 if it failed.
+ */
+static int ssl_handshake(http_client_t *client) {
+	int ret, err;
 
-    return 0;
+	if ((ret = SSL_do_handshake(client->ssl_context)) == 1) {
+		client->status = C_IDLE;
+		remove_write_fd(client->fd);
+		if (h2_negotiated(client->ssl_context))
+			client->h2 = init_h2(client);
+		return 1;
+	}
+
+	err = SSL_get_error(client->ssl_context, ret);
+	if (err == SSL_ERROR_WANT_READ) {
+		clear_read_fd(client->fd);
+		remove_write_fd(client->fd);
+		return 0;
+	}
+	if (err == SSL_ERROR_WANT_WRITE) {
+		clear_write_fd(client->fd);
+		add_write_fd(client->fd);
+		return 0;
+	}
+
+	log_msg(L_ERROR, "ssl_handshake on fd %d returns %d: %s\n", client->fd,
+			err, ERR_reason_error_string(ERR_get_error()));
+	return -1;
+}
+
+/** @brief Generate the keys protecting session tickets
+ *
+ *  Called before the workers are spawned, so they all share the keys.
+ */
+void init_ssl_tickets() {
+	if (RAND_bytes(ticket_keys, sizeof(ticket_keys)) != 1)
+		log_msg(L_ERROR, "init_ssl_tickets RAND_bytes error.\n");
 }
 
 /** @brief Accept connection from server_fd. If sucess, construct a client
- *	  	   struct and append it to the client linked list started with
- *   	   client_head
+ *	  	   struct and put it at the head of the client linked list started
+ *   	   with client_head
  *
  *  @param server_fd The server file descriptor which will be passed into
  * 		   accept()
  *  @param client_head The pointer to the head of a client linked list
- *  @return A pointer to the newly created client struct. NULL if error
+ *  @return A pointer to the newly created client struct. NULL if error or
+ *          there is no pending connection.
  */
 static http_client_t* accept_connection(int server_fd,
 										http_client_t **client_head) {
 	int client_fd;
 	socklen_t client_addr_len;
 	struct sockaddr_in client_addr;
-	struct hostent *host;
 	http_client_t *client;
 
 	client_addr_len = sizeof(client_addr);
-	if ((client_fd = accept(server_fd, (struct sockaddr *)&client_addr,
-							(socklen_t *)&client_addr_len)) == -1) {
-		log_error("Error accepting connection");
+	// Non-blocking from the start, and not inherited by cgi scripts
+	if ((client_fd = accept4(server_fd, (struct sockaddr *)&client_addr,
+							 &client_addr_len,
+							 SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			clear_read_fd(server_fd);
+		else
+			log_error("Error accepting connection");
 		return NULL;
 	}
-	// Add socket to fd list
+	/*
+	 * Add socket to fd list. Write interest is only registered when there is
+	 * something to send, see watch_writable().
+	 */
 	add_read_fd(client_fd);
-	add_write_fd(client_fd);
 	//Insert into client list
 	client = new_client(client_fd);
-	// Record ip address
-	if (inet_ntop(AF_INET, &client_addr, client->remote_ip,
+	/*
+	 * Record ip address. The host name is only looked up if a cgi request
+	 * needs it, see resolve_host().
+	 */
+	if (inet_ntop(AF_INET, &client_addr.sin_addr, client->remote_ip,
 				  INET_ADDRSTRLEN) == NULL)
 		log_error("Record client IP address error");
 
-	// Get host name
-	host = gethostbyaddr(&(client_addr.sin_addr), sizeof(struct in_addr), AF_INET);
-	if (host == NULL)
-		log_error("Record client host name error");
-	client->remote_host = host->h_name;
-
 	log_msg(L_INFO, "Incoming request from %s\n", client->remote_ip);
+	++nclients;
+	++metrics->accepted;
+	metrics->clients = nclients;
 
 	// Put at the head of client list
-	if (*client_head == NULL)
-		*client_head = client;
-	else {
-		client->next = (*client_head)->next;
-		(*client_head)->next = client;
-	}
+	client->next = *client_head;
+	if (*client_head != NULL)
+		(*client_head)->prev = client;
+	*client_head = client;
 
 	return client;
 }
 
+/** @brief Remove a client from the client list and destroy it */
+static void remove_client(http_client_t *client) {
+	if (client->prev == NULL)
+		client_head = client->next;
+	else
+		client->prev->next = client->next;
+	if (client->next != NULL)
+		client->next->prev = client->prev;
+
+	--nclients;
+	metrics->clients = nclients;
+	deinit_client(client);
+}
+
+/*
+ * Clients which may have something to do are kept in a FIFO list. Only
+ * clients in this list are served in an iteration of the serving loop. Each
+ * is served within a budget (SERVE_BYTES and SERVE_REQUESTS), and one which
+ * still has work to do is put back at the end, so they take turns.
+ */
+static http_client_t *active_head, *active_tail;
+
+/** @brief Put client at the end of the active list
+ *
+ *  An HTTP/2 stream is served by its connection, which is scheduled instead.
+ */
+static void schedule_client(http_client_t *client) {
+	if (client->stream)
+		client = client->stream->conn->client;
+	if (client->scheduled)
+		return;
+
+	client->scheduled = 1;
+	client->next_active = NULL;
+	if (active_tail == NULL)
+		active_head = client;
+	else
+		active_tail->next_active = client;
+	active_tail = client;
+}
+
+/** @brief Wake up a client whose deadline has passed, called by run_timers() */
+static void expire_client(void *arg) {
+	http_client_t *client = arg;
+
+	client->timed_out = 1;
+	schedule_client(client);
+}
+
+/** @brief Accept a connection beyond the cap and turn it away
+ *
+ *  A plain HTTP client is told to come back later with 503. The request it
+ *  may have sent is read first, closing a socket with unread data resets
+ *  the connection and the client might never see the response. Nothing is
+ *  said over TLS, which would take a whole handshake.
+ *
+ *  @return 0 if a connection was turned away. -1 if there is none pending.
+ */
+static int shed_connection(int server_fd, int ssl) {
+	char buf[BUFSIZE];
+	int client_fd;
+
+	if ((client_fd = accept4(server_fd, NULL, NULL,
+							 SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			clear_read_fd(server_fd);
+		else
+			log_error("Error accepting connection");
+		return -1;
+	}
+
+	if (!ssl) {
+		while (recv(client_fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+			;
+		send(client_fd, shed_response, sizeof(shed_response) - 1,
+			 MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+	close(client_fd);
+	++metrics->shed;
+	log_msg(L_INFO, "Turned away connection, %d being served\n", nclients);
+	return 0;
+}
+
+/** @brief Cap connections by the number of fds the process may open
+ *
+ *  The soft fd limit is raised as far as the hard limit allows. A request
+ *  may take one more fd for a file or a cgi pipe, and a few are kept for
+ *  listening sockets, logs and helpers.
+ */
+static void init_connection_cap() {
+	struct rlimit rl;
+	long limit;
+
+	if (max_connections > 0)
+		return;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		// The hard limit might be more than the kernel allows
+		if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+			log_error("setrlimit RLIMIT_NOFILE error");
+	}
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+		log_error("getrlimit RLIMIT_NOFILE error");
+		rl.rlim_cur = FD_SETSIZE;
+	}
+
+	limit = rl.rlim_cur == RLIM_INFINITY ? 1 << 20 : (long)rl.rlim_cur;
+	if (select_fd_limit() != -1 && select_fd_limit() < limit)
+		limit = select_fd_limit();
+	max_connections = (limit - RESERVED_FDS) / 2;
+	if (max_connections < 1)
+		max_connections = 1;
+	log_msg(L_INFO, "Serving up to %d connections\n", max_connections);
+}
+
+/** @brief Accept pending connections on server_fd
+ *
+ *  At most accept_batch connections are accepted at a time, so that a burst
+ *  of connections doesn't hold up clients already being served. The rest
+ *  are accepted in the next iteration of the serving loop.
+ *
+ *  @param server_fd The listening socket
+ *  @param ssl Whether connections on server_fd should be wrapped with SSL
+ */
+static void accept_connections(int server_fd, int ssl) {
+	http_client_t *client;
+	int n;
+
+	for (n = 0; n < accept_batch && test_read_fd(server_fd); ++n) {
+		if (nclients >= max_connections) {
+			if (shed_connection(server_fd, ssl) == -1)
+				break;
+			continue;
+		}
+		if ((client = accept_connection(server_fd, &client_head)) == NULL)
+			break;
+		init_timeout(&client->timeout, expire_client, client);
+
+		// The TLS handshake is done by serve_client() without blocking
+		if (ssl && ssl_wrap(client) == -1)
+			client->alive = 0;
+
+		schedule_client(client);
+	}
+}
+
+/** @brief Whether data should be received from client now
+ *
+ *  The rest of a request body is received even if the connection is going to
+ *  be closed. While the input buffer is at its limit, the socket is left
+ *  readable until buffered data has been consumed.
+ */
+static int can_recv(http_client_t *client) {
+	buf_t *in = client->in;
+
+	return (client->alive || client->body_stream) &&
+		test_read_fd(client->fd) &&
+		(in->limit == 0 || in->datasize - in->pos < in->limit);
+}
+
+/** @brief Whether requests from client can be parsed now
+ *
+ *  A cgi response can't be queued in advance, so it holds up the requests
+ *  after it. Otherwise responses are queued until the queue is full.
+ */
+static int can_parse(http_client_t *client) {
+	return client->alive && client->status != C_PIPING &&
+		!client->body_stream && client->out->count < PIPELINE_QUEUE;
+}
+
+/** @brief Whether client has output waiting for the socket to be writable */
+static int has_output(http_client_t *client) {
+	// A file being read ahead wakes the client up once it's in memory
+	if (chain_pending(client->out))
+		return !chain_loading(client->out);
+
+	/*
+	 * A pipe waiting for its source (a cgi script for example) doesn't need
+	 * the socket. The source becoming readable will wake the client up.
+	 */
+	return client->status == C_PIPING && client->pipe != NULL &&
+		(client->pipe->offset < client->pipe->datasize ||
+		 test_read_fd(client->pipe->from_fd));
+}
+
+/** @brief Only watch client socket for writability when there is output
+ *
+ *  Otherwise an idle connection, which is almost always writable, would wake
+ *  up the serving loop all the time.
+ */
+static void watch_writable(http_client_t *client) {
+	if (has_output(client))
+		add_write_fd(client->fd);
+	else
+		remove_write_fd(client->fd);
+}
+
+/** @brief Whether client can make progress without waiting for new events
+ *
+ *  @param client The client just served
+ *  @param parsed Whether the parser consumed any input during last service,
+ *                or had to stop because the output queue was full. For an
+ *                HTTP/2 connection, whether streams have more output once
+ *                the queue drains.
+ */
+static int client_ready(http_client_t *client, int parsed) {
+	// More data to fetch
+	if (can_recv(client))
+		return 1;
+
+	// Output ready to be sent
+	if (test_write_fd(client->fd) && has_output(client))
+		return 1;
+
+	// Streams waiting for room in the output queue
+	if (client->h2)
+		return parsed && client->out->count < H2_OUT_QUEUE;
+
+	// Pipelined requests waiting in the input buffer
+	if (parsed && can_parse(client) && client->in->pos < client->in->datasize)
+		return 1;
+
+	return 0;
+}
+
+/** @brief Set the timeout of client for what it's waiting for now
+ *
+ *  A deadline is set again when the client starts waiting for something
+ *  else. Otherwise it's only moved on by progress which counts for it: data
+ *  of the request body, output taken by the socket, or another request.
+ *  Headers arriving don't move it, so a client trickling them in still has
+ *  to finish within HEADER_TIMEOUT.
+ *
+ *  @param received Whether data was received from the client
+ *  @param sent Whether output was sent to the client
+ *  @param request Whether a request was completed
+ */
+static void update_deadline(http_client_t *client, int received, int sent,
+							int request) {
+	buf_t *in = client->in;
+	int kind, progress;
+
+	if (client->status == C_HANDSHAKE)
+		kind = D_HEADER;
+	else if (has_output(client) || chain_loading(client->out))
+		kind = D_WRITE;
+	else if (client->h2)
+		kind = client->h2->nstreams == 0 ? D_IDLE :
+			   h2_awaiting(client->h2) ? D_RESPONSE : D_NONE;
+	else if ((client->status == C_PBODY || client->body_stream) &&
+			 (in->limit == 0 || in->datasize - in->pos < in->limit))
+		kind = D_BODY;
+	else if (client->status == C_PHEADER ||
+			 (client->status == C_IDLE && in->pos < in->datasize))
+		kind = D_HEADER;
+	else if (client->status == C_IDLE)
+		kind = D_IDLE;
+	else if (client->pipe != NULL || client->fcgi != NULL)
+		kind = D_RESPONSE;
+	else
+		kind = D_NONE;
+
+	switch (kind) {
+	case D_BODY:
+		progress = received;
+		break;
+	case D_WRITE:
+		progress = sent;
+		break;
+	case D_HEADER:
+		progress = request;
+		break;
+	default:
+		progress = 0;
+	}
+
+	if (kind == client->deadline && !progress &&
+		(kind == D_NONE || client->timeout.pending))
+		return;
+
+	client->deadline = kind;
+	if (kind == D_NONE)
+		timeout_cancel(&client->timeout);
+	else if (kind == D_IDLE && draining)
+		timeout_set(&client->timeout, DRAIN_IDLE_TIMEOUT);
+	else
+		timeout_set(&client->timeout, deadline_ms[kind]);
+}
+
+/** @brief Tell clients waiting for cgi responses which never came why the
+ *  connection is closed
+ *
+ *  They get 504, sent as far as the socket takes it now.
+ */
+static void response_timeout(http_client_t *client) {
+	if (client->h2)
+		h2_gateway_timeout(client->h2);
+	else
+		gateway_timeout(client);
+	io_send(client->fd, client->out, client->ssl_context);
+}
+
+/** @brief Receive, parse and send data for a client
+ *
+ *  @return 1 if the client should be served again. 0 if it should wait for new
+ *          events. -1 if the client has been closed and destroyed.
+ */
+static int serve_client(http_client_t *client) {
+	int nbytes, bad, in_pos, status, pos, held, received, sent, request;
+
+	/*
+	 * Normally, bad will be 0 normally. When erro occurs, bad will
+	 * be set to 1. And corresponding socket will be closed.
+	 */
+	bad = 0;
+	received = sent = request = 0;
+
+	if (client->timed_out) {
+		log_msg(L_INFO, "Client %s on fd %d timed out\n", client->remote_ip,
+				client->fd);
+		++metrics->timeouts;
+		if (client->deadline == D_RESPONSE)
+			response_timeout(client);
+		remove_client(client);
+		return -1;
+	}
+
+	// Nothing else happens until the TLS handshake is done
+	if (client->status == C_HANDSHAKE) {
+		if ((nbytes = ssl_handshake(client)) == -1) {
+			remove_client(client);
+			return -1;
+		}
+		if (nbytes == 0) {
+			update_deadline(client, 0, 0, 0);
+			return 0;
+		}
+	}
+
+	// New data arrived!
+	if (can_recv(client)) {
+		nbytes = io_recv(client->fd, client->in, client->ssl_context);
+		if (nbytes == 0) {
+			// Peer closed the connection, finish current response first
+			client->alive = 0;
+			remove_read_fd(client->fd);
+			// Body not received by now never comes
+			if (client->body_stream)
+				cut_body(client);
+		}
+		if (nbytes == -1 && errno != EAGAIN) bad = 1;
+		received = nbytes > 0;
+	}
+
+	in_pos = client->in->pos;
+	status = client->status;
+
+	// Frames of all streams are handled and produced by the HTTP/2 layer
+	held = 0;
+	if (!bad && client->h2)
+		held = h2_serve(client);
+
+	/*
+	 * Parse data. Pipelined requests are handled one after another, and
+	 * their responses queued behind the one being sent.
+	 */
+	while (!bad && !client->h2 && can_parse(client)) {
+		pos = client->in->pos;
+		if (http_parse(client) == -1) {
+			/*
+			 * Something goes wrong and beyond repair. Send error code
+			 * to client before closing the connection
+			 */
+			io_send(client->fd, client->out, client->ssl_context);
+			bad = 1;	// End the connection
+		}
+		if (client->status != C_PHEADER && client->status != C_PBODY &&
+			client->in->pos != pos)
+			++request;
+
+		// Stop in the middle of a request, wait for the rest of it
+		if (client->status != C_IDLE || client->in->pos == pos ||
+			client->in->pos >= client->in->datasize)
+			break;
+
+		// The rest waits for the next turn
+		if (request >= SERVE_REQUESTS)
+			break;
+	}
+
+	/*
+	 * Free part of the buffer if a lot of data has been processed. Not in
+	 * the middle of a request, whose slices point into the buffer.
+	 */
+	if (!bad && !client->h2 && client->status == C_IDLE &&
+		!client->body_stream && empty(client->in))
+		io_shrink(client->in);
+
+	// Stream request body to the cgi script
+	if (!bad && (client->body_stream || client->cgi_in != -1))
+		feed_cgi(client);
+
+	// Requests may be left unparsed for the queue to drain
+	if (!client->h2)
+		held = client->out->count >= PIPELINE_QUEUE;
+
+	// Send data to client
+	if (!bad && test_write_fd(client->fd) && has_output(client)) {
+		sent = 1;
+		// Send queued data
+		if (chain_pending(client->out)) {
+			nbytes = io_send(client->fd, client->out,
+							 client->ssl_context);
+
+			if (nbytes == -1) bad = 1;
+		} else {
+			// Need to pipe data to client from some fd
+			nbytes = io_pipe(client->fd, client->pipe,
+							 client->ssl_context);
+			// Piping complete
+			if (nbytes == 1)
+				client->status = C_IDLE;
+			if (nbytes == -1) bad = 1;
+			// Deinit client pipe
+			if (nbytes != 0) {
+				deinit_pipe(client->pipe);
+				client->pipe = NULL;
+			}
+		}
+	}
+
+	/*
+	 * Nothing is parsed once the connection is going to be closed, so a
+	 * request with part of its headers never completes either
+	 */
+	if (bad || ((client->status == C_IDLE || client->status == C_PHEADER) &&
+				!client->alive && !chain_pending(client->out))) {
+		remove_client(client);
+		return -1;
+	}
+
+	if (io_budget_spent() || request >= SERVE_REQUESTS)
+		++metrics->yields;
+
+	watch_writable(client);
+	update_deadline(client, received, sent, request);
+	if (client->h2)
+		return client_ready(client, held);
+	return client_ready(client, client->in->pos != in_pos ||
+								client->status != status || held);
+}
+
+/** @brief Read the config again, and the TLS files it names
+ *
+ *  Nothing changes unless all of it is good. Connections keep the context
+ *  they were accepted with until they close, new ones get the new context.
+ *
+ *  @param old Where to save the settings replaced, NULL if not needed
+ *  @return 0 on success. -1 if the config is kept as it was.
+ */
+int reload_config(config_t *old) {
+	config_t *conf;
+	SSL_CTX *ctx;
+
+	if ((conf = load_config()) == NULL)
+		return -1;
+	ctx = new_ssl_context(conf->private_key_file, conf->certificate_file);
+	if (ctx == NULL)
+		return -1;
+
+	apply_config(conf, old);
+	if (ssl_context != NULL)
+		SSL_CTX_free(ssl_context);
+	ssl_context = ctx;
+	return 0;
+}
+
+/** @brief Reload config on SIGHUP, without stopping the serving loop
+ *
+ *  The file cache and the FastCGI pool are only started again if what they
+ *  depend on has changed, they are kept warm otherwise.
+ */
+static void reload_server() {
+	config_t old;
+
+	if (reload_config(&old) == -1) {
+		log_msg(L_ERROR, "Reload failed, config not changed\n");
+		return;
+	}
+
+	// Entries are keyed by request path, which leads elsewhere now
+	if (strcmp(old.www_folder, www_folder) != 0 ||
+		old.cache_size != cache_size) {
+		deinit_file_cache();
+		init_file_cache(cache_size);
+	}
+	if (strcmp(old.cgi_path, cgi_path) != 0 && fcgi_restart(cgi_path) == -1)
+		log_msg(L_ERROR, "FastCGI pool keeps running %s\n", old.cgi_path);
+	init_connection_cap();
+
+	log_msg(L_INFO, "Config reloaded\n");
+}
+
+/** @brief Clients still there when draining takes too long are closed */
+static void drain_expired(void *arg) {
+	http_client_t *client;
+
+	log_msg(L_INFO, "Draining timed out, close %d connections\n", nclients);
+	for (client = client_head; client != NULL; client = client->next)
+		expire_client(client);
+}
+
+/** @brief Stop accepting connections, and close those served as they finish
+ *
+ *  Responses from now on end their connections (see connection_close()).
+ *  Idle connections are given DRAIN_IDLE_TIMEOUT, as a request may be on its
+ *  way. HTTP/2 clients get a GOAWAY and open no more streams.
+ */
+static void start_draining() {
+	http_client_t *client;
+
+	remove_read_fd(http_fd);
+	remove_read_fd(https_fd);
+	close(http_fd);
+	close(https_fd);
+	http_fd = https_fd = -1;
+
+	for (client = client_head; client != NULL; client = client->next) {
+		if (client->h2)
+			h2_shutdown(client->h2);
+		if (client->deadline == D_IDLE)
+			timeout_set(&client->timeout, DRAIN_IDLE_TIMEOUT);
+		schedule_client(client);
+	}
+
+	init_timeout(&drain_timeout, drain_expired, NULL);
+	timeout_set(&drain_timeout, DRAIN_TIMEOUT);
+	log_msg(L_INFO, "Draining %d connections\n", nclients);
+}
+
+/** @brief Hand the listening sockets to a new program on SIGUSR2
+ *
+ *  The program is exec'ed in this process, so it keeps the pid and the lock.
+ *  Connections being served are left to a child forked just before, which
+ *  goes on serving until the new program is up and asks it to drain. The
+ *  child waits for the exec to succeed, a pipe closed by it tells.
+ */
+static void upgrade_server() {
+	int ready[2];
+	pid_t pid;
+	char c;
+
+	if (pipe2(ready, O_CLOEXEC) == -1) {
+		log_error("upgrade_server pipe2 error");
+		return;
+	}
+	log_flush();
+	if ((pid = fork()) == -1) {
+		log_error("upgrade_server fork error");
+		close(ready[0]);
+		close(ready[1]);
+		return;
+	}
+
+	if (pid == 0) {
+		close(ready[1]);
+		// The exec failed, the parent goes on serving
+		if (read(ready[0], &c, 1) == 1)
+			_exit(EXIT_SUCCESS);
+		close(ready[0]);
+		log_msg(L_INFO, "Serve connections of the old program in %d\n",
+				getpid());
+		return;
+	}
+
+	close(ready[0]);
+	exec_upgrade(&pid, 1);
+	if (write(ready[1], "", 1) == -1)
+		log_error("upgrade_server write error");
+	close(ready[1]);
+}
+
 /** @brief Finalize the server
  *
  *  Free all memory and close all sockets.
@@ -197,28 +1056,48 @@ void finalize() {
 		next = client->next;
 		deinit_client(client);
 	}
+	deinit_aio();
+	deinit_fcgi_pool();
+	deinit_resolver();
+	deinit_file_cache();
+	deinit_select_context();
 }
 
 /** @brief Create a concurrent server to serve on given port
  *
  *  The server will serve on both http_port and https_port(see config.h).
- *  Use select() to handle multiple socket. Each time a new connection
- *  established, the newly created socket will be made non-blocking so that the
- *  server can read as much data as possible each time by polling the socket.
+ *  An event backend (see event.c) is used to handle multiple socket. Each time
+ *  a new connection established, the newly created socket will be made
+ *  non-blocking so that the server can read as much data as possible each
+ *  time by polling the socket.
  *
- *  @return Should never return
+ *  Each ready fd leads directly to the client owning it, and only those
+ *  clients are served. Thus idle connections cost nothing in the loop.
+ *
+ *  When running with several workers, every worker process calls serve() and
+ *  owns its listening sockets, event loop, clients and SSL context.
+ *
+ *  SIGHUP reloads config (see reload_server()), SIGQUIT drains connections
+ *  and exits, SIGUSR2 upgrades the program (see upgrade_server()).
+ *
+ *  @param slot Index of the worker, whose listening sockets it takes
+ *  @return Only if the server can't be setup
  */
-void serve() {
-	http_client_t *client,
-				  *prev; //previous item in linked list when iterating
-	int nbytes, bad;
+void serve(int slot) {
+	http_client_t *client, *next;
+	int fd, i;
 
-	if ((http_fd = setup_server_socket(http_port)) == -1) return;
-	if ((https_fd = setup_server_socket(https_port)) == -1) {
-		close(http_fd);
-		return;
-	}
-	if (ssl_setup() == -1) {
+	http_fd = listeners[slot * 2];
+	https_fd = listeners[slot * 2 + 1];
+	// The other sockets belong to the other workers
+	for (i = 0; i < nlisteners; ++i)
+		if (i / 2 != slot)
+			close(listeners[i]);
+
+	// Normally loaded by reload_config() before the workers are spawned
+	if (ssl_context == NULL &&
+		(ssl_context = new_ssl_context(private_key_file,
+									   certificate_file)) == NULL) {
 		close(http_fd);
 		close(https_fd);
 		return;
@@ -228,97 +1107,100 @@ void serve() {
 	init_select_context();
 	add_read_fd(http_fd);
 	add_read_fd(https_fd);
+	init_file_cache(cache_size);
+	init_scan();
+	init_timers();
+	init_connection_cap();
+	if (init_resolver(RESOLVER_HELPERS) == -1)
+		log_msg(L_ERROR, "Resolver not available, no REMOTE_HOST for cgi\n");
+	if (init_fcgi_pool(fcgi_workers, cgi_path, schedule_client) == -1)
+		log_msg(L_ERROR, "FastCGI pool not available, fork for cgi instead\n");
+	if (init_aio(AIO_THREADS, schedule_client) == -1)
+		log_msg(L_ERROR, "I/O threads not available, file I/O blocks\n");
 
 	client_head = NULL;
+	active_head = active_tail = NULL;
+	nclients = 0;
+
+	// Up and serving, the program before an upgrade may stop now
+	retire_old();
 
 	/*===============Start accepting requests================*/
 	while (!terminate) {
-		if (io_select() == -1) {
+		if (reload) {
+			reload = 0;
+			reload_server();
+		}
+		if (upgrade) {
+			upgrade = 0;
+			if (!draining)
+				upgrade_server();
+		}
+		if (draining && http_fd != -1)
+			start_draining();
+		if (draining && client_head == NULL)
+			break;
+
+		/*
+		 * Don't block if some clients still have work to do, or more
+		 * connections are waiting to be accepted. Otherwise wake up for
+		 * the next deadline. A signal goes on with the iteration, so that
+		 * FastCGI workers which have exited are taken care of now.
+		 */
+		if (io_select(active_head || test_read_fd(http_fd) ||
+					  test_read_fd(https_fd) ? 0 : timers_wait()) == -1 &&
+			errno != EINTR) {
 			log_error("select error");
 			continue;
 		}
 
-		//New http request!
-		if (test_read_fd(http_fd))
-			client = accept_connection(http_fd, &client_head);
+		// Responses of this iteration share the same Date
+		update_date();
 
-		//New https request!
-		if (test_read_fd(https_fd)) {
-			if ((client = accept_connection(https_fd, &client_head)))
-				if (ssl_wrap(client) == -1)
-					client->alive = 0;
-		}
+		// Clients past their deadlines are scheduled to be closed
+		run_timers();
 
-		prev = NULL;
-		for (client = client_head; client != NULL; ) {
-			/*
-			 * Normally, bad will be 0 normally. When erro occurs, bad will
-			 * be set to 1. And corresponding socket will be closed.
-			 */
-			bad = 0;
+		// Dispatch events to clients
+		while ((fd = next_ready_fd()) != -1)
+			if ((client = get_fd_data(fd)) != NULL)
+				schedule_client(client);
 
-			// New data arrived!
-			if (client->alive && test_read_fd(client->fd)) {
-				nbytes = io_recv(client->fd, client->in, client->ssl_context);
-				if (nbytes == -1) bad = 1;
-			}
+		// Drop cached files which have been changed
+		cache_poll();
 
-			// Parse data
-			if (!bad && client->alive && client->status != C_PIPING) {
-				if (http_parse(client) == -1) {
-					/*
-					 * Something goes wrong and beyond repair. Send error code
-					 * to client before closing the connection
-					 */
-					io_send(client->fd, client->out, client->ssl_context);
-					bad = 1;	// End the connection
-				}
-
-				// Free part of the buffer if a lot of data has been processed
-				if (empty(client->in)) io_shrink(client->in);
-			}
+		// Talk to FastCGI workers
+		fcgi_poll();
 
-			// Send data to client
-			if (!bad && test_write_fd(client->fd)) {
-				// Send data from buffer
-				if (client->out->pos < client->out->datasize) {
-					nbytes = io_send(client->fd, client->out,
-									 client->ssl_context);
-
-					if (nbytes == -1) bad = 1;
-				} else if (!bad && client->status == C_PIPING &&
-						test_read_fd(client->pipe->from_fd)) {
-					// Need to pipe data to client from some fd
-					nbytes = io_pipe(client->fd, client->pipe,
-									 client->ssl_context);
-					// Piping complete
-					if (nbytes == 1)
-						client->status = C_IDLE;
-					if (nbytes == -1) bad = 1;
-					// Deinit client pipe
-					if (nbytes != 0) {
-						free(client->pipe);
-						client->pipe = NULL;
-					}
-				}
-			}
+		// Collect host names looked up
+		resolver_poll();
 
-			if (bad || (client->status == C_IDLE && !client->alive)) { //Delete client
-				//Remove from the linked list
-				if (prev == NULL)
-					client_head = client->next;
-				else
-					prev->next = client->next;
-				deinit_client(client);
-
-				if (prev == NULL)
-					client = client_head;
-				else
-					client = prev->next;
-			} else {
-				prev = client;
-				client = client->next;
-			}
-		} // End for client
+		// Go on with files opened and read by I/O threads
+		aio_poll();
+
+		// Write out logs of the last iteration in one go
+		log_flush();
+
+		//New http request!
+		accept_connections(http_fd, 0);
+
+		//New https request!
+		accept_connections(https_fd, 1);
+
+		// Serve clients scheduled in this iteration
+		client = active_head;
+		active_head = active_tail = NULL;
+		for (; client != NULL; client = next) {
+			next = client->next_active;
+			client->scheduled = 0;
+			io_budget(SERVE_BYTES);
+			if (serve_client(client) == 1)
+				schedule_client(client);
+		}
+		io_budget(-1);
 	}
+
+	// Drained, every connection has been closed
+	log_msg(L_INFO, "Process %d drained, bye~\n", getpid());
+	finalize();
+	exit(EXIT_SUCCESS);
 }
@@ -8,9 +8,66 @@
 
 #include "config.h"
 #include "io.h"
+#include "http_client.h"
 
 #define DEFAULT_BACKLOG 1024    //The second argument passed into listen()
 
+/*
+ * Seconds a connection may wait in the kernel for its first data before
+ * being accepted (TCP_DEFER_ACCEPT), and the number of TCP Fast Open
+ * connections the kernel may queue (TCP_FASTOPEN). 0 disables either.
+ */
+#define DEFER_ACCEPT 5
+#define FASTOPEN_QUEUE 256
+
+/*
+ * Pipelined requests are parsed ahead of the responses being sent, until
+ * this many output segments are queued for a client
+ */
+#define PIPELINE_QUEUE 64
+
+/*
+ * Budget of a client each time it's served: bytes sent, bytes received and
+ * requests parsed. A client with more to do goes to the end of the active
+ * list, so heavy clients take turns with everyone else. The byte budget is
+ * nginx's sendfile_max_chunk default.
+ */
+#define SERVE_BYTES (2 << 20)
+#define SERVE_REQUESTS 16
+
+/*
+ * Milliseconds a client is given to send the headers of a request (counted
+ * from its first byte, so trickling them doesn't help), between two pieces
+ * of a request body, between two requests on a kept-alive connection, and
+ * for the socket to take any output queued. A cgi script is given
+ * RESPONSE_TIMEOUT between two pieces of its response.
+ */
+#define HEADER_TIMEOUT 10000
+#define BODY_TIMEOUT 30000
+#define KEEPALIVE_TIMEOUT 15000
+#define WRITE_TIMEOUT 30000
+#define RESPONSE_TIMEOUT 60000
+
+/* File descriptors kept for other uses when deriving the connection cap */
+#define RESERVED_FDS 64
+
+/* Sessions kept for resumption by each worker, and how long (in seconds) */
+#define SSL_SESSION_CACHE 20480
+#define SSL_SESSION_TIMEOUT 3600
+
+/* Bytes of the session ticket keys: name, HMAC secret and AES key */
+#define SSL_TICKET_KEYS 80
+
+/*
+ * Milliseconds connections are given to finish once the server drains, and
+ * idle ones to send another request
+ */
+#define DRAIN_TIMEOUT 60000
+#define DRAIN_IDLE_TIMEOUT 1000
+
+/* Listening sockets handed to the program exec'ed by an upgrade, "fd,fd,.." */
+#define LISTEN_ENV "LISOD_LISTENERS"
+
 /**
  * In the serving loop, everytime before calling select(), this variable will
  * be checked to determine whether the serving loop should continue or not.
@@ -19,7 +76,21 @@
  */
 int terminate;
 
-void serve();
+/*
+ * Set by signal handlers, and acted on by the serving loop before the next
+ * select(): reload config (SIGHUP), exec the program again (SIGUSR2). See
+ * http_client.h for draining (SIGQUIT).
+ */
+int reload;
+int upgrade;
+
+void init_ssl_tickets();
+int reload_config(config_t *old);
+
+int open_listeners(int slots);
+void share_listeners(int share);
+
+void serve(int slot);
 
 void finalize();
 
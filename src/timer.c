@@ -0,0 +1,197 @@
+/** @file timer.c
+ *  @brief Timeouts kept in a hierarchical timer wheel
+ *
+ *  Time is counted in ticks of TIMER_TICK milliseconds. A timeout due in
+ *  less than TIMER_SLOTS ticks is put in the slot of its tick at level 0.
+ *  One due later goes into a coarser level, whose slots each span a whole
+ *  turn of the level below. Whenever the lower level completes a turn, the
+ *  next slot of the level above is emptied and its timeouts are put in the
+ *  slots below again (cascading), closer to their own tick.
+ *
+ *  Setting or cancelling a timeout is a list operation. Each tick only looks
+ *  at one slot, and a timeout is cascaded at most TIMER_LEVELS - 1 times, so
+ *  the cost doesn't depend on how many timeouts there are. Most timeouts,
+ *  like those of connections which keep being active, are cancelled or set
+ *  again long before they would be cascaded at all.
+ *
+ *  The clock is monotonic, so changes of the system time don't fire or hold
+ *  up timeouts.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <stddef.h>
+#include <time.h>
+#include "timer.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+
+/* Longest timeout in ticks, all levels together */
+#define MAX_TICKS ((1UL << (TIMER_BITS * TIMER_LEVELS)) - 1)
+
+static timeout_t *wheel[TIMER_LEVELS][TIMER_SLOTS];
+static unsigned long current;       //<!next tick to be run
+static int count;                   //<!timeouts pending
+
+/** @brief Ticks since some fixed point */
+static unsigned long now_ticks() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) /
+           TIMER_TICK;
+}
+
+/** @brief Setup an empty wheel starting from now */
+void init_timers() {
+    int l, s;
+
+    for (l = 0; l < TIMER_LEVELS; ++l)
+        for (s = 0; s < TIMER_SLOTS; ++s)
+            wheel[l][s] = NULL;
+    current = now_ticks();
+    count = 0;
+}
+
+/** @brief Put a timeout into the slot of its tick */
+static void place(timeout_t *t) {
+    unsigned long delta;
+    timeout_t **slot;
+    int l;
+
+    if (t->expires < current)
+        t->expires = current;
+    delta = t->expires - current;
+
+    for (l = 0; l < TIMER_LEVELS - 1; ++l)
+        if (delta < 1UL << (TIMER_BITS * (l + 1)))
+            break;
+    slot = &wheel[l][(t->expires >> (TIMER_BITS * l)) & SLOT_MASK];
+
+    t->slot = slot;
+    t->prev = NULL;
+    t->next = *slot;
+    if (*slot)
+        (*slot)->prev = t;
+    *slot = t;
+}
+
+/** @brief Take a timeout out of its slot */
+static void unlink_timeout(timeout_t *t) {
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        *t->slot = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+}
+
+/** @brief Make a timeout ready to be set
+ *
+ *  @param expire Called with arg when the timeout fires
+ */
+void init_timeout(timeout_t *t, void (*expire)(void *), void *arg) {
+    t->prev = t->next = NULL;
+    t->slot = NULL;
+    t->pending = 0;
+    t->expire = expire;
+    t->arg = arg;
+}
+
+/** @brief Fire a timeout ms milliseconds from now, instead of when it's set
+ *  to fire if it's pending
+ */
+void timeout_set(timeout_t *t, int ms) {
+    unsigned long ticks = (ms + TIMER_TICK - 1) / TIMER_TICK;
+
+    timeout_cancel(t);
+    if (ticks < 1)
+        ticks = 1;
+    if (ticks > MAX_TICKS)
+        ticks = MAX_TICKS;
+    t->expires = now_ticks() + ticks;
+    t->pending = 1;
+    ++count;
+    place(t);
+}
+
+/** @brief Stop a timeout from firing, nothing happens if it's not pending */
+void timeout_cancel(timeout_t *t) {
+    if (!t->pending)
+        return;
+    unlink_timeout(t);
+    t->pending = 0;
+    --count;
+}
+
+/** @brief Move timeouts of the current slot of a level to the levels below */
+static void cascade(int level) {
+    timeout_t **slot = &wheel[level][(current >> (TIMER_BITS * level)) &
+                                     SLOT_MASK];
+    timeout_t *t;
+
+    while ((t = *slot) != NULL) {
+        unlink_timeout(t);
+        place(t);
+    }
+}
+
+/** @brief Fire timeouts which are due
+ *
+ *  Should be called in every iteration of the serving loop. A timeout may be
+ *  set or cancelled again by what it calls, including other timeouts.
+ */
+void run_timers() {
+    unsigned long now = now_ticks();
+    timeout_t **slot, *t;
+    int l;
+
+    // Nothing to catch up with
+    if (count == 0) {
+        current = now + 1;
+        return;
+    }
+
+    for (; current <= now; ++current) {
+        for (l = 1; l < TIMER_LEVELS; ++l) {
+            if ((current & ((1UL << (TIMER_BITS * l)) - 1)) != 0)
+                break;
+            cascade(l);
+        }
+
+        slot = &wheel[0][current & SLOT_MASK];
+        while ((t = *slot) != NULL) {
+            unlink_timeout(t);
+            t->pending = 0;
+            --count;
+            t->expire(t->arg);
+        }
+    }
+}
+
+/** @brief Milliseconds until run_timers() should be called again
+ *
+ *  Only level 0 is looked at. When it has nothing due before it turns over,
+ *  the time of the next cascade is returned instead.
+ *
+ *  @return Milliseconds to wait. -1 if there is no timeout at all.
+ */
+int timers_wait() {
+    unsigned long now = now_ticks(), ticks;
+
+    if (count == 0)
+        return -1;
+    if (current <= now)
+        return 0;
+
+    // Slots until level 0 turns over, current is never run twice
+    for (ticks = 0; ticks < TIMER_SLOTS; ++ticks) {
+        if (wheel[0][(current + ticks) & SLOT_MASK] != NULL)
+            break;
+        if (((current + ticks + 1) & SLOT_MASK) == 0) {
+            ++ticks;
+            break;
+        }
+    }
+    return (current + ticks - now) * TIMER_TICK;
+}
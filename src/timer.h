@@ -0,0 +1,44 @@
+/** @file timer.h
+ *  @brief Header file for timer.c
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+/* Milliseconds of a tick, the resolution of timeouts */
+#define TIMER_TICK 100
+
+/*
+ * Each level of the wheel has 1 << TIMER_BITS slots, and a slot of a level
+ * spans all slots of the level below. 4 levels of 64 slots cover 19 days,
+ * longer timeouts are cut to it.
+ */
+#define TIMER_BITS 6
+#define TIMER_LEVELS 4
+#define TIMER_SLOTS (1 << TIMER_BITS)
+
+/** @brief A timeout, embedded in what it belongs to
+ *
+ *  Setting and cancelling only link and unlink it, so they take constant
+ *  time whatever the number of timeouts.
+ */
+typedef struct timeout {
+    struct timeout *prev, *next;    //<!other timeouts in the same slot
+    struct timeout **slot;          //<!head of the slot it's in
+    unsigned long expires;          //<!tick when it fires
+    int pending;                    //<!set and not fired yet
+    void (*expire)(void *arg);      //<!called when it fires
+    void *arg;
+} timeout_t;
+
+void init_timers();
+
+void init_timeout(timeout_t *t, void (*expire)(void *), void *arg);
+void timeout_set(timeout_t *t, int ms);
+void timeout_cancel(timeout_t *t);
+
+void run_timers();
+int timers_wait();
+
+#endif
@@ -0,0 +1,105 @@
+/** @file upgrade.c
+ *  @brief Replace the running program without dropping connections
+ *
+ *  On SIGUSR2 the daemon execs its binary again, which may have been
+ *  replaced by a new version, with the same arguments. The exec happens in
+ *  the daemon process itself, so the pid and the lock on the lock file are
+ *  kept. The listening sockets are inherited (see share_listeners()), so
+ *  connections arriving meanwhile wait in their queues and none is refused.
+ *
+ *  Connections being served stay with processes of the old program: the
+ *  workers when there is a master, or a child forked just before the exec
+ *  otherwise. Their pids are passed in RETIRE_ENV. Once the new program has
+ *  set up, it sends them SIGQUIT. They stop accepting, finish the requests
+ *  they have and exit.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include "upgrade.h"
+#include "server.h"
+#include "log.h"
+
+static char **program_argv;     //<!arguments to exec the program with
+static pid_t *retiring;         //<!processes of the old program
+static int nretiring;
+static int was_upgraded;
+
+/** @brief Keep the arguments, and take the processes to retire
+ *
+ *  Must be called before the program forks, and before argv is changed.
+ */
+void init_upgrade(char *argv[]) {
+    char *env, *p, *end;
+    pid_t pid;
+
+    program_argv = argv;
+    if ((env = getenv(RETIRE_ENV)) == NULL)
+        return;
+
+    was_upgraded = 1;
+    retiring = malloc(sizeof(pid_t) * (strlen(env) / 2 + 1));
+    for (p = env; *p != '\0'; p = end + (*end == ',')) {
+        pid = strtol(p, &end, 10);
+        if (end == p)
+            break;
+        if (pid > 0)
+            retiring[nretiring++] = pid;
+    }
+    unsetenv(RETIRE_ENV);
+}
+
+/** @brief Whether this process was exec'ed by an upgrade
+ *
+ *  It's already a daemon then, holding the lock.
+ */
+int upgraded() {
+    return was_upgraded;
+}
+
+/** @brief Ask the processes of the old program to drain and exit */
+void retire_old() {
+    int i;
+
+    for (i = 0; i < nretiring; ++i) {
+        log_msg(L_INFO, "Retire process %d of the old program\n",
+                (int)retiring[i]);
+        kill(retiring[i], SIGQUIT);
+    }
+    free(retiring);
+    retiring = NULL;
+    nretiring = 0;
+}
+
+/** @brief Exec the program again, handing over the listening sockets
+ *
+ *  @param old Processes which go on serving until the new program is up
+ *  @param n Number of them, pids not above 0 are skipped
+ *  @return Only if the exec failed, -1
+ */
+int exec_upgrade(pid_t *old, int n) {
+    char *env;
+    int i, len = 0;
+
+    env = malloc(n * 12 + 1);
+    env[0] = '\0';
+    for (i = 0; i < n; ++i)
+        if (old[i] > 0)
+            len += sprintf(env + len, "%s%d", len ? "," : "", (int)old[i]);
+    setenv(RETIRE_ENV, env, 1);
+    free(env);
+    share_listeners(1);
+
+    log_msg(L_INFO, "Upgrade to %s\n", program_argv[0]);
+    log_flush();
+    execvp(program_argv[0], program_argv);
+
+    log_error("exec_upgrade execvp error");
+    share_listeners(0);
+    unsetenv(RETIRE_ENV);
+    return -1;
+}
@@ -0,0 +1,19 @@
+/** @file upgrade.h
+ *  @brief Header file for upgrade.c
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __UPGRADE_H__
+#define __UPGRADE_H__
+
+#include <sys/types.h>
+
+/* Processes of the old program which stop once the new one is up, "pid,.." */
+#define RETIRE_ENV "LISOD_RETIRE"
+
+void init_upgrade(char *argv[]);
+int upgraded();
+void retire_old();
+int exec_upgrade(pid_t *old, int n);
+
+#endif
@@ -0,0 +1,136 @@
+"""Helpers shared by the *_checker.py scripts.
+
+Requests are written to a plain socket as raw bytes, so that the checkers
+control exactly how they are framed and when each piece is sent. Responses
+are read back with their Content-Length or chunked framing.
+"""
+
+import socket
+import sys
+import time
+
+TIMEOUT = 5     # Seconds to wait for a response
+
+
+class Conn(object):
+    """A connection to the server and its buffered input."""
+
+    def __init__(self, host, port, timeout=TIMEOUT):
+        self.sock = socket.create_connection((host, port), timeout)
+        self.buf = b""
+
+    def send(self, data):
+        self.sock.sendall(data)
+
+    def close(self):
+        self.sock.close()
+
+    def _fill(self):
+        data = self.sock.recv(65536)
+        if not data:
+            raise EOFError("connection closed")
+        self.buf += data
+
+    def readline(self):
+        while b"\r\n" not in self.buf:
+            self._fill()
+        line, self.buf = self.buf.split(b"\r\n", 1)
+        return line
+
+    def read(self, n):
+        pieces, size = [self.buf], len(self.buf)
+        while size < n:
+            data = self.sock.recv(min(n - size, 65536))
+            if not data:
+                raise EOFError("connection closed")
+            pieces.append(data)
+            size += len(data)
+        data = b"".join(pieces)
+        self.buf = data[n:]
+        return data[:n]
+
+    def read_all(self):
+        try:
+            while True:
+                self._fill()
+        except EOFError:
+            pass
+        data, self.buf = self.buf, b""
+        return data
+
+    def closed(self):
+        """Whether the server has closed the connection."""
+        if self.buf:
+            return False
+        try:
+            self._fill()
+        except EOFError:
+            return True
+        except socket.timeout:
+            return False
+        return False
+
+    def response(self, head=False):
+        """Read a response. Returns (status, headers, body).
+
+        Header names are lower case. A response without framing is read until
+        the connection is closed.
+        """
+        status = int(self.readline().split(b" ")[1])
+        headers = {}
+        while True:
+            line = self.readline()
+            if not line:
+                break
+            name, value = line.split(b":", 1)
+            headers[name.strip().lower().decode()] = value.strip().decode()
+
+        if head or status == 304 or status == 204:
+            return status, headers, b""
+        if headers.get("transfer-encoding", "").lower() == "chunked":
+            body = b""
+            while True:
+                size = int(self.readline().split(b";")[0], 16)
+                if size == 0:
+                    while self.readline():
+                        pass
+                    return status, headers, body
+                body += self.read(size)
+                self.read(2)
+        if "content-length" in headers:
+            return status, headers, self.read(int(headers["content-length"]))
+        return status, headers, self.read_all()
+
+
+def request(host, port, data, head=False):
+    """Send one request on a new connection and read its response."""
+    conn = Conn(host, port)
+    try:
+        conn.send(data)
+        return conn.response(head)
+    finally:
+        conn.close()
+
+
+def check(cond, what):
+    """Stop with an error if a check fails."""
+    if not cond:
+        sys.stderr.write("Error: %s\n" % what)
+        sys.exit(1)
+
+
+def usage(args):
+    """Stop with a usage message unless enough arguments are given."""
+    if len(sys.argv) < len(args) + 1:
+        sys.stderr.write("Usage: %s %s\n" % (sys.argv[0], " ".join(args)))
+        sys.exit(1)
+
+
+def wait_for(fn, seconds):
+    """Call fn until it returns true or some seconds have passed."""
+    end = time.time() + seconds
+    while time.time() < end:
+        if fn():
+            return True
+        time.sleep(0.1)
+    return fn()
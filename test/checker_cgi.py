@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+"""CGI script for the *_checker.py scripts, run as a CGI or FastCGI program.
+
+Passed to lisod as its CGI script. Forked for each request, it reads the
+request from its environment and stdin. Started as a FastCGI worker (-f), it
+accepts connections on the socket it has as stdin instead.
+
+What it does depends on the path after /cgi:
+    /echo       Reply with the body's CONTENT_LENGTH (or none), size and md5.
+                The reply has no Content-Length, so lisod sends it chunked.
+    /first      Reply as soon as the first bytes of the body have arrived,
+                with a Content-Length so that it ends there, then drop the
+                rest of the body.
+    /sleep      Give no reply for 70 seconds.
+    /partial    Reply with headers and part of the body, then hang like /sleep.
+    /die        Exit without a reply.
+"""
+
+import hashlib
+import os
+import socket
+import struct
+import sys
+import time
+
+FCGI_BEGIN_REQUEST = 1
+FCGI_END_REQUEST = 3
+FCGI_PARAMS = 4
+FCGI_STDIN = 5
+FCGI_STDOUT = 6
+
+HEAD = b"HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n"
+
+
+def handle(env, read, write):
+    """Answer a request.
+
+    read() returns the next piece of the body, b"" at its end. write() sends
+    a piece of the response.
+    """
+    path = env.get("PATH_INFO", "")
+    if env.get("REQUEST_METHOD") != "POST":
+        read = lambda: b""
+
+    if path == "/die":
+        os._exit(1)
+    if path in ("/sleep", "/partial"):
+        if path == "/partial":
+            write(HEAD + b"partial")
+        time.sleep(70)
+        return
+    if path == "/first":
+        reply = ("first=%d" % len(read())).encode()
+        write(b"HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n" % len(reply) +
+              reply)
+        while read():
+            pass
+        return
+
+    md5, size = hashlib.md5(), 0
+    while True:
+        data = read()
+        if not data:
+            break
+        md5.update(data)
+        size += len(data)
+    write(HEAD + ("length=%s size=%d md5=%s" % (
+        env.get("CONTENT_LENGTH", "none"), size, md5.hexdigest())).encode())
+
+
+def run_cgi():
+    def read():
+        return os.read(0, 65536)
+
+    def write(data):
+        sys.stdout.buffer.write(data)
+        sys.stdout.flush()
+
+    handle(os.environ, read, write)
+
+
+class Worker(object):
+    """One connection from lisod to a FastCGI worker."""
+
+    def __init__(self, conn):
+        self.conn = conn
+        self.buf = b""
+
+    def recv(self, n):
+        while len(self.buf) < n:
+            data = self.conn.recv(65536)
+            if not data:
+                raise EOFError()
+            self.buf += data
+        data, self.buf = self.buf[:n], self.buf[n:]
+        return data
+
+    def record(self):
+        _, kind, rid, length, pad, _ = struct.unpack(">BBHHBB", self.recv(8))
+        return kind, rid, self.recv(length + pad)[:length]
+
+    def send(self, kind, content):
+        for i in range(0, max(len(content), 1), 65535):
+            piece = content[i:i + 65535]
+            self.conn.sendall(struct.pack(">BBHHBB", 1, kind, self.rid,
+                                          len(piece), 0, 0) + piece)
+
+    def params(self, data):
+        env, i = {}, 0
+        while i < len(data):
+            lengths = []
+            for _ in range(2):
+                if data[i] < 128:
+                    lengths.append(data[i])
+                    i += 1
+                else:
+                    lengths.append(struct.unpack(">I", data[i:i + 4])[0] &
+                                   0x7fffffff)
+                    i += 4
+            name = data[i:i + lengths[0]].decode()
+            env[name] = data[i + lengths[0]:i + sum(lengths)].decode()
+            i += sum(lengths)
+        return env
+
+    def serve(self):
+        while True:
+            kind, self.rid, content = self.record()
+            if kind != FCGI_BEGIN_REQUEST:
+                continue    # Left over from a request which has ended
+            params = b""
+            while True:
+                kind, rid, content = self.record()
+                if kind != FCGI_PARAMS:
+                    continue
+                if not content:
+                    break
+                params += content
+            self.stdin_open = True
+            handle(self.params(params), self.read, self.write)
+            self.send(FCGI_STDOUT, b"")
+            self.send(FCGI_END_REQUEST, b"\0" * 8)
+
+    def read(self):
+        while self.stdin_open:
+            kind, rid, content = self.record()
+            if kind == FCGI_STDIN and rid == self.rid:
+                self.stdin_open = len(content) > 0
+                return content
+        return b""
+
+    def write(self, data):
+        self.send(FCGI_STDOUT, data)
+
+
+def run_fastcgi():
+    listener = socket.fromfd(0, socket.AF_UNIX, socket.SOCK_STREAM)
+    while True:
+        conn, _ = listener.accept()
+        try:
+            Worker(conn).serve()
+        except (EOFError, socket.error):
+            pass
+        conn.close()
+
+
+if __name__ == "__main__":
+    if "REQUEST_METHOD" in os.environ:
+        run_cgi()
+    else:
+        run_fastcgi()
@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+"""Check chunked request and response bodies of CGI requests.
+
+Run lisod with test/checker_cgi.py as its CGI script, forked or with -f:
+    - a chunked body which has all arrived is given to the script with its
+      CONTENT_LENGTH;
+    - a chunked body still arriving is streamed to the script without one,
+      and the script can answer before it ends;
+    - the reply of the script, which has no Content-Length, is sent chunked;
+    - the request after a chunked body on the connection is answered;
+    - a broken chunked body gets 400, a body over the 16MB limit 413.
+"""
+
+import hashlib
+import os
+import sys
+import time
+
+from checker import Conn, check, request, usage
+
+usage(["<ip>", "<port>"])
+host, port = sys.argv[1], int(sys.argv[2])
+
+POST = ("POST /cgi/%s HTTP/1.1\r\nHost: %s\r\n"
+        "Transfer-Encoding: chunked\r\n\r\n")
+
+
+def chunked(data, size):
+    out = b""
+    for i in range(0, len(data), size):
+        piece = data[i:i + size]
+        out += b"%x\r\n" % len(piece) + piece + b"\r\n"
+    return out + b"0\r\n\r\n"
+
+
+def echoed(data, length):
+    return ("length=%s size=%d md5=%s" % (
+        length, len(data), hashlib.md5(data).hexdigest())).encode()
+
+
+# Whole body in one go, the script is told its length
+data = os.urandom(10000)
+conn = Conn(host, port)
+conn.send((POST % ("echo", host)).encode() + chunked(data, 1000))
+status, headers, body = conn.response()
+check(status == 200 and body == echoed(data, len(data)),
+      "whole chunked body: %d %r" % (status, body))
+check(headers.get("transfer-encoding") == "chunked",
+      "reply without Content-Length not sent chunked")
+
+# The next request on the connection
+conn.send(("GET /cgi/echo HTTP/1.1\r\nHost: %s\r\n\r\n" % host).encode())
+status, _, body = conn.response()
+check(status == 200 and b" size=0 " in body,
+      "request after a chunked body: %d %r" % (status, body))
+conn.close()
+
+# A large body sent over time, streamed without a length
+data = os.urandom(1 << 20)
+encoded = chunked(data, 4096)
+conn = Conn(host, port)
+conn.send((POST % ("echo", host)).encode())
+for i in range(0, len(encoded), 64 << 10):
+    conn.send(encoded[i:i + (64 << 10)])
+    time.sleep(0.01)
+status, _, body = conn.response()
+conn.close()
+check(status == 200 and body == echoed(data, "none"),
+      "streamed chunked body: %d %r" % (status, body))
+
+# Answered before the body ends
+conn = Conn(host, port)
+conn.send((POST % ("first", host)).encode() + b"5\r\nhello\r\n")
+status, _, body = conn.response()
+check(status == 200 and body.startswith(b"first="),
+      "no answer to a chunked body still being sent: %d" % status)
+conn.send(b"0\r\n\r\n")
+conn.close()
+
+status, _, _ = request(host, port, (POST % ("echo", host)).encode() +
+                       b"zz\r\nhello\r\n0\r\n\r\n")
+check(status == 400, "expected 400 for a broken chunked body, got %d" % status)
+
+conn = Conn(host, port)
+conn.send(("POST /cgi/echo HTTP/1.1\r\nHost: %s\r\n"
+           "Content-Length: %d\r\n\r\n" % (host, 17 << 20)).encode())
+status, _, _ = conn.response()
+check(status == 413, "expected 413 for a large body, got %d" % status)
+check(conn.closed(), "connection kept after 413")
+conn.close()
+
+print("Success!")
@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+"""Check how lisod answers CGI requests with a FastCGI worker pool.
+
+Mode "worker", lisod run with -f 1 and checker_cgi.py as its CGI script:
+    - a request body is streamed to the worker as FCGI_STDIN, which can
+      answer before the body has all been sent;
+    - a large body arrives in one piece;
+    - a request whose worker dies before answering gets 502, and the worker
+      is restarted for the next ones.
+
+Mode "broken", lisod run with -f 1 and a CGI script which exits right away
+(e.g. /bin/true):
+    - CGI requests are answered with 503, quickly, while the worker is
+      restarted with a growing delay;
+    - static files are still served meanwhile.
+"""
+
+import hashlib
+import os
+import sys
+import time
+
+from checker import Conn, check, request, usage, wait_for
+
+usage(["<ip>", "<port>", "worker|broken"])
+host, port, mode = sys.argv[1], int(sys.argv[2]), sys.argv[3]
+
+GET = "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n"
+POST = "POST %s HTTP/1.1\r\nHost: %s\r\nContent-Length: %d\r\n\r\n"
+
+
+def get(uri):
+    return request(host, port, (GET % (uri, host)).encode())
+
+
+def check_worker():
+    # Answered before the body ends, so the body isn't buffered first
+    size = 1 << 20
+    conn = Conn(host, port)
+    conn.send((POST % ("/cgi/first", host, size)).encode() + b"x" * 1000)
+    status, _, body = conn.response()
+    check(status == 200 and body.startswith(b"first="),
+          "no answer to a body still being sent: %d %r" % (status, body))
+    conn.send(b"x" * (size - 1000))
+    conn.send((GET % ("/cgi/echo", host)).encode())
+    status, _, body = conn.response()
+    check(status == 200, "rest of a body answered early not dropped")
+    conn.close()
+
+    # A large body sent in pieces arrives whole
+    data = os.urandom(size)
+    conn = Conn(host, port)
+    conn.send((POST % ("/cgi/echo", host, size)).encode())
+    for i in range(0, size, 64 << 10):
+        conn.send(data[i:i + (64 << 10)])
+        time.sleep(0.01)
+    status, _, body = conn.response()
+    conn.close()
+    expect = "length=%d size=%d md5=%s" % (size, size,
+                                            hashlib.md5(data).hexdigest())
+    check(status == 200 and body.decode() == expect,
+          "body streamed to the worker changed: %r" % body)
+
+    # The worker dies with the request sent to it
+    status, _, _ = get("/cgi/die")
+    check(status == 502, "expected 502 for a dying worker, got %d" % status)
+    check(wait_for(lambda: get("/cgi/echo")[0] == 200, 5),
+          "worker not restarted after dying")
+
+
+def check_broken():
+    statuses = []
+    end = time.time() + 3
+    while time.time() < end:
+        start = time.time()
+        status, _, _ = get("/cgi/echo")
+        check(time.time() - start < 1, "slow answer without a worker")
+        statuses.append(status)
+        time.sleep(0.05)
+    check(all(s in (502, 503) for s in statuses),
+          "expected 502 or 503 without a worker: %s" % statuses)
+    check(statuses[-1] == 503, "expected 503 while restarting is delayed")
+    check(get("/")[0] == 200, "static files not served without a worker")
+
+
+if mode == "worker":
+    check_worker()
+elif mode == "broken":
+    check_broken()
+else:
+    check(False, "unknown mode %s" % mode)
+
+print("Success!")
@@ -0,0 +1,59 @@
+#!/usr/bin/env python3
+"""Check that pipelined requests are all answered, in order.
+
+Give the URI of a static file in the www folder of lisod, and the path of the
+same file here to compare with. Run lisod with test/checker_cgi.py as its CGI
+script. More requests than lisod queues per connection (PIPELINE_QUEUE) are
+sent in one go, mixing GET, HEAD, missing files and CGI requests, and the
+responses have to come back in the same order. A request asking to close
+the connection must be the last one answered.
+"""
+
+import sys
+
+from checker import Conn, check, usage
+
+usage(["<ip>", "<port>", "<uri>", "<file>"])
+host, port, uri = sys.argv[1], int(sys.argv[2]), sys.argv[3]
+with open(sys.argv[4], "rb") as f:
+    data = f.read()
+
+COUNT = 100
+
+expected, requests = [], b""
+for i in range(COUNT):
+    kind = i % 4
+    if kind == 0:
+        requests += b"GET %s HTTP/1.1\r\nHost: x\r\n\r\n" % uri.encode()
+        expected.append(("GET", 200))
+    elif kind == 1:
+        requests += b"HEAD %s HTTP/1.1\r\nHost: x\r\n\r\n" % uri.encode()
+        expected.append(("HEAD", 200))
+    elif kind == 2:
+        requests += b"GET /no-such-file-%d HTTP/1.1\r\nHost: x\r\n\r\n" % i
+        expected.append(("GET", 404))
+    else:
+        requests += b"GET /cgi/echo HTTP/1.1\r\nHost: x\r\n\r\n"
+        expected.append(("CGI", 200))
+requests += b"GET %s HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n" % \
+    uri.encode()
+expected.append(("GET", 200))
+requests += b"GET %s HTTP/1.1\r\nHost: x\r\n\r\n" % uri.encode()
+
+conn = Conn(host, port)
+conn.send(requests)
+for i, (kind, code) in enumerate(expected):
+    status, headers, body = conn.response(head=kind == "HEAD")
+    check(status == code, "response %d: expected %d, got %d" % (i, code,
+                                                                 status))
+    if kind == "GET" and code == 200:
+        check(body == data, "response %d: wrong body" % i)
+    if kind == "HEAD":
+        check(headers.get("content-length") == str(len(data)),
+              "response %d: wrong Content-Length for HEAD" % i)
+    if kind == "CGI":
+        check(body.startswith(b"length="), "response %d: not from cgi" % i)
+check(conn.closed(), "request after Connection: close answered")
+conn.close()
+
+print("Success!")
@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+"""Check range requests and conditional requests for a static file.
+
+Give the URI of a file of at least 20 bytes in the www folder of lisod, and
+the path of the same file here to compare with:
+    - Range gives 206 with the right part and Content-Range, and 416 if no
+      byte of the file is in the range;
+    - If-None-Match and If-Modified-Since give 304 for the current file;
+    - If-Range honours Range only for the current file.
+"""
+
+import sys
+
+from checker import check, request, usage
+
+usage(["<ip>", "<port>", "<uri>", "<file>"])
+host, port, uri = sys.argv[1], int(sys.argv[2]), sys.argv[3]
+with open(sys.argv[4], "rb") as f:
+    data = f.read()
+size = len(data)
+check(size >= 20, "file too small")
+
+
+def get(*headers):
+    return request(host, port, ("GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n" % (
+        uri, host, "".join(h + "\r\n" for h in headers))).encode())
+
+
+status, headers, body = get()
+check(status == 200 and body == data, "file not served whole: %d" % status)
+check(headers.get("accept-ranges") == "bytes", "no Accept-Ranges: bytes")
+etag, modified = headers.get("etag"), headers.get("last-modified")
+check(etag is not None and modified is not None, "no ETag or Last-Modified")
+
+for spec, start, end in (("0-9", 0, 9), ("-5", size - 5, size - 1),
+                         ("10-", 10, size - 1), ("5-%d" % (size * 2), 5,
+                                                 size - 1)):
+    status, headers, body = get("Range: bytes=" + spec)
+    check(status == 206, "expected 206 for bytes=%s, got %d" % (spec, status))
+    check(headers.get("content-range") ==
+          "bytes %d-%d/%d" % (start, end, size),
+          "wrong Content-Range for bytes=%s: %s" % (
+              spec, headers.get("content-range")))
+    check(body == data[start:end + 1], "wrong part for bytes=%s" % spec)
+
+status, headers, _ = get("Range: bytes=%d-" % size)
+check(status == 416, "expected 416 past the end, got %d" % status)
+check(headers.get("content-range") == "bytes */%d" % size,
+      "wrong Content-Range with 416: %s" % headers.get("content-range"))
+
+status, _, body = get("If-None-Match: " + etag)
+check(status == 304 and body == b"", "expected 304 for the ETag, got %d" %
+      status)
+status, _, _ = get('If-None-Match: "lisod-checker"')
+check(status == 200, "expected 200 for another ETag, got %d" % status)
+status, _, _ = get("If-Modified-Since: " + modified)
+check(status == 304, "expected 304 if not modified, got %d" % status)
+status, _, _ = get("If-Modified-Since: Thu, 01 Jan 1970 00:00:00 GMT")
+check(status == 200, "expected 200 if modified, got %d" % status)
+
+status, _, body = get("Range: bytes=0-9", "If-Range: " + etag)
+check(status == 206 and body == data[:10], "If-Range with the ETag: %d" %
+      status)
+status, _, body = get("Range: bytes=0-9", 'If-Range: "lisod-checker"')
+check(status == 200 and body == data, "If-Range with another ETag: %d" %
+      status)
+
+print("Success!")
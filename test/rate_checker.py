@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+"""Check the request rate limit, and the turns clients take in being served.
+
+Run lisod with -r <rate> and -b <burst>:
+    - a burst of requests is served, the ones over it get 429 with
+      Retry-After and the connection closed;
+    - requests are served again once the bucket has refilled.
+Given the URI of a large static file, small requests are answered promptly
+while it's being downloaded at full speed.
+"""
+
+import sys
+import threading
+import time
+
+from checker import Conn, check, request, usage
+
+usage(["<ip>", "<port>", "<rate>", "<burst>"])
+host, port = sys.argv[1], int(sys.argv[2])
+rate, burst = int(sys.argv[3]), int(sys.argv[4])
+large = sys.argv[5] if len(sys.argv) > 5 else None
+
+GET = "GET %s HTTP/1.1\r\nHost: x\r\n\r\n"
+
+
+def get(uri="/"):
+    return request(host, port, (GET % uri).encode())
+
+
+statuses = [get()[0] for _ in range(burst + 5)]
+check(statuses[:burst] == [200] * burst,
+      "burst not served: %s" % statuses)
+check(429 in statuses[burst:], "no 429 over the burst: %s" % statuses)
+
+conn = Conn(host, port)
+conn.send((GET % "/").encode())
+status, headers, _ = conn.response()
+check(status == 429, "expected 429 while limited, got %d" % status)
+check(headers.get("retry-after") is not None, "no Retry-After with 429")
+check(conn.closed(), "connection kept after 429")
+conn.close()
+
+time.sleep(float(burst) / rate + 1)
+check(get()[0] == 200, "not served after the bucket refilled")
+
+if large is not None:
+    def download():
+        conn = Conn(host, port, 60)
+        conn.send((GET % large).encode())
+        conn.response()
+        conn.close()
+
+    time.sleep(float(burst) / rate + 1)
+    t = threading.Thread(target=download)
+    t.start()
+    time.sleep(0.05)
+    start = time.time()
+    status = get()[0]
+    took = time.time() - start
+    t.join()
+    check(status == 200, "small request during a download: %d" % status)
+    check(took < 0.5,
+          "small request took %.2f seconds during a download" % took)
+
+print("Success!")
@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+"""Check the deadlines of clients and CGI scripts, and the connection cap.
+
+Run lisod with test/checker_cgi.py as its CGI script. The checks run at once
+and take about a minute, the longest deadline:
+    - headers not complete 10 seconds after their first byte, a body stalled
+      for 30 seconds and a kept-alive connection idle for 15 seconds get the
+      connection closed;
+    - a CGI script silent for 60 seconds gets 504, or its response cut if
+      part of it has been sent, and the connection closed;
+    - other clients are served meanwhile.
+Given the -m of lisod as <max connections>, the connection over it gets 503.
+"""
+
+import sys
+import threading
+import time
+
+from checker import Conn, check, request, usage
+
+usage(["<ip>", "<port>"])
+host, port = sys.argv[1], int(sys.argv[2])
+max_conns = int(sys.argv[3]) if len(sys.argv) > 3 else 0
+
+GET = "GET %s HTTP/1.1\r\nHost: x\r\n\r\n"
+
+
+def closed_after(conn, low, high):
+    """Wait for the server to close conn, between low and high seconds."""
+    start = time.time()
+    conn.sock.settimeout(high)
+    check(conn.closed(), "connection not closed within %d seconds" % high)
+    took = time.time() - start
+    check(took >= low, "connection closed after %.1f seconds, before %d" % (
+        took, low))
+
+
+def header_timeout():
+    conn = Conn(host, port)
+    conn.send(b"GET / HTTP/1.1\r\n")
+    # Trickling the rest doesn't keep the connection
+    for _ in range(5):
+        time.sleep(1)
+        conn.send(b"X-Trickle: 1\r\n")
+    closed_after(conn, 3, 8)
+
+
+def body_timeout():
+    conn = Conn(host, port)
+    conn.send(b"POST /cgi/echo HTTP/1.1\r\nHost: x\r\n"
+              b"Content-Length: 10\r\n\r\n12345")
+    closed_after(conn, 25, 35)
+
+
+def idle_timeout():
+    conn = Conn(host, port)
+    conn.send((GET % "/").encode())
+    status, _, _ = conn.response()
+    check(status == 200, "expected 200, got %d" % status)
+    closed_after(conn, 12, 20)
+
+
+def gateway_timeout():
+    conn = Conn(host, port, 70)
+    conn.send((GET % "/cgi/sleep").encode())
+    status, _, _ = conn.response()
+    check(status == 504, "expected 504 for a silent script, got %d" % status)
+    check(conn.closed(), "connection kept after 504")
+
+
+def cut_response():
+    conn = Conn(host, port, 70)
+    conn.send((GET % "/cgi/partial").encode())
+    try:
+        status, _, _ = conn.response()
+    except EOFError:
+        return
+    check(False, "response cut by the timeout was completed: %d" % status)
+
+
+def served_meanwhile():
+    for _ in range(10):
+        time.sleep(1)
+        check(request(host, port, (GET % "/").encode())[0] == 200,
+              "not served while others wait")
+
+
+def connection_cap():
+    conns = []
+    # Connections may only be accepted once they have sent something
+    for _ in range(max_conns):
+        conns.append(Conn(host, port))
+        conns[-1].send((GET % "/").encode())
+        conns[-1].response()
+    conn = Conn(host, port)
+    conn.send((GET % "/").encode())
+    status, _, _ = conn.response()
+    check(status == 503, "expected 503 over the cap, got %d" % status)
+    for c in conns + [conn]:
+        c.close()
+
+
+failed = []
+
+
+def run(fn):
+    try:
+        fn()
+    except SystemExit:
+        failed.append(fn.__name__)
+    except Exception as e:
+        sys.stderr.write("Error: %s: %r\n" % (fn.__name__, e))
+        failed.append(fn.__name__)
+
+
+if max_conns > 0:
+    run(connection_cap)
+    time.sleep(1)
+
+threads = [threading.Thread(target=run, args=(fn,)) for fn in (
+    header_timeout, body_timeout, idle_timeout, gateway_timeout,
+    cut_response, served_meanwhile)]
+for t in threads:
+    t.start()
+for t in threads:
+    t.join()
+
+check(not failed, "failed: %s" % ", ".join(failed))
+print("Success!")
@@ -0,0 +1,39 @@
+#!/usr/bin/env python3
+"""Print the binary access log written by lisod -l, one request per line.
+
+Each record is access_record_t (see src/log.h) followed by the URI.
+"""
+import socket
+import struct
+import sys
+import time
+
+RECORD = struct.Struct("!IIHBBIH")
+METHODS = {0: "GET", 1: "HEAD", 2: "POST"}
+FLAGS = ((0x1, "tls"), (0x2, "h2"))
+
+
+def records(f):
+    while True:
+        head = f.read(RECORD.size)
+        if len(head) < RECORD.size:
+            return
+        t, addr, status, method, flags, length, uri_len = RECORD.unpack(head)
+        uri = f.read(uri_len).decode("latin-1")
+        yield t, addr, status, method, flags, length, uri
+
+
+def main(path):
+    with open(path, "rb") as f:
+        for t, addr, status, method, flags, length, uri in records(f):
+            print("%s %s %s %s %s %d %s" % (
+                time.strftime("%Y-%m-%dT%H:%M:%S", time.gmtime(t)),
+                socket.inet_ntoa(struct.pack("!I", addr)),
+                status or "cgi", METHODS.get(method, "-"), uri, length,
+                ",".join(n for bit, n in FLAGS if flags & bit) or "-"))
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 2:
+        sys.exit("Usage: %s <access log>" % sys.argv[0])
+    main(sys.argv[1])
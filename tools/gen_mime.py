@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+"""Generate src/mime_table.h, a perfect hash table of file extensions.
+
+Extensions are hashed into buckets first. Each bucket gets a seed of its
+own, searched for so that its extensions land in free slots of the table
+when hashed again with that seed (hash and displace). A lookup is then two
+hashes and one string comparison, with no collision to resolve. The hash
+must match mime_hash() in src/mime.c.
+
+Usage: tools/gen_mime.py > src/mime_table.h
+"""
+import sys
+
+TYPES = {
+    # Text
+    "html": "text/html", "htm": "text/html", "shtml": "text/html",
+    "css": "text/css", "csv": "text/csv", "txt": "text/plain",
+    "text": "text/plain", "log": "text/plain", "md": "text/markdown",
+    "xml": "text/xml", "ics": "text/calendar", "vtt": "text/vtt",
+    "js": "text/javascript", "mjs": "text/javascript",
+    # Images
+    "png": "image/png", "jpg": "image/jpeg", "jpeg": "image/jpeg",
+    "gif": "image/gif", "bmp": "image/bmp", "ico": "image/x-icon",
+    "svg": "image/svg+xml", "svgz": "image/svg+xml", "webp": "image/webp",
+    "avif": "image/avif", "tif": "image/tiff", "tiff": "image/tiff",
+    "apng": "image/apng",
+    # Fonts
+    "woff": "font/woff", "woff2": "font/woff2", "ttf": "font/ttf",
+    "otf": "font/otf", "eot": "application/vnd.ms-fontobject",
+    # Audio and video
+    "mp3": "audio/mpeg", "ogg": "audio/ogg", "oga": "audio/ogg",
+    "wav": "audio/wav", "flac": "audio/flac", "m4a": "audio/mp4",
+    "aac": "audio/aac", "weba": "audio/webm", "mid": "audio/midi",
+    "midi": "audio/midi", "mp4": "video/mp4", "m4v": "video/mp4",
+    "webm": "video/webm", "ogv": "video/ogg", "mov": "video/quicktime",
+    "avi": "video/x-msvideo", "mpeg": "video/mpeg", "mpg": "video/mpeg",
+    "ts": "video/mp2t", "m3u8": "application/vnd.apple.mpegurl",
+    # Applications
+    "json": "application/json", "map": "application/json",
+    "jsonld": "application/ld+json",
+    "webmanifest": "application/manifest+json",
+    "wasm": "application/wasm", "pdf": "application/pdf",
+    "rss": "application/rss+xml", "atom": "application/atom+xml",
+    "xhtml": "application/xhtml+xml", "rtf": "application/rtf",
+    "zip": "application/zip", "gz": "application/gzip",
+    "tgz": "application/gzip", "bz2": "application/x-bzip2",
+    "xz": "application/x-xz", "7z": "application/x-7z-compressed",
+    "tar": "application/x-tar", "rar": "application/vnd.rar",
+    "jar": "application/java-archive", "doc": "application/msword",
+    "xls": "application/vnd.ms-excel",
+    "ppt": "application/vnd.ms-powerpoint",
+    "docx": "application/vnd.openxmlformats-officedocument."
+            "wordprocessingml.document",
+    "xlsx": "application/vnd.openxmlformats-officedocument."
+            "spreadsheetml.sheet",
+    "pptx": "application/vnd.openxmlformats-officedocument."
+            "presentationml.presentation",
+    "odt": "application/vnd.oasis.opendocument.text",
+    "epub": "application/epub+zip", "swf": "application/x-shockwave-flash",
+    "bin": "application/octet-stream", "exe": "application/octet-stream",
+    "iso": "application/octet-stream", "dmg": "application/octet-stream",
+}
+
+# First level seed, any value works
+SEED = 2166136261
+
+
+def mime_hash(ext, seed):
+    """FNV-1a of the lower case extension, starting from seed."""
+    h = seed
+    for c in ext.lower().encode():
+        h = ((h ^ c) * 16777619) & 0xffffffff
+    return h
+
+
+def search(exts):
+    """Seeds of buckets placing every extension in a slot of its own."""
+    slots = 1
+    while slots < len(exts):
+        slots <<= 1
+    nbuckets = slots >> 1
+
+    buckets = [[] for _ in range(nbuckets)]
+    for e in exts:
+        buckets[mime_hash(e, SEED) & (nbuckets - 1)].append(e)
+
+    table = [None] * slots
+    seeds = [0] * nbuckets
+    # Large buckets are the hardest to place, do them while the table is empty
+    for b in sorted(range(nbuckets), key=lambda b: -len(buckets[b])):
+        if not buckets[b]:
+            continue
+        seed = 1
+        while True:
+            pos = [mime_hash(e, seed) & (slots - 1) for e in buckets[b]]
+            if len(set(pos)) == len(pos) and all(table[p] is None for p in pos):
+                break
+            seed += 1
+        seeds[b] = seed
+        for e, p in zip(buckets[b], pos):
+            table[p] = e
+    return table, seeds
+
+
+def main():
+    table, seeds = search(sorted(TYPES))
+
+    out = sys.stdout
+    out.write("/** @file mime_table.h\n"
+              " *  @brief Perfect hash table of file extensions\n"
+              " *\n"
+              " *  Generated by tools/gen_mime.py, do not edit.\n"
+              " */\n"
+              "#ifndef __MIME_TABLE_H__\n"
+              "#define __MIME_TABLE_H__\n\n"
+              "#include \"mime.h\"\n\n")
+    out.write("#define MIME_SEED %du\n" % SEED)
+    out.write("#define MIME_BUCKETS %d\n" % len(seeds))
+    out.write("#define MIME_SLOTS %d\n\n" % len(table))
+    out.write("static const unsigned int mime_seeds[MIME_BUCKETS] = {")
+    for i, seed in enumerate(seeds):
+        out.write("%s%d," % ("\n    " if i % 12 == 0 else " ", seed))
+    out.write("\n};\n\n")
+    out.write("static const mime_type_t mime_table[MIME_SLOTS] = {\n")
+    for i, e in enumerate(table):
+        if e is not None:
+            out.write('    [%d] = { "%s", "%s" },\n' % (i, e, TYPES[e]))
+    out.write("};\n\n#endif\n")
+
+
+if __name__ == "__main__":
+    main()